@@ -0,0 +1,206 @@
+///////////////////////////////////////////////////////////
+/////////////////////BENCHMARK SERVER//////////////////////
+///////////////////////////////////////////////////////////
+
+// Echo / sink server for load_generator.
+//
+//   bench_server [--port N] [--mode thread|epoll|reactor|uring]
+//                [--threads N] [--workload echo|sink] [--framing fixed32|none]
+//                [--workers N] [--socket default|latency|throughput] [--metrics]
+//
+// echo: every message is sent back to its client unchanged.
+// sink: messages are only counted; a JSON line with the received
+//       throughput is printed to stdout for every busy second.
+// --workers runs the observer on N worker threads (see dispatchToWorkers).
+// --socket picks a socket options profile (see socket_options_t).
+// --metrics prints a JSON line of TcpServer::getMetrics() every second.
+
+#include <iostream>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <string>
+
+#include "../include/tcp_server.h"
+
+TcpServer server;
+std::atomic<bool> running(true);
+std::atomic<uint64_t> receivedMsgs(0);
+std::atomic<uint64_t> receivedBytes(0);
+bool echo = true;
+bool printMetrics = false;
+
+// on SIGINT / SIGTERM, stop accepting and exit
+void sigExit(int) {
+    running = false;
+}
+
+// observer callback. echo the message back, or just count it
+void onIncomingMsg(const Client & client, const char * msg, size_t size) {
+    receivedMsgs.fetch_add(1, std::memory_order_relaxed);
+    receivedBytes.fetch_add(size, std::memory_order_relaxed);
+    if (echo) {
+        server.sendToClient(client, msg, size);
+    }
+}
+
+/*
+ * Parse the server mode name given with --mode.
+ * Return false if the name is unknown.
+ */
+bool parseMode(const std::string & name, server_mode_t & mode) {
+    if (name == "thread") {
+        mode = SERVER_MODE_THREAD_PER_CLIENT;
+    } else if (name == "epoll") {
+        mode = SERVER_MODE_EPOLL;
+    } else if (name == "reactor") {
+        mode = SERVER_MODE_REACTOR;
+    } else if (name == "uring") {
+        mode = SERVER_MODE_IO_URING;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Write a snapshot of the server metrics as a JSON line
+ */
+void printServerMetrics(const std::string & modeName) {
+    server_metrics_t metrics = server.getMetrics();
+    printf("{\"benchmark\":\"server_metrics\",\"mode\":\"%s\",\"clients\":%llu,\"accepted\":%llu,"
+           "\"bytes_in\":%llu,\"msgs_in\":%llu,\"bytes_out\":%llu,\"msgs_out\":%llu,"
+           "\"partial_writes\":%llu,\"msgs_dropped\":%llu,\"queued_bytes\":%llu,"
+           "\"disconnects\":{\"peer_closed\":%llu,\"socket_error\":%llu,\"protocol_error\":%llu,"
+           "\"slow_client\":%llu,\"by_server\":%llu,\"timeout\":%llu},"
+           "\"accept_p50_us\":%.1f,\"accept_p99_us\":%.1f,"
+           "\"callback_p50_us\":%.2f,\"callback_p99_us\":%.2f,\"callback_p999_us\":%.2f}\n",
+           modeName.c_str(), (unsigned long long)metrics.clients, (unsigned long long)metrics.accepted,
+           (unsigned long long)metrics.bytesIn, (unsigned long long)metrics.msgsIn,
+           (unsigned long long)metrics.bytesOut, (unsigned long long)metrics.msgsOut,
+           (unsigned long long)metrics.partialWrites, (unsigned long long)metrics.msgsDropped,
+           (unsigned long long)metrics.queuedBytes,
+           (unsigned long long)metrics.disconnects[DISCONNECT_PEER_CLOSED],
+           (unsigned long long)metrics.disconnects[DISCONNECT_SOCKET_ERROR],
+           (unsigned long long)metrics.disconnects[DISCONNECT_PROTOCOL_ERROR],
+           (unsigned long long)metrics.disconnects[DISCONNECT_SLOW_CLIENT],
+           (unsigned long long)metrics.disconnects[DISCONNECT_BY_SERVER],
+           (unsigned long long)metrics.disconnects[DISCONNECT_TIMEOUT],
+           metrics.acceptLatency.percentile(50) / 1e3, metrics.acceptLatency.percentile(99) / 1e3,
+           metrics.callbackTime.percentile(50) / 1e3, metrics.callbackTime.percentile(99) / 1e3,
+           metrics.callbackTime.percentile(99.9) / 1e3);
+    fflush(stdout);
+}
+
+void usage(const char * name) {
+    std::cerr << "usage: " << name << " [--port N] [--mode thread|epoll|reactor|uring]"
+              << " [--threads N] [--workload echo|sink] [--framing fixed32|none] [--workers N]"
+              << " [--socket default|latency|throughput] [--metrics]" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    int port = 65123;
+    std::string modeName = "epoll";
+    server_config_t config;
+    config.framing.mode = FRAMING_FIXED32;
+
+    for (int i=1; i<argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--metrics") {
+            printMetrics = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        std::string value = argv[++i];
+        if (arg == "--port") {
+            port = atoi(value.c_str());
+        } else if (arg == "--mode") {
+            modeName = value;
+        } else if (arg == "--threads") {
+            config.ioThreads = atoi(value.c_str());
+        } else if (arg == "--workers") {
+            config.dispatchToWorkers = true;
+            config.workerThreads = atoi(value.c_str());
+        } else if (arg == "--workload" && (value == "echo" || value == "sink")) {
+            echo = (value == "echo");
+        } else if (arg == "--framing" && (value == "fixed32" || value == "none")) {
+            config.framing.mode = (value == "fixed32") ? FRAMING_FIXED32 : FRAMING_NONE;
+        } else if (arg == "--socket" && value == "latency") {
+            config.socketOptions = socket_options_t::lowLatency();
+        } else if (arg == "--socket" && value == "throughput") {
+            config.socketOptions = socket_options_t::bulkThroughput();
+        } else if (arg == "--socket" && value == "default") {
+            config.socketOptions = socket_options_t();
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!parseMode(modeName, config.mode)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, sigExit);
+    signal(SIGTERM, sigExit);
+    // a client vanishing mid-write must not kill a thread-per-client server
+    signal(SIGPIPE, SIG_IGN);
+
+    server_observer_t observer;
+    observer.incoming_packet_func = onIncomingMsg;
+    server.subscribe(observer);
+
+    pipe_ret_t startRet = server.start(port, config);
+    if (!startRet.success) {
+        std::cerr << "Server setup failed: " << startRet.msg << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cerr << "bench_server listening on port " << port << " (" << modeName << ", "
+              << (echo ? "echo" : "sink") << ")" << std::endl;
+
+    // thread and epoll modes accept on this thread, the others on their I/O threads
+    std::thread acceptor;
+    if (config.mode == SERVER_MODE_THREAD_PER_CLIENT || config.mode == SERVER_MODE_EPOLL) {
+        acceptor = std::thread([]() {
+            while (running) {
+                server.acceptClient(0);
+            }
+        });
+        acceptor.detach();
+    }
+
+    uint64_t lastMsgs = 0;
+    uint64_t lastBytes = 0;
+    auto last = std::chrono::steady_clock::now();
+    while (running) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        auto now = std::chrono::steady_clock::now();
+        uint64_t msgs = receivedMsgs.load(std::memory_order_relaxed);
+        uint64_t bytes = receivedBytes.load(std::memory_order_relaxed);
+        double seconds = std::chrono::duration<double>(now - last).count();
+        if (!echo && msgs != lastMsgs) {
+            printf("{\"benchmark\":\"sink\",\"mode\":\"%s\",\"seconds\":%.3f,"
+                   "\"msgs\":%llu,\"msgs_per_sec\":%.0f,\"mb_per_sec\":%.2f}\n",
+                   modeName.c_str(), seconds, (unsigned long long)(msgs - lastMsgs),
+                   (msgs - lastMsgs) / seconds, (bytes - lastBytes) / seconds / 1e6);
+            fflush(stdout);
+        }
+        if (printMetrics) {
+            printServerMetrics(modeName);
+        }
+        lastMsgs = msgs;
+        lastBytes = bytes;
+        last = now;
+    }
+
+    // the acceptor may still be blocked in accept(), leave it to process exit
+    server.finish();
+    return 0;
+}
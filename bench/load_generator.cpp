@@ -0,0 +1,579 @@
+///////////////////////////////////////////////////////////
+/////////////////////LOAD GENERATOR////////////////////////
+///////////////////////////////////////////////////////////
+
+// Multi-connection load generator for bench_server.
+//
+//   load_generator [--host A] [--port N] [--sizes 64,1024,...] [--clients 1,10,...]
+//                  [--duration SEC] [--window N] [--threads N] [--workload echo|sink]
+//                  [--uring] [--label NAME] [--connect N] [--max-connections N]
+//                  [--output FILE|-]
+//
+// For every (message size, client count) pair, opens that many TcpClient
+// connections and keeps each one busy for --duration seconds:
+//   echo: at most --window messages in flight per connection; reports round
+//         trip throughput (msgs/s, MB/s) and p50/p99/p999 latency.
+//   sink: sends as fast as the send queues accept; reports the offered rate
+//         (bench_server --workload sink prints the received rate).
+// --connect N measures the connect rate of N sequential connections and
+// --max-connections N opens connections until N or the first failure, then
+// checks that each one is served by sending a message through it.
+//
+// Results are appended as one JSON object per line to --output
+// (bench_results.jsonl by default, - for stdout), a summary goes to stderr.
+
+#include <iostream>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../include/tcp_client.h"
+
+// send time and connection index open every message, echoed back by the server
+struct msg_header_t {
+    uint64_t sendTime;
+    uint32_t clientIndex;
+    uint32_t reserved;
+};
+
+/*
+ * Log-linear latency histogram: 16 buckets per power of two, so any
+ * percentile is accurate to about 6%. Recording is a single relaxed
+ * atomic increment, cheap enough to run on every receive thread.
+ */
+class LatencyHistogram {
+public:
+    static const int SUB_BUCKETS = 16;
+    static const int BUCKETS = 64 * SUB_BUCKETS;
+
+    LatencyHistogram() { reset(); }
+
+    void reset() {
+        for (int i=0; i<BUCKETS; i++) {
+            m_counts[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void record(uint64_t value) {
+        m_counts[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+        uint64_t total = 0;
+        for (int i=0; i<BUCKETS; i++) {
+            total += m_counts[i].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    /*
+     * Return the lower bound of the bucket holding the
+     * given percentile (0-100), 0 if nothing was recorded.
+     */
+    uint64_t percentile(double percent) const {
+        uint64_t total = count();
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t wanted = (uint64_t)(total * percent / 100.0);
+        if (wanted >= total) {
+            wanted = total - 1;
+        }
+        uint64_t seen = 0;
+        for (int i=0; i<BUCKETS; i++) {
+            seen += m_counts[i].load(std::memory_order_relaxed);
+            if (seen > wanted) {
+                return valueOf(i);
+            }
+        }
+        return valueOf(BUCKETS - 1);
+    }
+
+private:
+    std::atomic<uint64_t> m_counts[BUCKETS];
+
+    static int bucketOf(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return (int)value;
+        }
+        int msb = 63 - __builtin_clzll(value);
+        return (msb - 3) * SUB_BUCKETS + (int)((value >> (msb - 4)) & (SUB_BUCKETS - 1));
+    }
+
+    static uint64_t valueOf(int bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
+        }
+        int msb = bucket / SUB_BUCKETS + 3;
+        return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << (msb - 4);
+    }
+};
+
+struct bench_options_t {
+    std::string host;
+    int port;
+    std::vector<size_t> sizes;
+    std::vector<size_t> clients;
+    double duration;
+    long window;
+    size_t threads;
+    bool echo;
+    bool uring;
+    std::string label;
+    size_t connectCount;
+    size_t maxConnections;
+    std::string output;
+
+    bench_options_t() {
+        host = "127.0.0.1";
+        port = 65123;
+        sizes = {64, 1024, 16384};
+        clients = {1, 10, 100};
+        duration = 3.0;
+        window = 16;
+        threads = 4;
+        echo = true;
+        uring = false;
+        label = "";
+        connectCount = 1000;
+        maxConnections = 0;
+        output = "bench_results.jsonl";
+    }
+};
+
+bench_options_t options;
+FILE * output = nullptr;
+LatencyHistogram latencies;
+std::atomic<uint64_t> receivedMsgs(0);
+std::atomic<uint64_t> disconnections(0);
+// messages sent but not yet echoed, per connection
+std::unique_ptr<std::atomic<long>[]> inflight;
+
+uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// text as the contents of a JSON string: quotes, backslashes and
+// control characters escaped
+std::string jsonEscape(const std::string & text) {
+    std::string escaped;
+    for (size_t i=0; i<text.size(); i++) {
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c < 0x20) {
+            char code[7];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+// observer callback. record the round trip of an echoed message
+void onIncomingMsg(const char * msg, size_t size) {
+    if (size < sizeof(msg_header_t)) {
+        return;
+    }
+    msg_header_t header;
+    memcpy(&header, msg, sizeof(header));
+    latencies.record(nowNs() - header.sendTime);
+    inflight[header.clientIndex].fetch_sub(1, std::memory_order_relaxed);
+    receivedMsgs.fetch_add(1, std::memory_order_relaxed);
+}
+
+// observer callback. a benchmark connection must not go away
+void onDisconnection(const pipe_ret_t & ret) {
+    disconnections.fetch_add(1, std::memory_order_relaxed);
+    std::cerr << "Server disconnected: " << ret.msg << std::endl;
+}
+
+/*
+ * Split a comma separated list of positive numbers.
+ * Return false if any element is not a positive number.
+ */
+bool parseList(const std::string & list, std::vector<size_t> & values) {
+    values.clear();
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        long value = atol(list.substr(start, end - start).c_str());
+        if (value <= 0) {
+            return false;
+        }
+        values.push_back((size_t)value);
+        start = end + 1;
+    }
+    return !values.empty();
+}
+
+/*
+ * Send messages of msgSize bytes on every threadCount-th connection,
+ * starting with connection first, until deadline.
+ * Return number of messages handed to the client send queues.
+ */
+uint64_t sendLoop(std::vector<TcpClient*> & clients, size_t first, size_t threadCount,
+                  size_t msgSize, uint64_t deadline) {
+    std::vector<char> msg(msgSize, 'x');
+    uint64_t sent = 0;
+    while (nowNs() < deadline) {
+        bool progress = false;
+        for (size_t i=first; i<clients.size(); i+=threadCount) {
+            // the sink server never answers, so only the send queue limits the sink workload
+            while (!options.echo || inflight[i].load(std::memory_order_relaxed) < options.window) {
+                msg_header_t header;
+                header.sendTime = nowNs();
+                header.clientIndex = (uint32_t)i;
+                header.reserved = 0;
+                memcpy(msg.data(), &header, sizeof(header));
+                inflight[i].fetch_add(1, std::memory_order_relaxed);
+                if (!clients[i]->sendMsg(msg.data(), msg.size()).success) {
+                    inflight[i].fetch_sub(1, std::memory_order_relaxed);
+                    break;
+                }
+                sent++;
+                progress = true;
+                if (!options.echo && sent % 64 == 0) {
+                    break;
+                }
+            }
+        }
+        if (!progress) {
+            // every window is full: let the receive threads catch up
+            std::this_thread::yield();
+        }
+    }
+    return sent;
+}
+
+/*
+ * Run the throughput / latency benchmark for one message
+ * size and client count and write its result line.
+ * Return false if the connections could not be set up.
+ */
+bool runThroughput(size_t msgSize, size_t clientCount) {
+    latencies.reset();
+    receivedMsgs = 0;
+    disconnections = 0;
+    inflight.reset(new std::atomic<long>[clientCount]);
+    for (size_t i=0; i<clientCount; i++) {
+        inflight[i].store(0, std::memory_order_relaxed);
+    }
+
+    framing_config_t framing;
+    framing.mode = FRAMING_FIXED32;
+    client_observer_t observer;
+    observer.incoming_packet_func = onIncomingMsg;
+    observer.disconnected_func = onDisconnection;
+
+    bool ok = true;
+    std::vector<TcpClient*> clients;
+    for (size_t i=0; i<clientCount; i++) {
+        TcpClient * client = new TcpClient();
+        client->setFraming(framing);
+        client->setIoUring(options.uring);
+        client->setSendQueueLimit(std::max((size_t)options.window * (msgSize + MAX_FRAME_HEADER_SIZE), (size_t)64 * 1024));
+        client->subscribe(observer);
+        clients.push_back(client);
+        pipe_ret_t connectRet = client->connectTo(options.host, options.port);
+        if (!connectRet.success) {
+            std::cerr << "Client " << i << " failed to connect: " << connectRet.msg << std::endl;
+            ok = false;
+            break;
+        }
+    }
+
+    if (ok) {
+        size_t threadCount = std::min(options.threads, clientCount);
+        std::vector<std::thread> senders;
+        std::vector<uint64_t> sent(threadCount, 0);
+        uint64_t start = nowNs();
+        uint64_t deadline = start + (uint64_t)(options.duration * 1e9);
+        for (size_t t=0; t<threadCount; t++) {
+            senders.push_back(std::thread([&clients, &sent, t, threadCount, msgSize, deadline]() {
+                sent[t] = sendLoop(clients, t, threadCount, msgSize, deadline);
+            }));
+        }
+        for (size_t t=0; t<threadCount; t++) {
+            senders[t].join();
+        }
+        double seconds = (nowNs() - start) / 1e9;
+        uint64_t totalSent = 0;
+        for (size_t t=0; t<threadCount; t++) {
+            totalSent += sent[t];
+        }
+        // echoes still in flight at the deadline are not counted
+        uint64_t msgs = options.echo ? receivedMsgs.load() : totalSent;
+        double msgsPerSec = msgs / seconds;
+        double mbPerSec = msgsPerSec * msgSize / 1e6;
+
+        fprintf(output, "{\"benchmark\":\"%s\",\"label\":\"%s\",\"client_io\":\"%s\",\"clients\":%zu,"
+                "\"msg_size\":%zu,\"window\":%ld,\"seconds\":%.3f,\"msgs\":%llu,"
+                "\"msgs_per_sec\":%.0f,\"mb_per_sec\":%.2f",
+                options.echo ? "echo" : "sink", jsonEscape(options.label).c_str(), options.uring ? "uring" : "poll",
+                clientCount, msgSize, options.window, seconds, (unsigned long long)msgs,
+                msgsPerSec, mbPerSec);
+        if (options.echo) {
+            fprintf(output, ",\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f",
+                    latencies.percentile(50) / 1e3, latencies.percentile(99) / 1e3,
+                    latencies.percentile(99.9) / 1e3);
+        }
+        fprintf(output, ",\"disconnections\":%llu}\n", (unsigned long long)disconnections.load());
+        fflush(output);
+
+        fprintf(stderr, "%-5s %-10s clients=%-5zu size=%-6zu %10.0f msgs/s %9.2f MB/s",
+                options.echo ? "echo" : "sink", options.label.c_str(), clientCount, msgSize,
+                msgsPerSec, mbPerSec);
+        if (options.echo) {
+            fprintf(stderr, "  p50=%.1fus p99=%.1fus p999=%.1fus",
+                    latencies.percentile(50) / 1e3, latencies.percentile(99) / 1e3,
+                    latencies.percentile(99.9) / 1e3);
+        }
+        fprintf(stderr, "\n");
+    }
+
+    for (size_t i=0; i<clients.size(); i++) {
+        clients[i]->unsubscribeAll();
+        clients[i]->finish();
+    }
+    // receive threads are detached by finish(), give them time to leave
+    // before their clients are destroyed
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    for (size_t i=0; i<clients.size(); i++) {
+        delete clients[i];
+    }
+    return ok;
+}
+
+/*
+ * Open a blocking TCP connection to the benchmark server.
+ * Return the socket, or -1 with errno set.
+ */
+int openConnection() {
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(options.port);
+    if (inet_pton(AF_INET, options.host.c_str(), &server.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&server, sizeof(server)) == -1) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Measure how fast connections are established. Connections stay
+ * open until all are made, so the server accepts every one of them.
+ * Connection benchmarks use plain sockets: a TcpClient runs a receive
+ * thread per connection, which would be measured instead of the server.
+ */
+void runConnectRate() {
+    std::vector<int> fds;
+    fds.reserve(options.connectCount);
+    const char * error = "";
+    uint64_t start = nowNs();
+    for (size_t i=0; i<options.connectCount; i++) {
+        int fd = openConnection();
+        if (fd == -1) {
+            error = strerror(errno);
+            break;
+        }
+        fds.push_back(fd);
+    }
+    double seconds = (nowNs() - start) / 1e9;
+    for (size_t i=0; i<fds.size(); i++) {
+        close(fds[i]);
+    }
+
+    fprintf(output, "{\"benchmark\":\"connect\",\"label\":\"%s\",\"connections\":%zu,"
+            "\"seconds\":%.3f,\"connects_per_sec\":%.0f,\"error\":\"%s\"}\n",
+            jsonEscape(options.label).c_str(), fds.size(), seconds, fds.size() / seconds, error);
+    fflush(output);
+    fprintf(stderr, "connect    %-10s %zu connections in %.3fs, %.0f/s %s\n",
+            options.label.c_str(), fds.size(), seconds, fds.size() / seconds, error);
+}
+
+/*
+ * Open up to maxConnections concurrent connections, then send a framed
+ * message through each of them and count the ones answered (echo only).
+ */
+void runMaxConnections() {
+    // two descriptors per connection when the server runs on this host
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    std::vector<int> fds;
+    fds.reserve(options.maxConnections);
+    const char * error = "";
+    for (size_t i=0; i<options.maxConnections; i++) {
+        int fd = openConnection();
+        if (fd == -1) {
+            error = strerror(errno);
+            break;
+        }
+        fds.push_back(fd);
+    }
+
+    size_t served = 0;
+    if (options.echo) {
+        char ping[4 + sizeof(msg_header_t)];
+        memset(ping, 0, sizeof(ping));
+        encodeFrameHeader(FRAMING_FIXED32, sizeof(msg_header_t), ping);
+        for (size_t i=0; i<fds.size(); i++) {
+            ssize_t sent = send(fds[i], ping, sizeof(ping), MSG_NOSIGNAL);
+            (void)sent;
+        }
+        uint64_t deadline = nowNs() + 10ULL * 1000 * 1000 * 1000;
+        for (size_t i=0; i<fds.size(); i++) {
+            char reply[sizeof(ping)];
+            size_t received = 0;
+            while (received < sizeof(reply)) {
+                int64_t left = (int64_t)(deadline - nowNs());
+                struct pollfd pfd = {fds[i], POLLIN, 0};
+                if (left <= 0 || poll(&pfd, 1, (int)(left / 1000000) + 1) <= 0) {
+                    break;
+                }
+                ssize_t numOfBytes = recv(fds[i], reply + received, sizeof(reply) - received, 0);
+                if (numOfBytes <= 0) {
+                    break;
+                }
+                received += numOfBytes;
+            }
+            if (received == sizeof(reply)) {
+                served++;
+            }
+        }
+    }
+    for (size_t i=0; i<fds.size(); i++) {
+        close(fds[i]);
+    }
+
+    fprintf(output, "{\"benchmark\":\"max_connections\",\"label\":\"%s\",\"requested\":%zu,"
+            "\"connected\":%zu,\"served\":%zu,\"error\":\"%s\"}\n",
+            jsonEscape(options.label).c_str(), options.maxConnections, fds.size(), served, error);
+    fflush(output);
+    fprintf(stderr, "max-conns  %-10s connected=%zu served=%zu %s\n",
+            options.label.c_str(), fds.size(), served, error);
+}
+
+void usage(const char * name) {
+    std::cerr << "usage: " << name << " [--host A] [--port N] [--sizes 64,1024,...] [--clients 1,10,...]"
+              << " [--duration SEC] [--window N] [--threads N] [--workload echo|sink] [--uring]"
+              << " [--label NAME] [--connect N] [--max-connections N] [--output FILE|-]" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i=1; i<argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--uring") {
+            options.uring = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        std::string value = argv[++i];
+        bool valid = true;
+        if (arg == "--host") {
+            options.host = value;
+        } else if (arg == "--port") {
+            options.port = atoi(value.c_str());
+        } else if (arg == "--sizes") {
+            valid = parseList(value, options.sizes);
+        } else if (arg == "--clients") {
+            valid = parseList(value, options.clients);
+        } else if (arg == "--duration") {
+            options.duration = atof(value.c_str());
+            valid = options.duration > 0;
+        } else if (arg == "--window") {
+            options.window = atol(value.c_str());
+            valid = options.window > 0;
+        } else if (arg == "--threads") {
+            options.threads = (size_t)atol(value.c_str());
+            valid = options.threads > 0;
+        } else if (arg == "--workload") {
+            options.echo = (value == "echo");
+            valid = (value == "echo" || value == "sink");
+        } else if (arg == "--label") {
+            options.label = value;
+        } else if (arg == "--connect") {
+            options.connectCount = (size_t)atol(value.c_str());
+        } else if (arg == "--max-connections") {
+            options.maxConnections = (size_t)atol(value.c_str());
+        } else if (arg == "--output") {
+            options.output = value;
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    for (size_t i=0; i<options.sizes.size(); i++) {
+        if (options.sizes[i] < sizeof(msg_header_t)) {
+            std::cerr << "Message sizes must be at least " << sizeof(msg_header_t) << " bytes" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    output = (options.output == "-") ? stdout : fopen(options.output.c_str(), "a");
+    if (output == nullptr) {
+        std::cerr << "Cannot open " << options.output << ": " << strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int ret = 0;
+    for (size_t s=0; s<options.sizes.size(); s++) {
+        for (size_t c=0; c<options.clients.size(); c++) {
+            if (!runThroughput(options.sizes[s], options.clients[c])) {
+                ret = EXIT_FAILURE;
+            }
+        }
+    }
+    if (options.connectCount > 0) {
+        runConnectRate();
+    }
+    if (options.maxConnections > 0) {
+        runMaxConnections();
+    }
+
+    if (output != stdout) {
+        fclose(output);
+    }
+    return ret;
+}
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Run load_generator against bench_server in every server mode over loopback.
+#
+#   bench/run_benchmarks.sh [BUILD_DIR] [OUTPUT]
+#
+# Extra load_generator options can be given in LOADGEN_ARGS, e.g.
+#   LOADGEN_ARGS="--sizes 64 --clients 1,1000 --max-connections 10000"
+# Results are appended to OUTPUT (bench_results.jsonl by default).
+
+BUILD_DIR=${1:-build}
+OUTPUT=${2:-bench_results.jsonl}
+PORT=${PORT:-65123}
+MODES=${MODES:-"thread epoll reactor uring"}
+
+for mode in $MODES; do
+    "$BUILD_DIR/bench_server" --port "$PORT" --mode "$mode" &
+    server=$!
+    sleep 1
+    if kill -0 $server 2>/dev/null; then
+        "$BUILD_DIR/load_generator" --port "$PORT" --label "$mode" --output "$OUTPUT" $LOADGEN_ARGS > /dev/null
+        kill $server
+    fi
+    wait $server
+done
@@ -2,8 +2,6 @@
 /////////////////////CLIENT EXAMPLE////////////////////////
 ///////////////////////////////////////////////////////////
 
-#ifdef CLIENT_EXAMPLE
-
 #include <iostream>
 #include <signal.h>
 #include "include/tcp_client.h"
@@ -67,7 +65,7 @@ int main() {
 		std::string msg = "hello server\n";
         pipe_ret_t sendRet = client.sendMsg(msg.c_str(), msg.size());
 		if (!sendRet.success) {
-			std::cout << "Failed to send msg: " << sendRet.msg << std::endl;
+			std::cout << "Failed to send msg: " << sendRet.reason << std::endl;
 			break;
 		}
 		sleep(1);
@@ -75,5 +73,3 @@ int main() {
 
 	return 0;
 }
-
-#endif
\ No newline at end of file
@@ -0,0 +1,122 @@
+///////////////////////////////////////////////////////////
+///////////////////COROUTINE EXAMPLE///////////////////////
+///////////////////////////////////////////////////////////
+
+// needs C++20: a request/response server and a client of it, written as
+// coroutines and driven by a single event loop thread
+
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <cstring>
+#include <errno.h>
+#include <string>
+#include <thread>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include "include/async_task.h"
+
+AsyncContext context;
+std::atomic<bool> done(false);
+
+// serve one client: read a 4 bytes length and the request, reply it upper cased
+async_task_t serveClient(AsyncSocket * socket) {
+    char request[1024];
+    while (true) {
+        uint32_t length;
+        io_result_t received = co_await socket->readExactly((char *)&length, sizeof(length));
+        if (!received.success) {
+            break;
+        }
+        length = ntohl(length);
+        if (length > sizeof(request)) {
+            break;
+        }
+        received = co_await socket->readExactly(request, length);
+        if (!received.success) {
+            break;
+        }
+        for (uint32_t i = 0; i < length; i++) {
+            request[i] = (char)toupper(request[i]);
+        }
+        uint32_t header = htonl(length);
+        if (!(co_await socket->write((const char *)&header, sizeof(header))).success ||
+            !(co_await socket->write(request, length)).success) {
+            break;
+        }
+    }
+    socket->close();
+    delete socket;
+}
+
+// accept clients and start a session for each of them
+async_task_t acceptClients(AsyncListener * listener) {
+    while (true) {
+        io_result_t accepted = co_await listener->accept();
+        if (!accepted.success) {
+            if (accepted.code != ECANCELED) {
+                std::cout << "Accepting client failed: " << accepted.reason << std::endl;
+            }
+            break;
+        }
+        serveClient(accepted.socket);
+    }
+}
+
+// send a few requests and wait for each reply
+async_task_t runClient(int port) {
+    AsyncSocket * socket = new AsyncSocket(context);
+    io_result_t connected = co_await socket->connect("127.0.0.1", port);
+    if (!connected.success) {
+        std::cout << "Connecting failed: " << connected.reason << std::endl;
+    } else {
+        const char * requests[] = { "hello", "coroutines", "bye" };
+        for (const char * request : requests) {
+            uint32_t length = htonl((uint32_t)strlen(request));
+            co_await socket->write((const char *)&length, sizeof(length));
+            co_await socket->write(request, strlen(request));
+            char reply[1024];
+            io_result_t received = co_await socket->readExactly((char *)&length, sizeof(length));
+            if (received.success) {
+                received = co_await socket->readExactly(reply, ntohl(length));
+            }
+            if (!received.success) {
+                std::cout << "Receiving failed: " << received.reason << std::endl;
+                break;
+            }
+            std::cout << "Got reply: " << std::string(reply, received.size) << std::endl;
+        }
+    }
+    socket->close();
+    delete socket;
+    done = true;
+}
+
+int main() {
+    pipe_ret_t startRet = context.start(1);
+    if (!startRet.success) {
+        std::cout << "Starting the event loop failed: " << startRet.msg << std::endl;
+        return EXIT_FAILURE;
+    }
+    AsyncListener listener(context);
+    pipe_ret_t listenRet = listener.listen(0);
+    if (!listenRet.success) {
+        std::cout << "Listening failed: " << listenRet.msg << std::endl;
+        return EXIT_FAILURE;
+    }
+    int port = listener.getPort();
+
+    // run the coroutines on the loop thread, where they are resumed anyway
+    context.post([&listener]() { acceptClients(&listener); });
+    context.post([port]() { runClient(port); });
+
+    while (!done) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    // closed on its loop thread, which ends acceptClients()
+    listener.close();
+    context.stop();
+    return 0;
+}
@@ -0,0 +1,306 @@
+
+
+#ifndef INTERCOM_ASYNC_IO_H
+#define INTERCOM_ASYNC_IO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+#include "memory_pool.h"
+#include "socket_options.h"
+#include "pipe_ret_t.h"
+
+class AsyncLoop;
+class AsyncSocket;
+class AsyncListener;
+
+/*
+ * Outcome of an asynchronous operation: the bytes transferred, even
+ * when it failed, and for accept() the new connection. A failure is
+ * described by code and reason, msg stays empty
+ */
+struct io_result_t : public pipe_ret_t {
+    size_t size = 0;
+    AsyncSocket * socket = nullptr;
+};
+
+// completion callback of the callback flavour of the operations
+typedef std::function<void(const io_result_t & result)> io_callback_t;
+
+/*
+ * Receiver of the completion of an operation. The operation keeps
+ * a pointer to it, so waiting for a completion never allocates.
+ */
+class IoWaiter {
+public:
+    virtual ~IoWaiter() {}
+    virtual void onIoComplete(const io_result_t & result) = 0;
+};
+
+/*
+ * Operation of an AsyncSocket or AsyncListener, as returned by their
+ * read(), readExactly(), write(), connect() and accept(), to be
+ * co_await'ed from a C++20 coroutine (see async_task.h):
+ *
+ *     io_result_t result = co_await socket->readExactly(header, sizeof(header));
+ *
+ * The operation starts when the coroutine suspends. If it completes
+ * right away the coroutine goes on without suspending, otherwise it is
+ * resumed on the loop thread of the socket. The awaitable lives in the
+ * coroutine frame and is the operation's waiter, so nothing is allocated.
+ * Declared in C++11, it is only usable from C++20 code.
+ */
+class IoAwaitable : private IoWaiter {
+
+    friend class AsyncSocket;
+    friend class AsyncListener;
+
+public:
+    bool await_ready() const { return false; }
+    template <typename Handle>
+    bool await_suspend(Handle handle) {
+        m_coroutine = handle.address();
+        m_resume = &resume<Handle>;
+        // may already be resumed on another thread when start() returns
+        return !start();
+    }
+    io_result_t await_resume() const { return m_result; }
+
+private:
+    enum op_t {
+        OP_READ,
+        OP_READ_EXACTLY,
+        OP_WRITE,
+        OP_CONNECT,
+        OP_ACCEPT,
+    };
+
+    op_t m_op;
+    AsyncSocket * m_socket = nullptr;
+    AsyncListener * m_listener = nullptr;
+    char * m_buffer = nullptr;
+    size_t m_size = 0;
+    // host of a connect, valid for the whole co_await expression
+    const std::string * m_host = nullptr;
+    int m_port = 0;
+    void * m_coroutine = nullptr;
+    void (*m_resume)(void * coroutine) = nullptr;
+    io_result_t m_result;
+
+    IoAwaitable(op_t op, AsyncSocket * socket) : m_op(op), m_socket(socket) {}
+    explicit IoAwaitable(AsyncListener * listener) : m_op(OP_ACCEPT), m_listener(listener) {}
+
+    bool start();
+    void onIoComplete(const io_result_t & result);
+
+    template <typename Handle>
+    static void resume(void * coroutine) { Handle::from_address(coroutine).resume(); }
+};
+
+/*
+ * Event loop threads serving AsyncSockets and AsyncListeners. Each
+ * socket belongs to one loop, whose thread performs its operations and
+ * calls their completions, so a single thread drives any number of
+ * sessions. The context must outlive its sockets and listeners.
+ */
+class AsyncContext {
+
+    friend class AsyncSocket;
+    friend class AsyncListener;
+
+private:
+    std::vector<AsyncLoop*> m_loops;
+    std::atomic<uint> m_nextLoop;
+
+    AsyncLoop * nextLoop();
+
+public:
+    AsyncContext();
+    ~AsyncContext();
+
+    // start the loop threads, 0 means one per core
+    pipe_ret_t start(uint threads = 1);
+    // stop and join the loop threads, operations still pending never complete
+    void stop();
+    // run task on a loop thread, e.g. to start a session there
+    void post(const std::function<void()> & task);
+};
+
+/*
+ * Descriptor registered in an AsyncLoop, base of sockets and listeners.
+ * It is watched for events from the first operation which has to wait,
+ * always on its loop thread.
+ */
+class AsyncDescriptor {
+
+    friend class AsyncLoop;
+    friend class DestroyGuard;
+    friend class CallbackWaiter;
+
+protected:
+    AsyncLoop * m_loop;
+    int m_fd;
+    // slot of the descriptor in its loop, 0 until it is watched
+    uint64_t m_token = 0;
+    // set while completions run, tells them the descriptor was deleted
+    bool * m_destroyed = nullptr;
+
+    AsyncDescriptor(AsyncLoop * loop, int fd) : m_loop(loop), m_fd(fd) {}
+    virtual ~AsyncDescriptor();
+
+    virtual void onEvents(uint32_t events) = 0;
+    bool watch();
+    void closeDescriptor();
+    // whether operations must be handed over to the loop thread, and
+    // how they fail when the loop is not running
+    bool isForeignThread() const;
+    bool isLoopStopped(io_result_t & result) const;
+    void post(const std::function<void()> & task);
+};
+
+/*
+ * Waiter calling the callback of the asyncXxx() flavour of operations.
+ * It is a trampoline: an operation started by the callback and completed
+ * right away has its callback run after this one returned, rather than
+ * nested in it, so a callback chain can't grow the stack.
+ */
+class CallbackWaiter : public IoWaiter {
+
+private:
+    AsyncDescriptor * m_owner;
+    io_callback_t m_callback;
+    io_result_t m_result;
+    bool m_ready = false;
+    bool m_running = false;
+
+public:
+    explicit CallbackWaiter(AsyncDescriptor * owner) : m_owner(owner) {}
+    // callback of the operation about to start
+    void setCallback(const io_callback_t & callback) { m_callback = callback; }
+    void onIoComplete(const io_result_t & result);
+};
+
+/*
+ * Non-blocking TCP connection driven by an AsyncContext, either
+ * connected by connect() or handed out by AsyncListener::accept().
+ *
+ * Every operation comes in three flavours:
+ * - read(), readExactly(), write(), connect(): awaitables for coroutines,
+ * - asyncRead(), ...: taking a callback, for C++11 code,
+ * - startRead(), ...: taking an IoWaiter, which the two others build on.
+ *   They return true when the operation completed right away, with
+ *   result filled, and otherwise call the waiter once it completes.
+ *
+ * One read and one write (or connect) may be pending at a time.
+ * Operations may be started from any thread, but completions run on the
+ * socket's loop thread, and the socket must be closed and deleted there
+ * (or once the context stopped), with no operation pending.
+ */
+class AsyncSocket : private AsyncDescriptor {
+
+    friend class AsyncListener;
+
+private:
+    struct pending_t {
+        IoWaiter * waiter = nullptr;
+        char * buffer = nullptr;
+        size_t size = 0;
+        size_t done = 0;
+        bool exactly = false;
+    };
+
+    socket_options_t m_options;
+    pending_t m_reading;
+    // pending write, or connect
+    pending_t m_writing;
+    bool m_connecting = false;
+    CallbackWaiter m_readCallback;
+    CallbackWaiter m_writeCallback;
+
+    AsyncSocket(AsyncLoop * loop, int fd);
+
+    void onEvents(uint32_t events);
+    bool beginRead(char * buffer, size_t size, bool exactly, IoWaiter * waiter, io_result_t & result);
+    bool beginWrite(const char * data, size_t size, IoWaiter * waiter, io_result_t & result);
+    bool beginConnect(const struct sockaddr_storage & address, socklen_t addressSize,
+                      IoWaiter * waiter, io_result_t & result);
+    bool continueRead(io_result_t & result);
+    bool continueWrite(io_result_t & result);
+    bool continueConnect(io_result_t & result);
+    bool wait(pending_t & pending, io_result_t & result);
+    void cancel(pending_t & pending, const io_result_t & result);
+
+public:
+    explicit AsyncSocket(AsyncContext & context);
+    ~AsyncSocket();
+
+    static void * operator new(size_t size) { return BufferPool::allocate(size); }
+    static void operator delete(void * ptr, size_t size) { BufferPool::deallocate(ptr, size); }
+
+    // options of the socket connect() creates, socket_options_t::client() by default
+    void setSocketOptions(const socket_options_t & options) { m_options = options; }
+
+    // whatever was received, at least a byte, up to size
+    IoAwaitable read(char * buffer, size_t size);
+    // exactly size bytes
+    IoAwaitable readExactly(char * buffer, size_t size);
+    // all of data, which must stay valid until the write completed
+    IoAwaitable write(const char * data, size_t size);
+    // host is resolved right away, from the calling thread
+    IoAwaitable connect(const std::string & host, int port);
+
+    void asyncRead(char * buffer, size_t size, const io_callback_t & callback);
+    void asyncReadExactly(char * buffer, size_t size, const io_callback_t & callback);
+    void asyncWrite(const char * data, size_t size, const io_callback_t & callback);
+    void asyncConnect(const std::string & host, int port, const io_callback_t & callback);
+
+    bool startRead(char * buffer, size_t size, IoWaiter * waiter, io_result_t & result);
+    bool startReadExactly(char * buffer, size_t size, IoWaiter * waiter, io_result_t & result);
+    bool startWrite(const char * data, size_t size, IoWaiter * waiter, io_result_t & result);
+    bool startConnect(const std::string & host, int port, IoWaiter * waiter, io_result_t & result);
+
+    // close the connection, pending operations complete with ECANCELED
+    void close();
+    bool isOpen() const { return m_fd != -1; }
+    int getFileDescriptor() const { return m_fd; }
+};
+
+/*
+ * Listening socket handing out AsyncSockets, spread round robin over
+ * the loops of its context. Same threading rules as AsyncSocket.
+ */
+class AsyncListener : private AsyncDescriptor {
+
+private:
+    socket_options_t m_options;
+    AsyncContext & m_context;
+    IoWaiter * m_accepting = nullptr;
+    CallbackWaiter m_acceptCallback;
+
+    void onEvents(uint32_t events);
+    bool beginAccept(IoWaiter * waiter, io_result_t & result);
+    bool continueAccept(io_result_t & result);
+
+public:
+    explicit AsyncListener(AsyncContext & context);
+    ~AsyncListener();
+
+    // listen on port of every IPv4 address, 0 picks a free port.
+    // Accepted sockets inherit options
+    pipe_ret_t listen(int port, const socket_options_t & options = socket_options_t(), int backlog = SOMAXCONN);
+    int getPort() const;
+
+    IoAwaitable accept();
+    void asyncAccept(const io_callback_t & callback);
+    bool startAccept(IoWaiter * waiter, io_result_t & result);
+
+    // stop listening, a pending accept completes with ECANCELED
+    void close();
+};
+
+
+#endif //INTERCOM_ASYNC_IO_H
@@ -0,0 +1,50 @@
+
+
+#ifndef INTERCOM_ASYNC_TASK_H
+#define INTERCOM_ASYNC_TASK_H
+
+#include "async_io.h"
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <coroutine>
+#include <exception>
+#include "memory_pool.h"
+
+/*
+ * Return type of the coroutines of a session, C++20 only:
+ *
+ *     async_task_t echo(AsyncSocket * socket) {
+ *         char buffer[4096];
+ *         while (true) {
+ *             io_result_t received = co_await socket->read(buffer, sizeof(buffer));
+ *             if (!received.success) break;
+ *             io_result_t sent = co_await socket->write(buffer, received.size);
+ *             if (!sent.success) break;
+ *         }
+ *         socket->close();
+ *         delete socket;
+ *     }
+ *
+ * The coroutine runs right away, until its first operation that has to
+ * wait, and frees itself once it returns. Nothing waits for it or gets
+ * its result. Its frame comes from the BufferPool, and is the only
+ * allocation of a session: suspending allocates nothing.
+ */
+struct async_task_t {
+
+    struct promise_type {
+        async_task_t get_return_object() { return async_task_t(); }
+        std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+        std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        static void * operator new(size_t size) { return BufferPool::allocate(size); }
+        static void operator delete(void * ptr, size_t size) { BufferPool::deallocate(ptr, size); }
+    };
+};
+
+#endif
+
+#endif //INTERCOM_ASYNC_TASK_H
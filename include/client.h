@@ -3,39 +3,180 @@
 #define INTERCOM_CLIENT_H
 
 
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
 #include <string>
 #include <thread>
 #include <functional>
+#include <atomic>
+#include "send_queue.h"
+#include "ip_address.h"
+#include "timer_wheel.h"
+
+class EventLoop;
+class FrameBuffer;
+class ReceiveBuffers;
+class ConnectionMetrics;
+class ClientStrand;
+class Stream;
+class TlsStream;
+class Compressor;
+class Decompressor;
+class TokenBucket;
+struct ObserverSet;
+
+// generation (32 bits) | registry slot (32 bits), 0 is never a valid id
+typedef uint64_t client_id_t;
+
+/*
+ * Observers of a client, as resolved by the server's ObserverTable.
+ * Copyable along with the client, unlike the atomic it wraps.
+ */
+class ObserverBinding {
+
+    friend class ObserverTable;
+
+private:
+    std::atomic<const ObserverSet *> m_set;
+
+public:
+    ObserverBinding() : m_set(nullptr) {}
+    ObserverBinding(const ObserverBinding & other) : m_set(other.m_set.load(std::memory_order_acquire)) {}
+    ObserverBinding & operator =(const ObserverBinding & other) {
+        m_set.store(other.m_set.load(std::memory_order_acquire), std::memory_order_release);
+        return *this;
+    }
+};
+
+/*
+ * Whether a flush of the client's send queue was handed to its I/O
+ * thread and has not run yet, so senders hand it over once rather
+ * than once per message. Copyable along with the client, unlike the
+ * atomic it wraps.
+ */
+class FlushRequest {
+
+private:
+    std::atomic<bool> m_pending;
+
+public:
+    FlushRequest() : m_pending(false) {}
+    FlushRequest(const FlushRequest & other) : m_pending(other.m_pending.load(std::memory_order_acquire)) {}
+    FlushRequest & operator =(const FlushRequest & other) {
+        m_pending.store(other.m_pending.load(std::memory_order_acquire), std::memory_order_release);
+        return *this;
+    }
+
+    // true if no flush was pending, the caller must then wake the I/O thread
+    bool request() { return !m_pending.exchange(true, std::memory_order_acq_rel); }
+    // I/O thread, before flushing: what is queued from now on needs a new request
+    void clear() { m_pending.exchange(false, std::memory_order_acq_rel); }
+};
+
+/*
+ * Liveness of a client, checked by its I/O thread whenever the client
+ * timer expires. The message path only records when it last received
+ * and queued something, it never touches the timer wheel.
+ */
+class ClientTimer {
+
+public:
+    // TimerWheel::clockMs() of the last receive and send
+    std::atomic<uint64_t> lastReceived;
+    std::atomic<uint64_t> lastSent;
+    // I/O thread side: the scheduled timer, and the bytes the send
+    // queue had written when last seen making progress, and when
+    timer_id_t timerId = 0;
+    uint64_t written = 0;
+    uint64_t progressAt;
+    // when the scheduled timer expires, and when reads or writes paused
+    // over their rate limit go on, 0 if none is paused
+    uint64_t expiresAt = 0;
+    uint64_t resumeAt = 0;
+    bool readPaused = false;
+    bool writePaused = false;
+
+    explicit ClientTimer(uint64_t now) : lastReceived(now), lastSent(now), progressAt(now) {}
+
+    static void * operator new(size_t size) { return BufferPool::allocate(size); }
+    static void operator delete(void * ptr, size_t size) { BufferPool::deallocate(ptr, size); }
+};
 
 class Client {
 
+    friend class TcpServer;
+    friend class ClientRegistry;
+    friend class ObserverTable;
+
 private:
+    client_id_t m_id = 0;
     int m_sockfd = 0;
-    std::string m_ip = "";
-    std::string m_errorMsg = "";
-    bool m_isConnected;
-    std::thread * m_threadHandler = nullptr;
+    char m_ip[INET6_ADDRSTRLEN] = "";
+    ip_address_t m_address;
+    // static string (literal or strerror()), never owned, or nullptr
+    // when the message was copied into m_errorText
+    const char * m_errorMsg = "";
+    char m_errorText[64] = "";
+    bool m_isConnected = false;
+    // the server draining shut its writing down
+    bool m_halfClosed = false;
+    // epoll I/O thread owning the socket (SERVER_MODE_EPOLL only)
+    EventLoop * m_eventLoop = nullptr;
+    uint m_eventLoopIndex = 0;
+    // reassembly buffer, when the server uses message framing
+    FrameBuffer * m_frameBuffer = nullptr;
+    // batch buffers, when it uses none (not with io_uring)
+    ReceiveBuffers * m_receiveBuffers = nullptr;
+    // outbound queue of non-blocking (epoll) clients
+    SendQueue * m_sendQueue = nullptr;
+    // connection of an in-memory client, whose file descriptor is the
+    // eventfd of the stream rather than a socket, or of a TLS client
+    Stream * m_stream = nullptr;
+    // the stream of a TLS client until its handshake is done, the
+    // client is only connected, and known to observers, afterwards
+    TlsStream * m_handshake = nullptr;
+    // compression of the messages sent and received, if enabled
+    Compressor * m_compressor = nullptr;
+    Decompressor * m_decompressor = nullptr;
+    // traffic counters, unless the server collects no metrics
+    ConnectionMetrics * m_metrics = nullptr;
+    // hand-off of received messages to the worker pool, if dispatching
+    ClientStrand * m_strand = nullptr;
+    // timeouts, heartbeats and rate limit pauses, if the server has any
+    ClientTimer * m_timer = nullptr;
+    // rate limit of reads, if the server has one (writes are
+    // limited by the send queue)
+    TokenBucket * m_readLimit = nullptr;
+    // observers interested in the client's address
+    ObserverBinding m_observers;
+    // a flush is pending on the I/O thread
+    FlushRequest m_flushRequest;
+    backpressure_policy_t m_backpressurePolicy = BACKPRESSURE_DROP;
 
 public:
-    ~Client();
     bool operator ==(const Client & other);
 
+    client_id_t getId() const { return m_id; }
+
     void setFileDescriptor(int sockfd) { m_sockfd = sockfd; }
     int getFileDescriptor() const { return m_sockfd; }
 
-    void setIp(const std::string & ip) { m_ip = ip; }
+    void setIp(const char * ip);
     std::string getIp() const { return m_ip; }
+    void setAddress(const struct sockaddr * address);
+    const ip_address_t & getAddress() const { return m_address; }
 
-    void setErrorMessage(const std::string & msg) { m_errorMsg = msg; }
-    std::string getInfoMessage() const { return m_errorMsg; }
+    // msg must outlive the client: a literal or strerror()
+    void setErrorMessage(const char * msg) { m_errorMsg = msg; }
+    // copied, truncated to 63 characters
+    void setErrorMessage(const std::string & msg);
+    std::string getInfoMessage() const { return m_errorMsg != nullptr ? m_errorMsg : m_errorText; }
 
     void setConnected() { m_isConnected = true; }
 
     void setDisconnected() { m_isConnected = false; }
     bool isConnected() { return m_isConnected; }
-
-    void setThreadHandler(std::function<void(void)> func) { m_threadHandler = new std::thread(func);}
-
 };
 
 
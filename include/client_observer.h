@@ -4,25 +4,44 @@
 
 
 #include <string>
+#include <functional>
+#include <sys/uio.h>
 #include "pipe_ret_t.h"
 
 
+// observer callbacks take function pointers as well as any callable
+// object, e.g. a lambda capturing the state it works on
 typedef void (incoming_packet_func)(const char * msg, size_t size);
-typedef incoming_packet_func* incoming_packet_func_t;
+typedef std::function<incoming_packet_func> incoming_packet_func_t;
+
+// everything received at once: chunks of the stream
+// without framing, complete messages with framing
+typedef void (incoming_buffers_func)(const struct iovec * buffers, size_t count);
+typedef std::function<incoming_buffers_func> incoming_buffers_func_t;
 
 typedef void (disconnected_func)(const pipe_ret_t & ret);
-typedef disconnected_func* disconnected_func_t;
+typedef std::function<disconnected_func> disconnected_func_t;
+
+typedef void (reconnected_func)();
+typedef std::function<reconnected_func> reconnected_func_t;
 
 struct client_observer_t {
 
     std::string wantedIp;
     incoming_packet_func_t incoming_packet_func;
+    // batched alternative to incoming_packet_func, called once per
+    // list of buffers instead of once per buffer
+    incoming_buffers_func_t incoming_buffers_func;
     disconnected_func_t disconnected_func;
+    // connection restored by a client set to reconnect
+    reconnected_func_t reconnected_func;
 
     client_observer_t() {
         wantedIp = "";
         incoming_packet_func = NULL;
+        incoming_buffers_func = NULL;
         disconnected_func = NULL;
+        reconnected_func = NULL;
     }
 };
 
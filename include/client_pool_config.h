@@ -0,0 +1,44 @@
+
+
+#ifndef INTERCOM_CLIENT_POOL_CONFIG_H
+#define INTERCOM_CLIENT_POOL_CONFIG_H
+
+#include <sys/types.h>
+#include "framing.h"
+#include "socket_options.h"
+
+// connection a TcpClientPool sends a message on
+enum pool_selection_t {
+    // every connection in turn
+    POOL_ROUND_ROBIN,
+    // the one of two random connections with less bytes queued
+    POOL_LEAST_LOADED,
+};
+
+struct client_pool_config_t {
+
+    // sockets connected to the server
+    uint connections;
+    // how long connectTo() waits for the connections to come up
+    uint connectTimeoutMs;
+    // I/O threads shared by all connections, 0 means one per core
+    uint ioThreads;
+    pool_selection_t selection;
+    // length prefix framing of messages, both received and sent
+    framing_config_t framing;
+    // bytes every connection may have queued for sending
+    size_t sendQueueLimit;
+    // TCP options of every connection
+    socket_options_t socketOptions;
+
+    client_pool_config_t() {
+        connections = 8;
+        connectTimeoutMs = 5000;
+        ioThreads = 1;
+        selection = POOL_ROUND_ROBIN;
+        sendQueueLimit = 16 * 1024 * 1024;
+        socketOptions = socket_options_t::client();
+    }
+};
+
+#endif //INTERCOM_CLIENT_POOL_CONFIG_H
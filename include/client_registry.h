@@ -0,0 +1,111 @@
+
+
+#ifndef INTERCOM_CLIENT_REGISTRY_H
+#define INTERCOM_CLIENT_REGISTRY_H
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include "client.h"
+
+/*
+ * Concurrent table of connected clients.
+ *
+ * Clients live in slots allocated in fixed size chunks which are never
+ * moved or freed while the registry exists, so a Client reference stays
+ * valid for as long as it is acquired. Every slot carries a generation
+ * counter which is part of the client id, so ids of removed clients are
+ * never confused with the client later reusing the same slot.
+ *
+ * Insert, lookup (acquire) and remove are O(1) and lock-free: they are
+ * built on compare-and-swap of the slot state word and of the head of
+ * the free slot list, so readers never block.
+ *
+ * A slot holds one reference while the client is live (registered) and
+ * one per acquire(). The client object is destroyed when its last
+ * reference is released, after the reclaim handler had a chance to
+ * release its resources (e.g. close the socket).
+ */
+class ClientRegistry {
+
+public:
+    typedef std::function<void(Client & client)> reclaim_handler_t;
+
+    static const uint32_t CHUNK_SIZE = 4096;
+    static const uint32_t MAX_CHUNKS = 1024;
+
+    ClientRegistry();
+    ~ClientRegistry();
+
+    void setReclaimHandler(const reclaim_handler_t & handler) { m_reclaimHandler = handler; }
+
+    Client * insert(const Client & client);
+    Client * acquire(client_id_t id);
+    void release(Client * client);
+    // another reference to a client the caller holds one to
+    void retain(Client * client) { slotAt(indexOf(client->getId()))->state.fetch_add(1, std::memory_order_relaxed); }
+    // client the caller holds a reference to, even if it was removed meanwhile
+    Client * held(client_id_t id) { return slotAt(indexOf(id))->client(); }
+    bool remove(client_id_t id);
+    size_t size() const { return m_size.load(std::memory_order_relaxed); }
+
+    /*
+     * Call func for every live client. Each client is acquired for
+     * the duration of the call, so func may safely use it even if
+     * it is concurrently removed.
+     */
+    template <typename Func>
+    void forEach(Func func) {
+        uint32_t highWater = m_highWater.load(std::memory_order_acquire);
+        for (uint32_t index=0; index<highWater; index++) {
+            slot_t * slot = slotAt(index);
+            if (slot == nullptr) {
+                continue;
+            }
+            uint64_t state = slot->state.load(std::memory_order_acquire);
+            if (!(state & LIVE_BIT)) {
+                continue;
+            }
+            Client * client = acquire(makeId(generationOf(state), index));
+            if (client != nullptr) {
+                func(*client);
+                release(client);
+            }
+        }
+    }
+
+private:
+    // slot state word: generation (32 bits) | live (1 bit) | references (31 bits)
+    static const uint64_t LIVE_BIT = 1ULL << 31;
+    static const uint64_t REFS_MASK = LIVE_BIT - 1;
+    static const uint32_t NO_SLOT = 0xFFFFFFFF;
+
+    struct slot_t {
+        std::atomic<uint64_t> state;
+        std::atomic<uint32_t> nextFree;
+        alignas(Client) unsigned char storage[sizeof(Client)];
+
+        Client * client() { return reinterpret_cast<Client *>(storage); }
+    };
+
+    std::atomic<slot_t *> m_chunks[MAX_CHUNKS];
+    // next never used slot index
+    std::atomic<uint32_t> m_highWater;
+    // free slot list head: ABA tag (32 bits) | slot index + 1 (32 bits), 0 when empty
+    std::atomic<uint64_t> m_freeHead;
+    std::atomic<size_t> m_size;
+    reclaim_handler_t m_reclaimHandler;
+
+    static uint32_t generationOf(uint64_t stateOrId) { return (uint32_t)(stateOrId >> 32); }
+    static uint32_t indexOf(client_id_t id) { return (uint32_t)id; }
+    static client_id_t makeId(uint32_t generation, uint32_t index) { return ((uint64_t)generation << 32) | index; }
+
+    slot_t * slotAt(uint32_t index) const;
+    slot_t * usedSlotAt(uint32_t index) const;
+    slot_t * allocateSlot(uint32_t & index);
+    void pushFree(uint32_t index);
+    void reclaim(slot_t * slot, uint32_t index);
+};
+
+
+#endif //INTERCOM_CLIENT_REGISTRY_H
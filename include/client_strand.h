@@ -0,0 +1,85 @@
+
+
+#ifndef INTERCOM_CLIENT_STRAND_H
+#define INTERCOM_CLIENT_STRAND_H
+
+#include <stddef.h>
+#include <atomic>
+#include "payload.h"
+#include "memory_pool.h"
+#include "worker_pool.h"
+
+class Client;
+
+/*
+ * Receiver of what a ClientStrand delivers on the worker threads
+ */
+class StrandHandler {
+public:
+    virtual ~StrandHandler() {}
+    virtual void onStrandMessage(Client & client, const char * msg, size_t size) = 0;
+    virtual void onStrandDisconnected(Client & client) = 0;
+    // the strand got scheduled: keep client alive until onStrandIdle()
+    virtual void onStrandScheduled(Client & client) = 0;
+    // last call of the strand for now, it may be destroyed by it
+    virtual void onStrandIdle(Client & client) = 0;
+};
+
+/*
+ * Ordered hand-off of a client's messages to a WorkerPool.
+ *
+ * The thread receiving from the client posts messages, which stay in
+ * the buffer they were received into (a reference to it is queued
+ * along, nothing is copied), to a lock-free queue. The strand is
+ * submitted to the pool when it goes from idle to having messages, and
+ * a single worker at a time delivers them, so the client's messages
+ * are seen in order, followed by its disconnection.
+ */
+class ClientStrand : public WorkerTask {
+
+public:
+    // messages delivered per run before the worker moves on to other tasks
+    static const int BATCH_SIZE = 64;
+
+    ClientStrand(StrandHandler * handler, WorkerPool * pool, Client * client);
+    ~ClientStrand();
+
+    // allocated for every connection, recycled through the BufferPool
+    static void * operator new(size_t size) { return BufferPool::allocate(size); }
+    static void operator delete(void * ptr, size_t size) { BufferPool::deallocate(ptr, size); }
+
+    // msg must point into buffer
+    void post(const Payload & buffer, const char * msg, size_t size);
+    void postDisconnected();
+    void run();
+
+private:
+    struct node_t {
+        std::atomic<node_t *> next;
+        // keeps msg alive until delivered
+        Payload buffer;
+        const char * msg;
+        size_t size;
+        bool disconnected;
+
+        static void * operator new(size_t size) { return BufferPool::allocate(size); }
+        static void operator delete(void * ptr, size_t size) { BufferPool::deallocate(ptr, size); }
+    };
+
+    StrandHandler * m_handler;
+    WorkerPool * m_pool;
+    Client * m_client;
+
+    // intrusive multi-producer single-consumer queue: producers swap
+    // m_head, the worker consumes from m_tail, m_stub keeps it non-empty
+    std::atomic<node_t *> m_head;
+    node_t * m_tail;
+    node_t m_stub;
+    std::atomic<bool> m_scheduled;
+
+    void push(node_t * node);
+    node_t * pop();
+};
+
+
+#endif //INTERCOM_CLIENT_STRAND_H
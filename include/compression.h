@@ -0,0 +1,124 @@
+
+
+#ifndef INTERCOM_COMPRESSION_H
+#define INTERCOM_COMPRESSION_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <mutex>
+#include "compression_config.h"
+#include "framing.h"
+#include "memory_pool.h"
+#include "payload.h"
+#include "pipe_ret_t.h"
+
+struct z_stream_s;
+
+// frame header followed by the compression flag
+#define MAX_MESSAGE_HEADER_SIZE (MAX_FRAME_HEADER_SIZE + 1)
+
+/*
+ * Header of a message sent as is: its frame header, followed with
+ * compression by the flag telling it is not compressed. header must
+ * hold MAX_MESSAGE_HEADER_SIZE bytes.
+ * Return number of header bytes written.
+ */
+size_t encodeMessageHeader(framing_mode_t mode, bool compression, size_t msgSize, char * header);
+
+/*
+ * Fail unless messages can be compressed as configured, framed with mode
+ */
+pipe_ret_t checkCompression(const compression_config_t & config, framing_mode_t mode);
+
+/*
+ * Compression of the messages sent on a connection.
+ *
+ * The body of every framed message starts with a flag: either 0 and
+ * the message as is, or 1, the size of the message as a varint and
+ * the message compressed with raw deflate, primed with the dictionary.
+ * Messages are compressed independently, so any of them may be dropped
+ * or coalesced away by the send queue, and one message may be sent to
+ * several connections. Messages smaller than minSize, or which would
+ * not shrink, are sent as is.
+ *
+ * The zlib stream and output buffer are created on first use and
+ * reused for every message; encode() serializes callers.
+ */
+class Compressor {
+
+public:
+    static void * operator new(size_t size) { return BufferPool::allocate(size); }
+    static void operator delete(void * ptr, size_t size) { BufferPool::deallocate(ptr, size); }
+
+    // config must outlive the compressor
+    Compressor(const compression_config_t & config, framing_mode_t mode) :
+        m_config(config), m_mode(mode) {}
+    ~Compressor();
+
+    // message framed, compressed if worth it, into a payload ready to be sent
+    Payload encode(const char * msg, size_t size);
+
+private:
+    std::mutex m_mtx;
+    const compression_config_t & m_config;
+    framing_mode_t m_mode;
+    struct z_stream_s * m_stream = nullptr;
+    char * m_buffer = nullptr;
+    size_t m_capacity = 0;
+
+    bool deflateLocked(const char * msg, size_t size, size_t & compressedSize);
+};
+
+/*
+ * Decompression of the messages received on a connection, see
+ * Compressor. Only used by the thread receiving from the connection.
+ *
+ * Messages are inflated one after the other into a pooled buffer of
+ * the connection, which can be referenced like the storage of a
+ * FrameBuffer: while references to it are held, messages are appended
+ * behind the ones they may still be reading, and a new buffer is taken
+ * once it is full; otherwise it is filled again from the start.
+ */
+class Decompressor {
+
+public:
+    static void * operator new(size_t size) { return BufferPool::allocate(size); }
+    static void operator delete(void * ptr, size_t size) { BufferPool::deallocate(ptr, size); }
+
+    // config must outlive the decompressor, messages larger
+    // than maxMessageSize are a protocol error
+    Decompressor(const compression_config_t & config, size_t maxMessageSize) :
+        m_config(config), m_maxMessageSize(maxMessageSize) {}
+    ~Decompressor();
+
+    /*
+     * Replace the bodies of received messages by the messages they
+     * carry. Compressed ones are inflated into a buffer of the
+     * decompressor, valid until the next call.
+     * Return false if a body is malformed.
+     */
+    bool decode(struct iovec * messages, size_t count);
+    /*
+     * Message carried by a single body: pointing into it if sent as
+     * is, otherwise inflated into storage(), which can be handed to
+     * another thread along with it.
+     * Return false if the body is malformed.
+     */
+    bool decode(const char * body, size_t bodySize, const char *& msg, size_t & size, bool & inflated);
+    // buffer the messages inflated by decode() point into
+    const Payload & storage() const { return m_storage; }
+
+private:
+    const compression_config_t & m_config;
+    size_t m_maxMessageSize;
+    struct z_stream_s * m_stream = nullptr;
+    Payload m_storage;
+    size_t m_used = 0; // bytes of m_storage taken by inflated messages
+
+    char * claim(size_t size);
+    int parse(const char * body, size_t bodySize, const char *& data, size_t & dataSize, size_t & size);
+    bool inflateMessage(const char * data, size_t dataSize, char * msg, size_t size);
+};
+
+
+#endif //INTERCOM_COMPRESSION_H
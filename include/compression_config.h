@@ -0,0 +1,31 @@
+#ifndef INTERCOM_COMPRESSION_CONFIG_H
+#define INTERCOM_COMPRESSION_CONFIG_H
+
+#include <stddef.h>
+#include <string>
+
+struct compression_config_t {
+
+    // every message carries a flag telling whether it is compressed,
+    // and those worth it are. Needs framing, both ends must enable it
+    // alike, requires a build with INTERCOM_COMPRESSION
+    bool enabled;
+    // zlib level, from 1 (fastest) to 9 (smallest)
+    int level;
+    // smaller messages are sent as is
+    size_t minSize;
+    // bytes messages commonly contain, e.g. samples of typical ones,
+    // most frequent last: every message is compressed as if following
+    // them, so even small ones shrink. Both ends must use the same,
+    // only the last 32KB count
+    std::string dictionary;
+
+    compression_config_t() {
+        enabled = false;
+        level = 6;
+        minSize = 32;
+        dictionary = "";
+    }
+};
+
+#endif //INTERCOM_COMPRESSION_CONFIG_H
@@ -0,0 +1,58 @@
+
+
+#ifndef INTERCOM_CONNECTION_LIMITER_H
+#define INTERCOM_CONNECTION_LIMITER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <mutex>
+#include <vector>
+#include "ip_address.h"
+
+/*
+ * Admission control of accepted connections: caps the number of
+ * connections open at once, in total and per source address.
+ *
+ * Counts per address live in an open addressing hash table, probed
+ * linearly and compacted on removal (no tombstones), holding only the
+ * addresses with connections open. Its hash is seeded per limiter, so
+ * peers can't pick addresses which collide. Once the table reached its
+ * working size, admitting and releasing no longer allocate.
+ */
+class ConnectionLimiter {
+
+public:
+    // 0 is no limit
+    ConnectionLimiter(uint maxConnections, uint maxPerAddress);
+
+    // count a connection from address, unless that would exceed a limit.
+    // Addresses which are not IP (AF_UNSPEC) only count in the total
+    bool admit(const ip_address_t & address);
+    // a connection admit() counted is closed
+    void release(const ip_address_t & address);
+
+    size_t connections();
+
+private:
+    struct entry_t {
+        ip_address_t address;
+        // 0 if the entry is free
+        uint32_t count;
+    };
+
+    std::mutex m_mtx;
+    uint m_maxConnections;
+    uint m_maxPerAddress;
+    size_t m_connections = 0;
+    // power of 2, at most half used
+    std::vector<entry_t> m_entries;
+    size_t m_used = 0;
+    uint64_t m_seed;
+
+    size_t slotOf(const ip_address_t & address) const;
+    size_t find(const ip_address_t & address) const;
+    void grow();
+};
+
+
+#endif //INTERCOM_CONNECTION_LIMITER_H
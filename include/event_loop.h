@@ -0,0 +1,105 @@
+
+
+#ifndef INTERCOM_EVENT_LOOP_H
+#define INTERCOM_EVENT_LOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include "pipe_ret_t.h"
+#include "uring.h"
+#include "timer_wheel.h"
+
+/*
+ * Receiver of readiness events. Every file descriptor registered
+ * in an EventLoop carries a 64 bit token which is handed back to
+ * the handler together with the epoll event mask.
+ * Loops driven by io_uring report completed requests instead.
+ */
+class EventHandler {
+public:
+    virtual ~EventHandler() {}
+    virtual void onEvents(uint64_t token, uint32_t events) = 0;
+    virtual void onCompletion(IoUring & uring, const uring_completion_t & completion) {
+        (void)uring;
+        (void)completion;
+    }
+    // a timer added with EventLoop::addTimer() expired
+    virtual void onTimer(uint64_t token) {
+        (void)token;
+    }
+};
+
+/*
+ * Single threaded epoll reactor. File descriptors are polled in
+ * edge-triggered mode and ready events are dispatched to the loop
+ * handler on the loop thread. Other threads may hand work to the
+ * loop thread with post(), or raise events themselves with inject().
+ *
+ * Initialized with initUring() the loop waits on an io_uring instead:
+ * the handler queues requests on uring() from the loop thread, they
+ * are submitted in one batch per loop iteration, and completions are
+ * dispatched to the handler.
+ *
+ * Either way the loop thread also runs a timer wheel: the wait ends
+ * in time for its next timer, and expired timers are dispatched to
+ * the handler after the events of the iteration.
+ */
+class EventLoop {
+private:
+    int m_epollfd = -1;
+    int m_wakeupfd = -1;
+    std::atomic<bool> m_stop;
+    EventHandler * m_handler = nullptr;
+    std::thread * m_thread = nullptr;
+    // set by the loop thread itself, once running
+    std::atomic<std::thread::id> m_threadId;
+    IoUring * m_uring = nullptr;
+    uint64_t m_wakeupCounter = 0;
+    std::mutex m_tasksMtx;
+    std::vector<std::function<void()>> m_tasks;
+    std::vector<struct epoll_event> m_injected;
+    // loop thread side of m_tasks and m_injected, kept to reuse their storage
+    std::vector<std::function<void()>> m_runningTasks;
+    std::vector<struct epoll_event> m_injectedEvents;
+    TimerWheel m_timers;
+
+    void run();
+    void runUring();
+    void runPendingTasks();
+    void runTimers();
+    void wakeup();
+
+public:
+    static const uint64_t WAKEUP_TOKEN = ~0ULL;
+    static const int MAX_EVENTS = 256;
+
+    EventLoop();
+    ~EventLoop();
+
+    pipe_ret_t init(EventHandler * handler);
+    pipe_ret_t initUring(EventHandler * handler, unsigned entries, unsigned buffers, size_t bufferSize);
+    pipe_ret_t start(int cpu = -1);
+    void stop();
+
+    bool add(int fd, uint32_t events, uint64_t token);
+    bool modify(int fd, uint32_t events, uint64_t token);
+    bool remove(int fd);
+
+    void post(const std::function<void()> & task);
+    void inject(uint64_t token, uint32_t events);
+    // io_uring of the loop, only to be used on the loop thread
+    IoUring * uring() const { return m_uring; }
+    // have the handler's onTimer() called with token in delayMs. Timers
+    // are added and cancelled on the loop thread only
+    timer_id_t addTimer(uint64_t token, uint64_t delayMs) { return m_timers.schedule(token, delayMs); }
+    bool cancelTimer(timer_id_t id) { return m_timers.cancel(id); }
+    bool isInLoopThread() const { return std::this_thread::get_id() == m_threadId.load(std::memory_order_acquire); }
+};
+
+
+#endif //INTERCOM_EVENT_LOOP_H
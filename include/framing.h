@@ -0,0 +1,150 @@
+
+
+#ifndef INTERCOM_FRAMING_H
+#define INTERCOM_FRAMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <vector>
+#include "memory_pool.h"
+#include "payload.h"
+
+// size of a single recv() into io_uring provided buffers, and
+// smallest read of adaptive receive buffers, shared by server and client
+#define MAX_PACKET_SIZE 4096
+
+// largest single read adaptive receive buffers grow to
+#define MAX_RECEIVE_SIZE (256 * 1024)
+
+// longest length prefix: 64 bit varint
+#define MAX_FRAME_HEADER_SIZE 10
+
+enum framing_mode_t {
+    // observers get whatever was received, as a list of buffers
+    FRAMING_NONE,
+    // every message is prefixed by its length as 4 byte big endian
+    FRAMING_FIXED32,
+    // every message is prefixed by its length as LEB128 varint
+    FRAMING_VARINT,
+};
+
+struct framing_config_t {
+
+    framing_mode_t mode;
+    // frames announcing a larger message are a protocol error
+    size_t maxMessageSize;
+    // initial size of the per-connection receive buffer
+    size_t bufferSize;
+
+    framing_config_t() {
+        mode = FRAMING_NONE;
+        maxMessageSize = 16 * 1024 * 1024;
+        bufferSize = 4 * MAX_PACKET_SIZE;
+    }
+};
+
+/*
+ * Write the length prefix of a msgSize bytes message into header,
+ * which must hold MAX_FRAME_HEADER_SIZE bytes.
+ * Return number of header bytes written.
+ */
+size_t encodeFrameHeader(framing_mode_t mode, size_t msgSize, char * header);
+
+/*
+ * Parse a length prefix from the available bytes at data.
+ * Return 1 and fill msgSize and headerSize when the prefix is complete,
+ * 0 if more bytes are needed and -1 if the prefix is malformed.
+ */
+int decodeFrameHeader(framing_mode_t mode, const char * data, size_t available,
+                      size_t & msgSize, size_t & headerSize);
+
+/*
+ * Per-connection receive buffer reassembling length prefixed messages.
+ *
+ * Sockets are read directly into the free space of the buffer and
+ * complete messages are handed out as pointers into it, so the common
+ * case involves no copy at all. Consumed space is reclaimed by rewinding
+ * to the start once the buffer is empty; only when a partial message
+ * reaches the end of the buffer is that tail moved to the front, and the
+ * buffer grows for messages larger than itself, and while reads keep
+ * filling it, up to MAX_RECEIVE_SIZE. Both the object and its storage
+ * come from the BufferPool.
+ *
+ * The storage is reference counted: a message may be handed to another
+ * thread along with a reference to it. While such references exist the
+ * buffer is neither rewound nor compacted; once it is full, receiving
+ * continues in a new buffer and only the partial message is copied.
+ */
+class FrameBuffer {
+
+private:
+    Payload m_storage;
+    char * m_data = nullptr;
+    size_t m_capacity = 0;
+    size_t m_head = 0;   // first unconsumed byte
+    size_t m_tail = 0;   // end of received data
+    size_t m_needed = 0; // size of the incomplete frame at head, if known
+    bool m_filled = false; // the last read took all the free space
+
+    void reserve(size_t size);
+    void relocate(size_t size);
+
+public:
+    explicit FrameBuffer(size_t capacity);
+
+    static void * operator new(size_t size) { return BufferPool::allocate(size); }
+    static void operator delete(void * ptr, size_t size) { BufferPool::deallocate(ptr, size); }
+
+    // free space received data may be written to
+    char * writePtr();
+    size_t writable() const { return m_capacity - m_tail; }
+    void commit(size_t size) { m_filled = size == writable(); m_tail += size; }
+    // buffer the messages handed out by consumeFrames() point into
+    const Payload & storage() const { return m_storage; }
+
+    /*
+     * Hand every complete message in the buffer to deliver(msg, size).
+     * Without framing, everything received so far is one message.
+     * Return false if the stream violates the framing.
+     */
+    template <typename Func>
+    bool consumeFrames(const framing_config_t & config, Func deliver) {
+        if (config.mode == FRAMING_NONE && m_head < m_tail) {
+            deliver(m_data + m_head, m_tail - m_head);
+            m_head = m_tail;
+        }
+        while (m_head < m_tail) {
+            size_t msgSize, headerSize;
+            int parsed = decodeFrameHeader(config.mode, m_data + m_head, m_tail - m_head, msgSize, headerSize);
+            if (parsed < 0 || (parsed > 0 && msgSize > config.maxMessageSize)) {
+                return false;
+            }
+            if (parsed == 0 || m_tail - m_head < headerSize + msgSize) { // wait for the rest
+                m_needed = parsed == 0 ? 0 : headerSize + msgSize;
+                break;
+            }
+            m_needed = 0;
+            deliver(m_data + m_head + headerSize, msgSize);
+            m_head += headerSize + msgSize;
+        }
+        if (m_head == m_tail && !m_storage.shared()) {
+            m_head = m_tail = 0;
+        }
+        return true;
+    }
+
+    // consumeFrames() into a list of the messages, appended to messages,
+    // valid until the buffer is written to again
+    bool collectFrames(const framing_config_t & config, std::vector<struct iovec> & messages) {
+        return consumeFrames(config, [&messages](const char * msg, size_t size) {
+            struct iovec message;
+            message.iov_base = (void *)msg;
+            message.iov_len = size;
+            messages.push_back(message);
+        });
+    }
+};
+
+
+#endif //INTERCOM_FRAMING_H
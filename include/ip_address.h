@@ -0,0 +1,49 @@
+
+
+#ifndef INTERCOM_IP_ADDRESS_H
+#define INTERCOM_IP_ADDRESS_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <string>
+
+/*
+ * IPv4 or IPv6 address in network byte order, compared as bytes.
+ * IPv4-mapped IPv6 addresses are stored as IPv4.
+ */
+struct ip_address_t {
+
+    // AF_INET, AF_INET6, or AF_UNSPEC if unknown
+    sa_family_t family;
+    // 4 bytes used for IPv4
+    uint8_t bytes[16];
+
+    ip_address_t();
+
+    size_t size() const { return family == AF_INET6 ? 16 : (family == AF_INET ? 4 : 0); }
+    bool operator ==(const ip_address_t & other) const;
+
+    static bool parse(const char * text, ip_address_t & address);
+    static ip_address_t fromSockaddr(const struct sockaddr * address);
+};
+
+/*
+ * Range of addresses an observer is interested in: a single address,
+ * a CIDR prefix ("10.0.0.0/8", "fe80::/10"), or any address
+ */
+struct ip_prefix_t {
+
+    ip_address_t address;
+    // bits of address to match, 0 matches every address of any family
+    uint prefixLength;
+
+    ip_prefix_t() : prefixLength(0) {}
+
+    bool matches(const ip_address_t & other) const;
+
+    // empty text is any address
+    static bool parse(const std::string & text, ip_prefix_t & prefix);
+};
+
+
+#endif //INTERCOM_IP_ADDRESS_H
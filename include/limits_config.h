@@ -0,0 +1,40 @@
+#ifndef INTERCOM_LIMITS_CONFIG_H
+#define INTERCOM_LIMITS_CONFIG_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct limits_config_t {
+
+    // connections open at once: more are closed as soon as accepted,
+    // 0 for no limit
+    uint maxConnections;
+    // connections open at once from a single IP address, 0 for no
+    // limit. Unix socket and in-memory clients only count in the total
+    uint maxConnectionsPerAddress;
+    // bytes per second read from each connection, 0 for no limit.
+    // Reading pauses while the connection is over its rate, leaving
+    // data in the socket: TCP flow control slows the peer down, and
+    // nothing is dropped. SERVER_MODE_EPOLL and SERVER_MODE_REACTOR
+    uint64_t readRate;
+    // bytes read at once after a pause, a second worth if 0
+    uint64_t readBurst;
+    // bytes per second written to each connection, 0 for no limit.
+    // Messages wait in the send queue meanwhile, its backpressure
+    // policy applies once it is full. SERVER_MODE_EPOLL and
+    // SERVER_MODE_REACTOR
+    uint64_t writeRate;
+    // bytes written at once after a pause, a second worth if 0
+    uint64_t writeBurst;
+
+    limits_config_t() {
+        maxConnections = 0;
+        maxConnectionsPerAddress = 0;
+        readRate = 0;
+        readBurst = 0;
+        writeRate = 0;
+        writeBurst = 0;
+    }
+};
+
+#endif //INTERCOM_LIMITS_CONFIG_H
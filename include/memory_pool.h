@@ -0,0 +1,82 @@
+
+
+#ifndef INTERCOM_MEMORY_POOL_H
+#define INTERCOM_MEMORY_POOL_H
+
+#include <stddef.h>
+#include <mutex>
+#include <vector>
+
+/*
+ * Pool of fixed size blocks carved out of large slabs.
+ * Freed blocks are kept on a free list and handed out again, so once
+ * the pool has grown to the working set size it stops allocating.
+ * Slabs are only returned to the system when the pool is destroyed.
+ * Blocks can be taken and given back in batches, a lock each.
+ */
+class BlockPool {
+
+public:
+    // a free block, linking to the next one of its list
+    struct free_block_t {
+        free_block_t * next;
+    };
+
+private:
+    std::mutex m_mtx;
+    free_block_t * m_freeList = nullptr;
+    std::vector<char *> m_slabs;
+    size_t m_blockSize;
+    size_t m_blocksPerSlab;
+
+    void grow();
+
+public:
+    BlockPool(size_t blockSize, size_t blocksPerSlab);
+    ~BlockPool();
+
+    void * allocate();
+    void deallocate(void * block);
+    // list of count blocks, the last one linking to nullptr
+    free_block_t * allocateBatch(size_t count);
+    // give back the list from first to last
+    void deallocateBatch(free_block_t * first, free_block_t * last);
+    size_t blockSize() const { return m_blockSize; }
+};
+
+/*
+ * Process wide buffer allocator: power of two size classes from
+ * MIN_BLOCK_SIZE to MAX_BLOCK_SIZE served from BlockPools, larger
+ * sizes from malloc. Used for message payloads, receive buffers and
+ * per-connection objects, so the steady state message path does not
+ * touch the system allocator.
+ *
+ * Every thread keeps a cache of free blocks per size class, taken from
+ * the shared pools a batch at a time and spilled back a batch at a time
+ * once it holds two, so allocating and freeing on a thread usually takes
+ * no lock. Blocks freed by another thread than the allocating one go
+ * through the freeing thread's cache. A thread's cache is given back to
+ * the pools when it exits.
+ */
+class BufferPool {
+
+public:
+    static const size_t MIN_BLOCK_SIZE = 64;
+    static const size_t MAX_BLOCK_SIZE = 64 * 1024;
+    static const int NUM_CLASSES = 11; // 64 B .. 64 KB
+
+    // allocate at least size bytes, capacity is set to the usable size
+    static void * allocate(size_t size, size_t & capacity);
+    static void * allocate(size_t size) { size_t capacity; return allocate(size, capacity); }
+    // capacity (or size) must be the one the block was allocated with
+    static void deallocate(void * block, size_t capacity);
+
+    // size class serving size, -1 above MAX_BLOCK_SIZE
+    static int sizeClass(size_t size);
+    static BlockPool * pool(int sizeClass);
+    // blocks a thread cache takes from, or gives back to, a shared pool at once
+    static size_t batchSize(int sizeClass);
+};
+
+
+#endif //INTERCOM_MEMORY_POOL_H
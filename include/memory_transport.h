@@ -0,0 +1,137 @@
+
+
+#ifndef INTERCOM_MEMORY_TRANSPORT_H
+#define INTERCOM_MEMORY_TRANSPORT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include "memory_pool.h"
+#include "pipe_ret_t.h"
+#include "stream.h"
+
+class MemoryChannel;
+
+/*
+ * Lock-free single producer, single consumer byte ring. Positions only
+ * grow and are masked into the storage; each side keeps the last
+ * position of the other it has seen, so it only reads the other's
+ * cache line once it has used up what it knew of.
+ */
+class SpscRing {
+
+public:
+    // capacity must be a power of 2
+    explicit SpscRing(size_t capacity);
+    ~SpscRing();
+
+    // plain new ignores the alignment of the positions before C++17
+    static void * operator new(size_t size);
+    static void operator delete(void * ptr);
+
+    // producer: copy as much of iov as there is room for, return the bytes copied
+    size_t write(const struct iovec * iov, int iovcnt);
+    // consumer: copy up to what iov holds, return the bytes copied
+    size_t read(const struct iovec * iov, int iovcnt);
+
+private:
+    char * m_data;
+    size_t m_capacity;
+
+    // consumer side
+    alignas(64) std::atomic<size_t> m_head;
+    size_t m_knownTail = 0;
+    // producer side
+    alignas(64) std::atomic<size_t> m_tail;
+    size_t m_knownHead = 0;
+};
+
+/*
+ * End of an in-process connection: a pair of SpscRings, one per
+ * direction, and an eventfd per end standing in for the socket.
+ *
+ * The eventfd is what gets polled: it is signalled when the peer wrote
+ * to an empty ring this end was reading, made room in a full ring this
+ * end was writing, or shut the connection down. A poller must then try
+ * to read and to write: the descriptor is always writable. Reading
+ * until EAGAIN resets the eventfd, so try to read before writing.
+ *
+ * One thread at a time may read, and one at a time may write.
+ */
+class MemoryStream : public Stream {
+
+    friend class MemoryListener;
+
+public:
+    static const size_t DEFAULT_RING_SIZE = 256 * 1024;
+
+    static void * operator new(size_t size) { return BufferPool::allocate(size); }
+    static void operator delete(void * ptr, size_t size) { BufferPool::deallocate(ptr, size); }
+
+    int fd() const;
+
+    ssize_t readv(const struct iovec * iov, int iovcnt);
+    // -1 with errno EAGAIN if the ring is full, EPIPE once shut down
+    ssize_t writev(const struct iovec * iov, int iovcnt);
+    ssize_t sendFile(int fd, off_t * offset, size_t count);
+
+    // both ends read end of stream and fail writing
+    void shutdown();
+    // the other end reads end of stream, this one fails writing
+    void shutdownWrite();
+    void close();
+
+private:
+    MemoryChannel * m_channel;
+    // index of this end in the channel
+    int m_side;
+
+    MemoryStream(MemoryChannel * channel, int side) : m_channel(channel), m_side(side) {}
+    ~MemoryStream() {}
+
+    static pipe_ret_t createPair(size_t ringSize, MemoryStream *& first, MemoryStream *& second);
+};
+
+/*
+ * In-process listener, registered under a name for the process'
+ * lifetime or until closed. connect() queues the server end of a new
+ * connection, which accept() hands out, like the backlog of a listening
+ * socket: fd() is readable while connections wait to be accepted.
+ */
+class MemoryListener {
+
+public:
+    MemoryListener();
+    ~MemoryListener();
+
+    // connections beyond backlog waiting to be accepted are refused.
+    // Connections get rings of ringSize bytes, a power of 2
+    pipe_ret_t listen(const std::string & name, int backlog, size_t ringSize = MemoryStream::DEFAULT_RING_SIZE);
+    // unregister the name, connections not accepted yet are shut down
+    void close();
+
+    int fd() const { return m_fd; }
+    // nullptr with errno EAGAIN if no connection waits
+    MemoryStream * accept();
+
+    // connect to the listener registered under name
+    static pipe_ret_t connect(const std::string & name, MemoryStream *& stream);
+
+private:
+    std::mutex m_mtx;
+    std::string m_name;
+    int m_fd = -1;
+    int m_backlog = 0;
+    size_t m_ringSize = MemoryStream::DEFAULT_RING_SIZE;
+    std::deque<MemoryStream*> m_pending;
+    bool m_listening = false;
+
+    pipe_ret_t enqueue(MemoryStream *& stream);
+};
+
+
+#endif //INTERCOM_MEMORY_TRANSPORT_H
@@ -0,0 +1,208 @@
+
+
+#ifndef INTERCOM_METRICS_H
+#define INTERCOM_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include "memory_pool.h"
+
+// counters and histograms are split in this many cache line aligned
+// shards, threads update the shard they were assigned to
+#define METRICS_SHARDS 16
+
+/*
+ * Index of the metrics shard of the calling thread. Threads are
+ * assigned shards round robin on first use.
+ */
+unsigned metricsShard();
+
+/*
+ * Monotonic counter updated from many threads.
+ * add() is a relaxed increment of the calling thread's shard, so
+ * threads never contend on a cache line; value() sums the shards.
+ */
+class Counter {
+
+private:
+    struct alignas(64) shard_t {
+        std::atomic<uint64_t> value;
+    };
+
+    shard_t m_shards[METRICS_SHARDS];
+
+public:
+    Counter();
+
+    void add(uint64_t n = 1) { m_shards[metricsShard()].value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const;
+};
+
+// log-linear buckets: 8 per power of two, about 12% relative error
+#define HISTOGRAM_SUB_BUCKET_BITS 3
+#define HISTOGRAM_BUCKETS (64 << HISTOGRAM_SUB_BUCKET_BITS)
+
+/*
+ * Point in time copy of a Histogram
+ */
+struct histogram_snapshot_t {
+
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+
+    histogram_snapshot_t();
+
+    double mean() const { return count == 0 ? 0 : (double)sum / count; }
+    // lower bound of the bucket holding the given percentile (0-100)
+    uint64_t percentile(double percent) const;
+    // smallest value counted in a bucket
+    static uint64_t bucketLowerBound(int bucket);
+    static int bucketOf(uint64_t value);
+};
+
+/*
+ * Distribution of values (e.g. durations in nanoseconds) recorded
+ * from many threads, sharded the same way as Counter
+ */
+class Histogram {
+
+private:
+    struct alignas(64) shard_t {
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+    };
+
+    shard_t m_shards[METRICS_SHARDS];
+
+public:
+    Histogram();
+
+    void record(uint64_t value);
+    void snapshot(histogram_snapshot_t & snapshot) const;
+};
+
+/*
+ * Monotonic clock in nanoseconds, for durations recorded in histograms
+ */
+uint64_t metricsClock();
+
+// why a connection ended
+enum disconnect_reason_t {
+    // peer closed the connection
+    DISCONNECT_PEER_CLOSED,
+    // socket error (reset, timeout...)
+    DISCONNECT_SOCKET_ERROR,
+    // peer violated the message framing
+    DISCONNECT_PROTOCOL_ERROR,
+    // send queue overflow under BACKPRESSURE_DISCONNECT
+    DISCONNECT_SLOW_CLIENT,
+    // deleteClient() or finish()
+    DISCONNECT_BY_SERVER,
+    // read, idle or write timeout
+    DISCONNECT_TIMEOUT,
+    DISCONNECT_REASONS,
+};
+
+/*
+ * Per-connection counters. Receive side counters are only updated by
+ * the thread serving the connection, send side ones by the senders.
+ */
+class ConnectionMetrics {
+
+public:
+    std::atomic<uint64_t> bytesIn;
+    std::atomic<uint64_t> msgsIn;
+    std::atomic<uint64_t> bytesOut;
+    std::atomic<uint64_t> msgsOut;
+    // writes the socket accepted only part of
+    std::atomic<uint64_t> partialWrites;
+    // messages refused or coalesced away by a full send queue
+    std::atomic<uint64_t> msgsDropped;
+
+    ConnectionMetrics();
+
+    // allocated for every connection, recycled through the BufferPool
+    static void * operator new(size_t size) { return BufferPool::allocate(size); }
+    static void operator delete(void * ptr, size_t size) { BufferPool::deallocate(ptr, size); }
+
+    static void add(std::atomic<uint64_t> & counter, uint64_t n) { counter.fetch_add(n, std::memory_order_relaxed); }
+};
+
+/*
+ * Server wide counters, updated on the message path
+ */
+struct ServerMetrics {
+
+    Counter bytesIn;
+    Counter msgsIn;
+    Counter bytesOut;
+    Counter msgsOut;
+    Counter partialWrites;
+    Counter msgsDropped;
+    Counter accepted;
+    Counter disconnects[DISCONNECT_REASONS];
+    // TLS connections dropped before completing their handshake, and
+    // those whose records the kernel encrypts or decrypts (kTLS)
+    Counter handshakeFailures;
+    Counter kernelTls;
+    // connections closed as soon as accepted for exceeding a connection
+    // limit, and pauses of reads or writes over a rate limit
+    Counter rejected;
+    Counter throttled;
+    // from accept() returning to the client being registered, in ns
+    Histogram acceptLatency;
+    // time spent in incoming_packet_func observers per message, in ns
+    Histogram callbackTime;
+};
+
+/*
+ * Snapshot of ServerMetrics, see TcpServer::getMetrics()
+ */
+struct server_metrics_t {
+
+    uint64_t bytesIn;
+    uint64_t msgsIn;
+    uint64_t bytesOut;
+    uint64_t msgsOut;
+    uint64_t partialWrites;
+    uint64_t msgsDropped;
+    uint64_t accepted;
+    uint64_t disconnects[DISCONNECT_REASONS];
+    uint64_t handshakeFailures;
+    uint64_t kernelTls;
+    uint64_t rejected;
+    uint64_t throttled;
+    // connected clients and the bytes waiting in their send queues
+    uint64_t clients;
+    uint64_t queuedBytes;
+    histogram_snapshot_t acceptLatency;
+    histogram_snapshot_t callbackTime;
+
+    server_metrics_t();
+};
+
+/*
+ * Snapshot of ConnectionMetrics and send queue of a single client,
+ * see TcpServer::getClientMetrics()
+ */
+struct connection_metrics_t {
+
+    uint64_t clientId;
+    uint64_t bytesIn;
+    uint64_t msgsIn;
+    uint64_t bytesOut;
+    uint64_t msgsOut;
+    uint64_t partialWrites;
+    uint64_t msgsDropped;
+    // current and largest send queue depth, in bytes
+    uint64_t queuedBytes;
+    uint64_t peakQueuedBytes;
+
+    connection_metrics_t();
+};
+
+
+#endif //INTERCOM_METRICS_H
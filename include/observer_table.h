@@ -0,0 +1,66 @@
+
+
+#ifndef INTERCOM_OBSERVER_TABLE_H
+#define INTERCOM_OBSERVER_TABLE_H
+
+#include <sys/types.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "client.h"
+#include "ip_address.h"
+#include "server_observer.h"
+#include "pipe_ret_t.h"
+
+/*
+ * Callbacks of the observers matching a client's address, without
+ * the empty ones: publishing is a plain loop over them. Immutable
+ * once built, and shared by every client matching the same observers.
+ */
+struct ObserverSet {
+    // ObserverTable version the set was built for
+    uint version;
+    // indices of the matching observers, identifies the set
+    std::vector<uint> observers;
+    std::vector<incoming_packet_func_t> incoming;
+    std::vector<incoming_buffers_func_t> incomingBuffers;
+    std::vector<connected_func_t> connected;
+    std::vector<disconnected_func_t> disconnected;
+};
+
+/*
+ * Server observers, with their wanted addresses parsed once when they
+ * subscribe. A client is bound to the ObserverSet of its address when
+ * first resolved, and only resolved again after the observers changed.
+ */
+class ObserverTable {
+
+public:
+    ObserverTable();
+    ~ObserverTable();
+
+    pipe_ret_t add(const server_observer_t & observer);
+    void clear();
+    // set bound to client, rebound if the observers changed since
+    const ObserverSet & resolve(Client & client);
+
+private:
+    struct entry_t {
+        server_observer_t observer;
+        ip_prefix_t prefix;
+    };
+
+    std::mutex m_mtx;
+    std::vector<entry_t> m_entries;
+    std::atomic<uint> m_version;
+    // sets of the current version
+    std::vector<ObserverSet *> m_sets;
+    // sets of previous versions, clients may still be using them
+    std::vector<ObserverSet *> m_retiredSets;
+
+    const ObserverSet * compile(const ip_address_t & address);
+    void retireSets();
+};
+
+
+#endif //INTERCOM_OBSERVER_TABLE_H
@@ -0,0 +1,64 @@
+
+
+#ifndef INTERCOM_PAYLOAD_H
+#define INTERCOM_PAYLOAD_H
+
+#include <stddef.h>
+#include <atomic>
+
+/*
+ * Immutable, reference counted message buffer.
+ *
+ * A payload is serialized once (including its frame header, if any)
+ * and may then be queued on any number of connections: copying a
+ * Payload only takes a reference, and the buffer is released when
+ * the last connection is done sending it.
+ */
+class Payload {
+
+private:
+    struct block_t {
+        std::atomic<unsigned int> refs;
+        size_t size;
+        // usable size of the pooled allocation
+        size_t capacity;
+        char data[1];
+    };
+
+    block_t * m_block = nullptr;
+
+    void unref();
+
+public:
+    Payload() {}
+    Payload(const char * header, size_t headerSize, const char * msg, size_t size);
+    Payload(const Payload & other);
+    Payload(Payload && other);
+    ~Payload() { unref(); }
+
+    Payload & operator =(const Payload & other);
+    Payload & operator =(Payload && other);
+
+    // bytes of a pooled block taken by the reference count and sizes
+    static const size_t BLOCK_OVERHEAD;
+
+    /*
+     * Uninitialized buffer of at least size bytes, for its owner to
+     * fill through mutableData() before sharing it. Its size() is all
+     * the usable space of the pooled block.
+     */
+    static Payload allocate(size_t size);
+
+    const char * data() const { return m_block ? m_block->data : nullptr; }
+    // only while the buffer is not shared
+    char * mutableData() { return m_block ? m_block->data : nullptr; }
+    size_t size() const { return m_block ? m_block->size : 0; }
+    // only while the buffer is not shared: keep the first size bytes
+    void truncate(size_t size) { if (m_block && size < m_block->size) m_block->size = size; }
+    bool empty() const { return m_block == nullptr; }
+    // other references to the buffer exist, they may read it concurrently
+    bool shared() const { return m_block && m_block->refs.load(std::memory_order_acquire) > 1; }
+};
+
+
+#endif //INTERCOM_PAYLOAD_H
@@ -1,17 +1,25 @@
 #ifndef INTERCOM_PIPE_RETURN_H
 #define INTERCOM_PIPE_RETURN_H
 
+#include <string>
+
+// reason points to a static string (a literal or strerror()) describing
+// a failure, so setting it never allocates. Calls on the message path
+// (sends, broadcasts, completions of asynchronous I/O and RPCs) only set
+// reason; other calls also copy it into msg
 struct pipe_ret_t
 {
   bool success;
   int code;
   std::string msg;
+  const char * reason;
   pipe_ret_t()
   {
     success = false;
+    code = 0;
     msg = "";
+    reason = "";
   }
 };
 
-
 #endif //INTERCOM_PIPE_RETURN_H
@@ -0,0 +1,85 @@
+
+
+#ifndef INTERCOM_RECEIVE_BUFFERS_H
+#define INTERCOM_RECEIVE_BUFFERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <vector>
+#include "framing.h"
+#include "memory_pool.h"
+#include "payload.h"
+
+class Stream;
+
+/*
+ * Receive side of a connection without framing.
+ *
+ * A socket is drained into a batch of pooled blocks: every recvmsg()
+ * scatters into as many blocks as the current read size takes, and
+ * reading goes on until the socket would block, so everything that
+ * arrived by a wakeup is published at once, as a list of buffers.
+ *
+ * The read size adapts to the traffic: it doubles, up to
+ * MAX_RECEIVE_SIZE, whenever a read fills all the blocks offered,
+ * and halves, down to MAX_PACKET_SIZE, after a few reads used less
+ * than a quarter of them. Blocks go back to the pool once the batch
+ * is cleared, an idle connection holds none.
+ */
+class ReceiveBuffers {
+
+public:
+    // a batch is published once that large, even if more is waiting
+    static const size_t MAX_BATCH_SIZE = 1024 * 1024;
+    // largest block, served by the BufferPool rather than malloc
+    static const size_t BLOCK_SIZE = BufferPool::MAX_BLOCK_SIZE;
+
+    static void * operator new(size_t size) { return BufferPool::allocate(size); }
+    static void operator delete(void * ptr, size_t size) { BufferPool::deallocate(ptr, size); }
+
+    /*
+     * Read fd into the batch until it would block, the batch is full,
+     * maxBytes were read or the peer closed. The first read gets flags,
+     * the next ones MSG_DONTWAIT as well, so a blocking socket only
+     * waits for the first.
+     * Return the bytes added to the batch, if any, otherwise the result
+     * of the last read, which errno is left from.
+     */
+    ssize_t receive(int fd, int flags, size_t maxBytes = SIZE_MAX);
+    // the last read found the socket empty
+    bool drained() const { return m_drained; }
+
+    const struct iovec * buffers() const { return m_buffers.data(); }
+    size_t count() const { return m_buffers.size(); }
+    // release the blocks of the published batch
+    void clear();
+
+    size_t readSize() const { return m_readSize; }
+
+    // read a stream (in-memory or TLS connection) rather than the
+    // socket, fd and flags given to receive() are then ignored
+    void setStream(Stream * stream) { m_stream = stream; }
+
+private:
+    // small reads in a row before the read size is halved
+    static const uint SHRINK_AFTER = 4;
+    static const int MAX_BLOCKS = MAX_RECEIVE_SIZE / BLOCK_SIZE;
+
+    // blocks of the batch, m_buffers being the received part of each
+    std::vector<Payload> m_blocks;
+    std::vector<struct iovec> m_buffers;
+    size_t m_batchSize = 0;
+    size_t m_readSize = MAX_PACKET_SIZE;
+    // consecutive reads much smaller than the read size
+    uint m_smallReads = 0;
+    bool m_drained = false;
+    Stream * m_stream = nullptr;
+
+    ssize_t receiveOnce(int fd, int flags, size_t maxBytes);
+    void adapt(size_t offered, size_t received);
+};
+
+
+#endif //INTERCOM_RECEIVE_BUFFERS_H
@@ -0,0 +1,42 @@
+
+
+#ifndef INTERCOM_RECONNECT_CONFIG_H
+#define INTERCOM_RECONNECT_CONFIG_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct reconnect_config_t {
+
+    // reconnect in the background when the connection is lost,
+    // instead of finishing the client
+    bool enabled;
+    // wait before the first attempt, doubled (times multiplier)
+    // after every failed attempt up to maxDelayMs
+    uint initialDelayMs;
+    uint maxDelayMs;
+    double multiplier;
+    // fraction of every wait that is random, so clients which lost
+    // their server together do not come back all at once
+    double jitter;
+    // give up and finish after that many failed attempts, 0 never gives up
+    uint maxAttempts;
+    // how long a single connect attempt may take
+    uint connectTimeoutMs;
+    // bytes sendMsg() may buffer while disconnected, written
+    // out once connected again
+    size_t maxBufferedBytes;
+
+    reconnect_config_t() {
+        enabled = false;
+        initialDelayMs = 100;
+        maxDelayMs = 30000;
+        multiplier = 2.0;
+        jitter = 0.5;
+        maxAttempts = 0;
+        connectTimeoutMs = 5000;
+        maxBufferedBytes = 4 * 1024 * 1024;
+    }
+};
+
+#endif //INTERCOM_RECONNECT_CONFIG_H
@@ -0,0 +1,98 @@
+
+
+#ifndef INTERCOM_RPC_CLIENT_H
+#define INTERCOM_RPC_CLIENT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "tcp_client.h"
+#include "rpc_protocol.h"
+#include "pipe_ret_t.h"
+
+// reply of a request, or why there is none in ret.reason. reply points
+// into the receive buffer and is only valid during the call
+typedef std::function<void(const pipe_ret_t & ret, const char * reply, size_t size)> rpc_callback_t;
+
+// reply delivered through a future, copied out of the receive buffer,
+// with the reason of a failure copied into msg as well
+struct rpc_reply_t : public pipe_ret_t {
+  std::string body;
+};
+
+/*
+ * Request/response calls over a TcpClient connection, many at once.
+ *
+ * Every request gets a correlation id, and waits for the reply with the
+ * same id in a fixed table of maxPending slots indexed by the id. Slots
+ * are claimed, completed and expired with compare and swap of the id
+ * they hold, so sending threads, the receive thread and the deadline
+ * thread never take a lock, and replies may come in any order.
+ *
+ * Callbacks run on the client receive thread, or on the deadline thread
+ * for requests which expired. Requests pending when the connection is
+ * lost fail right away.
+ *
+ * The client must use framing, and the RpcClient must be created before
+ * the client connects and destroyed after it finished: it subscribes to
+ * the client for good.
+ */
+class RpcClient
+{
+private:
+  // id of a free slot, and of one being claimed or completed
+  static const uint64_t SLOT_FREE = 0;
+  static const uint64_t SLOT_BUSY = ~0ULL;
+  static const uint64_t NO_DEADLINE = ~0ULL;
+
+  struct slot_t {
+    std::atomic<uint64_t> id{SLOT_FREE};
+    std::atomic<uint64_t> deadlineMs{NO_DEADLINE};
+    // only touched by the thread holding the slot busy
+    rpc_callback_t callback;
+  };
+
+  TcpClient & m_client;
+  rpc_config_t m_config;
+  slot_t * m_slots = nullptr;
+  uint64_t m_slotMask = 0;
+  std::atomic<uint64_t> m_nextId{1};
+  std::atomic<uint> m_pending{0};
+  // replies to requests which expired, or were never sent
+  std::atomic<uint64_t> m_lateReplies{0};
+
+  std::thread * m_deadlineTask = nullptr;
+  std::mutex m_deadlineMtx;
+  std::condition_variable m_deadlineCondition;
+  bool m_stop = false;
+
+  void handleReply(const char * msg, size_t size);
+  void failPending(const pipe_ret_t & ret);
+  bool complete(slot_t & slot, uint64_t id, const pipe_ret_t & ret, const char * reply, size_t size);
+  void expireTask();
+
+public:
+  explicit RpcClient(TcpClient & client, const rpc_config_t & config = rpc_config_t());
+  ~RpcClient();
+
+  /*
+   * Send request, and have callback called with its reply, or with the
+   * failure once timeoutMs expired (0: the configured default) or the
+   * connection was lost. Callback is never called if this fails.
+   */
+  pipe_ret_t call(const char * request, size_t size, const rpc_callback_t & callback, uint timeoutMs = 0);
+  // same, with the reply delivered through a future
+  std::future<rpc_reply_t> call(const char * request, size_t size, uint timeoutMs = 0);
+
+  uint pendingCount() const { return m_pending.load(); }
+  uint64_t lateReplies() const { return m_lateReplies.load(); }
+};
+
+#endif //INTERCOM_RPC_CLIENT_H
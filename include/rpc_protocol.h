@@ -0,0 +1,47 @@
+
+
+#ifndef INTERCOM_RPC_PROTOCOL_H
+#define INTERCOM_RPC_PROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <endian.h>
+#include <string.h>
+
+/*
+ * Requests and replies of RpcClient are framed messages starting with
+ * the 64 bit correlation id of the request, in network byte order.
+ * A server replies to a request with a message carrying the same id,
+ * in any order, see rpc_server.h.
+ */
+#define RPC_HEADER_SIZE 8
+
+struct rpc_config_t {
+
+    // requests awaiting their reply at once, rounded up to a power of two
+    uint maxPending;
+    // deadline of requests sent without one, 0 waits forever
+    uint defaultTimeoutMs;
+    // how often deadlines are checked, i.e. how late a request may expire
+    uint deadlineTickMs;
+
+    rpc_config_t() {
+        maxPending = 1024;
+        defaultTimeoutMs = 5000;
+        deadlineTickMs = 10;
+    }
+};
+
+inline void encodeRpcHeader(uint64_t id, char * header) {
+    uint64_t encoded = htobe64(id);
+    memcpy(header, &encoded, RPC_HEADER_SIZE);
+}
+
+inline uint64_t decodeRpcHeader(const char * header) {
+    uint64_t encoded;
+    memcpy(&encoded, header, RPC_HEADER_SIZE);
+    return be64toh(encoded);
+}
+
+#endif //INTERCOM_RPC_PROTOCOL_H
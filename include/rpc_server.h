@@ -0,0 +1,23 @@
+
+
+#ifndef INTERCOM_RPC_SERVER_H
+#define INTERCOM_RPC_SERVER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "tcp_server.h"
+#include "rpc_protocol.h"
+#include "pipe_ret_t.h"
+
+/*
+ * Server side of RpcClient calls, for a server using framing: an
+ * observer splits every message it gets into the correlation id and
+ * the request, and replies to it, right away or later and from any
+ * thread, with the same id.
+ */
+
+// return false if msg is too short to be a request
+bool parseRpcRequest(const char * msg, size_t size, uint64_t & id, const char *& request, size_t & requestSize);
+pipe_ret_t sendRpcReply(TcpServer & server, const Client & client, uint64_t id, const char * reply, size_t size);
+
+#endif //INTERCOM_RPC_SERVER_H
@@ -0,0 +1,278 @@
+
+
+#ifndef INTERCOM_SEND_QUEUE_H
+#define INTERCOM_SEND_QUEUE_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include "payload.h"
+#include "memory_pool.h"
+#include "metrics.h"
+#include "pipe_ret_t.h"
+#include "token_bucket.h"
+
+class Stream;
+
+// what to do when a message does not fit in a full send queue
+enum backpressure_policy_t {
+    // refuse the new message
+    BACKPRESSURE_DROP,
+    // discard queued broadcast messages not yet started in favour
+    // of the new one, the consumer only gets the latest updates
+    BACKPRESSURE_COALESCE,
+    // give up on the slow consumer and disconnect it
+    BACKPRESSURE_DISCONNECT,
+};
+
+// called once a file range or zero-copy buffer was sent, or failed to
+typedef void (send_complete_func)(const pipe_ret_t & ret);
+typedef std::function<send_complete_func> send_complete_func_t;
+
+/*
+ * Data queued by reference rather than as a payload: a range of an open
+ * file, written with sendfile() straight from the page cache, or a
+ * buffer of the caller, written with MSG_ZEROCOPY. Either must stay
+ * valid until onComplete is called.
+ */
+class SendRequest {
+
+public:
+    enum kind_t {
+        SEND_FILE,
+        SEND_ZEROCOPY,
+    };
+
+    kind_t kind;
+    // SEND_FILE: file and offset of the range
+    int fd = -1;
+    off_t offset = 0;
+    // SEND_ZEROCOPY: the buffer
+    const char * data = nullptr;
+    size_t size = 0;
+    send_complete_func_t onComplete;
+
+    static void * operator new(size_t size) { return BufferPool::allocate(size); }
+    static void operator delete(void * ptr, size_t size) { BufferPool::deallocate(ptr, size); }
+
+private:
+    friend class SendQueue;
+
+    // ids of the zero-copy sends of the buffer, and how many of
+    // them the kernel is done with
+    uint32_t m_firstZeroCopyId = 0;
+    uint32_t m_lastZeroCopyId = 0;
+    uint32_t m_zeroCopyAcked = 0;
+    // the kernel took a reference to some of the buffer's pages
+    bool m_zeroCopied = false;
+    const char * m_error = nullptr;
+    // in the list of requests awaiting completion
+    SendRequest * m_next = nullptr;
+};
+
+/*
+ * Outbound queue of a non-blocking connection.
+ *
+ * Any thread may push payloads; they are written to the socket in
+ * batches, many messages per sendmsg() call, and a partial write simply
+ * leaves the unsent remainder at the head of the queue. When the socket
+ * is full the queue is marked blocked and producers stop trying to write,
+ * leaving it to the I/O thread to flush once the socket is writable again.
+ * Entries live in a ring that only grows, so a queue that has reached its
+ * working size no longer allocates.
+ *
+ * With io_uring the queue is instead written by asynchronous sends:
+ * beginSend() describes the head of the queue to the kernel and the
+ * entries stay pinned until completeSend() consumes what was written.
+ *
+ * SendRequests are queued in order with the payloads. A zero-copy
+ * buffer is only complete once the kernel tells, on the socket error
+ * queue, that it no longer uses its pages: the I/O thread reaps these
+ * notifications with reapZeroCopy() when the socket reports EPOLLERR.
+ *
+ * A corked queue only queues: nothing is written until uncork(), when
+ * the messages queued meanwhile go out together, in as few writes and
+ * segments as possible.
+ *
+ * A rate limited queue writes no more than its rate allows: flushes then
+ * return FLUSH_THROTTLED and leave it to the I/O thread to flush again
+ * after throttleDelay(), producers only queue meanwhile.
+ */
+class SendQueue {
+
+public:
+    enum flush_ret_t {
+        FLUSH_COMPLETE,    // queue is empty
+        FLUSH_WOULD_BLOCK, // socket is full, wait for it to be writable
+        FLUSH_ERROR,       // socket failed, errno is set
+        FLUSH_THROTTLED,   // over the rate limit, flush after throttleDelay()
+    };
+
+    enum push_ret_t {
+        PUSH_QUEUED,
+        PUSH_DROPPED,  // queue is full, payload was not queued
+        PUSH_OVERFLOW, // queue is full and policy asks to disconnect
+    };
+
+    // upper bound of iovecs handed to a single sendmsg()
+    static const int MAX_IOVECS = 64;
+    // smaller zero-copy buffers are copied to the kernel as usual, as
+    // pinning their pages and notifying costs more than copying them
+    static const size_t MIN_ZEROCOPY_SIZE = 16 * 1024;
+
+    explicit SendQueue(size_t maxQueuedBytes);
+    ~SendQueue();
+
+    // per-connection queues are recycled through the BufferPool
+    static void * operator new(size_t size) { return BufferPool::allocate(size); }
+    static void operator delete(void * ptr, size_t size) { BufferPool::deallocate(ptr, size); }
+
+    push_ret_t push(const Payload & payload, bool coalescable, backpressure_policy_t policy);
+    // queue request after header (if not empty), regardless of the queue
+    // limit: the data is not held by the queue. Takes ownership of request
+    void push(const Payload & header, SendRequest * request);
+    flush_ret_t flush(int fd);
+    flush_ret_t tryFlush(int fd);
+
+    // the connection is being replaced, see restart()
+    void restart();
+
+    // hold writes until uncork(), flushes meanwhile write nothing and
+    // return FLUSH_WOULD_BLOCK. The caller of uncork() must flush or
+    // have the I/O thread flush, even if the queue was blocked
+    void cork();
+    void uncork();
+    // flag all writes of a flush but the last one MSG_MORE, so the kernel
+    // sends full segments (socket_options_t::corkBatches). Not applied
+    // to the asynchronous sends of io_uring
+    void setCorkBatches(bool enable);
+    // write rate bytes per second on average, at most burst bytes at
+    // once after being idle. Not applied to the asynchronous sends of io_uring
+    void setRateLimit(uint64_t rate, uint64_t burst);
+    // milliseconds until the last flush which returned
+    // FLUSH_THROTTLED may write again, from when it did
+    uint64_t throttleDelay();
+
+    // set SO_ZEROCOPY on fd, once. Return false if the kernel can't
+    // send from user pages, zero-copy buffers are then copied
+    bool enableZeroCopy(int fd);
+    // complete zero-copy buffers the kernel is done with
+    void reapZeroCopy(int fd);
+
+    // nullptr if the queue is empty or a send is already in flight
+    const struct msghdr * beginSend();
+    // return false, with errno set, if the send failed
+    bool completeSend(ssize_t result);
+
+    size_t queuedBytes();
+    size_t peakQueuedBytes();
+    // bytes written since the queue was created
+    uint64_t writtenBytes();
+    bool empty();
+    // queued data waits to be written: the queue is neither empty nor corked
+    bool hasPendingWrites();
+
+    // count what is written and dropped, either may be nullptr
+    void setMetrics(ServerMetrics * serverMetrics, ConnectionMetrics * metrics);
+    // write to a stream (in-memory or TLS connection) rather than to the
+    // socket, the fd given to flushes is then only the descriptor polled
+    // for it. Streams copy, zero-copy buffers are then copied as well
+    void setStream(Stream * stream);
+
+private:
+    struct entry_t {
+        Payload payload;
+        // broadcast payloads may be coalesced away under backpressure
+        bool coalescable;
+        // queued instead of a payload, owned by the queue
+        SendRequest * request = nullptr;
+    };
+
+    // a single write of the head of the queue, described under the
+    // lock and performed with or without it
+    struct write_t {
+        struct iovec iov[MAX_IOVECS];
+        int iovcnt;
+        size_t requested;
+        // head entry, if it is a request, at m_headOffset
+        SendRequest * request;
+        off_t fileOffset;
+        bool zeroCopy;
+        // more entries are queued after this write
+        bool more;
+    };
+
+    static const size_t INITIAL_RING_SIZE = 16;
+
+    std::mutex m_mtx;
+    // ring of m_count entries starting at m_first
+    std::vector<entry_t> m_ring;
+    size_t m_first = 0;
+    size_t m_count = 0;
+    // bytes of the head entry already written
+    size_t m_headOffset = 0;
+    size_t m_queuedBytes = 0;
+    size_t m_peakQueuedBytes = 0;
+    uint64_t m_writtenBytes = 0;
+    size_t m_maxQueuedBytes;
+    bool m_blocked = false;
+    bool m_corked = false;
+    bool m_corkBatches = false;
+    // 0 not tried yet, 1 enabled, -1 unavailable
+    int m_zeroCopy = 0;
+    // next id the kernel gives a zero-copy send on the socket
+    uint32_t m_nextZeroCopyId = 0;
+    // written zero-copy buffers waiting for the kernel, oldest first
+    SendRequest * m_zeroCopyHead = nullptr;
+    SendRequest * m_zeroCopyTail = nullptr;
+    // requests done with, completed once the lock is released
+    SendRequest * m_completed = nullptr;
+
+    struct async_send_t {
+        struct msghdr header;
+        struct iovec iov[MAX_IOVECS];
+    };
+    // allocated on first asynchronous send
+    async_send_t * m_asyncSend = nullptr;
+    // entries referenced by the send in flight, they can't be coalesced
+    size_t m_sendingEntries = 0;
+    size_t m_sendingBytes = 0;
+    bool m_sending = false;
+
+    ServerMetrics * m_serverMetrics = nullptr;
+    ConnectionMetrics * m_metrics = nullptr;
+    Stream * m_stream = nullptr;
+    // rate limit, if any, and the delay it last imposed
+    TokenBucket * m_rateLimit = nullptr;
+    uint64_t m_throttleDelay = 0;
+
+    flush_ret_t flushLocked(int fd);
+    bool throttledLocked();
+    void limitWrite(write_t & write);
+    void coalesceLocked();
+    int fillIovecs(struct iovec * iov, size_t & bytes);
+    void prepareWrite(write_t & write);
+    ssize_t performWrite(int fd, write_t & write);
+    void wroteLocked(const write_t & write, size_t numBytesSent);
+    void consumeLocked(size_t numBytesSent);
+    void requestDone(SendRequest * request, const char * error);
+    SendRequest * takeCompleted();
+    static void complete(SendRequest * requests);
+    void countSent(size_t numBytesSent, size_t requested);
+    void countDropped(uint64_t msgs);
+
+    entry_t & entryAt(size_t i) { return m_ring[(m_first + i) % m_ring.size()]; }
+    static size_t entrySize(const entry_t & entry) {
+        return entry.request != nullptr ? entry.request->size : entry.payload.size();
+    }
+    void pushBack(const Payload & payload, bool coalescable, SendRequest * request = nullptr);
+    void popFront();
+    void growRing();
+};
+
+
+#endif //INTERCOM_SEND_QUEUE_H
@@ -0,0 +1,121 @@
+
+
+#ifndef INTERCOM_SERVER_CONFIG_H
+#define INTERCOM_SERVER_CONFIG_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <string>
+#include "compression_config.h"
+#include "framing.h"
+#include "limits_config.h"
+#include "send_queue.h"
+#include "socket_options.h"
+#include "tls_config.h"
+#include "transport.h"
+
+enum server_mode_t {
+    // every accepted client gets its own thread blocked in recv()
+    SERVER_MODE_THREAD_PER_CLIENT,
+    // accepted clients are spread over a fixed number of
+    // I/O threads polling them with edge-triggered epoll
+    SERVER_MODE_EPOLL,
+    // every I/O thread owns a SO_REUSEPORT listener and accepts
+    // its own clients, so accepts are spread across cores as well
+    SERVER_MODE_REACTOR,
+    // like SERVER_MODE_REACTOR, but I/O threads drive io_uring:
+    // multishot accept and recv, sends batched into one submission
+    // per loop iteration. Requires a build with INTERCOM_IO_URING
+    // and a 6.0+ kernel
+    SERVER_MODE_IO_URING,
+};
+
+struct server_config_t {
+
+    server_mode_t mode;
+    // number of I/O threads (reactors), 0 means one per core
+    uint ioThreads;
+    // pin I/O thread i to core i (modulo number of cores)
+    bool pinThreads;
+    // pending connections queue size given to listen()
+    int backlog;
+    // length prefix framing of messages, both received and sent
+    framing_config_t framing;
+    // bytes an epoll client may have queued for sending
+    size_t sendQueueLimit;
+    // what to do with clients whose send queue is full,
+    // can be changed per client with setBackpressurePolicy()
+    backpressure_policy_t backpressurePolicy;
+    // io_uring submission queue size of every I/O thread
+    uint uringEntries;
+    // receive buffers of MAX_PACKET_SIZE provided to the io_uring of
+    // every I/O thread, power of 2
+    uint uringBuffers;
+    // count traffic, disconnects and time accepts and observer
+    // callbacks, see TcpServer::getMetrics()
+    bool collectMetrics;
+    // run observers on a pool of worker threads rather than on the
+    // thread receiving from the client, which then goes on receiving
+    // while they run. Messages of a client are still delivered in
+    // order, one at a time, followed by its disconnection
+    bool dispatchToWorkers;
+    // number of worker threads, 0 means one per core
+    uint workerThreads;
+    // disconnect clients nothing was received from for that long, 0 never.
+    // The only timeout of thread per client servers, where it is the
+    // receive timeout of the sockets; the others are checked by the I/O
+    // threads' timer wheels
+    uint readTimeoutMs;
+    // disconnect clients nothing was received from nor sent to for that long
+    uint idleTimeoutMs;
+    // disconnect clients whose queued messages were not written for that
+    // long, noticed within twice the time
+    uint writeTimeoutMs;
+    // send heartbeatMessage to clients nothing was sent to for that long,
+    // framed like any message. It must not be empty without framing
+    uint heartbeatIntervalMs;
+    std::string heartbeatMessage;
+    // TCP options of the listeners, inherited by accepted clients,
+    // see socket_options_t::lowLatency() and bulkThroughput()
+    socket_options_t socketOptions;
+    // what clients connect through. A Unix or in-memory server has a
+    // single listener, which reactors share, and ignores the port
+    transport_t transport;
+    // path of the Unix socket, or name of the in-memory listener
+    std::string path;
+    // bytes buffered in each direction of in-memory connections, power of 2
+    size_t memoryRingSize;
+    // TLS of the connections, SERVER_MODE_EPOLL and SERVER_MODE_REACTOR
+    // over TCP or Unix sockets. Clients are connected, and observers
+    // told, once their handshake is done
+    tls_config_t tls;
+    // compression of the messages, both received and sent, needs framing
+    compression_config_t compression;
+    // admission control and rate limits protecting the server from
+    // too many connections, or connections sending or reading too fast
+    limits_config_t limits;
+
+    server_config_t() {
+        mode = SERVER_MODE_THREAD_PER_CLIENT;
+        ioThreads = 0;
+        pinThreads = false;
+        backlog = SOMAXCONN;
+        sendQueueLimit = 16 * 1024 * 1024;
+        backpressurePolicy = BACKPRESSURE_DROP;
+        uringEntries = 256;
+        uringBuffers = 1024;
+        collectMetrics = true;
+        dispatchToWorkers = false;
+        workerThreads = 0;
+        readTimeoutMs = 0;
+        idleTimeoutMs = 0;
+        writeTimeoutMs = 0;
+        heartbeatIntervalMs = 0;
+        heartbeatMessage = "";
+        transport = TRANSPORT_TCP;
+        path = "";
+        memoryRingSize = 256 * 1024;
+    }
+};
+
+#endif //INTERCOM_SERVER_CONFIG_H
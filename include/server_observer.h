@@ -1,26 +1,44 @@
-
-
 #ifndef INTERCOM_SERVER_OBSERVER_H
 #define INTERCOM_SERVER_OBSERVER_H
 
 #include <string>
+#include <functional>
+#include <sys/uio.h>
 #include "client.h"
 
+// observer callbacks take function pointers as well as any callable
+// object, e.g. a lambda capturing the state it works on
 typedef void (incoming_packet_func)(const Client & client, const char * msg, size_t size);
-typedef incoming_packet_func* incoming_packet_func_t;
+typedef std::function<incoming_packet_func> incoming_packet_func_t;
+
+// everything received from a client at once: chunks of the stream
+// without framing, complete messages with framing
+typedef void (incoming_buffers_func)(const Client & client, const struct iovec * buffers, size_t count);
+typedef std::function<incoming_buffers_func> incoming_buffers_func_t;
+
+typedef void (connected_func)(const Client & client);
+typedef std::function<connected_func> connected_func_t;
 
 typedef void (disconnected_func)(const Client & client);
-typedef disconnected_func* disconnected_func_t;
+typedef std::function<disconnected_func> disconnected_func_t;
 
 struct server_observer_t {
 
+	// address ("10.0.0.1", "::1"), CIDR prefix ("10.0.0.0/8")
+	// or empty for all clients
 	std::string wantedIp;
 	incoming_packet_func_t incoming_packet_func;
+	// batched alternative to incoming_packet_func, called once per
+	// list of buffers instead of once per buffer
+	incoming_buffers_func_t incoming_buffers_func;
+	connected_func_t connected_func;
 	disconnected_func_t disconnected_func;
 
 	server_observer_t() {
 		wantedIp = "";
 		incoming_packet_func = NULL;
+		incoming_buffers_func = NULL;
+		connected_func = NULL;
 		disconnected_func = NULL;
 	}
 };
@@ -0,0 +1,77 @@
+
+
+#ifndef INTERCOM_SOCKET_OPTIONS_H
+#define INTERCOM_SOCKET_OPTIONS_H
+
+#include <sys/types.h>
+#include "pipe_ret_t.h"
+
+/*
+ * TCP options of a connection, shared by TcpServer (server_config_t),
+ * TcpClient and TcpClientPool. Fields left at their default keep
+ * the kernel's behaviour and cost no syscall.
+ *
+ * Start from a profile and adjust it rather than from scratch:
+ * lowLatency() for request/response traffic of small messages,
+ * bulkThroughput() for streams of many or large messages.
+ */
+struct socket_options_t {
+
+    // send small writes right away rather than holding them until
+    // outstanding data is acknowledged (TCP_NODELAY, no Nagle)
+    bool noDelay;
+    // acknowledge received data right away rather than delaying acks
+    // (TCP_QUICKACK). The kernel may go back to delayed acks later on
+    bool quickAck;
+    // kernel buffer sizes (SO_SNDBUF, SO_RCVBUF), 0 keeps the kernel
+    // default. A fixed size turns off the kernel auto-tuning
+    int sendBufferSize;
+    int receiveBufferSize;
+    // microseconds blocking reads busy poll the device for packets
+    // before sleeping (SO_BUSY_POLL), 0 never. Needs CAP_NET_ADMIN
+    // above the net.core.busy_read sysctl
+    uint busyPollUs;
+    // drop the connection when sent data stays unacknowledged
+    // that long (TCP_USER_TIMEOUT), 0 keeps the kernel retries
+    uint userTimeoutMs;
+    // probe idle connections (SO_KEEPALIVE): after keepAliveIdleS seconds
+    // without traffic, every keepAliveIntervalS seconds, giving up after
+    // keepAliveCount unanswered probes. 0 keeps the kernel default
+    bool keepAlive;
+    int keepAliveIdleS;
+    int keepAliveIntervalS;
+    int keepAliveCount;
+    // cork batches of queued messages: every write of a flush but the
+    // last one is flagged MSG_MORE, so the kernel packs small messages
+    // into full segments instead of sending a short one per write
+    bool corkBatches;
+
+    socket_options_t() {
+        noDelay = false;
+        quickAck = false;
+        sendBufferSize = 0;
+        receiveBufferSize = 0;
+        busyPollUs = 0;
+        userTimeoutMs = 0;
+        keepAlive = false;
+        keepAliveIdleS = 0;
+        keepAliveIntervalS = 0;
+        keepAliveCount = 0;
+        corkBatches = false;
+    }
+
+    // no Nagle, no delayed acks: every message goes out as it is sent
+    static socket_options_t lowLatency();
+    // large buffers, and batches corked into full segments
+    static socket_options_t bulkThroughput();
+    // default of TcpClient and TcpClientPool connections: aggressive
+    // keep alive probes, to find out quickly about a vanished server
+    static socket_options_t client();
+};
+
+// set options on fd, stopping at the first one the kernel refuses
+pipe_ret_t applySocketOptions(int fd, const socket_options_t & options);
+// the options an accepted socket does not inherit from its listener
+pipe_ret_t applyAcceptedSocketOptions(int fd, const socket_options_t & options);
+
+#endif //INTERCOM_SOCKET_OPTIONS_H
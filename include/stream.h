@@ -0,0 +1,54 @@
+
+
+#ifndef INTERCOM_STREAM_H
+#define INTERCOM_STREAM_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Connection read and written by its own means rather than with
+ * recvmsg() and sendmsg() on its socket: an in-memory connection, or
+ * TLS encrypted in user space. readv() and writev() behave like those
+ * calls on a non-blocking socket, so the code driving sockets drives
+ * streams as well. fd() is what gets polled for the stream.
+ */
+class Stream {
+
+public:
+    virtual ~Stream() {}
+
+    virtual int fd() const = 0;
+
+    // what the peer wrote, 0 once it shut down and everything was read,
+    // -1 with errno EAGAIN if nothing is there yet
+    virtual ssize_t readv(const struct iovec * iov, int iovcnt) = 0;
+    ssize_t read(char * buffer, size_t size) {
+        struct iovec iov;
+        iov.iov_base = buffer;
+        iov.iov_len = size;
+        return readv(&iov, 1);
+    }
+    // -1 with errno EAGAIN if there is no room
+    virtual ssize_t writev(const struct iovec * iov, int iovcnt) = 0;
+    // sendfile() counterpart: copy a range of a file to the peer
+    virtual ssize_t sendFile(int fd, off_t * offset, size_t count) = 0;
+
+    // writev() took data it could not write out yet, flushPending()
+    // must be called again once fd() is writable
+    virtual bool writePending() { return false; }
+    // 0 once written out, -1 with errno EAGAIN if still no room
+    virtual int flushPending() { return 0; }
+
+    // like shutdown(SHUT_RDWR), wakes the pollers of both ends up
+    virtual void shutdown() = 0;
+    // like shutdown(SHUT_WR): the peer reads what was written, then
+    // the end of the stream, while this end goes on reading
+    virtual void shutdownWrite() = 0;
+    // shut down and release the stream and its descriptor, the
+    // stream must not be used anymore
+    virtual void close() = 0;
+};
+
+
+#endif //INTERCOM_STREAM_H
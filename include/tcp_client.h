@@ -19,42 +19,156 @@
 #include <vector>
 #include <errno.h>
 #include <thread>
+#include <atomic>
+#include <random>
 #include "client_observer.h"
+#include "reconnect_config.h"
+#include "framing.h"
+#include "send_queue.h"
+#include "socket_options.h"
+#include "receive_buffers.h"
+#include "uring.h"
+#include "transport.h"
+#include "memory_transport.h"
+#include "tls.h"
+#include "compression.h"
 #include "pipe_ret_t.h"
 
-#define MAX_PACKET_SIZE 2048
-
-
 //TODO: REMOVE ABOVE CODE, AND SHARE client.h FILE WITH SERVER AND CLIENT
 
 class TcpClient
 {
 private:
-  int m_sockfd = 0;
+  int m_sockfd = -1;
   bool stop = false;
-  bool connected = false;
+  std::atomic<bool> connected{false};
   struct sockaddr_in m_server;
+  // local address the socket is bound to
+  struct sockaddr_in m_client;
+  transport_t m_transport = TRANSPORT_TCP;
+  // server address with TRANSPORT_UNIX
+  struct sockaddr_un m_unixServer;
+  socklen_t m_unixServerSize = 0;
+  // connection with TRANSPORT_MEMORY, m_sockfd being its eventfd,
+  // or TLS connection, owning m_sockfd
+  Stream * m_stream = nullptr;
+  tls_config_t m_tls;
+  TlsContext * m_tlsContext = nullptr;
+  compression_config_t m_compression;
+  Compressor * m_compressor = nullptr;
+  Decompressor * m_decompressor = nullptr;
   std::vector<client_observer_t> m_subscibers;
   std::thread * m_receiveTask = nullptr;
+  framing_config_t m_framing;
+  FrameBuffer * m_frameBuffer = nullptr;
+  // without framing, unless io_uring provides the buffers
+  ReceiveBuffers * m_receiveBuffers = nullptr;
+  // complete messages of the last read, published as a list
+  std::vector<struct iovec> m_messages;
+  SendQueue * m_sendQueue = nullptr;
+  size_t m_sendQueueLimit = 16 * 1024 * 1024;
+  socket_options_t m_socketOptions = socket_options_t::client();
+  // wakes up the receive thread when sends got queued
+  int m_wakeupfd = -1;
+  bool m_useIoUring = false;
+  IoUring * m_uring = nullptr;
+  uint64_t m_wakeupCounter = 0;
+  // a wakeup for queued sends is pending (io_uring only)
+  std::atomic<bool> m_flushRequested{false};
+  bool m_wakeupBlocking = false;
+  // sendMsg() only queues, see cork()
+  std::atomic<bool> m_corked{false};
+  reconnect_config_t m_reconnect;
+  // connection lost, the receive thread is connecting again
+  std::atomic<bool> m_reconnecting{false};
+  // finish() is draining: the server closing is the end, not a lost connection
+  std::atomic<bool> m_draining{false};
+  // jitter of reconnect delays
+  std::mt19937 m_random{std::random_device()()};
+
+  // io_uring request tokens
+  enum uring_op_t {
+    URING_RECV = 1,
+    URING_SEND,
+    URING_WAKEUP,
+  };
+  static const unsigned URING_ENTRIES = 64;
+  static const unsigned URING_BUFFERS = 64;
+  // how often finish() looks for the connection drained
+  static const uint DRAIN_POLL_INTERVAL_MS = 10;
 
   void publishServerMsg(const char * msg, size_t msgSize);
+  void publishServerBuffers(const struct iovec * buffers, size_t count);
   void publishServerDisconnected(const pipe_ret_t & ret);
+  void publishServerReconnected();
   void ReceiveTask();
+  void ReceiveTaskPoll();
+  void ReceiveTaskUring();
+  ssize_t receiveFromServer();
+  bool handleServerData(const char * data, size_t size);
+  pipe_ret_t flushQueue();
+  bool publishFrames();
+  pipe_ret_t resolveServer(const std::string & server_addr, int server_port,
+                           const std::string & client_addr, int client_port);
+  pipe_ret_t connectMemory(const std::string & name);
+  pipe_ret_t openSocket(int & sockfd);
+  int connectSocket(int sockfd);
+  pipe_ret_t startTls(const std::string & serverName);
+  pipe_ret_t initUring();
+  pipe_ret_t initWakeup();
+  void handleServerDisconnected(const char * reason);
+  bool reconnect();
+  pipe_ret_t connectWithTimeout(int sockfd);
+  bool waitWhileDisconnected(int fd, uint timeoutMs);
+  uint backoffDelay(uint attempt);
   void terminateReceiveThread();
+  void drain(uint timeoutMs);
 
 public:
   ~TcpClient();
+  // with TRANSPORT_UNIX server_addr is the socket path, with
+  // TRANSPORT_MEMORY the listener name; the ports are then ignored
   pipe_ret_t connectTo(
     const std::string & server_addr,
     int server_port,
     const std::string & client_addr = "0.0.0.0",
     int client_port = 0);
   pipe_ret_t sendMsg(const char * msg, size_t size);
+  // hold the messages sent until uncork(), which sends them together
+  void cork();
+  pipe_ret_t uncork();
+
+  // must be set before connectTo()
+  void setFraming(const framing_config_t & framing) { m_framing = framing; }
+  const framing_config_t & getFraming() const { return m_framing; }
+  // bytes sendMsg() may queue while the socket is full
+  void setSendQueueLimit(size_t limit) { m_sendQueueLimit = limit; }
+  // drive the connection with io_uring instead of poll(),
+  // must be set before connectTo()
+  void setIoUring(bool enable) { m_useIoUring = enable; }
+  // reconnect in the background when the connection is lost,
+  // must be set before connectTo()
+  void setReconnect(const reconnect_config_t & reconnect) { m_reconnect = reconnect; }
+  // TCP options of the connection, socket_options_t::client() by default,
+  // must be set before connectTo()
+  void setSocketOptions(const socket_options_t & options) { m_socketOptions = options; }
+  // what to connect through, TRANSPORT_TCP by default,
+  // must be set before connectTo()
+  void setTransport(transport_t transport) { m_transport = transport; }
+  // encrypt the connection, over TCP or Unix sockets, without io_uring
+  // nor reconnecting. connectTo() returns once the handshake is done.
+  // Must be set before connectTo()
+  void setTls(const tls_config_t & tls) { m_tls = tls; }
+  // compress the messages, as the server does, needs framing.
+  // Must be set before connectTo()
+  void setCompression(const compression_config_t & compression) { m_compression = compression; }
 
   void subscribe(const client_observer_t & observer);
   void unsubscribeAll();
 
-  pipe_ret_t finish();
+  // with drainTimeoutMs, wait up to that long for what is queued to
+  // be sent and the server to close in turn, before closing
+  pipe_ret_t finish(uint drainTimeoutMs = 0);
 };
 
 #endif //INTERCOM_TCP_CLIENT_H
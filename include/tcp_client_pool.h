@@ -0,0 +1,96 @@
+
+
+#ifndef INTERCOM_TCP_CLIENT_POOL_H
+#define INTERCOM_TCP_CLIENT_POOL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "client_observer.h"
+#include "client_pool_config.h"
+#include "event_loop.h"
+#include "framing.h"
+#include "receive_buffers.h"
+#include "send_queue.h"
+#include "pipe_ret_t.h"
+
+/*
+ * Many connections to the same server, connected concurrently and
+ * served by a few shared event loop threads instead of a thread each.
+ *
+ * connectTo() resolves the server once, starts a non-blocking connect
+ * on every socket and waits until they are all up or the timeout
+ * expires. sendMsg() queues the message on one of the connected
+ * sockets, picked round robin or by load; everything received on any
+ * connection is published to the same observers, from the I/O threads.
+ */
+class TcpClientPool : private EventHandler
+{
+private:
+  enum connection_state_t {
+    CONNECTING,
+    CONNECTED,
+    CLOSED,
+  };
+
+  struct connection_t {
+    int sockfd = -1;
+    std::atomic<int> state{CONNECTING};
+    EventLoop * eventLoop = nullptr;
+    FrameBuffer * frameBuffer = nullptr;
+    ReceiveBuffers * receiveBuffers = nullptr;
+    SendQueue * sendQueue = nullptr;
+  };
+
+  client_pool_config_t m_config;
+  std::vector<connection_t *> m_connections;
+  std::vector<EventLoop *> m_eventLoops;
+  std::vector<client_observer_t> m_subscibers;
+  std::atomic<uint> m_nextConnection{0};
+  std::atomic<uint> m_numConnected{0};
+
+  // connectTo() waits on it for pending connects
+  std::mutex m_connectMtx;
+  std::condition_variable m_connectCondition;
+  uint m_pendingConnects = 0;
+  // why the last failed connect failed
+  const char * m_connectError = "";
+
+  void onEvents(uint64_t token, uint32_t events);
+  void handleConnected(connection_t * connection);
+  void handleReadable(connection_t * connection);
+  ssize_t receive(connection_t * connection);
+  void handleClosed(connection_t * connection, const char * reason);
+  void connectDone(connection_t * connection, int newState, const char * error = nullptr);
+  connection_t * selectConnection();
+  pipe_ret_t send(connection_t * connection, const char * msg, size_t size);
+  void publishServerBuffers(const struct iovec * buffers, size_t count);
+  void publishServerDisconnected(const pipe_ret_t & ret);
+  pipe_ret_t startEventLoops();
+
+public:
+  ~TcpClientPool();
+  pipe_ret_t connectTo(
+    const std::string & server_addr,
+    int server_port,
+    const client_pool_config_t & config = client_pool_config_t());
+  // on a connection picked by the configured selection
+  pipe_ret_t sendMsg(const char * msg, size_t size);
+  // on a given connection, e.g. to keep related messages in order
+  pipe_ret_t sendMsg(uint connection, const char * msg, size_t size);
+
+  uint size() const { return (uint)m_connections.size(); }
+  uint connectedCount() const { return m_numConnected.load(); }
+
+  // observers are called from the I/O threads, concurrently if more than one
+  void subscribe(const client_observer_t & observer);
+  void unsubscribeAll();
+
+  pipe_ret_t finish();
+};
+
+#endif //INTERCOM_TCP_CLIENT_POOL_H
@@ -6,6 +6,7 @@
 
 
 #include <vector>
+#include <unordered_map>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -13,46 +14,183 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <thread>
+#include <chrono>
 #include <functional>
 #include <cstring>
 #include <errno.h>
 #include <iostream>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
 #include "client.h"
+#include "client_registry.h"
 #include "server_observer.h"
+#include "observer_table.h"
+#include "server_config.h"
+#include "event_loop.h"
+#include "framing.h"
+#include "send_queue.h"
+#include "metrics.h"
+#include "worker_pool.h"
+#include "client_strand.h"
+#include "socket_options.h"
+#include "receive_buffers.h"
+#include "memory_transport.h"
+#include "tls.h"
+#include "compression.h"
+#include "connection_limiter.h"
+#include "token_bucket.h"
 #include "pipe_ret_t.h"
 
-
-#define MAX_PACKET_SIZE 4096
-
-class TcpServer
+class TcpServer : private EventHandler, private StrandHandler
 {
 private:
 
     int m_sockfd;
+    std::vector<int> m_listenfds;
     struct sockaddr_in m_serverAddress;
-    struct sockaddr_in m_clientAddress;
     fd_set m_fds;
-    std::vector<Client> m_clients;
-    std::vector<server_observer_t> m_subscibers;
-    std::thread * threadHandle;
-
-    void publishClientMsg(const Client & client, const char * msg, size_t msgSize);
-    void publishClientDisconnected(const Client & client);
-    void receiveTask(/*void * context*/);
+    server_config_t m_config;
+    ClientRegistry m_clients;
+    ObserverTable m_observers;
+    std::vector<EventLoop*> m_eventLoops;
+    // released by the destructor, as finish() may run on an I/O thread
+    std::vector<EventLoop*> m_retiredEventLoops;
+    std::atomic<uint> m_nextEventLoop;
+    ServerMetrics m_metrics;
+    // runs observers when dispatching to workers
+    WorkerPool * m_workerPool = nullptr;
+    Payload m_heartbeat;
+    // listener of TRANSPORT_MEMORY, kept until the server is deleted
+    // or started again, as reactors may still look at it once closed
+    MemoryListener * m_memoryListener = nullptr;
+    // certificates and settings of TLS connections, if enabled
+    TlsContext * m_tlsContext = nullptr;
+    // compresses payloads made for any client (broadcasts, heartbeats),
+    // if compression is enabled
+    Compressor * m_compressor = nullptr;
+    // counts connections against the connection limits, if any
+    ConnectionLimiter * m_limiter = nullptr;
+    // finish() is draining the clients, new connections are refused
+    std::atomic<bool> m_draining;
+    // receive threads of SERVER_MODE_THREAD_PER_CLIENT clients by client
+    // id, and those which returned, joined by the next accept or finish()
+    std::mutex m_receiveThreadsMtx;
+    std::unordered_map<client_id_t, std::thread> m_receiveThreads;
+    std::vector<client_id_t> m_finishedThreads;
+    // how often finish() looks for drained clients
+    static const uint DRAIN_POLL_INTERVAL_MS = 10;
+
+    void publishClientMsg(Client & client, const char * msg, size_t msgSize);
+    void publishClientBuffers(Client & client, const struct iovec * buffers, size_t count);
+    void publishClientConnected(Client & client);
+    void publishClientDisconnected(Client & client);
+    void notifyClientDisconnected(Client * client);
+    void onStrandMessage(Client & client, const char * msg, size_t size);
+    void onStrandDisconnected(Client & client);
+    void onStrandScheduled(Client & client);
+    void onStrandIdle(Client & client);
+    void receiveTask(client_id_t clientId);
+    void startReceiveThread(client_id_t clientId);
+    void receiveTaskDone(client_id_t clientId);
+    void joinReceiveThreads();
+    void onEvents(uint64_t token, uint32_t events);
+    void onCompletion(IoUring & uring, const uring_completion_t & completion);
+    void onTimer(uint64_t token);
+    void startClientTimer(Client * client);
+    void checkClientTimeouts(Client * client);
+    bool hasClientTimers() const;
+    void pauseClient(Client * client, uint64_t delayMs, bool reads);
+    void resumeClient(Client * client);
+    bool continueHandshake(Client * client);
+    void handleClientReadable(Client * client);
+    void handleClientWritable(Client * client);
+    void requestFlush(Client * client);
+    ssize_t receiveFromClient(Client * client);
+    bool handleClientData(Client * client, const char * data, size_t size);
+    bool publishFrames(Client * client);
+    void initClient(Client * client);
+    pipe_ret_t queueToClient(Client * client, const Payload & payload, bool coalescable, bool flushNow);
+    void disconnectSlowClient(Client * client);
+    pipe_ret_t sendBlocking(Client * client, const char * header, size_t headerSize,
+                            const char * msg, size_t size);
+    pipe_ret_t sendRequest(const Client & client, SendRequest * request);
+    pipe_ret_t sendFileBlocking(Client * client, const SendRequest & request);
+    void handleClientDisconnected(Client * client, disconnect_reason_t reason, const char * message);
+    void countReceived(Client * client, size_t size);
+    void countSent(Client * client, size_t msgs);
+    void countAccepted(uint64_t acceptedAt);
+    void countDisconnect(Client * client, disconnect_reason_t reason);
+    static void fillClientMetrics(Client & client, connection_metrics_t & metrics);
+    void closeClient(Client & client);
+    static void shutdownClient(Client & client);
+    int acceptConnection(int listenfd, Client & newClient, int flags);
+    bool admitConnection(const Client & newClient);
+    void discardConnection(const Client & newClient);
+    Client * registerLoopClient(const Client & newClient, uint eventLoopIndex);
+    void acceptReactorClients(uint reactorIndex);
+    void handleUringAccept(IoUring & uring, uint reactorIndex, const uring_completion_t & completion);
+    void handleUringReceive(IoUring & uring, const uring_completion_t & completion);
+    void handleUringSent(const uring_completion_t & completion);
+    void submitUringSend(Client * client);
+    pipe_ret_t createListener(int port, bool reusePort, int & listenfd);
+    pipe_ret_t createUnixListener(int & listenfd);
+    pipe_ret_t createMemoryListener(int & listenfd);
+    pipe_ret_t startEventLoops();
+    void stopEventLoops();
+    void stopAccepting();
+    void drainClients(uint timeoutMs);
+    bool isIoThread();
+
+    // client sockets are registered with their client id, whose generation
+    // is never 0, listener sockets of reactor threads with the reactor index
+    static uint64_t listenerToken(uint reactorIndex) { return reactorIndex; }
+    static bool isListenerToken(uint64_t token) { return (token >> 32) == 0; }
+    static uint listenerIndex(uint64_t token) { return (uint)token; }
+
+    // io_uring requests carry the client id (or the listener index) with
+    // the operation in bits 24-31, above the largest clients table slot
+    enum uring_op_t {
+        URING_ACCEPT = 1,
+        URING_RECV,
+        URING_SEND,
+    };
+    static uint64_t uringToken(uring_op_t op, uint64_t id) { return id | ((uint64_t)op << 24); }
+    static uring_op_t uringOp(uint64_t token) { return (uring_op_t)((token >> 24) & 0xFF); }
+    static uint64_t uringId(uint64_t token) { return token & ~(0xFFULL << 24); }
 
 
 public:
 
-    pipe_ret_t start(int port);
+    TcpServer();
+    ~TcpServer();
+
+    pipe_ret_t start(int port, const server_config_t & config = server_config_t());
+    int getPort() const;
     Client acceptClient(uint timeout);
     bool deleteClient(Client & client);
-    void subscribe(const server_observer_t & observer);
+    pipe_ret_t subscribe(const server_observer_t & observer);
     void unsubscribeAll();
     pipe_ret_t sendToAllClients(const char * msg, size_t size);
+    Payload makePayload(const char * msg, size_t size) const;
+    pipe_ret_t broadcast(const Payload & payload);
+    bool setBackpressurePolicy(const Client & client, backpressure_policy_t policy);
+    bool corkClient(const Client & client);
+    pipe_ret_t uncorkClient(const Client & client);
     pipe_ret_t sendToClient(const Client & client, const char * msg, size_t size);
-    pipe_ret_t finish();
+    pipe_ret_t sendFileToClient(const Client & client, int fd, off_t offset, size_t length,
+                                const send_complete_func_t & onComplete = nullptr);
+    pipe_ret_t sendZeroCopyToClient(const Client & client, const char * msg, size_t size,
+                                    const send_complete_func_t & onComplete);
+    pipe_ret_t finish(uint drainTimeoutMs = 0);
     void printClients();
+    server_metrics_t getMetrics();
+    bool getClientMetrics(const Client & client, connection_metrics_t & metrics);
+    void getClientsMetrics(std::vector<connection_metrics_t> & metrics);
 };
 
 
@@ -0,0 +1,90 @@
+
+
+#ifndef INTERCOM_TIMER_WHEEL_H
+#define INTERCOM_TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+
+// generation (32 bits) | node index (32 bits), 0 is never a valid id
+typedef uint64_t timer_id_t;
+
+/*
+ * Hierarchical timing wheel: LEVELS wheels of SLOTS slots, every slot
+ * of a level spanning a whole turn of the level below. A timer goes in
+ * the slot of the lowest level its expiry falls in, and moves down one
+ * level every time the level below completes a turn, until it reaches
+ * the first level and expires. Scheduling and cancelling are O(1)
+ * whatever the number of timers, and so is expiring, amortized.
+ *
+ * Time is counted in ticks of tickMs milliseconds: timers expire on
+ * the first tick at or after their expiry. Timers live in a pool of
+ * nodes that only grows, so a wheel which reached its working size
+ * no longer allocates.
+ *
+ * Not thread safe: a wheel belongs to the thread of its EventLoop.
+ */
+class TimerWheel {
+
+public:
+    static const uint SLOT_BITS = 6;
+    static const uint SLOTS = 1 << SLOT_BITS;
+    static const uint LEVELS = 4;
+
+    explicit TimerWheel(uint tickMs = 10);
+
+    // monotonic milliseconds, cheap enough to be read for every message
+    static uint64_t clockMs();
+
+    // have token expire delayMs from now
+    timer_id_t schedule(uint64_t token, uint64_t delayMs);
+    // return false if the timer already expired or was cancelled
+    bool cancel(timer_id_t id);
+
+    /*
+     * Pop the next timer expired by now, return false if there is none.
+     * Timers scheduled meanwhile, even without delay, expire on a later call.
+     */
+    bool nextExpired(uint64_t nowMs, uint64_t & token);
+    // milliseconds until the next timer may expire, -1 if none is scheduled
+    int timeout(uint64_t nowMs) const;
+
+    size_t size() const { return m_count; }
+
+private:
+    static const uint32_t NIL = ~0U;
+    // list of the expired nodes, after the slots of all levels
+    static const uint32_t EXPIRED_LIST = SLOTS * LEVELS;
+
+    struct node_t {
+        uint64_t token;
+        uint64_t expiry;
+        uint32_t prev;
+        uint32_t next;
+        // list the node is in, NIL if free
+        uint32_t list;
+        uint32_t generation;
+    };
+
+    uint64_t m_tickMs;
+    // time of tick 0
+    uint64_t m_startMs;
+    // last tick processed
+    uint64_t m_tick = 0;
+    size_t m_count = 0;
+    std::vector<node_t> m_nodes;
+    uint32_t m_freeNodes = NIL;
+    // first node of every slot, then of the expired list
+    std::vector<uint32_t> m_lists;
+
+    void insert(uint32_t index, uint64_t first);
+    void link(uint32_t index, uint32_t list);
+    void unlink(uint32_t index);
+    void release(uint32_t index);
+    void advance();
+    void cascade(uint level);
+};
+
+
+#endif //INTERCOM_TIMER_WHEEL_H
@@ -0,0 +1,110 @@
+
+
+#ifndef INTERCOM_TLS_H
+#define INTERCOM_TLS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <mutex>
+#include <string>
+#include "memory_pool.h"
+#include "pipe_ret_t.h"
+#include "stream.h"
+#include "tls_config.h"
+
+struct ssl_st;
+struct ssl_ctx_st;
+class TlsStream;
+
+/*
+ * OpenSSL context shared by the connections of a server, or of a
+ * client: certificates, verification and protocol settings.
+ * Built only with INTERCOM_HAVE_TLS, otherwise init() fails.
+ */
+class TlsContext {
+
+public:
+    TlsContext() {}
+    ~TlsContext();
+
+    pipe_ret_t init(const tls_config_t & config, bool server);
+    // TLS stream over the connected socket fd, which it takes
+    // ownership of. Clients send and verify serverName
+    pipe_ret_t createStream(int fd, const std::string & serverName, TlsStream *& stream);
+
+private:
+    struct ssl_ctx_st * m_ctx = nullptr;
+    bool m_server = false;
+    bool m_verifyPeer = false;
+};
+
+/*
+ * TLS connection over a non-blocking socket.
+ *
+ * The handshake runs in user space, a step whenever the socket is
+ * ready, until handshake() succeeds. OpenSSL then hands the record
+ * layer over to the kernel (kTLS) where it can: each direction the
+ * kernel took over is read or written straight from the socket, and
+ * sendFile() is sendfile() again. The others go through SSL_read()
+ * and SSL_write(), serialized by a lock as OpenSSL does not allow
+ * both at once on a connection.
+ *
+ * A record SSL_write() could not write out is kept by OpenSSL, and
+ * the bytes it holds count as written: writePending() tells the
+ * record still has to be flushed once the socket is writable.
+ */
+class TlsStream : public Stream {
+
+    friend class TlsContext;
+
+public:
+    // plaintext gathered into a single record per SSL_write()
+    static const size_t MAX_RECORD_SIZE = 16 * 1024;
+
+    static void * operator new(size_t size) { return BufferPool::allocate(size); }
+    static void operator delete(void * ptr, size_t size) { BufferPool::deallocate(ptr, size); }
+
+    int fd() const { return m_fd; }
+
+    // success once done, otherwise code is EAGAIN while the handshake
+    // waits for the socket, or EPROTO if it failed
+    pipe_ret_t handshake();
+    // the handshake waits for the socket to be writable, rather than readable
+    bool handshakeWantsWrite() const { return m_wantsWrite; }
+    // the kernel encrypts, resp. decrypts, the records
+    bool kernelSend() const { return m_kernelSend; }
+    bool kernelReceive() const { return m_kernelReceive; }
+
+    ssize_t readv(const struct iovec * iov, int iovcnt);
+    ssize_t writev(const struct iovec * iov, int iovcnt);
+    ssize_t sendFile(int fd, off_t * offset, size_t count);
+    bool writePending();
+    int flushPending();
+
+    void shutdown();
+    // sends close_notify as well, best effort
+    void shutdownWrite();
+    void close();
+
+private:
+    std::mutex m_mtx;
+    struct ssl_st * m_ssl;
+    int m_fd;
+    bool m_kernelSend = false;
+    bool m_kernelReceive = false;
+    bool m_wantsWrite = false;
+    // plaintext of the record being written, kept until written out
+    char * m_record = nullptr;
+    size_t m_pendingSize = 0;
+
+    TlsStream(struct ssl_st * ssl, int fd) : m_ssl(ssl), m_fd(fd) {}
+    ~TlsStream();
+
+    ssize_t writeRecordLocked(size_t size);
+    int flushPendingLocked();
+    int fail(int ret);
+};
+
+
+#endif //INTERCOM_TLS_H
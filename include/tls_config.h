@@ -0,0 +1,46 @@
+#ifndef INTERCOM_TLS_CONFIG_H
+#define INTERCOM_TLS_CONFIG_H
+
+#include <sys/types.h>
+#include <string>
+
+struct tls_config_t {
+
+    // encrypt connections with TLS 1.2 or later, requires a
+    // build with INTERCOM_TLS
+    bool enabled;
+    // PEM certificate chain and private key, required by servers,
+    // optional for clients
+    std::string certificateFile;
+    std::string privateKeyFile;
+    // PEM CA certificates peers are verified against, the system
+    // ones if empty
+    std::string caFile;
+    // clients verify the server certificate and name, servers
+    // require a client certificate
+    bool verifyPeer;
+    // clients: name sent to the server (SNI) and verified, the
+    // address connected to if empty
+    std::string serverName;
+    // hand record encryption over to the kernel (kTLS) once the
+    // handshake is done, if it supports the cipher. Connections
+    // it takes over are written with sendmsg() and sendfile()
+    // again, encryption no longer costs a copy in user space
+    bool kernelOffload;
+    // connections which did not complete their handshake by then
+    // are dropped, 0 never
+    uint handshakeTimeoutMs;
+
+    tls_config_t() {
+        enabled = false;
+        certificateFile = "";
+        privateKeyFile = "";
+        caFile = "";
+        verifyPeer = false;
+        serverName = "";
+        kernelOffload = true;
+        handshakeTimeoutMs = 10000;
+    }
+};
+
+#endif //INTERCOM_TLS_CONFIG_H
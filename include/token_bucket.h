@@ -0,0 +1,40 @@
+
+
+#ifndef INTERCOM_TOKEN_BUCKET_H
+#define INTERCOM_TOKEN_BUCKET_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "memory_pool.h"
+
+/*
+ * Rate limit of a connection: rate bytes per second on average, burst
+ * bytes at most after being idle. Transfers are cut to what is
+ * available(), and take() what they moved once done.
+ *
+ * Not thread safe.
+ */
+class TokenBucket {
+
+public:
+    TokenBucket(uint64_t rate, uint64_t burst, uint64_t nowMs);
+
+    static void * operator new(size_t size) { return BufferPool::allocate(size); }
+    static void operator delete(void * ptr, size_t size) { BufferPool::deallocate(ptr, size); }
+
+    // milliseconds to wait until bytes can be transferred, 0 if they can now
+    uint64_t delay(uint64_t nowMs);
+    void take(size_t bytes) { m_tokens -= (int64_t)bytes * 1000; }
+    // bytes which can be transferred as of the last delay()
+    uint64_t available() const { return m_tokens > 0 ? (uint64_t)m_tokens / 1000 : 0; }
+
+private:
+    uint64_t m_rate;
+    // in thousandths of bytes, so refilling every millisecond loses nothing
+    int64_t m_burst;
+    int64_t m_tokens;
+    uint64_t m_refilledMs;
+};
+
+
+#endif //INTERCOM_TOKEN_BUCKET_H
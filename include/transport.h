@@ -0,0 +1,32 @@
+
+
+#ifndef INTERCOM_TRANSPORT_H
+#define INTERCOM_TRANSPORT_H
+
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "pipe_ret_t.h"
+
+// what a TcpServer and its TcpClients talk through
+enum transport_t {
+    // TCP/IP socket, addressed by host and port
+    TRANSPORT_TCP,
+    // Unix domain stream socket, addressed by a filesystem path:
+    // same host peers, in different processes
+    TRANSPORT_UNIX,
+    // in-process connection through memory, addressed by a name:
+    // peers of the same process, no syscall per message, see
+    // memory_transport.h. Not available to thread per client
+    // and io_uring servers, nor to clients using io_uring
+    TRANSPORT_MEMORY,
+};
+
+/*
+ * Fill address with the Unix socket path, fails if
+ * it is empty or too long for a sockaddr_un
+ */
+pipe_ret_t unixSocketAddress(const std::string & path, struct sockaddr_un & address, socklen_t & addressSize);
+
+
+#endif //INTERCOM_TRANSPORT_H
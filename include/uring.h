@@ -0,0 +1,96 @@
+
+
+#ifndef INTERCOM_URING_H
+#define INTERCOM_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include "pipe_ret_t.h"
+
+struct msghdr;
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+// a completed io_uring request
+struct uring_completion_t {
+    uint64_t token;
+    // what the equivalent syscall would have returned, or -errno
+    int32_t result;
+    // multishot request stays armed and will complete again
+    bool more;
+    // provided buffer holding the received data, or -1
+    int bufferId;
+};
+
+/*
+ * Minimal io_uring instance, driven through the raw syscalls so no
+ * liburing is needed. Requests are queued with the prepare*() calls
+ * and handed to the kernel, many at once, by submit().
+ *
+ * Receives use a ring of provided buffers: a multishot recv picks a
+ * free buffer for every chunk it receives, and the buffer goes back
+ * to the ring with recycleBuffer() once the data was consumed.
+ *
+ * Not thread safe: an instance is used by a single thread.
+ * Built only with INTERCOM_HAVE_IO_URING, otherwise init() fails.
+ */
+class IoUring {
+
+private:
+    int m_ringfd = -1;
+    // submission queue
+    void * m_sqRing = nullptr;
+    size_t m_sqRingSize = 0;
+    std::atomic<unsigned> * m_sqHead = nullptr;
+    std::atomic<unsigned> * m_sqTail = nullptr;
+    unsigned m_sqMask = 0;
+    unsigned m_sqEntries = 0;
+    unsigned m_sqLocalTail = 0;
+    unsigned m_sqSubmitted = 0;
+    struct io_uring_sqe * m_sqes = nullptr;
+    size_t m_sqesSize = 0;
+    // completion queue, shares the mapping of the submission queue if possible
+    void * m_cqRing = nullptr;
+    size_t m_cqRingSize = 0;
+    std::atomic<unsigned> * m_cqHead = nullptr;
+    std::atomic<unsigned> * m_cqTail = nullptr;
+    unsigned m_cqMask = 0;
+    struct io_uring_cqe * m_cqes = nullptr;
+    // provided buffers
+    struct io_uring_buf_ring * m_bufferRing = nullptr;
+    size_t m_bufferRingSize = 0;
+    char * m_buffers = nullptr;
+    size_t m_buffersSize = 0;
+    size_t m_bufferSize = 0;
+    unsigned m_bufferCount = 0;
+    uint16_t m_bufferTail = 0;
+
+    struct io_uring_sqe * getSqe();
+
+public:
+    // buffer group of the provided buffer ring
+    static const uint16_t BUFFER_GROUP = 0;
+
+    IoUring() {}
+    ~IoUring();
+
+    pipe_ret_t init(unsigned entries);
+    pipe_ret_t initBuffers(unsigned count, size_t bufferSize);
+
+    bool prepareAccept(int listenfd, uint64_t token);
+    bool prepareRecv(int fd, uint64_t token);
+    bool prepareSend(int fd, const struct msghdr * msg, uint64_t token);
+    bool prepareRead(int fd, void * buffer, size_t size, uint64_t token);
+
+    // wait no longer than timeoutMs, unless it is negative
+    int submit(unsigned waitFor, int timeoutMs = -1);
+    bool nextCompletion(uring_completion_t & completion);
+
+    char * buffer(int bufferId) { return m_buffers + (size_t)bufferId * m_bufferSize; }
+    void recycleBuffer(int bufferId);
+};
+
+
+#endif //INTERCOM_URING_H
@@ -0,0 +1,102 @@
+
+
+#ifndef INTERCOM_WORKER_POOL_H
+#define INTERCOM_WORKER_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "pipe_ret_t.h"
+
+/*
+ * Unit of work run by a WorkerPool. The pool does not own tasks:
+ * a task may free itself, or be freed by whatever run() calls,
+ * as long as it is not touched after run() returns.
+ */
+class WorkerTask {
+public:
+    virtual ~WorkerTask() {}
+    virtual void run() = 0;
+};
+
+/*
+ * Fixed size pool of worker threads running submitted tasks.
+ *
+ * Every worker has a bounded lock-free queue. Tasks submitted from a
+ * worker go to its own queue, other threads spread theirs round robin;
+ * a worker whose queue is empty steals from the others before going
+ * to sleep, so a burst landing on one worker is shared by all of them.
+ * Only when every queue is full do tasks spill to a locked list.
+ */
+class WorkerPool {
+
+public:
+    // tasks every worker queue holds, power of 2
+    static const size_t QUEUE_SIZE = 1024;
+
+    WorkerPool();
+    ~WorkerPool();
+
+    pipe_ret_t start(uint numThreads);
+    // run what is queued, then stop the workers; may be called by a task
+    void stop();
+    void submit(WorkerTask * task);
+
+private:
+    /*
+     * Bounded multi-producer multi-consumer queue: every cell carries
+     * a sequence number telling producers and consumers whose turn it is
+     */
+    class TaskQueue {
+    public:
+        TaskQueue();
+        bool push(WorkerTask * task);
+        WorkerTask * pop();
+
+    private:
+        struct cell_t {
+            std::atomic<size_t> sequence;
+            WorkerTask * task;
+        };
+
+        cell_t m_cells[QUEUE_SIZE];
+        alignas(64) std::atomic<size_t> m_enqueuePos;
+        alignas(64) std::atomic<size_t> m_dequeuePos;
+    };
+
+    struct worker_t {
+        TaskQueue queue;
+        std::thread thread;
+
+        // plain new ignores the alignment of the queue positions before C++17
+        static void * operator new(size_t size);
+        static void operator delete(void * ptr);
+    };
+
+    std::vector<worker_t *> m_workers;
+    std::atomic<uint> m_nextWorker;
+    std::atomic<bool> m_running;
+
+    // tasks which found every queue full
+    std::mutex m_overflowMtx;
+    std::deque<WorkerTask *> m_overflow;
+    std::atomic<size_t> m_overflowSize;
+
+    // idle workers sleep until a task is submitted
+    std::mutex m_idleMtx;
+    std::condition_variable m_idleCondition;
+    std::atomic<int> m_sleepers;
+
+    void workerLoop(uint index);
+    WorkerTask * findTask(uint index);
+    void wakeWorker();
+};
+
+
+#endif //INTERCOM_WORKER_POOL_H
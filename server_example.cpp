@@ -2,8 +2,6 @@
 /////////////////////SERVER EXAMPLE////////////////////////
 ///////////////////////////////////////////////////////////
 
-#ifdef SERVER_EXAMPLE
-
 #include <iostream>
 #include <signal.h>
 
@@ -12,10 +10,6 @@
 // declare the server
 TcpServer server;
 
-// declare a server observer which will receive incoming messages.
-// the server supports multiple observers
-server_observer_t observer1, observer2;
-
 // observer callback. will be called for every new message received by clients
 // with the requested IP address
 void onIncomingMsg1(const Client & client, const char * msg, size_t size) {
@@ -41,18 +35,6 @@ void onIncomingMsg1(const Client & client, const char * msg, size_t size) {
     }
 }
 
-// observer callback. will be called for every new message received by clients
-// with the requested IP address
-void onIncomingMsg2(const Client & client, const char * msg, size_t size) {
-    std::string msgStr = msg;
-    // print client message
-    std::cout << "Observer2 got client msg: " << msgStr << std::endl;
-
-    // reply back to client
-    std::string replyMsg = "server got this msg: "+ msgStr;
-    server.sendToClient(client, msg, size);
-}
-
 // observer callback. will be called when client disconnects
 void onClientDisconnected(const Client & client) {
     std::cout << "Client: " << client.getIp() << " disconnected: " << client.getInfoMessage() << std::endl;
@@ -69,17 +51,33 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    // declare server observers which will receive incoming messages.
+    // the server supports multiple observers
+    server_observer_t observer1, observer2;
+
     // configure and register observer1
     observer1.incoming_packet_func = onIncomingMsg1;
     observer1.disconnected_func = onClientDisconnected;
     observer1.wantedIp = "127.0.0.1";
     server.subscribe(observer1);
 
-    // configure and register observer2
-    observer2.incoming_packet_func = onIncomingMsg2;
-    observer1.disconnected_func = nullptr; //don't care about disconnection
-    observer2.wantedIp = "10.88.0.11"; // use empty string instead to receive messages from any IP address
-    server.subscribe(observer2);
+    // configure and register observer2. callbacks may be any callable,
+    // here a lambda keeping its own count of the messages it replied to
+    std::atomic<uint64_t> replies(0);
+    observer2.incoming_packet_func = [&replies](const Client & client, const char * msg, size_t size) {
+        // print client message
+        std::cout << "Observer2 got client msg #" << ++replies << ": " << std::string(msg, size) << std::endl;
+        // reply back to client
+        server.sendToClient(client, msg, size);
+    };
+    // don't care about disconnection
+    // wantedIp may be an address, a CIDR prefix, or empty to receive messages from any IP address
+    observer2.wantedIp = "10.88.0.0/16";
+    pipe_ret_t subscribeRet = server.subscribe(observer2);
+    if (!subscribeRet.success) {
+        std::cout << "Subscribing observer2 failed: " << subscribeRet.msg << std::endl;
+        return EXIT_FAILURE;
+    }
 
     // receive clients
     while(1) {
@@ -95,5 +93,3 @@ int main(int argc, char *argv[])
 
     return 0;
 }
-
-#endif
\ No newline at end of file
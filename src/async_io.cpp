@@ -0,0 +1,820 @@
+#include "../include/async_io.h"
+#include "../include/event_loop.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <algorithm>
+#include <thread>
+
+
+/*
+ * An EventLoop thread of an AsyncContext, dispatching the events of its
+ * descriptors. Descriptors are registered with their slot in m_slots and
+ * its generation, so events still queued for a descriptor deleted
+ * meanwhile are dropped. The slots are only used on the loop thread.
+ */
+class AsyncLoop : private EventHandler {
+
+private:
+    static const uint32_t NIL = ~0U;
+
+    struct slot_t {
+        AsyncDescriptor * descriptor = nullptr;
+        uint32_t generation = 1;
+        uint32_t nextFree = NIL;
+    };
+
+    std::vector<slot_t> m_slots;
+    uint32_t m_freeSlots = NIL;
+
+    void onEvents(uint64_t token, uint32_t events);
+
+public:
+    EventLoop eventLoop;
+    std::atomic<bool> running{false};
+
+    pipe_ret_t start() {
+        pipe_ret_t ret = eventLoop.init(this);
+        if (!ret.success) {
+            return ret;
+        }
+        ret = eventLoop.start();
+        running = ret.success;
+        return ret;
+    }
+
+    uint64_t add(AsyncDescriptor * descriptor);
+    void remove(uint64_t token);
+};
+
+uint64_t AsyncLoop::add(AsyncDescriptor * descriptor) {
+    uint32_t index = m_freeSlots;
+    if (index != NIL) {
+        m_freeSlots = m_slots[index].nextFree;
+    } else {
+        index = (uint32_t)m_slots.size();
+        m_slots.push_back(slot_t());
+    }
+    m_slots[index].descriptor = descriptor;
+    return ((uint64_t)m_slots[index].generation << 32) | index;
+}
+
+void AsyncLoop::remove(uint64_t token) {
+    slot_t & slot = m_slots[(uint32_t)token];
+    slot.descriptor = nullptr;
+    slot.generation++;
+    if (slot.generation == 0) {
+        slot.generation = 1;
+    }
+    slot.nextFree = m_freeSlots;
+    m_freeSlots = (uint32_t)token;
+}
+
+void AsyncLoop::onEvents(uint64_t token, uint32_t events) {
+    uint32_t index = (uint32_t)token;
+    if (index >= m_slots.size() || m_slots[index].generation != (uint32_t)(token >> 32) ||
+        m_slots[index].descriptor == nullptr) {
+        return;
+    }
+    m_slots[index].descriptor->onEvents(events);
+}
+
+/*
+ * Tells code calling out to completions whether they deleted the
+ * descriptor, in which case it must not be touched anymore.
+ * Guards nest, a deletion is reported to all of them.
+ */
+class DestroyGuard {
+
+private:
+    AsyncDescriptor * m_descriptor;
+    bool * m_outer;
+    bool m_destroyed = false;
+
+public:
+    explicit DestroyGuard(AsyncDescriptor * descriptor) :
+            m_descriptor(descriptor),
+            m_outer(descriptor->m_destroyed) {
+        m_descriptor->m_destroyed = &m_destroyed;
+    }
+    ~DestroyGuard() {
+        if (!m_destroyed) {
+            m_descriptor->m_destroyed = m_outer;
+        } else if (m_outer != nullptr) {
+            *m_outer = true;
+        }
+    }
+    bool destroyed() const { return m_destroyed; }
+};
+
+static bool failed(io_result_t & result, int code, const char * reason) {
+    result.success = false;
+    result.code = code;
+    result.reason = reason;
+    return true;
+}
+
+static bool failedWithErrno(io_result_t & result) {
+    return failed(result, errno, strerror(errno));
+}
+
+static bool succeeded(io_result_t & result, size_t size) {
+    result.success = true;
+    result.size = size;
+    return true;
+}
+
+
+AsyncContext::AsyncContext() : m_nextLoop(0) {
+}
+
+AsyncContext::~AsyncContext() {
+    stop();
+    for (size_t i=0; i<m_loops.size(); i++) {
+        delete m_loops[i];
+    }
+}
+
+pipe_ret_t AsyncContext::start(uint threads) {
+    pipe_ret_t ret;
+    if (!m_loops.empty()) {
+        ret.success = false;
+        ret.msg = ret.reason = "context is already started";
+        return ret;
+    }
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (uint i=0; i<threads; i++) {
+        AsyncLoop * loop = new AsyncLoop();
+        m_loops.push_back(loop);
+        ret = loop->start();
+        if (!ret.success) {
+            stop();
+            return ret;
+        }
+    }
+    ret.success = true;
+    return ret;
+}
+
+/*
+ * The loops themselves are kept until the context is destroyed,
+ * sockets still refer to them
+ */
+void AsyncContext::stop() {
+    for (size_t i=0; i<m_loops.size(); i++) {
+        m_loops[i]->running = false;
+        m_loops[i]->eventLoop.stop();
+    }
+}
+
+void AsyncContext::post(const std::function<void()> & task) {
+    AsyncLoop * loop = nextLoop();
+    if (loop != nullptr) {
+        loop->eventLoop.post(task);
+    }
+}
+
+AsyncLoop * AsyncContext::nextLoop() {
+    if (m_loops.empty()) {
+        return nullptr;
+    }
+    return m_loops[m_nextLoop++ % m_loops.size()];
+}
+
+
+AsyncDescriptor::~AsyncDescriptor() {
+    if (m_destroyed != nullptr) {
+        *m_destroyed = true;
+    }
+    closeDescriptor();
+}
+
+/*
+ * Register the descriptor in its loop, once. Edge-triggered, for reads
+ * and writes alike: an edge nobody waited for is harmless, as every
+ * operation first tries the socket before waiting.
+ */
+bool AsyncDescriptor::watch() {
+    if (m_token != 0) {
+        return true;
+    }
+    m_token = m_loop->add(this);
+    if (!m_loop->eventLoop.add(m_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, m_token)) {
+        int error = errno;
+        m_loop->remove(m_token);
+        m_token = 0;
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
+void AsyncDescriptor::closeDescriptor() {
+    if (m_fd == -1) {
+        return;
+    }
+    if (m_token != 0) {
+        m_loop->eventLoop.remove(m_fd);
+        m_loop->remove(m_token);
+        m_token = 0;
+    }
+    ::close(m_fd);
+    m_fd = -1;
+}
+
+bool AsyncDescriptor::isForeignThread() const {
+    return !m_loop->eventLoop.isInLoopThread();
+}
+
+bool AsyncDescriptor::isLoopStopped(io_result_t & result) const {
+    if (m_loop == nullptr || !m_loop->running) {
+        failed(result, ESHUTDOWN, "context is not running");
+        return true;
+    }
+    return false;
+}
+
+void AsyncDescriptor::post(const std::function<void()> & task) {
+    m_loop->eventLoop.post(task);
+}
+
+
+/*
+ * The callback gets its own copy of the result, since an operation it
+ * starts may complete right away and overwrite m_result.
+ */
+void CallbackWaiter::onIoComplete(const io_result_t & result) {
+    m_result = result;
+    m_ready = true;
+    if (m_running) { // called from the callback below, which picks it up
+        return;
+    }
+    m_running = true;
+    DestroyGuard guard(m_owner);
+    while (m_ready) {
+        m_ready = false;
+        io_callback_t callback;
+        callback.swap(m_callback);
+        io_result_t completed = m_result;
+        callback(completed);
+        if (guard.destroyed()) {
+            return;
+        }
+    }
+    m_running = false;
+}
+
+
+bool IoAwaitable::start() {
+    switch (m_op) {
+        case OP_READ:
+            return m_socket->startRead(m_buffer, m_size, this, m_result);
+        case OP_READ_EXACTLY:
+            return m_socket->startReadExactly(m_buffer, m_size, this, m_result);
+        case OP_WRITE:
+            return m_socket->startWrite(m_buffer, m_size, this, m_result);
+        case OP_CONNECT:
+            return m_socket->startConnect(*m_host, m_port, this, m_result);
+        case OP_ACCEPT:
+            return m_listener->startAccept(this, m_result);
+    }
+    return failed(m_result, EINVAL, "unknown operation");
+}
+
+void IoAwaitable::onIoComplete(const io_result_t & result) {
+    m_result = result;
+    m_resume(m_coroutine);
+}
+
+
+AsyncSocket::AsyncSocket(AsyncContext & context) :
+        AsyncDescriptor(context.nextLoop(), -1),
+        m_options(socket_options_t::client()),
+        m_readCallback(this),
+        m_writeCallback(this) {
+}
+
+AsyncSocket::AsyncSocket(AsyncLoop * loop, int fd) :
+        AsyncDescriptor(loop, fd),
+        m_options(socket_options_t::client()),
+        m_readCallback(this),
+        m_writeCallback(this) {
+}
+
+AsyncSocket::~AsyncSocket() {
+}
+
+IoAwaitable AsyncSocket::read(char * buffer, size_t size) {
+    IoAwaitable awaitable(IoAwaitable::OP_READ, this);
+    awaitable.m_buffer = buffer;
+    awaitable.m_size = size;
+    return awaitable;
+}
+
+IoAwaitable AsyncSocket::readExactly(char * buffer, size_t size) {
+    IoAwaitable awaitable(IoAwaitable::OP_READ_EXACTLY, this);
+    awaitable.m_buffer = buffer;
+    awaitable.m_size = size;
+    return awaitable;
+}
+
+IoAwaitable AsyncSocket::write(const char * data, size_t size) {
+    IoAwaitable awaitable(IoAwaitable::OP_WRITE, this);
+    awaitable.m_buffer = const_cast<char *>(data);
+    awaitable.m_size = size;
+    return awaitable;
+}
+
+IoAwaitable AsyncSocket::connect(const std::string & host, int port) {
+    IoAwaitable awaitable(IoAwaitable::OP_CONNECT, this);
+    awaitable.m_host = &host;
+    awaitable.m_port = port;
+    return awaitable;
+}
+
+void AsyncSocket::asyncRead(char * buffer, size_t size, const io_callback_t & callback) {
+    m_readCallback.setCallback(callback);
+    io_result_t result;
+    if (startRead(buffer, size, &m_readCallback, result)) {
+        m_readCallback.onIoComplete(result);
+    }
+}
+
+void AsyncSocket::asyncReadExactly(char * buffer, size_t size, const io_callback_t & callback) {
+    m_readCallback.setCallback(callback);
+    io_result_t result;
+    if (startReadExactly(buffer, size, &m_readCallback, result)) {
+        m_readCallback.onIoComplete(result);
+    }
+}
+
+void AsyncSocket::asyncWrite(const char * data, size_t size, const io_callback_t & callback) {
+    m_writeCallback.setCallback(callback);
+    io_result_t result;
+    if (startWrite(data, size, &m_writeCallback, result)) {
+        m_writeCallback.onIoComplete(result);
+    }
+}
+
+void AsyncSocket::asyncConnect(const std::string & host, int port, const io_callback_t & callback) {
+    m_writeCallback.setCallback(callback);
+    io_result_t result;
+    if (startConnect(host, port, &m_writeCallback, result)) {
+        m_writeCallback.onIoComplete(result);
+    }
+}
+
+/*
+ * Started from another thread, the operation is posted to the loop
+ * thread, and its waiter called there even if it completes right away
+ */
+bool AsyncSocket::startRead(char * buffer, size_t size, IoWaiter * waiter, io_result_t & result) {
+    if (isLoopStopped(result)) {
+        return true;
+    }
+    if (isForeignThread()) {
+        post([this, buffer, size, waiter]() {
+            io_result_t result;
+            if (beginRead(buffer, size, false, waiter, result)) {
+                waiter->onIoComplete(result);
+            }
+        });
+        return false;
+    }
+    return beginRead(buffer, size, false, waiter, result);
+}
+
+bool AsyncSocket::startReadExactly(char * buffer, size_t size, IoWaiter * waiter, io_result_t & result) {
+    if (isLoopStopped(result)) {
+        return true;
+    }
+    if (isForeignThread()) {
+        post([this, buffer, size, waiter]() {
+            io_result_t result;
+            if (beginRead(buffer, size, true, waiter, result)) {
+                waiter->onIoComplete(result);
+            }
+        });
+        return false;
+    }
+    return beginRead(buffer, size, true, waiter, result);
+}
+
+bool AsyncSocket::startWrite(const char * data, size_t size, IoWaiter * waiter, io_result_t & result) {
+    if (isLoopStopped(result)) {
+        return true;
+    }
+    if (isForeignThread()) {
+        post([this, data, size, waiter]() {
+            io_result_t result;
+            if (beginWrite(data, size, waiter, result)) {
+                waiter->onIoComplete(result);
+            }
+        });
+        return false;
+    }
+    return beginWrite(data, size, waiter, result);
+}
+
+/*
+ * Resolving is blocking, pass an address rather than a name
+ * to connect from a loop thread without stalling it
+ */
+bool AsyncSocket::startConnect(const std::string & host, int port, IoWaiter * waiter, io_result_t & result) {
+    if (isLoopStopped(result)) {
+        return true;
+    }
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo * addresses = nullptr;
+    std::string portString = std::to_string(port);
+    if (getaddrinfo(host.c_str(), portString.c_str(), &hints, &addresses) != 0) {
+        return failed(result, EHOSTUNREACH, "Failed to resolve hostname");
+    }
+    struct sockaddr_storage address;
+    socklen_t addressSize = addresses->ai_addrlen;
+    memcpy(&address, addresses->ai_addr, addressSize);
+    freeaddrinfo(addresses);
+
+    if (isForeignThread()) {
+        post([this, address, addressSize, waiter]() {
+            io_result_t result;
+            if (beginConnect(address, addressSize, waiter, result)) {
+                waiter->onIoComplete(result);
+            }
+        });
+        return false;
+    }
+    return beginConnect(address, addressSize, waiter, result);
+}
+
+bool AsyncSocket::beginRead(char * buffer, size_t size, bool exactly, IoWaiter * waiter, io_result_t & result) {
+    if (m_fd == -1 || m_connecting) {
+        return failed(result, ENOTCONN, "socket is not connected");
+    }
+    if (m_reading.waiter != nullptr) {
+        return failed(result, EBUSY, "a read is already pending");
+    }
+    m_reading.buffer = buffer;
+    m_reading.size = size;
+    m_reading.done = 0;
+    m_reading.exactly = exactly;
+    if (size == 0) {
+        return succeeded(result, 0);
+    }
+    if (continueRead(result)) {
+        return true;
+    }
+    m_reading.waiter = waiter;
+    return wait(m_reading, result);
+}
+
+bool AsyncSocket::beginWrite(const char * data, size_t size, IoWaiter * waiter, io_result_t & result) {
+    if (m_fd == -1 || m_connecting) {
+        return failed(result, ENOTCONN, "socket is not connected");
+    }
+    if (m_writing.waiter != nullptr) {
+        return failed(result, EBUSY, "a write is already pending");
+    }
+    m_writing.buffer = const_cast<char *>(data);
+    m_writing.size = size;
+    m_writing.done = 0;
+    if (continueWrite(result)) {
+        return true;
+    }
+    m_writing.waiter = waiter;
+    return wait(m_writing, result);
+}
+
+bool AsyncSocket::beginConnect(const struct sockaddr_storage & address, socklen_t addressSize,
+                               IoWaiter * waiter, io_result_t & result) {
+    if (m_fd != -1) {
+        return failed(result, EISCONN, "socket is already connected");
+    }
+    m_fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (m_fd == -1) {
+        return failedWithErrno(result);
+    }
+    pipe_ret_t optionsRet = applySocketOptions(m_fd, m_options);
+    if (!optionsRet.success) {
+        closeDescriptor();
+        return failed(result, optionsRet.code, optionsRet.reason);
+    }
+    if (::connect(m_fd, (const struct sockaddr *)&address, addressSize) == 0) {
+        return succeeded(result, 0);
+    }
+    if (errno != EINPROGRESS) {
+        failedWithErrno(result);
+        closeDescriptor();
+        return true;
+    }
+    m_connecting = true;
+    m_writing.done = 0;
+    m_writing.waiter = waiter;
+    if (!wait(m_writing, result)) {
+        return false;
+    }
+    m_connecting = false;
+    closeDescriptor();
+    return true;
+}
+
+/*
+ * Return true once the read completed, successfully or not.
+ * A read failing with code 0 met the end of the stream.
+ */
+bool AsyncSocket::continueRead(io_result_t & result) {
+    pending_t & reading = m_reading;
+    while (true) {
+        ssize_t received = recv(m_fd, reading.buffer + reading.done, reading.size - reading.done, 0);
+        if (received > 0) {
+            reading.done += (size_t)received;
+            if (!reading.exactly || reading.done == reading.size) {
+                return succeeded(result, reading.done);
+            }
+            continue;
+        }
+        result.size = reading.done;
+        if (received == 0) {
+            return failed(result, 0, "connection closed by peer");
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return false;
+        }
+        return failedWithErrno(result);
+    }
+}
+
+bool AsyncSocket::continueWrite(io_result_t & result) {
+    pending_t & writing = m_writing;
+    while (writing.done < writing.size) {
+        ssize_t sent = send(m_fd, writing.buffer + writing.done, writing.size - writing.done, MSG_NOSIGNAL);
+        if (sent > 0) {
+            writing.done += (size_t)sent;
+            continue;
+        }
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return false;
+        }
+        result.size = writing.done;
+        return failedWithErrno(result);
+    }
+    return succeeded(result, writing.done);
+}
+
+/*
+ * A failed connect closes the socket, so connect may be tried again
+ */
+bool AsyncSocket::continueConnect(io_result_t & result) {
+    int error = 0;
+    socklen_t errorSize = sizeof(error);
+    if (getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &error, &errorSize) == -1) {
+        error = errno;
+    }
+    if (error == EINPROGRESS || error == EALREADY) {
+        return false;
+    }
+    m_connecting = false;
+    if (error != 0) {
+        failed(result, error, strerror(error));
+        closeDescriptor();
+        return true;
+    }
+    return succeeded(result, 0);
+}
+
+/*
+ * Have the pending operation resumed by the events of the socket,
+ * or complete it with the error if they can't be watched
+ */
+bool AsyncSocket::wait(pending_t & pending, io_result_t & result) {
+    if (watch()) {
+        return false;
+    }
+    pending.waiter = nullptr;
+    result.size = pending.done;
+    return failedWithErrno(result);
+}
+
+void AsyncSocket::onEvents(uint32_t events) {
+    DestroyGuard guard(this);
+    if (m_writing.waiter != nullptr && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        io_result_t result;
+        if (m_connecting ? continueConnect(result) : continueWrite(result)) {
+            IoWaiter * waiter = m_writing.waiter;
+            m_writing.waiter = nullptr;
+            waiter->onIoComplete(result);
+            if (guard.destroyed()) {
+                return;
+            }
+        }
+    }
+    if (m_reading.waiter != nullptr && (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))) {
+        io_result_t result;
+        if (continueRead(result)) {
+            IoWaiter * waiter = m_reading.waiter;
+            m_reading.waiter = nullptr;
+            waiter->onIoComplete(result);
+        }
+    }
+}
+
+/*
+ * From another thread, the socket is closed on its loop thread later on
+ */
+void AsyncSocket::close() {
+    if (m_loop != nullptr && m_loop->running && isForeignThread()) {
+        post([this]() { close(); });
+        return;
+    }
+    closeDescriptor();
+    m_connecting = false;
+    io_result_t result;
+    failed(result, ECANCELED, "socket closed");
+    DestroyGuard guard(this);
+    cancel(m_writing, result);
+    if (!guard.destroyed()) {
+        cancel(m_reading, result);
+    }
+}
+
+void AsyncSocket::cancel(pending_t & pending, const io_result_t & result) {
+    if (pending.waiter == nullptr) {
+        return;
+    }
+    IoWaiter * waiter = pending.waiter;
+    pending.waiter = nullptr;
+    io_result_t cancelled = result;
+    cancelled.size = pending.done;
+    waiter->onIoComplete(cancelled);
+}
+
+
+AsyncListener::AsyncListener(AsyncContext & context) :
+        AsyncDescriptor(context.nextLoop(), -1),
+        m_context(context),
+        m_acceptCallback(this) {
+}
+
+AsyncListener::~AsyncListener() {
+}
+
+pipe_ret_t AsyncListener::listen(int port, const socket_options_t & options, int backlog) {
+    pipe_ret_t ret;
+    if (m_fd != -1) {
+        ret.success = false;
+        ret.msg = ret.reason = "listener is already listening";
+        return ret;
+    }
+    m_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_fd == -1) {
+        ret.success = false;
+        ret.code = errno;
+        ret.msg = ret.reason = strerror(errno);
+        return ret;
+    }
+    int option = 1;
+    setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+    // accepted sockets inherit them, buffer sizes must be set before listen()
+    ret = applySocketOptions(m_fd, options);
+    if (!ret.success) {
+        closeDescriptor();
+        return ret;
+    }
+    m_options = options;
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (bind(m_fd, (struct sockaddr *)&address, sizeof(address)) == -1 || ::listen(m_fd, backlog) == -1) {
+        ret.success = false;
+        ret.code = errno;
+        ret.msg = ret.reason = strerror(errno);
+        closeDescriptor();
+        return ret;
+    }
+    ret.success = true;
+    return ret;
+}
+
+int AsyncListener::getPort() const {
+    struct sockaddr_in address;
+    socklen_t addressSize = sizeof(address);
+    if (m_fd == -1 || getsockname(m_fd, (struct sockaddr *)&address, &addressSize) == -1) {
+        return -1;
+    }
+    return ntohs(address.sin_port);
+}
+
+IoAwaitable AsyncListener::accept() {
+    return IoAwaitable(this);
+}
+
+void AsyncListener::asyncAccept(const io_callback_t & callback) {
+    m_acceptCallback.setCallback(callback);
+    io_result_t result;
+    if (startAccept(&m_acceptCallback, result)) {
+        m_acceptCallback.onIoComplete(result);
+    }
+}
+
+bool AsyncListener::startAccept(IoWaiter * waiter, io_result_t & result) {
+    if (isLoopStopped(result)) {
+        return true;
+    }
+    if (isForeignThread()) {
+        post([this, waiter]() {
+            io_result_t result;
+            if (beginAccept(waiter, result)) {
+                waiter->onIoComplete(result);
+            }
+        });
+        return false;
+    }
+    return beginAccept(waiter, result);
+}
+
+bool AsyncListener::beginAccept(IoWaiter * waiter, io_result_t & result) {
+    if (m_fd == -1) {
+        return failed(result, EBADF, "listener is not listening");
+    }
+    if (m_accepting != nullptr) {
+        return failed(result, EBUSY, "an accept is already pending");
+    }
+    if (continueAccept(result)) {
+        return true;
+    }
+    if (!watch()) {
+        return failedWithErrno(result);
+    }
+    m_accepting = waiter;
+    return false;
+}
+
+/*
+ * The accepted socket goes to the next loop of the context, so
+ * connections accepted by one listener are spread over all loops
+ */
+bool AsyncListener::continueAccept(io_result_t & result) {
+    while (true) {
+        int fd = accept4(m_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            return failedWithErrno(result);
+        }
+        pipe_ret_t optionsRet = applyAcceptedSocketOptions(fd, m_options);
+        if (!optionsRet.success) {
+            ::close(fd);
+            return failed(result, optionsRet.code, optionsRet.reason);
+        }
+        result.socket = new AsyncSocket(m_context.nextLoop(), fd);
+        return succeeded(result, 0);
+    }
+}
+
+void AsyncListener::onEvents(uint32_t events) {
+    if (m_accepting == nullptr || !(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        return;
+    }
+    io_result_t result;
+    if (continueAccept(result)) {
+        IoWaiter * waiter = m_accepting;
+        m_accepting = nullptr;
+        waiter->onIoComplete(result);
+    }
+}
+
+void AsyncListener::close() {
+    if (m_loop != nullptr && m_loop->running && isForeignThread()) {
+        post([this]() { close(); });
+        return;
+    }
+    closeDescriptor();
+    if (m_accepting != nullptr) {
+        IoWaiter * waiter = m_accepting;
+        m_accepting = nullptr;
+        io_result_t result;
+        failed(result, ECANCELED, "listener closed");
+        waiter->onIoComplete(result);
+    }
+}
@@ -1,20 +1,39 @@
 
 
 #include "../include/client.h"
+#include <arpa/inet.h>
+#include <algorithm>
 
 
-Client::~Client() {
-    if (m_threadHandler != nullptr) {
-        m_threadHandler->detach();
-        delete m_threadHandler;
-        m_threadHandler = nullptr;
-    }
-}
-
 bool Client::operator ==(const Client & other) {
     if ( (this->m_sockfd == other.m_sockfd) &&
-         (this->m_ip == other.m_ip) ) {
+         (strcmp(this->m_ip, other.m_ip) == 0) ) {
         return true;
     }
     return false;
 }
+
+/*
+ * Set the textual address, parsed to binary as well
+ */
+void Client::setIp(const char * ip) {
+    strncpy(m_ip, ip, sizeof(m_ip) - 1);
+    ip_address_t::parse(m_ip, m_address);
+}
+
+/*
+ * Set the peer address from accept(), in binary and as text
+ */
+void Client::setAddress(const struct sockaddr * address) {
+    m_address = ip_address_t::fromSockaddr(address);
+    if (inet_ntop(m_address.family, m_address.bytes, m_ip, sizeof(m_ip)) == nullptr) {
+        m_ip[0] = '\0';
+    }
+}
+
+void Client::setErrorMessage(const std::string & msg) {
+    size_t size = std::min(msg.size(), sizeof(m_errorText) - 1);
+    memcpy(m_errorText, msg.data(), size);
+    m_errorText[size] = '\0';
+    m_errorMsg = nullptr;
+}
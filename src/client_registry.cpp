@@ -0,0 +1,197 @@
+
+
+#include "../include/client_registry.h"
+#include <new>
+
+
+ClientRegistry::ClientRegistry() : m_highWater(0), m_freeHead(0), m_size(0) {
+    for (uint32_t i=0; i<MAX_CHUNKS; i++) {
+        m_chunks[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+/*
+ * Destroy remaining clients. Must not race with any other
+ * registry call.
+ */
+ClientRegistry::~ClientRegistry() {
+    uint32_t highWater = m_highWater.load();
+    for (uint32_t index=0; index<highWater; index++) {
+        slot_t * slot = slotAt(index);
+        if (slot != nullptr && (slot->state.load() & (LIVE_BIT | REFS_MASK))) {
+            if (m_reclaimHandler) {
+                m_reclaimHandler(*slot->client());
+            }
+            slot->client()->~Client();
+        }
+    }
+    for (uint32_t i=0; i<MAX_CHUNKS; i++) {
+        delete [] m_chunks[i].load();
+    }
+}
+
+ClientRegistry::slot_t * ClientRegistry::slotAt(uint32_t index) const {
+    slot_t * chunk = m_chunks[index / CHUNK_SIZE].load(std::memory_order_acquire);
+    if (chunk == nullptr) {
+        return nullptr;
+    }
+    return &chunk[index % CHUNK_SIZE];
+}
+
+/*
+ * Slot of a used index: its chunk was published before the index
+ * could be handed out, so unlike slotAt() this never returns nullptr
+ */
+ClientRegistry::slot_t * ClientRegistry::usedSlotAt(uint32_t index) const {
+    return m_chunks[index / CHUNK_SIZE].load(std::memory_order_acquire) + index % CHUNK_SIZE;
+}
+
+/*
+ * Pop a slot from the free list, or take a never used one.
+ * Chunks are allocated on first use of their first slot; a thread
+ * losing the race to publish a chunk frees its own copy.
+ */
+ClientRegistry::slot_t * ClientRegistry::allocateSlot(uint32_t & index) {
+    uint64_t head = m_freeHead.load(std::memory_order_acquire);
+    while ((uint32_t)head != 0) {
+        index = (uint32_t)head - 1;
+        // a slot on the free list always has its chunk
+        slot_t * slot = usedSlotAt(index);
+        uint32_t next = slot->nextFree.load(std::memory_order_relaxed);
+        uint64_t newHead = (((head >> 32) + 1) << 32) | (next == NO_SLOT ? 0 : next + 1);
+        if (m_freeHead.compare_exchange_weak(head, newHead, std::memory_order_acq_rel)) {
+            return slot;
+        }
+    }
+
+    index = m_highWater.load(std::memory_order_relaxed);
+    do {
+        if (index >= CHUNK_SIZE * MAX_CHUNKS) {
+            return nullptr;
+        }
+    } while (!m_highWater.compare_exchange_weak(index, index + 1, std::memory_order_acq_rel));
+
+    uint32_t chunkIndex = index / CHUNK_SIZE;
+    slot_t * chunk = m_chunks[chunkIndex].load(std::memory_order_acquire);
+    if (chunk == nullptr) {
+        slot_t * newChunk = new slot_t[CHUNK_SIZE];
+        for (uint32_t i=0; i<CHUNK_SIZE; i++) {
+            newChunk[i].state.store(makeId(1, 0), std::memory_order_relaxed);
+            newChunk[i].nextFree.store(NO_SLOT, std::memory_order_relaxed);
+        }
+        if (m_chunks[chunkIndex].compare_exchange_strong(chunk, newChunk, std::memory_order_acq_rel)) {
+            chunk = newChunk;
+        } else {
+            delete [] newChunk;
+        }
+    }
+    return &chunk[index % CHUNK_SIZE];
+}
+
+void ClientRegistry::pushFree(uint32_t index) {
+    slot_t * slot = usedSlotAt(index);
+    uint64_t head = m_freeHead.load(std::memory_order_acquire);
+    uint64_t newHead;
+    do {
+        slot->nextFree.store((uint32_t)head == 0 ? NO_SLOT : (uint32_t)head - 1, std::memory_order_relaxed);
+        newHead = (((head >> 32) + 1) << 32) | (index + 1);
+    } while (!m_freeHead.compare_exchange_weak(head, newHead, std::memory_order_acq_rel));
+}
+
+/*
+ * Store a copy of client in a free slot and mark it live.
+ * The stored client gets its id assigned.
+ * Return nullptr if the registry is full.
+ */
+Client * ClientRegistry::insert(const Client & client) {
+    uint32_t index;
+    slot_t * slot = allocateSlot(index);
+    if (slot == nullptr) {
+        return nullptr;
+    }
+    uint32_t generation = generationOf(slot->state.load(std::memory_order_relaxed));
+    Client * stored = new (slot->storage) Client(client);
+    stored->m_id = makeId(generation, index);
+    slot->state.store(((uint64_t)generation << 32) | LIVE_BIT | 1, std::memory_order_release);
+    m_size.fetch_add(1, std::memory_order_relaxed);
+    return stored;
+}
+
+/*
+ * Take a reference on a live client.
+ * Return nullptr if id does not denote a live client anymore.
+ */
+Client * ClientRegistry::acquire(client_id_t id) {
+    uint32_t index = indexOf(id);
+    if (index >= m_highWater.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+    slot_t * slot = slotAt(index);
+    if (slot == nullptr) {
+        return nullptr;
+    }
+    uint64_t state = slot->state.load(std::memory_order_acquire);
+    do {
+        if (generationOf(state) != generationOf(id) || !(state & LIVE_BIT)) {
+            return nullptr;
+        }
+    } while (!slot->state.compare_exchange_weak(state, state + 1, std::memory_order_acq_rel));
+    return slot->client();
+}
+
+void ClientRegistry::release(Client * client) {
+    uint32_t index = indexOf(client->getId());
+    slot_t * slot = usedSlotAt(index);
+    uint64_t state = slot->state.fetch_sub(1, std::memory_order_acq_rel) - 1;
+    if ((state & (LIVE_BIT | REFS_MASK)) == 0) {
+        reclaim(slot, index);
+    }
+}
+
+/*
+ * Unregister a client. New acquire() calls fail right away, the
+ * client itself is reclaimed once all references are released.
+ * Return false if the client was already removed.
+ */
+bool ClientRegistry::remove(client_id_t id) {
+    uint32_t index = indexOf(id);
+    if (index >= m_highWater.load(std::memory_order_acquire)) {
+        return false;
+    }
+    slot_t * slot = slotAt(index);
+    if (slot == nullptr) {
+        return false;
+    }
+    uint64_t state = slot->state.load(std::memory_order_acquire);
+    uint64_t newState;
+    do {
+        if (generationOf(state) != generationOf(id) || !(state & LIVE_BIT)) {
+            return false;
+        }
+        // clear the live bit and drop the reference it stood for
+        newState = (state & ~LIVE_BIT) - 1;
+    } while (!slot->state.compare_exchange_weak(state, newState, std::memory_order_acq_rel));
+    m_size.fetch_sub(1, std::memory_order_relaxed);
+
+    if ((newState & REFS_MASK) == 0) {
+        reclaim(slot, index);
+    }
+    return true;
+}
+
+/*
+ * Last reference is gone: release client resources, destroy it
+ * and recycle the slot under the next generation.
+ */
+void ClientRegistry::reclaim(slot_t * slot, uint32_t index) {
+    if (m_reclaimHandler) {
+        m_reclaimHandler(*slot->client());
+    }
+    slot->client()->~Client();
+    uint32_t generation = generationOf(slot->state.load(std::memory_order_relaxed)) + 1;
+    if (generation == 0 || generation == 0xFFFFFFFF) { // generation 0 is never a valid client id
+        generation = 1;
+    }
+    slot->state.store((uint64_t)generation << 32, std::memory_order_release);
+    pushFree(index);
+}
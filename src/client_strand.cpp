@@ -0,0 +1,118 @@
+#include "../include/client_strand.h"
+
+
+ClientStrand::ClientStrand(StrandHandler * handler, WorkerPool * pool, Client * client) :
+    m_handler(handler), m_pool(pool), m_client(client), m_head(&m_stub), m_tail(&m_stub), m_scheduled(false) {
+    m_stub.next.store(nullptr, std::memory_order_relaxed);
+}
+
+/*
+ * Drop messages never delivered
+ */
+ClientStrand::~ClientStrand() {
+    node_t * node;
+    while ((node = pop()) != nullptr) {
+        delete node;
+    }
+}
+
+/*
+ * Queue a message and make sure a worker will deliver it
+ */
+void ClientStrand::post(const Payload & buffer, const char * msg, size_t size) {
+    node_t * node = new node_t();
+    node->buffer = buffer;
+    node->msg = msg;
+    node->size = size;
+    node->disconnected = false;
+    push(node);
+    if (!m_scheduled.exchange(true, std::memory_order_seq_cst)) {
+        m_handler->onStrandScheduled(*m_client);
+        m_pool->submit(this);
+    }
+}
+
+/*
+ * Queue the client disconnection, delivered after its last message
+ */
+void ClientStrand::postDisconnected() {
+    node_t * node = new node_t();
+    node->msg = nullptr;
+    node->size = 0;
+    node->disconnected = true;
+    push(node);
+    if (!m_scheduled.exchange(true, std::memory_order_seq_cst)) {
+        m_handler->onStrandScheduled(*m_client);
+        m_pool->submit(this);
+    }
+}
+
+/*
+ * Deliver up to BATCH_SIZE messages, then either stay scheduled
+ * if more are waiting or go idle.
+ */
+void ClientStrand::run() {
+    for (int i=0; i<BATCH_SIZE; i++) {
+        node_t * node = pop();
+        if (node == nullptr) {
+            break;
+        }
+        if (node->disconnected) {
+            m_handler->onStrandDisconnected(*m_client);
+        } else {
+            m_handler->onStrandMessage(*m_client, node->msg, node->size);
+        }
+        delete node;
+    }
+
+    // a producer finding the strand scheduled relies on this run to see its
+    // message. Once unscheduled, another worker may own m_tail: read it before.
+    bool queued = m_tail != &m_stub;
+    m_scheduled.store(false, std::memory_order_seq_cst);
+    if ((queued || m_head.load(std::memory_order_seq_cst) != &m_stub) &&
+        !m_scheduled.exchange(true, std::memory_order_seq_cst)) {
+        m_pool->submit(this);
+        return;
+    }
+    StrandHandler * handler = m_handler;
+    Client * client = m_client;
+    handler->onStrandIdle(*client);
+}
+
+void ClientStrand::push(node_t * node) {
+    node->next.store(nullptr, std::memory_order_relaxed);
+    node_t * prev = m_head.exchange(node, std::memory_order_seq_cst);
+    prev->next.store(node, std::memory_order_release);
+}
+
+/*
+ * Take the oldest message off the queue. Return nullptr if the
+ * queue is empty, or if the next message is still being pushed.
+ */
+ClientStrand::node_t * ClientStrand::pop() {
+    node_t * tail = m_tail;
+    node_t * next = tail->next.load(std::memory_order_acquire);
+    if (tail == &m_stub) {
+        if (next == nullptr) {
+            return nullptr;
+        }
+        m_tail = next;
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next != nullptr) {
+        m_tail = next;
+        return tail;
+    }
+    if (tail != m_head.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+    // tail is the last message: put the stub behind it to take it off
+    push(&m_stub);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next != nullptr) {
+        m_tail = next;
+        return tail;
+    }
+    return nullptr;
+}
@@ -0,0 +1,277 @@
+
+
+#include "../include/compression.h"
+#include <limits.h>
+#include <string.h>
+#include <algorithm>
+
+#ifdef INTERCOM_HAVE_COMPRESSION
+#include <zlib.h>
+#endif
+
+// first byte of the body of a message
+enum compression_flag_t {
+    COMPRESSION_NONE = 0,
+    COMPRESSION_DEFLATE = 1,
+};
+
+/*
+ * Have buffer hold at least size bytes, giving back the
+ * memory a past large message took once it is not needed
+ */
+static void reserve(char *& buffer, size_t & capacity, size_t size) {
+    if (capacity >= size && (capacity <= MAX_RECEIVE_SIZE || size > MAX_RECEIVE_SIZE)) {
+        return;
+    }
+    delete[] buffer;
+    capacity = std::max(size, (size_t)MAX_PACKET_SIZE);
+    buffer = new char[capacity];
+}
+
+size_t encodeMessageHeader(framing_mode_t mode, bool compression, size_t msgSize, char * header) {
+    if (!compression) {
+        return encodeFrameHeader(mode, msgSize, header);
+    }
+    size_t headerSize = encodeFrameHeader(mode, msgSize + 1, header);
+    header[headerSize++] = COMPRESSION_NONE;
+    return headerSize;
+}
+
+pipe_ret_t checkCompression(const compression_config_t & config, framing_mode_t mode) {
+    pipe_ret_t ret;
+    ret.success = false;
+#ifndef INTERCOM_HAVE_COMPRESSION
+    ret.msg = ret.reason = "Compression support was not built in";
+    return ret;
+#endif
+    if (mode == FRAMING_NONE) {
+        ret.msg = ret.reason = "Compression needs message framing";
+        return ret;
+    }
+    if (config.level < 1 || config.level > 9) {
+        ret.msg = ret.reason = "Compression level must be between 1 and 9";
+        return ret;
+    }
+    ret.success = true;
+    return ret;
+}
+
+Payload Compressor::encode(const char * msg, size_t size) {
+    // frame header, flag and size of the message
+    char header[MAX_MESSAGE_HEADER_SIZE + MAX_FRAME_HEADER_SIZE];
+    if (size >= m_config.minSize) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        size_t compressedSize;
+        if (deflateLocked(msg, size, compressedSize)) {
+            char sizeHeader[MAX_FRAME_HEADER_SIZE];
+            size_t sizeHeaderSize = encodeFrameHeader(FRAMING_VARINT, size, sizeHeader);
+            if (sizeHeaderSize + compressedSize < size) {
+                size_t headerSize = encodeFrameHeader(m_mode, 1 + sizeHeaderSize + compressedSize, header);
+                header[headerSize++] = COMPRESSION_DEFLATE;
+                memcpy(header + headerSize, sizeHeader, sizeHeaderSize);
+                headerSize += sizeHeaderSize;
+                return Payload(header, headerSize, m_buffer, compressedSize);
+            }
+        }
+    }
+    size_t headerSize = encodeMessageHeader(m_mode, true, size, header);
+    return Payload(header, headerSize, msg, size);
+}
+
+bool Decompressor::decode(struct iovec * messages, size_t count) {
+    // room for all the inflated messages, which are published together
+    size_t total = 0;
+    for (size_t i=0; i<count; i++) {
+        const char * data;
+        size_t dataSize;
+        size_t size;
+        int kind = parse((const char *)messages[i].iov_base, messages[i].iov_len, data, dataSize, size);
+        if (kind == -1) {
+            return false;
+        }
+        if (kind == COMPRESSION_DEFLATE) {
+            total += size;
+        }
+    }
+    char * out = total > 0 ? claim(total) : nullptr;
+    for (size_t i=0; i<count; i++) {
+        const char * data;
+        size_t dataSize;
+        size_t size;
+        if (parse((const char *)messages[i].iov_base, messages[i].iov_len, data, dataSize, size) == COMPRESSION_DEFLATE) {
+            if (!inflateMessage(data, dataSize, out, size)) {
+                return false;
+            }
+            data = out;
+            out += size;
+        }
+        messages[i].iov_base = (void *)data;
+        messages[i].iov_len = size;
+    }
+    return true;
+}
+
+bool Decompressor::decode(const char * body, size_t bodySize, const char *& msg, size_t & size, bool & inflated) {
+    const char * data;
+    size_t dataSize;
+    int kind = parse(body, bodySize, data, dataSize, size);
+    inflated = kind == COMPRESSION_DEFLATE;
+    if (kind == COMPRESSION_NONE) {
+        msg = data;
+        return true;
+    }
+    if (kind == -1) {
+        return false;
+    }
+    char * out = claim(size);
+    msg = out;
+    return inflateMessage(data, dataSize, out, size);
+}
+
+/*
+ * Room for size bytes in m_storage, behind the messages inflated
+ * before as long as the buffer is referenced, otherwise from its start.
+ * A buffer grown for a large message is given back once it is not
+ * needed anymore, like the one of the compressor.
+ */
+char * Decompressor::claim(size_t size) {
+    if (!m_storage.shared()) {
+        m_used = 0;
+    }
+    bool oversized = m_used == 0 && m_storage.size() > MAX_RECEIVE_SIZE && size <= MAX_RECEIVE_SIZE;
+    if (m_storage.size() - m_used < size || oversized) {
+        m_storage = Payload::allocate(std::max(size, (size_t)MAX_PACKET_SIZE));
+        m_used = 0;
+    }
+    // past the bytes others may read: writing there is safe while shared
+    char * out = m_storage.mutableData() + m_used;
+    m_used += size;
+    return out;
+}
+
+/*
+ * Split the body of a message into its flag, returned, and the data
+ * that follows: the message if sent as is, otherwise the deflated
+ * message of the given size.
+ * Return -1 if the body is malformed.
+ */
+int Decompressor::parse(const char * body, size_t bodySize, const char *& data, size_t & dataSize, size_t & size) {
+    if (bodySize == 0) {
+        return -1;
+    }
+    if (body[0] == COMPRESSION_NONE) {
+        data = body + 1;
+        dataSize = bodySize - 1;
+        size = dataSize;
+        return COMPRESSION_NONE;
+    }
+    if (body[0] != COMPRESSION_DEFLATE) {
+        return -1;
+    }
+    size_t sizeHeaderSize;
+    if (decodeFrameHeader(FRAMING_VARINT, body + 1, bodySize - 1, size, sizeHeaderSize) != 1 ||
+        size == 0 || size > m_maxMessageSize) {
+        return -1;
+    }
+    data = body + 1 + sizeHeaderSize;
+    dataSize = bodySize - 1 - sizeHeaderSize;
+    return COMPRESSION_DEFLATE;
+}
+
+#ifdef INTERCOM_HAVE_COMPRESSION
+
+Compressor::~Compressor() {
+    if (m_stream != nullptr) {
+        deflateEnd(m_stream);
+        delete m_stream;
+    }
+    delete[] m_buffer;
+}
+
+/*
+ * Deflate msg into m_buffer, provided it shrinks.
+ * Return false if it does not.
+ */
+bool Compressor::deflateLocked(const char * msg, size_t size, size_t & compressedSize) {
+    if (size > UINT_MAX) {
+        return false;
+    }
+    if (m_stream == nullptr) {
+        m_stream = new z_stream();
+        if (deflateInit2(m_stream, m_config.level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            delete m_stream;
+            m_stream = nullptr;
+            return false;
+        }
+    } else if (deflateReset(m_stream) != Z_OK) {
+        return false;
+    }
+    if (!m_config.dictionary.empty()) {
+        deflateSetDictionary(m_stream, (const Bytef *)m_config.dictionary.data(), (uInt)m_config.dictionary.size());
+    }
+    reserve(m_buffer, m_capacity, size);
+    m_stream->next_in = (Bytef *)msg;
+    m_stream->avail_in = (uInt)size;
+    m_stream->next_out = (Bytef *)m_buffer;
+    // no room for more than the message: not worth it then
+    m_stream->avail_out = (uInt)size;
+    if (deflate(m_stream, Z_FINISH) != Z_STREAM_END) {
+        return false;
+    }
+    compressedSize = size - m_stream->avail_out;
+    return true;
+}
+
+Decompressor::~Decompressor() {
+    if (m_stream != nullptr) {
+        inflateEnd(m_stream);
+        delete m_stream;
+    }
+}
+
+/*
+ * Inflate data into msg, which it must fill exactly
+ */
+bool Decompressor::inflateMessage(const char * data, size_t dataSize, char * msg, size_t size) {
+    if (dataSize > UINT_MAX || size > UINT_MAX) {
+        return false;
+    }
+    if (m_stream == nullptr) {
+        m_stream = new z_stream();
+        if (inflateInit2(m_stream, -MAX_WBITS) != Z_OK) {
+            delete m_stream;
+            m_stream = nullptr;
+            return false;
+        }
+    } else if (inflateReset(m_stream) != Z_OK) {
+        return false;
+    }
+    if (!m_config.dictionary.empty()) {
+        inflateSetDictionary(m_stream, (const Bytef *)m_config.dictionary.data(), (uInt)m_config.dictionary.size());
+    }
+    m_stream->next_in = (Bytef *)data;
+    m_stream->avail_in = (uInt)dataSize;
+    m_stream->next_out = (Bytef *)msg;
+    m_stream->avail_out = (uInt)size;
+    return inflate(m_stream, Z_FINISH) == Z_STREAM_END &&
+           m_stream->avail_out == 0 && m_stream->avail_in == 0;
+}
+
+#else
+
+Compressor::~Compressor() {
+    delete[] m_buffer;
+}
+
+bool Compressor::deflateLocked(const char *, size_t, size_t &) {
+    return false;
+}
+
+Decompressor::~Decompressor() {
+}
+
+bool Decompressor::inflateMessage(const char *, size_t, char *, size_t) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,109 @@
+
+
+#include "../include/connection_limiter.h"
+#include <string.h>
+#include <random>
+
+static const size_t INITIAL_ENTRIES = 64;
+
+
+ConnectionLimiter::ConnectionLimiter(uint maxConnections, uint maxPerAddress) :
+    m_maxConnections(maxConnections), m_maxPerAddress(maxPerAddress) {
+    if (maxPerAddress > 0) {
+        m_entries.resize(INITIAL_ENTRIES);
+    }
+    std::random_device random;
+    m_seed = ((uint64_t)random() << 32) | random();
+}
+
+bool ConnectionLimiter::admit(const ip_address_t & address) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (m_maxConnections > 0 && m_connections >= m_maxConnections) {
+        return false;
+    }
+    if (m_maxPerAddress > 0 && address.family != AF_UNSPEC) {
+        size_t index = find(address);
+        if (m_entries[index].count >= m_maxPerAddress) {
+            return false;
+        }
+        if (m_entries[index].count == 0) {
+            if ((m_used + 1) * 2 > m_entries.size()) {
+                grow();
+                index = find(address);
+            }
+            m_entries[index].address = address;
+            m_used++;
+        }
+        m_entries[index].count++;
+    }
+    m_connections++;
+    return true;
+}
+
+void ConnectionLimiter::release(const ip_address_t & address) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_connections--;
+    if (m_maxPerAddress == 0 || address.family == AF_UNSPEC) {
+        return;
+    }
+    size_t index = find(address);
+    if (m_entries[index].count == 0 || --m_entries[index].count > 0) {
+        return;
+    }
+    // move back the entries which probed past the freed one, so
+    // lookups never have to skip over free entries
+    m_used--;
+    size_t mask = m_entries.size() - 1;
+    size_t hole = index;
+    for (size_t next = (hole + 1) & mask; m_entries[next].count != 0; next = (next + 1) & mask) {
+        size_t home = slotOf(m_entries[next].address);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            m_entries[hole] = m_entries[next];
+            hole = next;
+        }
+    }
+    m_entries[hole].count = 0;
+}
+
+size_t ConnectionLimiter::connections() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_connections;
+}
+
+/*
+ * Seeded hash of an address, as the slot it belongs in
+ */
+size_t ConnectionLimiter::slotOf(const ip_address_t & address) const {
+    uint64_t words[2] = { 0, 0 };
+    memcpy(words, address.bytes, address.size());
+    uint64_t hash = m_seed ^ address.family;
+    for (int i=0; i<2; i++) {
+        hash = (hash ^ words[i]) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 32;
+    }
+    hash *= 0xBF58476D1CE4E5B9ULL;
+    hash ^= hash >> 29;
+    return (size_t)hash & (m_entries.size() - 1);
+}
+
+/*
+ * Entry of address, or the free entry it would take
+ */
+size_t ConnectionLimiter::find(const ip_address_t & address) const {
+    size_t mask = m_entries.size() - 1;
+    size_t index = slotOf(address);
+    while (m_entries[index].count != 0 && !(m_entries[index].address == address)) {
+        index = (index + 1) & mask;
+    }
+    return index;
+}
+
+void ConnectionLimiter::grow() {
+    std::vector<entry_t> entries(m_entries.size() * 2);
+    entries.swap(m_entries);
+    for (size_t i=0; i<entries.size(); i++) {
+        if (entries[i].count != 0) {
+            m_entries[find(entries[i].address)] = entries[i];
+        }
+    }
+}
@@ -0,0 +1,282 @@
+
+
+#include "../include/event_loop.h"
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+
+EventLoop::EventLoop() : m_stop(false), m_threadId(std::thread::id()) {
+}
+
+EventLoop::~EventLoop() {
+    if (m_thread != nullptr && isInLoopThread()) {
+        m_thread->detach();
+        delete m_thread;
+        m_thread = nullptr;
+    }
+    stop();
+    if (m_wakeupfd != -1) {
+        close(m_wakeupfd);
+        m_wakeupfd = -1;
+    }
+    if (m_epollfd != -1) {
+        close(m_epollfd);
+        m_epollfd = -1;
+    }
+    delete m_uring;
+    m_uring = nullptr;
+}
+
+/*
+ * Create the epoll instance and the wakeup eventfd used by post()
+ * and stop() to interrupt epoll_wait.
+ */
+pipe_ret_t EventLoop::init(EventHandler * handler) {
+    pipe_ret_t ret;
+    m_handler = handler;
+
+    m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epollfd == -1) { // epoll_create failed
+        ret.success = false;
+        ret.msg = ret.reason = strerror(errno);
+        return ret;
+    }
+    m_wakeupfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wakeupfd == -1) { // eventfd failed
+        ret.success = false;
+        ret.msg = ret.reason = strerror(errno);
+        return ret;
+    }
+    if (!add(m_wakeupfd, EPOLLIN | EPOLLET, WAKEUP_TOKEN)) {
+        ret.success = false;
+        ret.msg = ret.reason = strerror(errno);
+        return ret;
+    }
+    ret.success = true;
+    return ret;
+}
+
+/*
+ * Create the io_uring, with a ring of buffers provided for multishot
+ * receives, instead of the epoll instance. The wakeup eventfd is read
+ * through the ring, and is blocking since io_uring would otherwise
+ * complete the read right away with EAGAIN.
+ */
+pipe_ret_t EventLoop::initUring(EventHandler * handler, unsigned entries, unsigned buffers, size_t bufferSize) {
+    pipe_ret_t ret;
+    m_handler = handler;
+
+    m_uring = new IoUring();
+    ret = m_uring->init(entries);
+    if (!ret.success) {
+        return ret;
+    }
+    ret = m_uring->initBuffers(buffers, bufferSize);
+    if (!ret.success) {
+        return ret;
+    }
+    m_wakeupfd = eventfd(0, EFD_CLOEXEC);
+    if (m_wakeupfd == -1) { // eventfd failed
+        ret.success = false;
+        ret.msg = ret.reason = strerror(errno);
+        return ret;
+    }
+    ret.success = true;
+    return ret;
+}
+
+/*
+ * Spawn the loop thread, optionally pinned to a cpu core
+ */
+pipe_ret_t EventLoop::start(int cpu) {
+    pipe_ret_t ret;
+    if (m_epollfd == -1 && m_uring == nullptr) {
+        ret.success = false;
+        ret.msg = ret.reason = "event loop is not initialized";
+        return ret;
+    }
+    m_stop = false;
+    m_thread = new std::thread(&EventLoop::run, this);
+    if (cpu >= 0) {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(cpu, &cpuSet);
+        int affinityRet = pthread_setaffinity_np(m_thread->native_handle(), sizeof(cpuSet), &cpuSet);
+        if (affinityRet != 0) {
+            ret.success = false;
+            ret.msg = ret.reason = strerror(affinityRet);
+            return ret;
+        }
+    }
+    ret.success = true;
+    return ret;
+}
+
+/*
+ * Ask the loop thread to exit and wait for it. When called from
+ * the loop thread itself the loop exits after the current dispatch
+ * and the thread is joined by the next stop() or by the destructor.
+ * Safe to call more than once.
+ */
+void EventLoop::stop() {
+    m_stop = true;
+    if (m_thread == nullptr) {
+        return;
+    }
+    wakeup();
+    if (isInLoopThread()) {
+        return;
+    }
+    m_thread->join();
+    delete m_thread;
+    m_thread = nullptr;
+}
+
+bool EventLoop::add(int fd, uint32_t events, uint64_t token) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = token;
+    return epoll_ctl(m_epollfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+bool EventLoop::modify(int fd, uint32_t events, uint64_t token) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = token;
+    return epoll_ctl(m_epollfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+bool EventLoop::remove(int fd) {
+    struct epoll_event ev; // ignored, but required by kernels < 2.6.9
+    return epoll_ctl(m_epollfd, EPOLL_CTL_DEL, fd, &ev) == 0;
+}
+
+/*
+ * Queue a task to be executed on the loop thread
+ * during the next loop iteration.
+ */
+void EventLoop::post(const std::function<void()> & task) {
+    {
+        std::lock_guard<std::mutex> lock(m_tasksMtx);
+        m_tasks.push_back(task);
+    }
+    wakeup();
+}
+
+/*
+ * Have the handler receive events for token on the loop thread, as if
+ * epoll reported them. Unlike post() this does not allocate, so it is
+ * suited to per-message notifications.
+ */
+void EventLoop::inject(uint64_t token, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = token;
+    bool wasEmpty;
+    {
+        std::lock_guard<std::mutex> lock(m_tasksMtx);
+        wasEmpty = m_injected.empty();
+        m_injected.push_back(ev);
+    }
+    if (wasEmpty) { // otherwise the loop was already woken up
+        wakeup();
+    }
+}
+
+void EventLoop::wakeup() {
+    uint64_t one = 1;
+    ssize_t written = write(m_wakeupfd, &one, sizeof(one));
+    (void)written; // counter overflow only means a wakeup is already pending
+}
+
+void EventLoop::runPendingTasks() {
+    {
+        std::lock_guard<std::mutex> lock(m_tasksMtx);
+        m_runningTasks.swap(m_tasks);
+        m_injectedEvents.swap(m_injected);
+    }
+    for (size_t i=0; i<m_injectedEvents.size(); i++) {
+        m_handler->onEvents(m_injectedEvents[i].data.u64, m_injectedEvents[i].events);
+    }
+    m_injectedEvents.clear();
+    for (size_t i=0; i<m_runningTasks.size(); i++) {
+        m_runningTasks[i]();
+    }
+    m_runningTasks.clear();
+}
+
+/*
+ * Loop thread body: wait for ready descriptors and dispatch
+ * them to the handler until stop() is called.
+ */
+void EventLoop::run() {
+    // before anything runs on this thread that could ask isInLoopThread()
+    m_threadId.store(std::this_thread::get_id(), std::memory_order_release);
+    if (m_uring != nullptr) {
+        runUring();
+        return;
+    }
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!m_stop) {
+        int numEvents = epoll_wait(m_epollfd, events, MAX_EVENTS, m_timers.timeout(TimerWheel::clockMs()));
+        if (numEvents == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i=0; i<numEvents; i++) {
+            if (events[i].data.u64 == WAKEUP_TOKEN) {
+                uint64_t counter;
+                while (read(m_wakeupfd, &counter, sizeof(counter)) > 0) {}
+                continue;
+            }
+            m_handler->onEvents(events[i].data.u64, events[i].events);
+        }
+        runPendingTasks();
+        runTimers();
+    }
+    runPendingTasks();
+}
+
+/*
+ * io_uring flavour of run(): submit what the handler queued, wait for
+ * completions and dispatch them, one io_uring_enter() per iteration
+ */
+void EventLoop::runUring() {
+    m_uring->prepareRead(m_wakeupfd, &m_wakeupCounter, sizeof(m_wakeupCounter), WAKEUP_TOKEN);
+
+    while (!m_stop) {
+        int submitRet = m_uring->submit(1, m_timers.timeout(TimerWheel::clockMs()));
+        if (submitRet < 0 && submitRet != -EINTR && submitRet != -EBUSY && submitRet != -ETIME) {
+            break;
+        }
+        uring_completion_t completion;
+        while (m_uring->nextCompletion(completion)) {
+            if (completion.token == WAKEUP_TOKEN) {
+                m_uring->prepareRead(m_wakeupfd, &m_wakeupCounter, sizeof(m_wakeupCounter), WAKEUP_TOKEN);
+                continue;
+            }
+            m_handler->onCompletion(*m_uring, completion);
+        }
+        runPendingTasks();
+        runTimers();
+    }
+    runPendingTasks();
+}
+
+void EventLoop::runTimers() {
+    if (m_timers.size() == 0) {
+        return;
+    }
+    uint64_t now = TimerWheel::clockMs();
+    uint64_t token;
+    while (m_timers.nextExpired(now, token)) {
+        m_handler->onTimer(token);
+    }
+}
@@ -0,0 +1,131 @@
+
+
+#include "../include/framing.h"
+#include "../include/memory_pool.h"
+#include <string.h>
+#include <algorithm>
+
+
+size_t encodeFrameHeader(framing_mode_t mode, size_t msgSize, char * header) {
+    if (mode == FRAMING_FIXED32) {
+        header[0] = (char)((msgSize >> 24) & 0xFF);
+        header[1] = (char)((msgSize >> 16) & 0xFF);
+        header[2] = (char)((msgSize >> 8) & 0xFF);
+        header[3] = (char)(msgSize & 0xFF);
+        return 4;
+    }
+    if (mode == FRAMING_VARINT) {
+        size_t headerSize = 0;
+        uint64_t value = msgSize;
+        do {
+            uint8_t byte = value & 0x7F;
+            value >>= 7;
+            if (value != 0) {
+                byte |= 0x80;
+            }
+            header[headerSize++] = (char)byte;
+        } while (value != 0);
+        return headerSize;
+    }
+    return 0;
+}
+
+int decodeFrameHeader(framing_mode_t mode, const char * data, size_t available,
+                      size_t & msgSize, size_t & headerSize) {
+    if (mode == FRAMING_FIXED32) {
+        if (available < 4) {
+            return 0;
+        }
+        const uint8_t * bytes = (const uint8_t *)data;
+        msgSize = ((size_t)bytes[0] << 24) | ((size_t)bytes[1] << 16) |
+                  ((size_t)bytes[2] << 8) | (size_t)bytes[3];
+        headerSize = 4;
+        return 1;
+    }
+    if (mode == FRAMING_VARINT) {
+        uint64_t value = 0;
+        for (size_t i=0; i<MAX_FRAME_HEADER_SIZE; i++) {
+            if (i == available) {
+                return 0;
+            }
+            uint8_t byte = (uint8_t)data[i];
+            value |= (uint64_t)(byte & 0x7F) << (7 * i);
+            if (!(byte & 0x80)) {
+                msgSize = value;
+                headerSize = i + 1;
+                return 1;
+            }
+        }
+        return -1; // varint longer than 64 bits
+    }
+    return -1;
+}
+
+
+FrameBuffer::FrameBuffer(size_t capacity) {
+    // fill a pool block of capacity bytes
+    reserve(capacity > Payload::BLOCK_OVERHEAD ? capacity - Payload::BLOCK_OVERHEAD : capacity);
+}
+
+/*
+ * Make room at the end of the buffer for the next recv(). The
+ * partial frame at head is moved to the front, and the buffer is
+ * grown if that frame does not fit in it at all, or if the last
+ * read filled it: more is likely waiting in the socket.
+ */
+char * FrameBuffer::writePtr() {
+    if (m_filled && m_capacity < MAX_RECEIVE_SIZE && !m_storage.shared()) {
+        m_filled = false;
+        reserve(std::min(m_capacity * 2, (size_t)MAX_RECEIVE_SIZE));
+    }
+    if (m_tail == m_capacity || (m_needed > 0 && m_head + m_needed > m_capacity)) {
+        if (m_storage.shared()) {
+            // handed out messages still point into the buffer
+            size_t size = m_needed > m_capacity ? m_needed : m_capacity;
+            if (m_head == 0 && m_tail == m_capacity) {
+                size = m_capacity * 2;
+            }
+            relocate(size);
+            return m_data + m_tail;
+        }
+        if (m_needed > m_capacity) {
+            reserve(m_needed);
+        }
+        if (m_head > 0) {
+            memmove(m_data, m_data + m_head, m_tail - m_head);
+            m_tail -= m_head;
+            m_head = 0;
+        }
+        if (m_tail == m_capacity) { // header of the partial frame not even complete
+            reserve(m_capacity * 2);
+        }
+    }
+    return m_data + m_tail;
+}
+
+void FrameBuffer::reserve(size_t size) {
+    if (size <= m_capacity) {
+        return;
+    }
+    Payload storage = Payload::allocate(size);
+    if (m_data != nullptr) {
+        memcpy(storage.mutableData(), m_data, m_tail);
+    }
+    m_storage = std::move(storage);
+    m_data = m_storage.mutableData();
+    m_capacity = m_storage.size();
+}
+
+/*
+ * Continue in a new buffer of at least size bytes, starting
+ * with the partial frame at head
+ */
+void FrameBuffer::relocate(size_t size) {
+    Payload storage = Payload::allocate(size);
+    memcpy(storage.mutableData(), m_data + m_head, m_tail - m_head);
+    m_tail -= m_head;
+    m_head = 0;
+    m_storage = std::move(storage);
+    m_data = m_storage.mutableData();
+    m_capacity = m_storage.size();
+}
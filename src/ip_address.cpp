@@ -0,0 +1,102 @@
+#include "../include/ip_address.h"
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+
+ip_address_t::ip_address_t() : family(AF_UNSPEC) {
+    memset(bytes, 0, sizeof(bytes));
+}
+
+bool ip_address_t::operator ==(const ip_address_t & other) const {
+    return family == other.family && memcmp(bytes, other.bytes, size()) == 0;
+}
+
+/*
+ * Parse a dotted IPv4 or an IPv6 address.
+ * Return false if text is neither.
+ */
+bool ip_address_t::parse(const char * text, ip_address_t & address) {
+    address = ip_address_t();
+    if (inet_pton(AF_INET, text, address.bytes) == 1) {
+        address.family = AF_INET;
+        return true;
+    }
+    struct sockaddr_in6 ipv6;
+    if (inet_pton(AF_INET6, text, &ipv6.sin6_addr) == 1) {
+        ipv6.sin6_family = AF_INET6;
+        address = fromSockaddr((struct sockaddr *)&ipv6);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Address of an accepted peer, AF_UNSPEC if not an IP socket
+ */
+ip_address_t ip_address_t::fromSockaddr(const struct sockaddr * address) {
+    ip_address_t result;
+    if (address->sa_family == AF_INET) {
+        result.family = AF_INET;
+        memcpy(result.bytes, &((const struct sockaddr_in *)address)->sin_addr, 4);
+    } else if (address->sa_family == AF_INET6) {
+        const struct in6_addr & ipv6 = ((const struct sockaddr_in6 *)address)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&ipv6)) {
+            result.family = AF_INET;
+            memcpy(result.bytes, ipv6.s6_addr + 12, 4);
+        } else {
+            result.family = AF_INET6;
+            memcpy(result.bytes, ipv6.s6_addr, 16);
+        }
+    }
+    return result;
+}
+
+bool ip_prefix_t::matches(const ip_address_t & other) const {
+    if (prefixLength == 0) {
+        return true;
+    }
+    if (other.family != address.family) {
+        return false;
+    }
+    uint fullBytes = prefixLength / 8;
+    if (memcmp(address.bytes, other.bytes, fullBytes) != 0) {
+        return false;
+    }
+    uint remainingBits = prefixLength % 8;
+    if (remainingBits == 0) {
+        return true;
+    }
+    uint8_t mask = (uint8_t)(0xFF << (8 - remainingBits));
+    return (address.bytes[fullBytes] & mask) == (other.bytes[fullBytes] & mask);
+}
+
+/*
+ * Parse "address" or "address/length". A bare address must match
+ * exactly. Return false on a malformed address or length.
+ */
+bool ip_prefix_t::parse(const std::string & text, ip_prefix_t & prefix) {
+    prefix = ip_prefix_t();
+    if (text.empty()) {
+        return true;
+    }
+    size_t slash = text.find('/');
+    if (!ip_address_t::parse(text.substr(0, slash).c_str(), prefix.address)) {
+        return false;
+    }
+    uint maxLength = (uint)prefix.address.size() * 8;
+    if (slash == std::string::npos) {
+        prefix.prefixLength = maxLength;
+        return true;
+    }
+    const char * length = text.c_str() + slash + 1;
+    char * end;
+    unsigned long value = strtoul(length, &end, 10);
+    if (*length == '\0' || *end != '\0' || value > maxLength) {
+        return false;
+    }
+    prefix.prefixLength = (uint)value;
+    // "/0" matches any address, of either family
+    return true;
+}
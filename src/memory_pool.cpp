@@ -0,0 +1,226 @@
+
+
+#include "../include/memory_pool.h"
+#include <stdlib.h>
+#include <new>
+
+
+BlockPool::BlockPool(size_t blockSize, size_t blocksPerSlab) :
+    m_blockSize(blockSize < sizeof(free_block_t) ? sizeof(free_block_t) : blockSize),
+    m_blocksPerSlab(blocksPerSlab == 0 ? 1 : blocksPerSlab) {
+}
+
+BlockPool::~BlockPool() {
+    for (size_t i=0; i<m_slabs.size(); i++) {
+        free(m_slabs[i]);
+    }
+}
+
+void * BlockPool::allocate() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (m_freeList == nullptr) {
+        grow();
+    }
+    free_block_t * block = m_freeList;
+    m_freeList = block->next;
+    return block;
+}
+
+void BlockPool::deallocate(void * block) {
+    if (block == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_mtx);
+    free_block_t * freeBlock = static_cast<free_block_t *>(block);
+    freeBlock->next = m_freeList;
+    m_freeList = freeBlock;
+}
+
+BlockPool::free_block_t * BlockPool::allocateBatch(size_t count) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    free_block_t * first = nullptr;
+    for (size_t i=0; i<count; i++) {
+        if (m_freeList == nullptr) {
+            grow();
+        }
+        free_block_t * block = m_freeList;
+        m_freeList = block->next;
+        block->next = first;
+        first = block;
+    }
+    return first;
+}
+
+void BlockPool::deallocateBatch(free_block_t * first, free_block_t * last) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    last->next = m_freeList;
+    m_freeList = first;
+}
+
+/*
+ * Allocate a new slab and thread its blocks onto the free list
+ */
+void BlockPool::grow() {
+    char * slab = (char *)malloc(m_blockSize * m_blocksPerSlab);
+    if (slab == nullptr) {
+        throw std::bad_alloc();
+    }
+    m_slabs.push_back(slab);
+    for (size_t i=0; i<m_blocksPerSlab; i++) {
+        free_block_t * block = reinterpret_cast<free_block_t *>(slab + i * m_blockSize);
+        block->next = m_freeList;
+        m_freeList = block;
+    }
+}
+
+
+namespace {
+
+/*
+ * Free blocks of every size class kept by a thread
+ */
+class ThreadCache {
+
+public:
+    BlockPool::free_block_t * lists[BufferPool::NUM_CLASSES];
+    size_t counts[BufferPool::NUM_CLASSES];
+
+    ThreadCache();
+    ~ThreadCache();
+
+    void * allocate(int sizeClass);
+    void deallocate(int sizeClass, void * block);
+
+private:
+    void spill(int sizeClass, size_t count);
+};
+
+// set once the cache of the thread is destroyed: buffers freed later
+// on, by other thread local or static objects, go to the pools directly
+thread_local bool cacheDestroyed = false;
+thread_local ThreadCache cache;
+
+ThreadCache::ThreadCache() {
+    for (int i=0; i<BufferPool::NUM_CLASSES; i++) {
+        lists[i] = nullptr;
+        counts[i] = 0;
+    }
+}
+
+ThreadCache::~ThreadCache() {
+    for (int i=0; i<BufferPool::NUM_CLASSES; i++) {
+        spill(i, counts[i]);
+    }
+    cacheDestroyed = true;
+}
+
+void * ThreadCache::allocate(int sizeClass) {
+    if (lists[sizeClass] == nullptr) {
+        counts[sizeClass] = BufferPool::batchSize(sizeClass);
+        lists[sizeClass] = BufferPool::pool(sizeClass)->allocateBatch(counts[sizeClass]);
+    }
+    BlockPool::free_block_t * block = lists[sizeClass];
+    lists[sizeClass] = block->next;
+    counts[sizeClass]--;
+    return block;
+}
+
+/*
+ * Keep the block, give a batch back once the cache holds two,
+ * so a thread freeing what others allocate doesn't hoard blocks
+ */
+void ThreadCache::deallocate(int sizeClass, void * block) {
+    BlockPool::free_block_t * freeBlock = static_cast<BlockPool::free_block_t *>(block);
+    freeBlock->next = lists[sizeClass];
+    lists[sizeClass] = freeBlock;
+    size_t batchSize = BufferPool::batchSize(sizeClass);
+    if (++counts[sizeClass] >= 2 * batchSize) {
+        spill(sizeClass, batchSize);
+    }
+}
+
+/*
+ * Give the first count cached blocks of a size class back to its pool
+ */
+void ThreadCache::spill(int sizeClass, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    BlockPool::free_block_t * first = lists[sizeClass];
+    BlockPool::free_block_t * last = first;
+    for (size_t i=1; i<count; i++) {
+        last = last->next;
+    }
+    lists[sizeClass] = last->next;
+    counts[sizeClass] -= count;
+    BufferPool::pool(sizeClass)->deallocateBatch(first, last);
+}
+
+}
+
+
+int BufferPool::sizeClass(size_t size) {
+    if (size > MAX_BLOCK_SIZE) {
+        return -1;
+    }
+    int sizeClass = 0;
+    size_t classSize = MIN_BLOCK_SIZE;
+    while (classSize < size) {
+        classSize <<= 1;
+        sizeClass++;
+    }
+    return sizeClass;
+}
+
+/*
+ * The pools are intentionally never destroyed: buffers may still
+ * be released by static objects during process exit
+ */
+BlockPool * BufferPool::pool(int sizeClass) {
+    static BlockPool * pools[NUM_CLASSES] = {
+        new BlockPool(64, 1024), new BlockPool(128, 512), new BlockPool(256, 256),
+        new BlockPool(512, 128), new BlockPool(1024, 64), new BlockPool(2048, 32),
+        new BlockPool(4096, 16), new BlockPool(8192, 8), new BlockPool(16384, 4),
+        new BlockPool(32768, 2), new BlockPool(65536, 1),
+    };
+    return pools[sizeClass];
+}
+
+/*
+ * 64 KB worth of blocks, 2 to 32 of them: a thread caches
+ * at most 128 KB or 64 blocks per size class
+ */
+size_t BufferPool::batchSize(int sizeClass) {
+    size_t blocks = (64 * 1024) / (MIN_BLOCK_SIZE << sizeClass);
+    return blocks < 2 ? 2 : blocks > 32 ? 32 : blocks;
+}
+
+void * BufferPool::allocate(size_t size, size_t & capacity) {
+    int sizeClass = BufferPool::sizeClass(size);
+    if (sizeClass < 0) {
+        void * block = malloc(size);
+        if (block == nullptr) {
+            throw std::bad_alloc();
+        }
+        capacity = size;
+        return block;
+    }
+    capacity = MIN_BLOCK_SIZE << sizeClass;
+    if (cacheDestroyed) {
+        return pool(sizeClass)->allocate();
+    }
+    return cache.allocate(sizeClass);
+}
+
+void BufferPool::deallocate(void * block, size_t capacity) {
+    int sizeClass = BufferPool::sizeClass(capacity);
+    if (sizeClass < 0) {
+        free(block);
+    } else if (block == nullptr) {
+        return;
+    } else if (cacheDestroyed) {
+        pool(sizeClass)->deallocate(block);
+    } else {
+        cache.deallocate(sizeClass, block);
+    }
+}
@@ -0,0 +1,411 @@
+
+
+#include "../include/memory_transport.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+#include <map>
+#include <new>
+
+const size_t MemoryStream::DEFAULT_RING_SIZE;
+
+/*
+ * Shared state of the two ends of a connection, freed once both
+ * are closed. Its eventfds live as long, so an end can signal its
+ * peer even while the peer is being closed.
+ */
+class MemoryChannel {
+
+public:
+    // rings[i] is read by end i and written by the other
+    SpscRing * rings[2];
+    // readers and writers of rings[i] waiting for it to fill or drain
+    std::atomic<bool> readerWaiting[2];
+    std::atomic<bool> writerWaiting[2];
+    // eventfds[i] wakes up the poller of end i
+    int eventfds[2];
+    std::atomic<bool> shut;
+    // end i shut its writing down
+    std::atomic<bool> writeShut[2];
+    std::atomic<int> references;
+
+    explicit MemoryChannel(size_t ringSize) : shut(false), references(2) {
+        for (int i=0; i<2; i++) {
+            rings[i] = new SpscRing(ringSize);
+            // nothing was read yet: the first write signals
+            readerWaiting[i] = true;
+            writerWaiting[i] = false;
+            writeShut[i] = false;
+            eventfds[i] = -1;
+        }
+    }
+
+    ~MemoryChannel() {
+        for (int i=0; i<2; i++) {
+            delete rings[i];
+            if (eventfds[i] != -1) {
+                ::close(eventfds[i]);
+            }
+        }
+    }
+
+    void signal(int side) {
+        uint64_t one = 1;
+        ssize_t written = ::write(eventfds[side], &one, sizeof(one));
+        (void)written;
+    }
+
+    void clearSignals(int side) {
+        uint64_t counter;
+        ssize_t numRead = ::read(eventfds[side], &counter, sizeof(counter));
+        (void)numRead;
+    }
+};
+
+
+SpscRing::SpscRing(size_t capacity) : m_data(new char[capacity]), m_capacity(capacity), m_head(0), m_tail(0) {
+}
+
+SpscRing::~SpscRing() {
+    delete[] m_data;
+}
+
+void * SpscRing::operator new(size_t size) {
+    void * ptr;
+    if (posix_memalign(&ptr, alignof(SpscRing), size) != 0) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void SpscRing::operator delete(void * ptr) {
+    free(ptr);
+}
+
+/*
+ * Copy everything, or up to the room left, which is only
+ * looked up again once the room known of is too small
+ */
+size_t SpscRing::write(const struct iovec * iov, int iovcnt) {
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    size_t wanted = 0;
+    for (int i=0; i<iovcnt; i++) {
+        wanted += iov[i].iov_len;
+    }
+    size_t room = m_capacity - (tail - m_knownHead);
+    if (room < wanted) {
+        m_knownHead = m_head.load(std::memory_order_acquire);
+        room = m_capacity - (tail - m_knownHead);
+    }
+    size_t written = 0;
+    for (int i=0; i<iovcnt && room > 0; i++) {
+        size_t size = std::min(iov[i].iov_len, room);
+        size_t offset = (tail + written) & (m_capacity - 1);
+        size_t first = std::min(size, m_capacity - offset);
+        memcpy(m_data + offset, iov[i].iov_base, first);
+        memcpy(m_data, (const char *)iov[i].iov_base + first, size - first);
+        written += size;
+        room -= size;
+    }
+    if (written > 0) {
+        m_tail.store(tail + written, std::memory_order_release);
+    }
+    return written;
+}
+
+size_t SpscRing::read(const struct iovec * iov, int iovcnt) {
+    size_t head = m_head.load(std::memory_order_relaxed);
+    size_t wanted = 0;
+    for (int i=0; i<iovcnt; i++) {
+        wanted += iov[i].iov_len;
+    }
+    size_t available = m_knownTail - head;
+    if (available < wanted) {
+        m_knownTail = m_tail.load(std::memory_order_acquire);
+        available = m_knownTail - head;
+    }
+    size_t received = 0;
+    for (int i=0; i<iovcnt && available > 0; i++) {
+        size_t size = std::min(iov[i].iov_len, available);
+        size_t offset = (head + received) & (m_capacity - 1);
+        size_t first = std::min(size, m_capacity - offset);
+        memcpy(iov[i].iov_base, m_data + offset, first);
+        memcpy((char *)iov[i].iov_base + first, m_data, size - first);
+        received += size;
+        available -= size;
+    }
+    if (received > 0) {
+        m_head.store(head + received, std::memory_order_release);
+    }
+    return received;
+}
+
+
+/*
+ * Create the two ends of a new connection
+ */
+pipe_ret_t MemoryStream::createPair(size_t ringSize, MemoryStream *& first, MemoryStream *& second) {
+    pipe_ret_t ret;
+    MemoryChannel * channel = new MemoryChannel(ringSize);
+    for (int i=0; i<2; i++) {
+        channel->eventfds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (channel->eventfds[i] == -1) {
+            ret.success = false;
+            ret.code = errno;
+            ret.msg = ret.reason = strerror(errno);
+            delete channel;
+            return ret;
+        }
+    }
+    first = new MemoryStream(channel, 0);
+    second = new MemoryStream(channel, 1);
+    ret.success = true;
+    return ret;
+}
+
+int MemoryStream::fd() const {
+    return m_channel->eventfds[m_side];
+}
+
+/*
+ * A reader finding the ring empty clears the signals of its eventfd
+ * and flags itself waiting before looking again: the writer either
+ * sees the flag and signals, or wrote before the second look. Same
+ * the other way round for a writer finding the ring full. The fences
+ * order each side's flag against its look at the other's position.
+ */
+ssize_t MemoryStream::readv(const struct iovec * iov, int iovcnt) {
+    MemoryChannel & channel = *m_channel;
+    SpscRing & ring = *channel.rings[m_side];
+    // whatever was written before the shutdown is read first
+    bool shut = channel.shut.load(std::memory_order_acquire) ||
+                channel.writeShut[1 - m_side].load(std::memory_order_acquire);
+    size_t received = ring.read(iov, iovcnt);
+    if (received == 0 && !shut) {
+        channel.clearSignals(m_side);
+        channel.readerWaiting[m_side].store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        shut = channel.shut.load(std::memory_order_acquire) ||
+               channel.writeShut[1 - m_side].load(std::memory_order_acquire);
+        received = ring.read(iov, iovcnt);
+    }
+    if (received == 0) {
+        if (shut) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (channel.writerWaiting[m_side].load(std::memory_order_relaxed) &&
+        channel.writerWaiting[m_side].exchange(false)) {
+        channel.signal(1 - m_side);
+    }
+    return (ssize_t)received;
+}
+
+ssize_t MemoryStream::writev(const struct iovec * iov, int iovcnt) {
+    MemoryChannel & channel = *m_channel;
+    int peer = 1 - m_side;
+    SpscRing & ring = *channel.rings[peer];
+    if (channel.shut.load(std::memory_order_acquire) || channel.writeShut[m_side].load(std::memory_order_acquire)) {
+        errno = EPIPE;
+        return -1;
+    }
+    size_t written = ring.write(iov, iovcnt);
+    if (written == 0) {
+        channel.writerWaiting[peer].store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        written = ring.write(iov, iovcnt);
+        if (written == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (channel.readerWaiting[peer].load(std::memory_order_relaxed) &&
+        channel.readerWaiting[peer].exchange(false)) {
+        channel.signal(peer);
+    }
+    return (ssize_t)written;
+}
+
+/*
+ * Read the range through a buffer, what did not fit in the
+ * ring is read again by the next call
+ */
+ssize_t MemoryStream::sendFile(int fd, off_t * offset, size_t count) {
+    static thread_local char buffer[64 * 1024];
+    ssize_t numRead = pread(fd, buffer, std::min(count, sizeof(buffer)), *offset);
+    if (numRead <= 0) {
+        return numRead;
+    }
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = (size_t)numRead;
+    ssize_t written = writev(&iov, 1);
+    if (written > 0) {
+        *offset += written;
+    }
+    return written;
+}
+
+void MemoryStream::shutdown() {
+    if (!m_channel->shut.exchange(true)) {
+        m_channel->signal(0);
+        m_channel->signal(1);
+    }
+}
+
+void MemoryStream::shutdownWrite() {
+    if (!m_channel->writeShut[m_side].exchange(true)) {
+        m_channel->signal(1 - m_side);
+    }
+}
+
+void MemoryStream::close() {
+    shutdown();
+    if (m_channel->references.fetch_sub(1) == 1) {
+        delete m_channel;
+    }
+    delete this;
+}
+
+
+/*
+ * Listeners by name, looked up by connect()
+ */
+static std::mutex & listenersMutex() {
+    static std::mutex mtx;
+    return mtx;
+}
+
+static std::map<std::string, MemoryListener*> & listeners() {
+    static std::map<std::string, MemoryListener*> byName;
+    return byName;
+}
+
+MemoryListener::MemoryListener() {
+}
+
+MemoryListener::~MemoryListener() {
+    close();
+    if (m_fd != -1) {
+        ::close(m_fd);
+    }
+}
+
+pipe_ret_t MemoryListener::listen(const std::string & name, int backlog, size_t ringSize) {
+    pipe_ret_t ret;
+    if (name.empty()) {
+        ret.success = false;
+        ret.msg = ret.reason = "Listener name is empty";
+        return ret;
+    }
+    if (ringSize == 0 || (ringSize & (ringSize - 1)) != 0) {
+        ret.success = false;
+        ret.msg = ret.reason = "Ring size is not a power of 2";
+        return ret;
+    }
+    if (m_fd == -1) {
+        m_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_fd == -1) {
+            ret.success = false;
+            ret.code = errno;
+            ret.msg = ret.reason = strerror(errno);
+            return ret;
+        }
+    }
+    std::lock_guard<std::mutex> registryLock(listenersMutex());
+    if (m_listening || listeners().count(name) > 0) {
+        ret.success = false;
+        ret.code = EADDRINUSE;
+        ret.msg = ret.reason = strerror(EADDRINUSE);
+        return ret;
+    }
+    listeners()[name] = this;
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_name = name;
+    m_backlog = backlog;
+    m_ringSize = ringSize;
+    m_listening = true;
+    ret.success = true;
+    return ret;
+}
+
+void MemoryListener::close() {
+    std::lock_guard<std::mutex> registryLock(listenersMutex());
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (!m_listening) {
+        return;
+    }
+    listeners().erase(m_name);
+    m_listening = false;
+    for (size_t i=0; i<m_pending.size(); i++) {
+        m_pending[i]->close();
+    }
+    m_pending.clear();
+}
+
+/*
+ * The eventfd is signalled by every queued connection and
+ * cleared along with the queue, so it is readable while
+ * and only while connections wait
+ */
+MemoryStream * MemoryListener::accept() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (m_pending.empty()) {
+        errno = EAGAIN;
+        return nullptr;
+    }
+    MemoryStream * stream = m_pending.front();
+    m_pending.pop_front();
+    if (m_pending.empty()) {
+        uint64_t counter;
+        ssize_t numRead = ::read(m_fd, &counter, sizeof(counter));
+        (void)numRead;
+    }
+    return stream;
+}
+
+/*
+ * Refused like a socket connect, with ECONNREFUSED, if nothing
+ * listens under name or its backlog is full
+ */
+pipe_ret_t MemoryListener::connect(const std::string & name, MemoryStream *& stream) {
+    std::lock_guard<std::mutex> registryLock(listenersMutex());
+    std::map<std::string, MemoryListener*>::iterator found = listeners().find(name);
+    if (found == listeners().end()) {
+        pipe_ret_t ret;
+        ret.success = false;
+        ret.code = ECONNREFUSED;
+        ret.msg = ret.reason = strerror(ECONNREFUSED);
+        return ret;
+    }
+    return found->second->enqueue(stream);
+}
+
+pipe_ret_t MemoryListener::enqueue(MemoryStream *& stream) {
+    pipe_ret_t ret;
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (m_pending.size() >= (size_t)std::max(m_backlog, 1)) {
+        ret.success = false;
+        ret.code = ECONNREFUSED;
+        ret.msg = ret.reason = strerror(ECONNREFUSED);
+        return ret;
+    }
+    MemoryStream * accepted;
+    ret = MemoryStream::createPair(m_ringSize, stream, accepted);
+    if (!ret.success) {
+        return ret;
+    }
+    m_pending.push_back(accepted);
+    uint64_t one = 1;
+    ssize_t written = ::write(m_fd, &one, sizeof(one));
+    (void)written;
+    ret.success = true;
+    return ret;
+}
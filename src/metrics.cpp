@@ -0,0 +1,124 @@
+
+
+#include "../include/metrics.h"
+#include <string.h>
+#include <time.h>
+
+
+unsigned metricsShard() {
+    static std::atomic<unsigned> nextShard(0);
+    static thread_local unsigned shard = nextShard.fetch_add(1, std::memory_order_relaxed) % METRICS_SHARDS;
+    return shard;
+}
+
+uint64_t metricsClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+Counter::Counter() {
+    for (int i=0; i<METRICS_SHARDS; i++) {
+        m_shards[i].value.store(0, std::memory_order_relaxed);
+    }
+}
+
+uint64_t Counter::value() const {
+    uint64_t total = 0;
+    for (int i=0; i<METRICS_SHARDS; i++) {
+        total += m_shards[i].value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+histogram_snapshot_t::histogram_snapshot_t() : count(0), sum(0) {
+    memset(buckets, 0, sizeof(buckets));
+}
+
+/*
+ * Values below 2^HISTOGRAM_SUB_BUCKET_BITS get a bucket each, larger
+ * ones are bucketed by their most significant bit and the bits below it
+ */
+int histogram_snapshot_t::bucketOf(uint64_t value) {
+    const uint64_t subBuckets = 1 << HISTOGRAM_SUB_BUCKET_BITS;
+    if (value < subBuckets) {
+        return (int)value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HISTOGRAM_SUB_BUCKET_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BUCKET_BITS) + (int)((value >> shift) & (subBuckets - 1));
+}
+
+uint64_t histogram_snapshot_t::bucketLowerBound(int bucket) {
+    const int subBuckets = 1 << HISTOGRAM_SUB_BUCKET_BITS;
+    if (bucket < subBuckets) {
+        return bucket;
+    }
+    int shift = (bucket >> HISTOGRAM_SUB_BUCKET_BITS) - 1;
+    return (uint64_t)(subBuckets + (bucket & (subBuckets - 1))) << shift;
+}
+
+uint64_t histogram_snapshot_t::percentile(double percent) const {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t wanted = (uint64_t)(count * percent / 100.0);
+    if (wanted >= count) {
+        wanted = count - 1;
+    }
+    uint64_t seen = 0;
+    for (int i=0; i<HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > wanted) {
+            return bucketLowerBound(i);
+        }
+    }
+    return bucketLowerBound(HISTOGRAM_BUCKETS - 1);
+}
+
+Histogram::Histogram() {
+    for (int i=0; i<METRICS_SHARDS; i++) {
+        m_shards[i].count.store(0, std::memory_order_relaxed);
+        m_shards[i].sum.store(0, std::memory_order_relaxed);
+        for (int j=0; j<HISTOGRAM_BUCKETS; j++) {
+            m_shards[i].buckets[j].store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+void Histogram::record(uint64_t value) {
+    shard_t & shard = m_shards[metricsShard()];
+    shard.buckets[histogram_snapshot_t::bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    shard.count.fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+/*
+ * Sum the shards into snapshot. Concurrent records may be
+ * half visible, so count and buckets may differ slightly.
+ */
+void Histogram::snapshot(histogram_snapshot_t & snapshot) const {
+    snapshot = histogram_snapshot_t();
+    for (int i=0; i<METRICS_SHARDS; i++) {
+        snapshot.count += m_shards[i].count.load(std::memory_order_relaxed);
+        snapshot.sum += m_shards[i].sum.load(std::memory_order_relaxed);
+        for (int j=0; j<HISTOGRAM_BUCKETS; j++) {
+            snapshot.buckets[j] += m_shards[i].buckets[j].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+ConnectionMetrics::ConnectionMetrics() :
+    bytesIn(0), msgsIn(0), bytesOut(0), msgsOut(0), partialWrites(0), msgsDropped(0) {
+}
+
+server_metrics_t::server_metrics_t() :
+    bytesIn(0), msgsIn(0), bytesOut(0), msgsOut(0), partialWrites(0), msgsDropped(0),
+    accepted(0), handshakeFailures(0), kernelTls(0), rejected(0), throttled(0), clients(0), queuedBytes(0) {
+    memset(disconnects, 0, sizeof(disconnects));
+}
+
+connection_metrics_t::connection_metrics_t() :
+    clientId(0), bytesIn(0), msgsIn(0), bytesOut(0), msgsOut(0), partialWrites(0),
+    msgsDropped(0), queuedBytes(0), peakQueuedBytes(0) {
+}
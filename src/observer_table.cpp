@@ -0,0 +1,103 @@
+#include "../include/observer_table.h"
+
+
+ObserverTable::ObserverTable() : m_version(1) {
+}
+
+ObserverTable::~ObserverTable() {
+    retireSets();
+    for (uint i=0; i<m_retiredSets.size(); i++) {
+        delete m_retiredSets[i];
+    }
+}
+
+/*
+ * Add an observer. Fails if its wantedIp is neither
+ * empty, an address, nor a CIDR prefix.
+ */
+pipe_ret_t ObserverTable::add(const server_observer_t & observer) {
+    pipe_ret_t ret;
+    entry_t entry;
+    if (!ip_prefix_t::parse(observer.wantedIp, entry.prefix)) {
+        ret.success = false;
+        ret.msg = ret.reason = "Invalid observer IP address";
+        return ret;
+    }
+    entry.observer = observer;
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_entries.push_back(entry);
+    retireSets();
+    ret.success = true;
+    return ret;
+}
+
+void ObserverTable::clear() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_entries.clear();
+    retireSets();
+}
+
+/*
+ * Observers of client. Publishing threads call this for every
+ * message: unless the observers changed, it is a single load.
+ */
+const ObserverSet & ObserverTable::resolve(Client & client) {
+    const ObserverSet * set = client.m_observers.m_set.load(std::memory_order_acquire);
+    if (set != nullptr && set->version == m_version.load(std::memory_order_acquire)) {
+        return *set;
+    }
+    std::lock_guard<std::mutex> lock(m_mtx);
+    set = compile(client.getAddress());
+    client.m_observers.m_set.store(set, std::memory_order_release);
+    return *set;
+}
+
+/*
+ * Find the set of the observers matching address, or build it.
+ * Called under m_mtx.
+ */
+const ObserverSet * ObserverTable::compile(const ip_address_t & address) {
+    std::vector<uint> matching;
+    for (uint i=0; i<m_entries.size(); i++) {
+        if (m_entries[i].prefix.matches(address)) {
+            matching.push_back(i);
+        }
+    }
+    for (uint i=0; i<m_sets.size(); i++) {
+        if (m_sets[i]->observers == matching) {
+            return m_sets[i];
+        }
+    }
+
+    ObserverSet * set = new ObserverSet();
+    set->version = m_version.load(std::memory_order_relaxed);
+    set->observers = matching;
+    for (uint i=0; i<matching.size(); i++) {
+        const server_observer_t & observer = m_entries[matching[i]].observer;
+        if (observer.incoming_packet_func) {
+            set->incoming.push_back(observer.incoming_packet_func);
+        }
+        if (observer.incoming_buffers_func) {
+            set->incomingBuffers.push_back(observer.incoming_buffers_func);
+        }
+        if (observer.connected_func) {
+            set->connected.push_back(observer.connected_func);
+        }
+        if (observer.disconnected_func) {
+            set->disconnected.push_back(observer.disconnected_func);
+        }
+    }
+    m_sets.push_back(set);
+    return set;
+}
+
+/*
+ * Observers changed: make clients resolve again. Called under m_mtx.
+ * Previous sets live on with the table, as a thread may be publishing
+ * through one right now.
+ */
+void ObserverTable::retireSets() {
+    m_retiredSets.insert(m_retiredSets.end(), m_sets.begin(), m_sets.end());
+    m_sets.clear();
+    m_version.fetch_add(1, std::memory_order_release);
+}
@@ -0,0 +1,73 @@
+
+
+#include "../include/payload.h"
+#include "../include/memory_pool.h"
+#include <string.h>
+#include <new>
+
+
+/*
+ * Serialize header followed by msg into a new pooled
+ * buffer holding a single reference
+ */
+Payload::Payload(const char * header, size_t headerSize, const char * msg, size_t size) {
+    size_t totalSize = headerSize + size;
+    size_t capacity;
+    void * memory = BufferPool::allocate(offsetof(block_t, data) + totalSize, capacity);
+    m_block = new (memory) block_t;
+    m_block->refs.store(1, std::memory_order_relaxed);
+    m_block->size = totalSize;
+    m_block->capacity = capacity;
+    memcpy(m_block->data, header, headerSize);
+    memcpy(m_block->data + headerSize, msg, size);
+}
+
+const size_t Payload::BLOCK_OVERHEAD = offsetof(block_t, data);
+
+Payload Payload::allocate(size_t size) {
+    Payload payload;
+    size_t capacity;
+    void * memory = BufferPool::allocate(BLOCK_OVERHEAD + size, capacity);
+    payload.m_block = new (memory) block_t;
+    payload.m_block->refs.store(1, std::memory_order_relaxed);
+    payload.m_block->size = capacity - BLOCK_OVERHEAD;
+    payload.m_block->capacity = capacity;
+    return payload;
+}
+
+Payload::Payload(const Payload & other) : m_block(other.m_block) {
+    if (m_block != nullptr) {
+        m_block->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+Payload::Payload(Payload && other) : m_block(other.m_block) {
+    other.m_block = nullptr;
+}
+
+Payload & Payload::operator =(const Payload & other) {
+    if (other.m_block != nullptr) {
+        other.m_block->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    unref();
+    m_block = other.m_block;
+    return *this;
+}
+
+Payload & Payload::operator =(Payload && other) {
+    if (this != &other) {
+        unref();
+        m_block = other.m_block;
+        other.m_block = nullptr;
+    }
+    return *this;
+}
+
+void Payload::unref() {
+    if (m_block != nullptr && m_block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        size_t capacity = m_block->capacity;
+        m_block->~block_t();
+        BufferPool::deallocate(m_block, capacity);
+    }
+    m_block = nullptr;
+}
@@ -0,0 +1,99 @@
+
+
+#include "../include/receive_buffers.h"
+#include "../include/stream.h"
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <algorithm>
+
+const size_t ReceiveBuffers::BLOCK_SIZE;
+
+
+ssize_t ReceiveBuffers::receive(int fd, int flags, size_t maxBytes) {
+    size_t received = 0;
+    m_drained = false;
+    while (m_batchSize < MAX_BATCH_SIZE && received < maxBytes) {
+        ssize_t numOfBytesReceived = receiveOnce(fd, received > 0 ? flags | MSG_DONTWAIT : flags, maxBytes - received);
+        if (numOfBytesReceived > 0) {
+            received += (size_t)numOfBytesReceived;
+            m_batchSize += (size_t)numOfBytesReceived;
+            continue;
+        }
+        if (numOfBytesReceived < 0 && errno == EINTR) {
+            continue;
+        }
+        m_drained = numOfBytesReceived < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        return received > 0 ? (ssize_t)received : numOfBytesReceived;
+    }
+    return (ssize_t)received;
+}
+
+/*
+ * Scatter a single read over new blocks of m_readSize bytes in all,
+ * maxBytes at most, and keep those something was received in
+ */
+ssize_t ReceiveBuffers::receiveOnce(int fd, int flags, size_t maxBytes) {
+    struct iovec iov[MAX_BLOCKS];
+    int iovcnt = 0;
+    size_t offered = 0;
+    size_t first = m_blocks.size();
+    for (size_t left = std::min(m_readSize, maxBytes); left > 0 && iovcnt < MAX_BLOCKS; iovcnt++) {
+        // the block header takes part of the pooled allocation
+        size_t blockSize = std::min(left, BLOCK_SIZE);
+        m_blocks.push_back(Payload::allocate(blockSize - Payload::BLOCK_OVERHEAD));
+        Payload & block = m_blocks.back();
+        iov[iovcnt].iov_base = block.mutableData();
+        iov[iovcnt].iov_len = block.size();
+        offered += block.size();
+        left -= blockSize;
+    }
+
+    struct msghdr msgHeader;
+    memset(&msgHeader, 0, sizeof(msgHeader));
+    msgHeader.msg_iov = iov;
+    msgHeader.msg_iovlen = iovcnt;
+    ssize_t numOfBytesReceived = m_stream != nullptr ? m_stream->readv(iov, iovcnt) : recvmsg(fd, &msgHeader, flags);
+    if (numOfBytesReceived <= 0) {
+        m_blocks.resize(first);
+        return numOfBytesReceived;
+    }
+
+    size_t left = (size_t)numOfBytesReceived;
+    size_t used = 0;
+    while (left > 0) {
+        size_t size = std::min(left, iov[used].iov_len);
+        m_blocks[first + used].truncate(size);
+        struct iovec buffer;
+        buffer.iov_base = iov[used].iov_base;
+        buffer.iov_len = size;
+        m_buffers.push_back(buffer);
+        left -= size;
+        used++;
+    }
+    m_blocks.resize(first + used);
+    adapt(offered, (size_t)numOfBytesReceived);
+    return numOfBytesReceived;
+}
+
+void ReceiveBuffers::adapt(size_t offered, size_t received) {
+    if (received == offered) {
+        m_smallReads = 0;
+        if (m_readSize < MAX_RECEIVE_SIZE) {
+            m_readSize *= 2;
+        }
+    } else if (received < offered / 4) {
+        if (++m_smallReads >= SHRINK_AFTER && m_readSize > MAX_PACKET_SIZE) {
+            m_readSize /= 2;
+            m_smallReads = 0;
+        }
+    } else {
+        m_smallReads = 0;
+    }
+}
+
+void ReceiveBuffers::clear() {
+    m_blocks.clear();
+    m_buffers.clear();
+    m_batchSize = 0;
+}
@@ -0,0 +1,199 @@
+#include "../include/rpc_client.h"
+#include "../include/timer_wheel.h"
+#include <chrono>
+#include <memory>
+
+const uint64_t RpcClient::SLOT_FREE;
+const uint64_t RpcClient::SLOT_BUSY;
+const uint64_t RpcClient::NO_DEADLINE;
+
+
+RpcClient::RpcClient(TcpClient & client, const rpc_config_t & config) :
+  m_client(client),
+  m_config(config)
+{
+  uint64_t slots = 1;
+  while (slots < m_config.maxPending) {
+    slots <<= 1;
+  }
+  m_slots = new slot_t[slots];
+  m_slotMask = slots - 1;
+
+  client_observer_t observer;
+  observer.incoming_packet_func = [this](const char * msg, size_t size) {
+    handleReply(msg, size);
+  };
+  observer.disconnected_func = [this](const pipe_ret_t & ret) {
+    pipe_ret_t lost;
+    lost.success = false;
+    lost.code = ret.code;
+    lost.reason = "connection lost";
+    failPending(lost);
+  };
+  m_client.subscribe(observer);
+  m_deadlineTask = new std::thread(&RpcClient::expireTask, this);
+}
+
+RpcClient::~RpcClient()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_deadlineMtx);
+    m_stop = true;
+  }
+  m_deadlineCondition.notify_all();
+  m_deadlineTask->join();
+  delete m_deadlineTask;
+  delete[] m_slots;
+}
+
+/*
+ * Claim the slot of a new id, publish the request in it, then send it,
+ * so that the reply always finds it. Ids only grow: a slot still held by
+ * a request sent maxPending ids ago is skipped, the next id is tried.
+ */
+pipe_ret_t RpcClient::call(const char * request, size_t size, const rpc_callback_t & callback, uint timeoutMs)
+{
+  pipe_ret_t ret;
+  if (m_client.getFraming().mode == FRAMING_NONE) {
+    ret.success = false;
+    ret.reason = "rpc needs a client using framing";
+    return ret;
+  }
+  if (timeoutMs == 0) {
+    timeoutMs = m_config.defaultTimeoutMs;
+  }
+  slot_t * slot = nullptr;
+  uint64_t id = 0;
+  for (uint64_t attempt = 0; attempt <= m_slotMask && slot == nullptr; attempt++) {
+    id = m_nextId.fetch_add(1);
+    uint64_t expected = SLOT_FREE;
+    if (id != SLOT_FREE && id != SLOT_BUSY &&
+        m_slots[id & m_slotMask].id.compare_exchange_strong(expected, SLOT_BUSY, std::memory_order_acquire)) {
+      slot = &m_slots[id & m_slotMask];
+    }
+  }
+  if (slot == nullptr) {
+    ret.success = false;
+    ret.reason = "too many pending requests";
+    return ret;
+  }
+  slot->callback = callback;
+  slot->deadlineMs.store(timeoutMs > 0 ? TimerWheel::clockMs() + timeoutMs : NO_DEADLINE, std::memory_order_relaxed);
+  m_pending++;
+  slot->id.store(id, std::memory_order_release);
+
+  static thread_local std::vector<char> message;
+  message.resize(RPC_HEADER_SIZE + size);
+  encodeRpcHeader(id, message.data());
+  if (size > 0) {
+    memcpy(message.data() + RPC_HEADER_SIZE, request, size);
+  }
+  ret = m_client.sendMsg(message.data(), message.size());
+  if (!ret.success) {
+    // take the slot back, unless it expired meanwhile and called back already
+    uint64_t expected = id;
+    if (slot->id.compare_exchange_strong(expected, SLOT_BUSY, std::memory_order_acquire)) {
+      slot->callback = nullptr;
+      m_pending--;
+      slot->id.store(SLOT_FREE, std::memory_order_release);
+      return ret;
+    }
+    ret.success = true;
+  }
+  return ret;
+}
+
+std::future<rpc_reply_t> RpcClient::call(const char * request, size_t size, uint timeoutMs)
+{
+  std::shared_ptr<std::promise<rpc_reply_t>> promise = std::make_shared<std::promise<rpc_reply_t>>();
+  std::future<rpc_reply_t> future = promise->get_future();
+  pipe_ret_t ret = call(request, size, [promise](const pipe_ret_t & ret, const char * reply, size_t size) {
+    rpc_reply_t result;
+    result.success = ret.success;
+    result.code = ret.code;
+    result.msg = result.reason = ret.reason;
+    result.body.assign(reply != nullptr ? reply : "", size);
+    promise->set_value(result);
+  }, timeoutMs);
+  if (!ret.success) {
+    rpc_reply_t result;
+    result.success = false;
+    result.code = ret.code;
+    result.msg = result.reason = ret.reason;
+    promise->set_value(result);
+  }
+  return future;
+}
+
+/*
+ * Called from the receive thread for every reply
+ */
+void RpcClient::handleReply(const char * msg, size_t size)
+{
+  if (size < RPC_HEADER_SIZE) {
+    m_lateReplies++;
+    return;
+  }
+  uint64_t id = decodeRpcHeader(msg);
+  pipe_ret_t ret;
+  ret.success = true;
+  if (!complete(m_slots[id & m_slotMask], id, ret, msg + RPC_HEADER_SIZE, size - RPC_HEADER_SIZE)) {
+    m_lateReplies++;
+  }
+}
+
+void RpcClient::failPending(const pipe_ret_t & ret)
+{
+  for (uint64_t i = 0; i <= m_slotMask; i++) {
+    uint64_t id = m_slots[i].id.load(std::memory_order_acquire);
+    if (id != SLOT_FREE && id != SLOT_BUSY) {
+      complete(m_slots[i], id, ret, nullptr, 0);
+    }
+  }
+}
+
+/*
+ * Complete the request id if it still holds slot: whoever swaps its id
+ * out first, the reply, the deadline or the disconnection, calls back.
+ * The slot is free again before the callback runs.
+ */
+bool RpcClient::complete(slot_t & slot, uint64_t id, const pipe_ret_t & ret, const char * reply, size_t size)
+{
+  uint64_t expected = id;
+  if (!slot.id.compare_exchange_strong(expected, SLOT_BUSY, std::memory_order_acquire)) {
+    return false;
+  }
+  rpc_callback_t callback;
+  callback.swap(slot.callback);
+  m_pending--;
+  slot.id.store(SLOT_FREE, std::memory_order_release);
+  callback(ret, reply, size);
+  return true;
+}
+
+/*
+ * Deadline thread: every tick, expire the pending requests past their
+ * deadline. The deadline read may belong to a request which took the
+ * slot over since its id was read, completing with the stale id fails.
+ */
+void RpcClient::expireTask()
+{
+  pipe_ret_t timeout;
+  timeout.success = false;
+  timeout.code = ETIMEDOUT;
+  timeout.reason = "request timed out";
+  std::unique_lock<std::mutex> lock(m_deadlineMtx);
+  while (!m_stop) {
+    m_deadlineCondition.wait_for(lock, std::chrono::milliseconds(m_config.deadlineTickMs));
+    if (m_pending == 0) {
+      continue;
+    }
+    uint64_t now = TimerWheel::clockMs();
+    for (uint64_t i = 0; i <= m_slotMask; i++) {
+      uint64_t id = m_slots[i].id.load(std::memory_order_acquire);
+      if (id != SLOT_FREE && id != SLOT_BUSY && m_slots[i].deadlineMs.load(std::memory_order_relaxed) <= now) {
+        complete(m_slots[i], id, timeout, nullptr, 0);
+      }
+    }
+  }
+}
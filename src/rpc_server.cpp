@@ -0,0 +1,28 @@
+#include "../include/rpc_server.h"
+#include <string.h>
+#include <vector>
+
+
+bool parseRpcRequest(const char * msg, size_t size, uint64_t & id, const char *& request, size_t & requestSize) {
+    if (size < RPC_HEADER_SIZE) {
+        return false;
+    }
+    id = decodeRpcHeader(msg);
+    request = msg + RPC_HEADER_SIZE;
+    requestSize = size - RPC_HEADER_SIZE;
+    return true;
+}
+
+/*
+ * The reply is put together in a per-thread buffer,
+ * which is reused so replying does not allocate
+ */
+pipe_ret_t sendRpcReply(TcpServer & server, const Client & client, uint64_t id, const char * reply, size_t size) {
+    static thread_local std::vector<char> message;
+    message.resize(RPC_HEADER_SIZE + size);
+    encodeRpcHeader(id, message.data());
+    if (size > 0) {
+        memcpy(message.data() + RPC_HEADER_SIZE, reply, size);
+    }
+    return server.sendToClient(client, message.data(), message.size());
+}
@@ -0,0 +1,727 @@
+
+
+#include "../include/send_queue.h"
+#include "../include/stream.h"
+#include "../include/timer_wheel.h"
+#include <string.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
+
+SendQueue::SendQueue(size_t maxQueuedBytes) : m_ring(INITIAL_RING_SIZE), m_maxQueuedBytes(maxQueuedBytes) {
+}
+
+/*
+ * The connection is gone: what was not sent, or not
+ * acknowledged by the kernel yet, failed
+ */
+SendQueue::~SendQueue() {
+    for (size_t i=0; i<m_count; i++) {
+        if (entryAt(i).request != nullptr) {
+            requestDone(entryAt(i).request, "Connection closed before the data was sent");
+        }
+    }
+    while (m_zeroCopyHead != nullptr) {
+        SendRequest * request = m_zeroCopyHead;
+        m_zeroCopyHead = request->m_next;
+        requestDone(request, "Connection closed before the data was sent");
+    }
+    complete(m_completed);
+    if (m_asyncSend != nullptr) {
+        BufferPool::deallocate(m_asyncSend, sizeof(async_send_t));
+    }
+    delete m_rateLimit;
+}
+
+void SendQueue::pushBack(const Payload & payload, bool coalescable, SendRequest * request) {
+    if (m_count == m_ring.size()) {
+        growRing();
+    }
+    entry_t & entry = entryAt(m_count);
+    entry.payload = payload;
+    entry.coalescable = coalescable;
+    entry.request = request;
+    m_count++;
+}
+
+void SendQueue::popFront() {
+    // release the payload reference now rather than when the slot is reused
+    m_ring[m_first].payload = Payload();
+    m_ring[m_first].request = nullptr;
+    m_first = (m_first + 1) % m_ring.size();
+    m_count--;
+}
+
+/*
+ * Double the ring, moving the entries to its start
+ */
+void SendQueue::growRing() {
+    std::vector<entry_t> ring(m_ring.size() * 2);
+    for (size_t i=0; i<m_count; i++) {
+        ring[i] = std::move(entryAt(i));
+    }
+    m_ring.swap(ring);
+    m_first = 0;
+}
+
+/*
+ * Queue a reference to payload, applying policy if the queue is full.
+ */
+SendQueue::push_ret_t SendQueue::push(const Payload & payload, bool coalescable, backpressure_policy_t policy) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (m_queuedBytes + payload.size() > m_maxQueuedBytes) {
+        if (policy == BACKPRESSURE_DISCONNECT) {
+            return PUSH_OVERFLOW;
+        }
+        if (policy == BACKPRESSURE_COALESCE) {
+            coalesceLocked();
+        }
+        if (m_queuedBytes + payload.size() > m_maxQueuedBytes) {
+            countDropped(1);
+            return PUSH_DROPPED;
+        }
+    }
+    pushBack(payload, coalescable);
+    m_queuedBytes += payload.size();
+    if (m_queuedBytes > m_peakQueuedBytes) {
+        m_peakQueuedBytes = m_queuedBytes;
+    }
+    return PUSH_QUEUED;
+}
+
+/*
+ * Queue request, preceded by its frame header if any. Both go in
+ * at once, so no other message can end up between them.
+ */
+void SendQueue::push(const Payload & header, SendRequest * request) {
+    SendRequest * completed;
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (!header.empty()) {
+            pushBack(header, false);
+            m_queuedBytes += header.size();
+        }
+        if (request->size > 0) {
+            pushBack(Payload(), false, request);
+        } else { // nothing to wait for
+            requestDone(request, nullptr);
+        }
+        completed = takeCompleted();
+    }
+    complete(completed);
+}
+
+/*
+ * Drop queued coalescable payloads, except a partially written head
+ * which must be completed to keep the stream intact, and those an
+ * asynchronous send in flight refers to
+ */
+void SendQueue::coalesceLocked() {
+    size_t kept = m_headOffset > 0 ? 1 : 0;
+    if (m_sendingEntries > kept) {
+        kept = m_sendingEntries;
+    }
+    for (size_t i=kept; i<m_count; i++) {
+        entry_t & entry = entryAt(i);
+        if (entry.coalescable) {
+            m_queuedBytes -= entry.payload.size();
+            entry.payload = Payload();
+        } else {
+            if (i != kept) {
+                entryAt(kept) = std::move(entry);
+            }
+            kept++;
+        }
+    }
+    countDropped(m_count - kept);
+    m_count = kept;
+}
+
+/*
+ * Write queued messages until the queue is empty or the socket is full.
+ * Called by the I/O thread when the socket becomes writable. The lock is
+ * released around every write, so producers keep queueing (but don't
+ * write) while a long queue, e.g. built up while disconnected or a large
+ * file, is written out batch by batch.
+ */
+SendQueue::flush_ret_t SendQueue::flush(int fd) {
+    std::unique_lock<std::mutex> lock(m_mtx);
+    if (m_sending || m_corked) {
+        return FLUSH_WOULD_BLOCK;
+    }
+    flush_ret_t ret = FLUSH_COMPLETE;
+    int flushErrno = 0;
+    while (m_count > 0) {
+        if (m_corked) { // uncork() has the rest flushed
+            ret = FLUSH_WOULD_BLOCK;
+            break;
+        }
+        if (throttledLocked()) {
+            m_blocked = true;
+            ret = FLUSH_THROTTLED;
+            break;
+        }
+        write_t write;
+        prepareWrite(write);
+        limitWrite(write);
+        // keep producers from writing, and from coalescing entries away
+        m_blocked = true;
+        m_sending = true;
+        m_sendingEntries = write.iovcnt > 0 ? write.iovcnt : 1;
+        lock.unlock();
+
+        ssize_t numBytesSent = performWrite(fd, write);
+        int sendErrno = errno;
+
+        lock.lock();
+        m_sending = false;
+        m_sendingEntries = 0;
+        if (numBytesSent < 0) {
+            if (sendErrno == EINTR) {
+                continue;
+            }
+            flushErrno = sendErrno;
+            if (sendErrno == EAGAIN || sendErrno == EWOULDBLOCK) {
+                ret = FLUSH_WOULD_BLOCK;
+            } else {
+                if (write.request != nullptr) {
+                    write.request->m_error = strerror(sendErrno);
+                }
+                ret = FLUSH_ERROR;
+            }
+            break;
+        }
+        wroteLocked(write, (size_t)numBytesSent);
+    }
+    if (ret == FLUSH_COMPLETE && m_stream != nullptr && m_stream->flushPending() == -1) {
+        flushErrno = errno;
+        ret = errno == EAGAIN ? FLUSH_WOULD_BLOCK : FLUSH_ERROR;
+    }
+    if (ret == FLUSH_COMPLETE) {
+        m_blocked = false;
+    }
+    SendRequest * completed = takeCompleted();
+    lock.unlock();
+    complete(completed);
+    errno = flushErrno;
+    return ret;
+}
+
+/*
+ * Like flush(), but leave it to the I/O thread
+ * if the socket was full on the last attempt.
+ */
+SendQueue::flush_ret_t SendQueue::tryFlush(int fd) {
+    flush_ret_t ret;
+    SendRequest * completed;
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (m_blocked || m_corked) {
+            return FLUSH_WOULD_BLOCK;
+        }
+        ret = flushLocked(fd);
+        completed = takeCompleted();
+    }
+    if (completed != nullptr) {
+        int flushErrno = errno;
+        complete(completed);
+        errno = flushErrno;
+    }
+    return ret;
+}
+
+SendQueue::flush_ret_t SendQueue::flushLocked(int fd) {
+    m_blocked = false;
+    while (m_count > 0) {
+        if (throttledLocked()) {
+            m_blocked = true;
+            return FLUSH_THROTTLED;
+        }
+        write_t write;
+        prepareWrite(write);
+        limitWrite(write);
+        ssize_t numBytesSent = performWrite(fd, write);
+        if (numBytesSent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                m_blocked = true;
+                return FLUSH_WOULD_BLOCK;
+            }
+            if (write.request != nullptr) {
+                write.request->m_error = strerror(errno);
+            }
+            return FLUSH_ERROR;
+        }
+        wroteLocked(write, (size_t)numBytesSent);
+    }
+    // what the stream took but could not write yet
+    if (m_stream != nullptr && m_stream->flushPending() == -1) {
+        if (errno == EAGAIN) {
+            m_blocked = true;
+            return FLUSH_WOULD_BLOCK;
+        }
+        return FLUSH_ERROR;
+    }
+    return FLUSH_COMPLETE;
+}
+
+/*
+ * Describe up to MAX_IOVECS queued payloads, the head one from where
+ * the last partial write stopped, up to the first queued request
+ */
+int SendQueue::fillIovecs(struct iovec * iov, size_t & bytes) {
+    int iovcnt = 0;
+    bytes = 0;
+    for (size_t i=0; i<m_count && iovcnt<MAX_IOVECS; i++) {
+        if (entryAt(i).request != nullptr) {
+            break;
+        }
+        const Payload & payload = entryAt(i).payload;
+        size_t offset = i == 0 ? m_headOffset : 0;
+        iov[iovcnt].iov_base = (char *)payload.data() + offset;
+        iov[iovcnt].iov_len = payload.size() - offset;
+        bytes += iov[iovcnt].iov_len;
+        iovcnt++;
+    }
+    return iovcnt;
+}
+
+/*
+ * Describe the next write: queued payloads, or what is
+ * left of a request at the head of the queue
+ */
+void SendQueue::prepareWrite(write_t & write) {
+    write.request = nullptr;
+    write.zeroCopy = false;
+    SendRequest * request = entryAt(0).request;
+    if (request == nullptr) {
+        write.iovcnt = fillIovecs(write.iov, write.requested);
+        write.more = m_corkBatches && (size_t)write.iovcnt < m_count;
+        return;
+    }
+    write.more = m_corkBatches && m_count > 1;
+    write.request = request;
+    write.requested = request->size - m_headOffset;
+    if (request->kind == SendRequest::SEND_FILE) {
+        write.iovcnt = 0;
+        write.fileOffset = request->offset + (off_t)m_headOffset;
+        return;
+    }
+    write.iov[0].iov_base = (char *)request->data + m_headOffset;
+    write.iov[0].iov_len = write.requested;
+    write.iovcnt = 1;
+    write.zeroCopy = m_zeroCopy > 0 && request->size >= MIN_ZEROCOPY_SIZE;
+}
+
+/*
+ * Whether the rate limit holds writes back for now
+ */
+bool SendQueue::throttledLocked() {
+    if (m_rateLimit == nullptr) {
+        return false;
+    }
+    m_throttleDelay = m_rateLimit->delay(TimerWheel::clockMs());
+    return m_throttleDelay > 0;
+}
+
+/*
+ * Cut a write to what the rate limit allows, the
+ * rest of it is left for a later write
+ */
+void SendQueue::limitWrite(write_t & write) {
+    if (m_rateLimit == nullptr || write.requested <= m_rateLimit->available()) {
+        return;
+    }
+    size_t maxBytes = m_rateLimit->available();
+    write.requested = maxBytes;
+    // a pause follows, don't have the kernel hold a partial segment meanwhile
+    write.more = false;
+    size_t bytes = 0;
+    for (int i=0; i<write.iovcnt; i++) {
+        if (bytes + write.iov[i].iov_len >= maxBytes) {
+            write.iov[i].iov_len = maxBytes - bytes;
+            write.iovcnt = i + 1;
+            break;
+        }
+        bytes += write.iov[i].iov_len;
+    }
+}
+
+/*
+ * Perform a write described by prepareWrite(), with the semantics of
+ * sendmsg() on a non-blocking socket. Needs no lock, the entries it
+ * refers to stay queued until wroteLocked().
+ */
+ssize_t SendQueue::performWrite(int fd, write_t & write) {
+    if (write.request != nullptr && write.request->kind == SendRequest::SEND_FILE) {
+        off_t offset = write.fileOffset;
+        ssize_t numBytesSent = m_stream != nullptr ?
+                               m_stream->sendFile(write.request->fd, &offset, write.requested) :
+                               sendfile(fd, write.request->fd, &offset, write.requested);
+        if (numBytesSent == 0) { // file ends before the range does
+            errno = ENODATA;
+            return -1;
+        }
+        return numBytesSent;
+    }
+
+    if (m_stream != nullptr) { // never zero-copy, see setStream()
+        return m_stream->writev(write.iov, write.iovcnt);
+    }
+    struct msghdr msgHeader;
+    memset(&msgHeader, 0, sizeof(msgHeader));
+    msgHeader.msg_iov = write.iov;
+    msgHeader.msg_iovlen = write.iovcnt;
+    // the kernel holds a partial segment until the write without MSG_MORE
+    int flags = MSG_NOSIGNAL | MSG_DONTWAIT | (write.more ? MSG_MORE : 0);
+    if (write.zeroCopy) {
+        ssize_t numBytesSent = sendmsg(fd, &msgHeader, flags | MSG_ZEROCOPY);
+        if (numBytesSent >= 0 || errno != ENOBUFS) {
+            return numBytesSent;
+        }
+        // out of memory to pin pages with, copy instead
+        write.zeroCopy = false;
+    }
+    return sendmsg(fd, &msgHeader, flags);
+}
+
+/*
+ * Account for a successful write of numBytesSent bytes. Every
+ * zero-copy send got the next id of the socket from the kernel.
+ */
+void SendQueue::wroteLocked(const write_t & write, size_t numBytesSent) {
+    if (write.zeroCopy) {
+        SendRequest * request = write.request;
+        if (!request->m_zeroCopied) {
+            request->m_firstZeroCopyId = m_nextZeroCopyId;
+            request->m_zeroCopied = true;
+        }
+        request->m_lastZeroCopyId = m_nextZeroCopyId++;
+    }
+    if (m_rateLimit != nullptr) {
+        m_rateLimit->take(numBytesSent);
+    }
+    countSent(numBytesSent, write.requested);
+    consumeLocked(numBytesSent);
+}
+
+/*
+ * Drop what was written, a partial write resumes from m_headOffset.
+ * A written request is done, unless the kernel still
+ * uses pages of its buffer.
+ */
+void SendQueue::consumeLocked(size_t numBytesSent) {
+    size_t remaining = numBytesSent;
+    while (remaining > 0) {
+        entry_t & head = entryAt(0);
+        size_t headLeft = entrySize(head) - m_headOffset;
+        size_t consumed = remaining < headLeft ? remaining : headLeft;
+        if (head.request == nullptr) {
+            m_queuedBytes -= consumed;
+        }
+        if (remaining < headLeft) {
+            m_headOffset += remaining;
+            break;
+        }
+        remaining -= headLeft;
+        SendRequest * request = head.request;
+        if (request != nullptr && request->m_zeroCopied) {
+            request->m_next = nullptr;
+            if (m_zeroCopyTail != nullptr) {
+                m_zeroCopyTail->m_next = request;
+            } else {
+                m_zeroCopyHead = request;
+            }
+            m_zeroCopyTail = request;
+        } else if (request != nullptr) {
+            requestDone(request, nullptr);
+        }
+        popFront();
+        m_headOffset = 0;
+    }
+}
+
+/*
+ * Queue request for completion, error is nullptr if it succeeded,
+ * unless it failed already. Its callback is called by complete(),
+ * once the lock is released.
+ */
+void SendQueue::requestDone(SendRequest * request, const char * error) {
+    if (request->m_error == nullptr) {
+        request->m_error = error;
+    }
+    request->m_next = m_completed;
+    m_completed = request;
+}
+
+SendRequest * SendQueue::takeCompleted() {
+    SendRequest * completed = m_completed;
+    m_completed = nullptr;
+    return completed;
+}
+
+/*
+ * Call the callbacks of requests taken with takeCompleted(), oldest
+ * first, and release them
+ */
+void SendQueue::complete(SendRequest * requests) {
+    SendRequest * oldest = nullptr;
+    while (requests != nullptr) { // the list is newest first
+        SendRequest * next = requests->m_next;
+        requests->m_next = oldest;
+        oldest = requests;
+        requests = next;
+    }
+    while (oldest != nullptr) {
+        SendRequest * next = oldest->m_next;
+        if (oldest->onComplete) {
+            pipe_ret_t ret;
+            ret.success = oldest->m_error == nullptr;
+            ret.reason = oldest->m_error != nullptr ? oldest->m_error : "";
+            oldest->onComplete(ret);
+        }
+        delete oldest;
+        oldest = next;
+    }
+}
+
+/*
+ * Socket options are per socket, the
+ * queue is the one place to remember them
+ */
+bool SendQueue::enableZeroCopy(int fd) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (m_zeroCopy == 0) {
+        int one = 1;
+        m_zeroCopy = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0 ? 1 : -1;
+    }
+    return m_zeroCopy > 0;
+}
+
+/*
+ * Read the zero-copy notifications of the socket error queue. Each
+ * acknowledges a range of send ids: the buffers whose sends are all
+ * acknowledged may be reused by their owners.
+ */
+void SendQueue::reapZeroCopy(int fd) {
+    std::unique_lock<std::mutex> lock(m_mtx);
+    while (m_zeroCopyHead != nullptr) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr msgHeader;
+        memset(&msgHeader, 0, sizeof(msgHeader));
+        msgHeader.msg_control = control;
+        msgHeader.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msgHeader, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msgHeader); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msgHeader, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            const struct sock_extended_err * error = (const struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (error->ee_origin != SO_EE_ORIGIN_ZEROCOPY || error->ee_errno != 0) {
+                continue;
+            }
+            // ids from ee_info to ee_data, compared relative to ee_info as they wrap around
+            int64_t last = (int32_t)(error->ee_data - error->ee_info);
+            SendRequest * previous = nullptr;
+            SendRequest * request = m_zeroCopyHead;
+            while (request != nullptr) {
+                int64_t from = (int32_t)(request->m_firstZeroCopyId - error->ee_info);
+                int64_t to = (int32_t)(request->m_lastZeroCopyId - error->ee_info);
+                int64_t overlap = (to < last ? to : last) - (from > 0 ? from : 0) + 1;
+                if (overlap > 0) {
+                    request->m_zeroCopyAcked += (uint32_t)overlap;
+                }
+                SendRequest * next = request->m_next;
+                if (request->m_zeroCopyAcked == request->m_lastZeroCopyId - request->m_firstZeroCopyId + 1) {
+                    if (previous != nullptr) {
+                        previous->m_next = next;
+                    } else {
+                        m_zeroCopyHead = next;
+                    }
+                    if (m_zeroCopyTail == request) {
+                        m_zeroCopyTail = previous;
+                    }
+                    requestDone(request, nullptr);
+                } else {
+                    previous = request;
+                }
+                request = next;
+            }
+        }
+    }
+    SendRequest * completed = takeCompleted();
+    lock.unlock();
+    complete(completed);
+}
+
+/*
+ * The connection was lost and the queue will be written to a new one:
+ * forget the send in flight, write a partially sent head again from its
+ * start so the new stream begins on a message boundary, and leave what
+ * is queued to the I/O thread, which writes it once connected, while
+ * producers only queue.
+ */
+void SendQueue::restart() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_sending = false;
+    m_sendingEntries = 0;
+    m_sendingBytes = 0;
+    if (m_count > 0 && entryAt(0).request == nullptr) {
+        m_queuedBytes += m_headOffset;
+    }
+    m_headOffset = 0;
+    m_blocked = true;
+}
+
+void SendQueue::cork() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_corked = true;
+}
+
+void SendQueue::uncork() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_corked = false;
+}
+
+void SendQueue::setStream(Stream * stream) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_stream = stream;
+    if (stream != nullptr) {
+        m_zeroCopy = -1;
+    }
+}
+
+void SendQueue::setCorkBatches(bool enable) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_corkBatches = enable;
+}
+
+void SendQueue::setRateLimit(uint64_t rate, uint64_t burst) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    delete m_rateLimit;
+    m_rateLimit = new TokenBucket(rate, burst, TimerWheel::clockMs());
+}
+
+uint64_t SendQueue::throttleDelay() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_throttleDelay;
+}
+
+/*
+ * Start an asynchronous send of the head of the queue. Producers
+ * stop writing to the socket themselves until it completes.
+ */
+const struct msghdr * SendQueue::beginSend() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (m_sending || m_corked || m_count == 0) {
+        return nullptr;
+    }
+    if (m_asyncSend == nullptr) {
+        m_asyncSend = (async_send_t *)BufferPool::allocate(sizeof(async_send_t));
+    }
+    int iovcnt = fillIovecs(m_asyncSend->iov, m_sendingBytes);
+    memset(&m_asyncSend->header, 0, sizeof(m_asyncSend->header));
+    m_asyncSend->header.msg_iov = m_asyncSend->iov;
+    m_asyncSend->header.msg_iovlen = iovcnt;
+    m_sendingEntries = iovcnt;
+    m_sending = true;
+    m_blocked = true;
+    return &m_asyncSend->header;
+}
+
+bool SendQueue::completeSend(ssize_t result) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_sending = false;
+    m_sendingEntries = 0;
+    m_blocked = false;
+    if (result < 0) {
+        errno = (int)-result;
+        return false;
+    }
+    countSent((size_t)result, m_sendingBytes);
+    consumeLocked((size_t)result);
+    return true;
+}
+
+void SendQueue::setMetrics(ServerMetrics * serverMetrics, ConnectionMetrics * metrics) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_serverMetrics = serverMetrics;
+    m_metrics = metrics;
+}
+
+void SendQueue::countSent(size_t numBytesSent, size_t requested) {
+    m_writtenBytes += numBytesSent;
+    bool partial = numBytesSent < requested;
+    if (m_serverMetrics != nullptr) {
+        m_serverMetrics->bytesOut.add(numBytesSent);
+        if (partial) {
+            m_serverMetrics->partialWrites.add();
+        }
+    }
+    if (m_metrics != nullptr) {
+        ConnectionMetrics::add(m_metrics->bytesOut, numBytesSent);
+        if (partial) {
+            ConnectionMetrics::add(m_metrics->partialWrites, 1);
+        }
+    }
+}
+
+void SendQueue::countDropped(uint64_t msgs) {
+    if (msgs == 0) {
+        return;
+    }
+    if (m_serverMetrics != nullptr) {
+        m_serverMetrics->msgsDropped.add(msgs);
+    }
+    if (m_metrics != nullptr) {
+        ConnectionMetrics::add(m_metrics->msgsDropped, msgs);
+    }
+}
+
+size_t SendQueue::queuedBytes() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_queuedBytes;
+}
+
+size_t SendQueue::peakQueuedBytes() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_peakQueuedBytes;
+}
+
+uint64_t SendQueue::writtenBytes() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_writtenBytes;
+}
+
+bool SendQueue::empty() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_count == 0;
+}
+
+bool SendQueue::hasPendingWrites() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (m_corked) {
+        return false;
+    }
+    return m_count > 0 || (m_stream != nullptr && m_stream->writePending());
+}
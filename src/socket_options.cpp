@@ -0,0 +1,119 @@
+
+
+#include "../include/socket_options.h"
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+
+socket_options_t socket_options_t::lowLatency() {
+    socket_options_t options;
+    options.noDelay = true;
+    options.quickAck = true;
+    return options;
+}
+
+/*
+ * Nagle is off as well: corking already packs the messages of a
+ * batch, and would otherwise hold the last segment of every batch
+ * until the previous one is acknowledged
+ */
+socket_options_t socket_options_t::bulkThroughput() {
+    socket_options_t options;
+    options.noDelay = true;
+    options.sendBufferSize = 4 * 1024 * 1024;
+    options.receiveBufferSize = 4 * 1024 * 1024;
+    options.corkBatches = true;
+    return options;
+}
+
+socket_options_t socket_options_t::client() {
+    socket_options_t options;
+    options.keepAlive = true;
+    options.keepAliveIdleS = 1;
+    options.keepAliveIntervalS = 1;
+    options.keepAliveCount = 3;
+    return options;
+}
+
+static bool setIntOption(int fd, int level, int name, int value) {
+    return setsockopt(fd, level, name, &value, sizeof(value)) == 0;
+}
+
+/*
+ * Unix sockets have no TCP level options, setting them would fail
+ */
+static bool isTcpSocket(int fd) {
+    int domain = AF_INET;
+    socklen_t domainSize = sizeof(domain);
+    getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &domainSize);
+    return domain == AF_INET || domain == AF_INET6;
+}
+
+static pipe_ret_t optionFailed() {
+    pipe_ret_t ret;
+    ret.success = false;
+    ret.code = errno;
+    ret.msg = ret.reason = strerror(errno);
+    return ret;
+}
+
+/*
+ * Only options differing from the kernel default are set. The buffer
+ * sizes of a listener must be set before listen(), as the TCP window
+ * scale of accepted connections is picked from them. Only the socket
+ * level ones apply to Unix sockets.
+ */
+pipe_ret_t applySocketOptions(int fd, const socket_options_t & options) {
+    pipe_ret_t ret;
+    bool tcp = isTcpSocket(fd);
+    if (tcp && options.noDelay && !setIntOption(fd, IPPROTO_TCP, TCP_NODELAY, 1)) {
+        return optionFailed();
+    }
+    if (options.sendBufferSize > 0 && !setIntOption(fd, SOL_SOCKET, SO_SNDBUF, options.sendBufferSize)) {
+        return optionFailed();
+    }
+    if (options.receiveBufferSize > 0 && !setIntOption(fd, SOL_SOCKET, SO_RCVBUF, options.receiveBufferSize)) {
+        return optionFailed();
+    }
+    if (options.busyPollUs > 0 && !setIntOption(fd, SOL_SOCKET, SO_BUSY_POLL, (int)options.busyPollUs)) {
+        return optionFailed();
+    }
+    if (tcp && options.userTimeoutMs > 0 && !setIntOption(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, (int)options.userTimeoutMs)) {
+        return optionFailed();
+    }
+    if (tcp && options.keepAlive) {
+        if (!setIntOption(fd, SOL_SOCKET, SO_KEEPALIVE, 1)) {
+            return optionFailed();
+        }
+        if (options.keepAliveIdleS > 0 && !setIntOption(fd, IPPROTO_TCP, TCP_KEEPIDLE, options.keepAliveIdleS)) {
+            return optionFailed();
+        }
+        if (options.keepAliveIntervalS > 0 && !setIntOption(fd, IPPROTO_TCP, TCP_KEEPINTVL, options.keepAliveIntervalS)) {
+            return optionFailed();
+        }
+        if (options.keepAliveCount > 0 && !setIntOption(fd, IPPROTO_TCP, TCP_KEEPCNT, options.keepAliveCount)) {
+            return optionFailed();
+        }
+    }
+    return applyAcceptedSocketOptions(fd, options);
+}
+
+/*
+ * Accepted sockets inherit the options of their listener,
+ * but quick ack is a state of the connection
+ */
+pipe_ret_t applyAcceptedSocketOptions(int fd, const socket_options_t & options) {
+    pipe_ret_t ret;
+    if (options.quickAck && isTcpSocket(fd) && !setIntOption(fd, IPPROTO_TCP, TCP_QUICKACK, 1)) {
+        return optionFailed();
+    }
+    ret.success = true;
+    return ret;
+}
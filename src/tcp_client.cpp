@@ -1,5 +1,13 @@
 #include "../include/tcp_client.h"
 #include <netinet/tcp.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+const uint TcpClient::DRAIN_POLL_INTERVAL_MS;
 
 
 pipe_ret_t TcpClient::connectTo(
@@ -8,73 +16,128 @@ pipe_ret_t TcpClient::connectTo(
   const std::string & client_addr,
   int client_port)
 {
+  if (connected || m_reconnecting) {   // the previous connection is still up
+    finish();
+  }
+  terminateReceiveThread();
   stop = false;
-  m_sockfd = 0;
+  m_sockfd = -1;
   pipe_ret_t ret;
 
-  m_sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-
-  if (m_sockfd == -1) {   //socket failed
+  if (m_stream != nullptr) {   // of the previous connection
+    m_stream->close();
+    m_stream = nullptr;
+  }
+  if (m_tls.enabled && (m_transport == TRANSPORT_MEMORY || m_useIoUring || m_reconnect.enabled)) {
     ret.success = false;
-    ret.msg = strerror(errno);
+    ret.msg = ret.reason = "TLS needs a TCP or Unix connection, without io_uring nor reconnecting";
+    return ret;
+  }
+  if (m_compression.enabled) {
+    ret = checkCompression(m_compression, m_framing.mode);
+    if (!ret.success) {
+      return ret;
+    }
+  }
+  if (m_transport == TRANSPORT_MEMORY) {
+    ret = connectMemory(server_addr);
+  } else if (m_transport == TRANSPORT_UNIX) {
+    ret = unixSocketAddress(server_addr, m_unixServer, m_unixServerSize);
+  } else {
+    ret = resolveServer(server_addr, server_port, client_addr, client_port);
+  }
+  if (!ret.success) {
     return ret;
   }
 
-  // timeout of receive set to 0 as we do not want to disconnect when nothing is received
-  struct timeval tv_recv = {
-    .tv_sec = 0,
-    .tv_usec = 0,
-  };
-  // set timeout for send to inform user of slow connection
-  struct timeval tv_send = {
-    .tv_sec = 0,
-    .tv_usec = 100000,
-  };
+  if (m_transport != TRANSPORT_MEMORY) {
+    ret = openSocket(m_sockfd);
+    if (!ret.success) {
+      return ret;
+    }
 
-  if (setsockopt(m_sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv_recv, sizeof(tv_recv)) == -1) {
-    std::cerr << "RCVTIMEO error" << std::endl;
-  }
-  if (setsockopt(m_sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv_send, sizeof(tv_send)) == -1) {
-    std::cerr << "SNDTIMEO error" << std::endl;
+    int connectRet = connectSocket(m_sockfd);
+    if (connectRet == -1) {
+      ret.success = false;
+      ret.msg = ret.reason = strerror(errno);
+      close(m_sockfd);
+      m_sockfd = -1;
+      return ret;
+    }
+
+    if (m_tls.enabled) {
+      ret = startTls(m_transport == TRANSPORT_TCP ? server_addr : "");
+      if (!ret.success) {
+        return ret;
+      }
+    }
   }
 
-  int option = 1;
-  if (setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(int)) == -1) {
-    std::cerr << "REUSEADDR error" << std::endl;
+  delete m_frameBuffer;
+  m_frameBuffer = nullptr;
+  delete m_receiveBuffers;
+  m_receiveBuffers = nullptr;
+  if (m_framing.mode != FRAMING_NONE) {
+    m_frameBuffer = new FrameBuffer(m_framing.bufferSize);
+  } else if (!m_useIoUring) {
+    m_receiveBuffers = new ReceiveBuffers();
+    m_receiveBuffers->setStream(m_stream);
   }
-  if (setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(int)) == -1) {
-    std::cerr << "REUSEPORT error" << std::endl;
+  delete m_compressor;
+  m_compressor = nullptr;
+  delete m_decompressor;
+  m_decompressor = nullptr;
+  if (m_compression.enabled) {
+    m_compressor = new Compressor(m_compression, m_framing.mode);
+    m_decompressor = new Decompressor(m_compression, m_framing.maxMessageSize);
   }
 
-  /** Enable keep alive mode
-   */
-  int keepalive = 1;
-  /** The time (in seconds) the connection needs to remain
-   * idle before TCP starts sending keepalive probes (TCP_KEEPIDLE socket option)
-   */
-  int keepidle = 1;
-  /** The maximum number of keepalive probes TCP should
-   * send before dropping the connection. (TCP_KEEPCNT socket option)
-   */
-  int keepcnt = 3;
-  /** The time (in seconds) between individual keepalive probes.
-   *  (TCP_KEEPINTVL socket option)
-   */
-  int keepintvl = 1;
-  if (setsockopt(m_sockfd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive)) == -1) {
-    std::cerr << "KEEPALIVE error" << std::endl;
+  // from now on the socket is non-blocking, sends are queued
+  // and flushed by the receive thread when the socket is full.
+  // With io_uring all sends are made by the receive thread, and
+  // the socket stays blocking as io_uring waits for it by itself
+  if (!m_useIoUring) {
+    int flags = fcntl(m_sockfd, F_GETFL, 0);
+    fcntl(m_sockfd, F_SETFL, flags | O_NONBLOCK);
   }
-  //set the keepalive options
-  if (setsockopt(m_sockfd, IPPROTO_TCP, TCP_KEEPCNT, &keepcnt, sizeof(keepcnt)) != 0) {
-    std::cerr << "TCP_KEEPCNT error" << std::endl;
+  delete m_sendQueue;
+  m_sendQueue = new SendQueue(m_sendQueueLimit);
+  m_sendQueue->setCorkBatches(m_socketOptions.corkBatches);
+  m_sendQueue->setStream(m_stream);
+  if (m_useIoUring) {
+    ret = initUring();
+    if (!ret.success) {
+      return ret;
+    }
   }
-  if (setsockopt(m_sockfd, IPPROTO_TCP, TCP_KEEPIDLE, &keepidle, sizeof(keepidle)) != 0) {
-    std::cerr << "TCP_KEEPIDLE error" << std::endl;
+  ret = initWakeup();
+  if (!ret.success) {
+    return ret;
   }
-  if (setsockopt(m_sockfd, IPPROTO_TCP, TCP_KEEPINTVL, &keepintvl, sizeof(keepintvl)) != 0) {
-    std::cerr << "TCP_KEEPINTVL error" << std::endl;
+
+  m_reconnecting = false;
+  m_draining = false;
+  if (m_receiveTask != nullptr) {   // connecting again from an observer, it returns afterwards
+    m_receiveTask->detach();
+    delete m_receiveTask;
   }
+  m_receiveTask = new std::thread(&TcpClient::ReceiveTask, this);
+  ret.success = true;
+  connected = true;
+  return ret;
+}
 
+/*
+ * Fill the TCP address of the server, resolving its
+ * name if needed, and the local address to bind to
+ */
+pipe_ret_t TcpClient::resolveServer(
+  const std::string & server_addr,
+  int server_port,
+  const std::string & client_addr,
+  int client_port)
+{
+  pipe_ret_t ret;
   int inetSuccess = inet_aton(server_addr.c_str(), &m_server.sin_addr);
 
   if (!inetSuccess) {  // inet_addr failed to parse address
@@ -83,7 +146,7 @@ pipe_ret_t TcpClient::connectTo(
     struct in_addr ** addrList;
     if ( (host = gethostbyname(server_addr.c_str() ) ) == NULL) {
       ret.success = false;
-      ret.msg = "Failed to resolve hostname";
+      ret.msg = ret.reason = "Failed to resolve hostname";
       return ret;
     }
     addrList = (struct in_addr **) host->h_addr_list;
@@ -92,7 +155,6 @@ pipe_ret_t TcpClient::connectTo(
   m_server.sin_family = AF_INET;
   m_server.sin_port = htons(server_port);
 
-  struct sockaddr_in m_client;
   // Explicitly assigning port from paramters
   // binding client with that port
   // this allows multiple clients in same process to define different port
@@ -102,50 +164,298 @@ pipe_ret_t TcpClient::connectTo(
 
   // This ip address will change according to the machine
   m_client.sin_addr.s_addr = inet_addr(client_addr.c_str());
+  ret.success = true;
+  return ret;
+}
 
-  int bindRet = bind(m_sockfd, (struct sockaddr *)&m_client, sizeof(m_client));
-  if (bindRet == -1) {
+/*
+ * Connect to the in-memory listener registered under name.
+ * The eventfd of the stream takes the place of the socket.
+ */
+pipe_ret_t TcpClient::connectMemory(const std::string & name)
+{
+  pipe_ret_t ret;
+  if (m_useIoUring || m_reconnect.enabled) {
     ret.success = false;
-    ret.msg = strerror(errno);
+    ret.msg = ret.reason = "The memory transport supports neither io_uring nor reconnecting";
     return ret;
   }
+  MemoryStream * stream;
+  ret = MemoryListener::connect(name, stream);
+  if (!ret.success) {
+    return ret;
+  }
+  m_stream = stream;
+  m_sockfd = m_stream->fd();
+  return ret;
+}
 
-  int connectRet = connect(m_sockfd, (struct sockaddr *)&m_server, sizeof(m_server));
-  if (connectRet == -1) {
+/*
+ * Create a socket bound to the client address, with the client
+ * socket options set. On failure sockfd is -1. Unix sockets
+ * are left unbound.
+ */
+pipe_ret_t TcpClient::openSocket(int & sockfd)
+{
+  pipe_ret_t ret;
+  bool unixSocket = m_transport == TRANSPORT_UNIX;
+  sockfd = unixSocket ? socket(AF_UNIX, SOCK_STREAM, 0) : socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+  if (sockfd == -1) {   //socket failed
     ret.success = false;
-    ret.msg = strerror(errno);
+    ret.msg = ret.reason = strerror(errno);
     return ret;
   }
 
-  m_receiveTask = new std::thread(&TcpClient::ReceiveTask, this);
+  // timeout of receive set to 0 as we do not want to disconnect when nothing is received
+  struct timeval tv_recv = {
+    .tv_sec = 0,
+    .tv_usec = 0,
+  };
+
+  if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv_recv, sizeof(tv_recv)) == -1) {
+    std::cerr << "RCVTIMEO error" << std::endl;
+  }
+
+  ret = applySocketOptions(sockfd, m_socketOptions);
+  if (!ret.success) {
+    close(sockfd);
+    sockfd = -1;
+    return ret;
+  }
+  if (unixSocket) {
+    ret.success = true;
+    return ret;
+  }
+
+  int option = 1;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(int)) == -1) {
+    std::cerr << "REUSEADDR error" << std::endl;
+  }
+  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(int)) == -1) {
+    std::cerr << "REUSEPORT error" << std::endl;
+  }
+
+  int bindRet = bind(sockfd, (struct sockaddr *)&m_client, sizeof(m_client));
+  if (bindRet == -1) {
+    ret.success = false;
+    ret.msg = ret.reason = strerror(errno);
+    close(sockfd);
+    sockfd = -1;
+    return ret;
+  }
   ret.success = true;
-  connected = true;
   return ret;
 }
 
+/*
+ * connect() sockfd to the TCP or Unix address of the server
+ */
+int TcpClient::connectSocket(int sockfd)
+{
+  if (m_transport == TRANSPORT_UNIX) {
+    return connect(sockfd, (struct sockaddr *)&m_unixServer, m_unixServerSize);
+  }
+  return connect(sockfd, (struct sockaddr *)&m_server, sizeof(m_server));
+}
+
+/*
+ * Run the TLS handshake over the connected socket, made non-blocking,
+ * within the handshake timeout. The stream owns the socket from then
+ * on; if the handshake fails, both are closed.
+ */
+pipe_ret_t TcpClient::startTls(const std::string & serverName)
+{
+  pipe_ret_t ret;
+  delete m_tlsContext;
+  m_tlsContext = new TlsContext();
+  ret = m_tlsContext->init(m_tls, false);
+  if (!ret.success) {
+    close(m_sockfd);
+    m_sockfd = -1;
+    return ret;
+  }
+  TlsStream * stream;
+  ret = m_tlsContext->createStream(m_sockfd, m_tls.serverName.empty() ? serverName : m_tls.serverName, stream);
+  if (!ret.success) {
+    close(m_sockfd);
+    m_sockfd = -1;
+    return ret;
+  }
+  int flags = fcntl(m_sockfd, F_GETFL, 0);
+  fcntl(m_sockfd, F_SETFL, flags | O_NONBLOCK);
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_tls.handshakeTimeoutMs);
+  while (true) {
+    ret = stream->handshake();
+    if (ret.success || ret.code != EAGAIN) {
+      break;
+    }
+    int timeout = -1;
+    if (m_tls.handshakeTimeoutMs > 0) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+      if (left.count() <= 0) {
+        ret.msg = ret.reason = "TLS handshake timeout";
+        break;
+      }
+      timeout = (int)left.count() + 1;
+    }
+    struct pollfd fds;
+    fds.fd = m_sockfd;
+    fds.events = stream->handshakeWantsWrite() ? POLLOUT : POLLIN;
+    if (poll(&fds, 1, timeout) == -1 && errno != EINTR) {
+      ret.success = false;
+      ret.msg = ret.reason = strerror(errno);
+      break;
+    }
+  }
+  if (!ret.success) {
+    stream->close();
+    m_sockfd = -1;
+    return ret;
+  }
+  m_stream = stream;
+  return ret;
+}
 
+/*
+ * Create the io_uring of the receive thread
+ */
+pipe_ret_t TcpClient::initUring()
+{
+  pipe_ret_t ret;
+  delete m_uring;
+  m_uring = new IoUring();
+  ret = m_uring->init(URING_ENTRIES);
+  if (!ret.success) {
+    return ret;
+  }
+  ret = m_uring->initBuffers(URING_BUFFERS, MAX_PACKET_SIZE);
+  if (!ret.success) {
+    return ret;
+  }
+  m_flushRequested = false;
+  ret.success = true;
+  return ret;
+}
+
+/*
+ * Create the eventfd waking up the receive thread for queued sends.
+ * It is blocking with io_uring, which reads it through the ring and
+ * would otherwise complete the read right away with EAGAIN.
+ */
+pipe_ret_t TcpClient::initWakeup()
+{
+  pipe_ret_t ret;
+  if (m_wakeupfd != -1 && m_wakeupBlocking == m_useIoUring) {
+    ret.success = true;
+    return ret;
+  }
+  if (m_wakeupfd != -1) {
+    close(m_wakeupfd);
+  }
+  m_wakeupfd = eventfd(0, m_useIoUring ? EFD_CLOEXEC : EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_wakeupfd == -1) {
+    ret.success = false;
+    ret.msg = ret.reason = strerror(errno);
+    return ret;
+  }
+  m_wakeupBlocking = m_useIoUring;
+  ret.success = true;
+  return ret;
+}
+
+/*
+ * Send message to server. With framing, the
+ * message is prefixed by its length.
+ * Never blocks: the message is written right away if the
+ * socket has room, else queued and written by the receive
+ * thread as soon as the socket drains. While a client set to
+ * reconnect is disconnected, messages are queued until it is
+ * connected again.
+ */
 pipe_ret_t TcpClient::sendMsg(const char * msg, size_t size)
 {
   pipe_ret_t ret;
-  if (!connected) {
+  bool reconnecting = m_reconnecting;
+  if (!connected && !reconnecting) {
     ret.success = false;
-    ret.msg = "not connected";
+    ret.reason = "not connected";
     return ret;
   }
-  ssize_t numBytesSent = send(m_sockfd, msg, size, 0);
-  if (numBytesSent < 0) {    // send failed
+  Payload payload;
+  if (m_compressor != nullptr) {
+    payload = m_compressor->encode(msg, size);
+  } else {
+    char header[MAX_FRAME_HEADER_SIZE];
+    size_t headerSize = encodeFrameHeader(m_framing.mode, size, header);
+    payload = Payload(header, headerSize, msg, size);
+  }
+  if (reconnecting && m_sendQueue->queuedBytes() + payload.size() > m_reconnect.maxBufferedBytes) {
     ret.success = false;
-    ret.code = errno;
-    ret.msg = strerror(errno);
+    ret.reason = "reconnect buffer is full";
+    return ret;
+  }
+  if (m_sendQueue->push(payload, false, BACKPRESSURE_DROP) != SendQueue::PUSH_QUEUED) {
+    ret.success = false;
+    ret.reason = "send queue is full";
+    return ret;
+  }
+  if (m_corked) {   // sent by uncork()
+    ret.success = true;
+    return ret;
+  }
+  return flushQueue();
+}
+
+/*
+ * Hold the messages sent from now on in the send queue, so many small
+ * messages go out in a single write and full segments on uncork().
+ * Must be called once connected.
+ */
+void TcpClient::cork()
+{
+  m_corked = true;
+  m_sendQueue->cork();
+}
+
+pipe_ret_t TcpClient::uncork()
+{
+  m_sendQueue->uncork();
+  m_corked = false;
+  return flushQueue();
+}
+
+/*
+ * Write what is queued, or have the receive thread write it if the
+ * socket is full or io_uring is used
+ */
+pipe_ret_t TcpClient::flushQueue()
+{
+  pipe_ret_t ret;
+  if (m_useIoUring) {
+    // the receive thread batches everything queued until it wakes up
+    if (!m_flushRequested.exchange(true)) {
+      uint64_t one = 1;
+      ssize_t written = write(m_wakeupfd, &one, sizeof(one));
+      (void)written;
+    }
+    ret.success = true;
     return ret;
   }
-  if ((uint)numBytesSent < size) {   // not all bytes were sent
+  SendQueue::flush_ret_t flushRet = m_sendQueue->tryFlush(m_sockfd);
+  if (flushRet == SendQueue::FLUSH_ERROR) {    // send failed
     ret.success = false;
-    char msg[100];
-    sprintf(msg, "Only %ld bytes out of %lu was sent to client", numBytesSent, size);
-    ret.msg = msg;
+    ret.code = errno;
+    ret.reason = strerror(errno);
     return ret;
   }
+  if (flushRet == SendQueue::FLUSH_WOULD_BLOCK) {
+    // let the receive thread wait for the socket to be writable
+    uint64_t one = 1;
+    ssize_t written = write(m_wakeupfd, &one, sizeof(one));
+    (void)written;
+  }
   ret.success = true;
   return ret;
 }
@@ -167,10 +477,27 @@ void TcpClient::unsubscribeAll()
  * the specific observer requested IP
  */
 void TcpClient::publishServerMsg(const char * msg, size_t msgSize)
+{
+  struct iovec buffer;
+  buffer.iov_base = (void *)msg;
+  buffer.iov_len = msgSize;
+  publishServerBuffers(&buffer, 1);
+}
+
+/*
+ * Publish a list of received buffers: at once to observers
+ * taking lists, one buffer after the other to the others
+ */
+void TcpClient::publishServerBuffers(const struct iovec * buffers, size_t count)
 {
   for (uint i = 0; i < m_subscibers.size(); i++) {
+    if (m_subscibers[i].incoming_buffers_func != NULL) {
+      m_subscibers[i].incoming_buffers_func(buffers, count);
+    }
     if (m_subscibers[i].incoming_packet_func != NULL) {
-      (*m_subscibers[i].incoming_packet_func)(msg, msgSize);
+      for (size_t j = 0; j < count; j++) {
+        m_subscibers[i].incoming_packet_func((const char *)buffers[j].iov_base, buffers[j].iov_len);
+      }
     }
   }
 }
@@ -186,60 +513,503 @@ void TcpClient::publishServerDisconnected(const pipe_ret_t & ret)
   connected = false;
   for (uint i = 0; i < m_subscibers.size(); i++) {
     if (m_subscibers[i].disconnected_func != NULL) {
-      (*m_subscibers[i].disconnected_func)(ret);
+      m_subscibers[i].disconnected_func(ret);
     }
   }
 }
 
 /*
- * Receive server packets, and notify user
+ * Publish that a client set to reconnect is connected again
+ */
+void TcpClient::publishServerReconnected()
+{
+  for (uint i = 0; i < m_subscibers.size(); i++) {
+    if (m_subscibers[i].reconnected_func != NULL) {
+      m_subscibers[i].reconnected_func();
+    }
+  }
+}
+
+/*
+ * Receive server packets, and notify user. A client set to
+ * reconnect goes on with the next connection once one is lost.
  */
 void TcpClient::ReceiveTask()
 {
+  do {
+    if (m_useIoUring) {
+      ReceiveTaskUring();
+    } else {
+      ReceiveTaskPoll();
+    }
+  } while (m_reconnecting && reconnect());
+}
 
+void TcpClient::ReceiveTaskPoll()
+{
+  // a memory stream is always writable, it signals room to write as readable
+  bool memory = m_transport == TRANSPORT_MEMORY;
   while (!stop) {
-    char msg[MAX_PACKET_SIZE];
-    int numOfBytesReceived = recv(m_sockfd, msg, MAX_PACKET_SIZE, 0);
-    if (numOfBytesReceived < 0) {
-      pipe_ret_t ret;
-      ret.success = false;
-      ret.msg = strerror(errno);
-      std::cerr << ret.msg << std::endl;
-      publishServerDisconnected(ret);
-      finish();
+    struct pollfd fds[2];
+    fds[0].fd = m_sockfd;
+    fds[0].events = POLLIN | (!memory && m_sendQueue->hasPendingWrites() ? POLLOUT : 0);
+    fds[1].fd = m_wakeupfd;
+    fds[1].events = POLLIN;
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      handleServerDisconnected(strerror(errno));
       break;
-    } else if (numOfBytesReceived > 0) {
-      publishServerMsg(msg, numOfBytesReceived);
+    }
+    if (fds[1].revents & POLLIN) {
+      uint64_t counter;
+      ssize_t numRead = read(m_wakeupfd, &counter, sizeof(counter));
+      (void)numRead;
+    }
+    if (fds[0].revents & POLLOUT) {
+      if (m_sendQueue->flush(m_sockfd) == SendQueue::FLUSH_ERROR) {
+        handleServerDisconnected(strerror(errno));
+        break;
+      }
+    }
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      // drain the socket before polling again
+      ssize_t numOfBytesReceived;
+      do {
+        numOfBytesReceived = receiveFromServer();
+      } while (numOfBytesReceived > 0 && !stop);
+      if (numOfBytesReceived == 0) {
+        handleServerDisconnected("server closed connection");
+        break;
+      }
+      if (numOfBytesReceived < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        handleServerDisconnected(strerror(errno));
+        break;
+      }
+    }
+    // after reading, which cleared the signals of the stream
+    if (memory && (fds[0].revents & POLLIN) && m_sendQueue->hasPendingWrites()) {
+      if (m_sendQueue->flush(m_sockfd) == SendQueue::FLUSH_ERROR) {
+        handleServerDisconnected(strerror(errno));
+        break;
+      }
     }
   }
 }
 
-pipe_ret_t TcpClient::finish()
+/*
+ * io_uring flavour of ReceiveTask(): a multishot recv publishes
+ * straight from provided buffers, and everything queued by sendMsg()
+ * meanwhile goes out with a single sendmsg, submitted together with
+ * the other requests in one io_uring_enter() per iteration
+ */
+void TcpClient::ReceiveTaskUring()
+{
+  m_uring->prepareRecv(m_sockfd, URING_RECV);
+  m_uring->prepareRead(m_wakeupfd, &m_wakeupCounter, sizeof(m_wakeupCounter), URING_WAKEUP);
+  bool sending = false;
+
+  while (!stop) {
+    if (!sending) {
+      m_flushRequested = false;
+      const struct msghdr * msg = m_sendQueue->beginSend();
+      if (msg != nullptr) {
+        sending = m_uring->prepareSend(m_sockfd, msg, URING_SEND);
+      }
+    }
+    int submitRet = m_uring->submit(1);
+    if (submitRet < 0 && submitRet != -EINTR && submitRet != -EBUSY) {
+      handleServerDisconnected(strerror(-submitRet));
+      return;
+    }
+
+    uring_completion_t completion;
+    while (!stop && m_uring->nextCompletion(completion)) {
+      if (completion.token == URING_WAKEUP) {
+        m_uring->prepareRead(m_wakeupfd, &m_wakeupCounter, sizeof(m_wakeupCounter), URING_WAKEUP);
+      } else if (completion.token == URING_SEND) {
+        sending = false;
+        if (!m_sendQueue->completeSend(completion.result)) {
+          handleServerDisconnected(strerror(errno));
+          return;
+        }
+      } else if (completion.result > 0) { // URING_RECV
+        bool valid = handleServerData(m_uring->buffer(completion.bufferId), completion.result);
+        m_uring->recycleBuffer(completion.bufferId);
+        if (!valid) {
+          handleServerDisconnected(strerror(EPROTO));
+          return;
+        }
+        if (!completion.more) {
+          m_uring->prepareRecv(m_sockfd, URING_RECV);
+        }
+      } else if (completion.result == 0) {
+        handleServerDisconnected("server closed connection");
+        return;
+      } else if (completion.result == -ENOBUFS) { // buffers were recycled meanwhile
+        m_uring->prepareRecv(m_sockfd, URING_RECV);
+      } else {
+        handleServerDisconnected(strerror(-completion.result));
+        return;
+      }
+    }
+  }
+}
+
+/*
+ * Connection lost: publish it, then finish the client, or with
+ * reconnect set, keep what is queued for the next connection
+ * and have the receive thread connect again
+ */
+void TcpClient::handleServerDisconnected(const char * reason)
+{
+  pipe_ret_t ret;
+  ret.success = false;
+  ret.msg = ret.reason = reason;
+  std::cerr << ret.msg << std::endl;
+  bool reconnect = m_reconnect.enabled && !stop && !m_draining;
+  if (reconnect) {
+    m_reconnecting = true;
+    m_sendQueue->restart();
+    // the descriptor is kept for the next connection, see reconnect()
+    shutdown(m_sockfd, SHUT_RDWR);
+  }
+  publishServerDisconnected(ret);
+  if (!reconnect) {
+    finish();
+  }
+}
+
+/*
+ * Connect to the server again, after a jittered, exponentially
+ * growing delay before every attempt. The new socket takes over the
+ * descriptor number of the lost one, so senders never write to a
+ * descriptor that was closed under their feet.
+ * Return false if the client was finished, or gave up.
+ */
+bool TcpClient::reconnect()
+{
+  // requests of the lost connection go with its ring, including
+  // the read of the wakeup eventfd, which is read here meanwhile
+  delete m_uring;
+  m_uring = nullptr;
+  for (uint attempt = 0; m_reconnect.maxAttempts == 0 || attempt < m_reconnect.maxAttempts; attempt++) {
+    if (!waitWhileDisconnected(-1, backoffDelay(attempt))) {
+      return false;
+    }
+    int sockfd;
+    pipe_ret_t ret = openSocket(sockfd);
+    if (ret.success) {
+      ret = connectWithTimeout(sockfd);
+      if (!ret.success || stop) {
+        close(sockfd);
+      }
+    }
+    if (stop) {
+      return false;
+    }
+    if (!ret.success) {
+      continue;
+    }
+    dup2(sockfd, m_sockfd);
+    close(sockfd);
+    if (m_useIoUring && !initUring().success) {
+      shutdown(m_sockfd, SHUT_RDWR);
+      continue;
+    }
+    // a partial message of the lost connection will never complete
+    delete m_frameBuffer;
+    m_frameBuffer = nullptr;
+    if (m_framing.mode != FRAMING_NONE) {
+      m_frameBuffer = new FrameBuffer(m_framing.bufferSize);
+    }
+    connected = true;
+    m_reconnecting = false;
+    publishServerReconnected();
+    return true;
+  }
+
+  m_reconnecting = false;
+  pipe_ret_t ret;
+  ret.success = false;
+  ret.msg = ret.reason = "gave up reconnecting";
+  publishServerDisconnected(ret);
+  finish();
+  return false;
+}
+
+/*
+ * Connect sockfd to the server within the reconnect timeout. The
+ * socket is left non-blocking, unless driven by io_uring.
+ */
+pipe_ret_t TcpClient::connectWithTimeout(int sockfd)
 {
-  stop = true;
-  terminateReceiveThread();
   pipe_ret_t ret;
-  if (close(m_sockfd) == -1) {   // close failed
+  int flags = fcntl(sockfd, F_GETFL, 0);
+  fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+  int connectRet = connectSocket(sockfd);
+  if (connectRet == -1 && errno != EINPROGRESS) {
     ret.success = false;
-    ret.msg = strerror(errno);
+    ret.msg = ret.reason = strerror(errno);
     return ret;
   }
+  if (connectRet == -1) {
+    if (!waitWhileDisconnected(sockfd, m_reconnect.connectTimeoutMs)) {
+      ret.success = false;
+      ret.msg = ret.reason = "client finished";
+      return ret;
+    }
+    // not writable by now means timed out
+    int error = ETIMEDOUT;
+    struct pollfd fds;
+    fds.fd = sockfd;
+    fds.events = POLLOUT;
+    if (poll(&fds, 1, 0) == 1) {
+      socklen_t errorSize = sizeof(error);
+      if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &errorSize) == -1) {
+        error = errno;
+      }
+    }
+    if (error != 0) {
+      ret.success = false;
+      ret.msg = ret.reason = strerror(error);
+      return ret;
+    }
+  }
+  if (m_useIoUring) {
+    fcntl(sockfd, F_SETFL, flags);
+  }
   ret.success = true;
   return ret;
 }
 
+/*
+ * Wait timeoutMs, or until fd (unless -1) is writable. Wakeups of
+ * sendMsg() are consumed meanwhile: what they queued is sent once
+ * connected. Return false if the client was finished.
+ */
+bool TcpClient::waitWhileDisconnected(int fd, uint timeoutMs)
+{
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+  while (!stop) {
+    auto now = std::chrono::steady_clock::now();
+    if (now >= deadline) {
+      return true;
+    }
+    struct pollfd fds[2];
+    fds[0].fd = m_wakeupfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = fd;
+    fds[1].events = POLLOUT;
+    int timeout = (int)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1;
+    int pollRet = poll(fds, fd == -1 ? 1 : 2, timeout);
+    if (pollRet > 0 && (fds[0].revents & POLLIN)) {
+      uint64_t counter;
+      ssize_t numRead = read(m_wakeupfd, &counter, sizeof(counter));
+      (void)numRead;
+    }
+    if (pollRet > 0 && fd != -1 && fds[1].revents != 0) {
+      return !stop;
+    }
+  }
+  return false;
+}
+
+/*
+ * Delay before reconnect attempt: growing exponentially from
+ * initialDelayMs up to maxDelayMs, minus a random share of it
+ */
+uint TcpClient::backoffDelay(uint attempt)
+{
+  double delay = m_reconnect.initialDelayMs * std::pow(m_reconnect.multiplier, (double)attempt);
+  delay = std::min(delay, (double)m_reconnect.maxDelayMs);
+  double jitter = std::max(0.0, std::min(m_reconnect.jitter, 1.0));
+  std::uniform_real_distribution<double> random(0.0, jitter);
+  return (uint)(delay * (1.0 - random(m_random)));
+}
+
+/*
+ * Receive from server and publish what was received. Without framing
+ * the socket is drained into a batch of buffers, published as a list.
+ * With framing it is read once, and only complete messages are
+ * published, straight from the reassembly buffer it is read into.
+ * Return recv() result, or -1 with errno set to EPROTO if the server
+ * violated the framing, or to EAGAIN once the socket is drained.
+ */
+ssize_t TcpClient::receiveFromServer()
+{
+  if (m_receiveBuffers != nullptr) {
+    ssize_t numOfBytesReceived = m_receiveBuffers->receive(m_sockfd, 0);
+    if (numOfBytesReceived > 0) {
+      publishServerBuffers(m_receiveBuffers->buffers(), m_receiveBuffers->count());
+      m_receiveBuffers->clear();
+      if (m_receiveBuffers->drained()) {
+        errno = EAGAIN;
+        return -1;
+      }
+    }
+    return numOfBytesReceived;
+  }
+
+  char * writePtr = m_frameBuffer->writePtr();
+  ssize_t numOfBytesReceived = m_stream != nullptr ?
+                               m_stream->read(writePtr, m_frameBuffer->writable()) :
+                               recv(m_sockfd, writePtr, m_frameBuffer->writable(), 0);
+  if (numOfBytesReceived > 0) {
+    m_frameBuffer->commit(numOfBytesReceived);
+    if (!publishFrames()) {
+      errno = EPROTO;
+      return -1;
+    }
+  }
+  return numOfBytesReceived;
+}
+
+/*
+ * Publish the complete messages of the reassembly buffer.
+ * Return false if the server violated the framing.
+ */
+bool TcpClient::publishFrames()
+{
+  m_messages.clear();
+  bool valid = m_frameBuffer->collectFrames(m_framing, m_messages);
+  if (m_decompressor != nullptr && !m_decompressor->decode(m_messages.data(), m_messages.size())) {
+    return false;
+  }
+  if (!m_messages.empty()) {
+    publishServerBuffers(m_messages.data(), m_messages.size());
+  }
+  return valid;
+}
+
+/*
+ * Publish data received into an io_uring provided buffer: as is
+ * without framing, or through the reassembly buffer.
+ * Return false if the server violated the framing.
+ */
+bool TcpClient::handleServerData(const char * data, size_t size)
+{
+  if (m_frameBuffer == nullptr) {
+    publishServerMsg(data, size);
+    return true;
+  }
+  while (size > 0) {
+    char * writePtr = m_frameBuffer->writePtr();
+    size_t chunkSize = std::min(size, m_frameBuffer->writable());
+    memcpy(writePtr, data, chunkSize);
+    m_frameBuffer->commit(chunkSize);
+    if (!publishFrames()) {
+      return false;
+    }
+    data += chunkSize;
+    size -= chunkSize;
+  }
+  return true;
+}
+
+/*
+ * Wait for the send queue to be written out, then half-close the
+ * connection: the server reads everything sent, then end of stream,
+ * and closes in turn, while replies are still received. Return once
+ * it did, or after timeoutMs.
+ */
+void TcpClient::drain(uint timeoutMs)
+{
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+  m_draining = true;
+  if (m_corked) {
+    uncork();
+  }
+  bool halfClosed = false;
+  while (connected && std::chrono::steady_clock::now() < deadline) {
+    if (!halfClosed && !m_sendQueue->hasPendingWrites()) {
+      halfClosed = true;
+      if (m_stream != nullptr) {
+        m_stream->shutdownWrite();
+      } else {
+        shutdown(m_sockfd, SHUT_WR);
+      }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(DRAIN_POLL_INTERVAL_MS));
+  }
+}
+
+/*
+ * Stop the receive thread and close the connection, after
+ * draining it if drainTimeoutMs is set, unless called from an
+ * observer on the receive thread
+ */
+pipe_ret_t TcpClient::finish(uint drainTimeoutMs)
+{
+  bool onReceiveThread = m_receiveTask != nullptr && m_receiveTask->get_id() == std::this_thread::get_id();
+  if (drainTimeoutMs > 0 && connected && !onReceiveThread) {
+    drain(drainTimeoutMs);
+  }
+  stop = true;
+  m_reconnecting = false;
+  if (m_wakeupfd != -1) {
+    uint64_t one = 1;
+    ssize_t written = write(m_wakeupfd, &one, sizeof(one));
+    (void)written;
+  }
+  terminateReceiveThread();
+  pipe_ret_t ret;
+  if (m_stream != nullptr) {
+    // released by the destructor or the next connectTo(),
+    // as the receive thread may still be reading it
+    m_stream->shutdown();
+  } else if (m_sockfd != -1) {   // unless finished already, on a disconnection
+    int closeRet = close(m_sockfd);
+    m_sockfd = -1;
+    if (closeRet == -1) {   // close failed
+      ret.success = false;
+      ret.msg = ret.reason = strerror(errno);
+      return ret;
+    }
+  }
+  ret.success = true;
+  return ret;
+}
+
+/*
+ * Join the receive thread, woken up by finish(). A receive thread
+ * finishing the client can't join itself: it is joined by the next
+ * finish() or connectTo(), or left to return if the client is
+ * destroyed from it.
+ */
 void TcpClient::terminateReceiveThread()
 {
-  if (m_receiveTask != nullptr) {
-    m_receiveTask->detach();
-    delete m_receiveTask;
-    m_receiveTask = nullptr;
+  if (m_receiveTask == nullptr || m_receiveTask->get_id() == std::this_thread::get_id()) {
+    return;
   }
+  m_receiveTask->join();
+  delete m_receiveTask;
+  m_receiveTask = nullptr;
 }
 
 TcpClient::~TcpClient()
 {
   printf("shutting down\r\n");
-  shutdown(m_sockfd, SHUT_RDWR);
+  if (m_stream == nullptr) {
+    shutdown(m_sockfd, SHUT_RDWR);
+  }
   finish();
+  if (m_receiveTask != nullptr) {   // destroyed by an observer
+    m_receiveTask->detach();
+    delete m_receiveTask;
+  }
+  delete m_frameBuffer;
+  delete m_receiveBuffers;
+  delete m_sendQueue;
+  delete m_uring;
+  if (m_wakeupfd != -1) {
+    close(m_wakeupfd);
+  }
+  if (m_stream != nullptr) {
+    m_stream->close();
+  }
+  delete m_tlsContext;
+  delete m_compressor;
+  delete m_decompressor;
 }
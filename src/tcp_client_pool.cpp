@@ -0,0 +1,459 @@
+#include "../include/tcp_client_pool.h"
+#include "../include/socket_options.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <chrono>
+#include <thread>
+
+
+namespace {
+  // per-thread generator of the random picks of POOL_LEAST_LOADED
+  uint32_t randomIndex(uint32_t bound)
+  {
+    static thread_local uint32_t state = 0;
+    if (state == 0) {
+      state = (uint32_t)std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+    }
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state % bound;
+  }
+}
+
+TcpClientPool::~TcpClientPool()
+{
+  finish();
+}
+
+/*
+ * Resolve server_addr once and connect config.connections sockets
+ * to it concurrently. Return once every connect completed, or when
+ * config.connectTimeoutMs expired, abandoning those still pending.
+ * Succeeds if at least one connection is up, see connectedCount().
+ */
+pipe_ret_t TcpClientPool::connectTo(
+  const std::string & server_addr,
+  int server_port,
+  const client_pool_config_t & config)
+{
+  pipe_ret_t ret;
+  if (!m_connections.empty()) {
+    ret.success = false;
+    ret.msg = ret.reason = "pool is already connected";
+    return ret;
+  }
+  m_config = config;
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo * addresses = nullptr;
+  std::string port = std::to_string(server_port);
+  int resolveRet = getaddrinfo(server_addr.c_str(), port.c_str(), &hints, &addresses);
+  if (resolveRet != 0) {
+    ret.success = false;
+    ret.msg = ret.reason = "Failed to resolve hostname";
+    return ret;
+  }
+
+  ret = startEventLoops();
+  if (!ret.success) {
+    freeaddrinfo(addresses);
+    return ret;
+  }
+
+  // all connections exist before the I/O threads look them up by index
+  for (uint i = 0; i < m_config.connections; i++) {
+    m_connections.push_back(new connection_t());
+  }
+  m_pendingConnects = m_config.connections;
+  m_connectError = "Timeout connecting to server";
+  for (uint i = 0; i < m_connections.size(); i++) {
+    connection_t * connection = m_connections[i];
+    connection->sockfd = socket(addresses->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (connection->sockfd == -1) {
+      connectDone(connection, CLOSED, strerror(errno));
+      continue;
+    }
+    pipe_ret_t optionsRet = applySocketOptions(connection->sockfd, m_config.socketOptions);
+    if (!optionsRet.success) {
+      connectDone(connection, CLOSED, optionsRet.reason);
+      continue;
+    }
+    connection->sendQueue = new SendQueue(m_config.sendQueueLimit);
+    connection->sendQueue->setCorkBatches(m_config.socketOptions.corkBatches);
+    if (m_config.framing.mode != FRAMING_NONE) {
+      connection->frameBuffer = new FrameBuffer(m_config.framing.bufferSize);
+    } else {
+      connection->receiveBuffers = new ReceiveBuffers();
+    }
+    connection->eventLoop = m_eventLoops[i % m_eventLoops.size()];
+
+    int connectRet = connect(connection->sockfd, addresses->ai_addr, addresses->ai_addrlen);
+    // the socket turns writable once connected, whether connect()
+    // completed right away or is still in progress
+    if ((connectRet == -1 && errno != EINPROGRESS) ||
+        !connection->eventLoop->add(connection->sockfd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, i)) {
+      connectDone(connection, CLOSED, strerror(errno));
+    }
+  }
+  freeaddrinfo(addresses);
+
+  std::unique_lock<std::mutex> lock(m_connectMtx);
+  m_connectCondition.wait_for(lock, std::chrono::milliseconds(m_config.connectTimeoutMs),
+                              [this]() { return m_pendingConnects == 0; });
+  const char * connectError = m_connectError;
+  lock.unlock();
+  // abandon the connects still in progress
+  for (uint i = 0; i < m_connections.size(); i++) {
+    connection_t * connection = m_connections[i];
+    int connecting = CONNECTING;
+    if (connection->state.compare_exchange_strong(connecting, CLOSED)) {
+      connection->eventLoop->remove(connection->sockfd);
+      shutdown(connection->sockfd, SHUT_RDWR);
+    }
+  }
+
+  if (m_numConnected == 0) {
+    finish();
+    ret.success = false;
+    ret.msg = ret.reason = connectError;
+    return ret;
+  }
+  ret.success = true;
+  return ret;
+}
+
+/*
+ * Start the I/O threads shared by the connections
+ */
+pipe_ret_t TcpClientPool::startEventLoops()
+{
+  pipe_ret_t ret;
+  uint numLoops = m_config.ioThreads;
+  if (numLoops == 0) {
+    numLoops = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (uint i = 0; i < numLoops; i++) {
+    EventLoop * eventLoop = new EventLoop();
+    m_eventLoops.push_back(eventLoop);
+    ret = eventLoop->init(this);
+    if (!ret.success) {
+      return ret;
+    }
+    ret = eventLoop->start();
+    if (!ret.success) {
+      return ret;
+    }
+  }
+  ret.success = true;
+  return ret;
+}
+
+/*
+ * A pending connect ended, successfully or else with error.
+ * Does nothing if the connection was already abandoned by connectTo().
+ */
+void TcpClientPool::connectDone(connection_t * connection, int newState, const char * error)
+{
+  int connecting = CONNECTING;
+  if (!connection->state.compare_exchange_strong(connecting, newState)) {
+    return;
+  }
+  if (newState == CONNECTED) {
+    m_numConnected++;
+  }
+  std::lock_guard<std::mutex> lock(m_connectMtx);
+  if (error != nullptr) {
+    m_connectError = error;
+  }
+  m_pendingConnects--;
+  if (m_pendingConnects == 0) {
+    m_connectCondition.notify_all();
+  }
+}
+
+/*
+ * Dispatch epoll events of connection token on its I/O thread
+ */
+void TcpClientPool::onEvents(uint64_t token, uint32_t events)
+{
+  connection_t * connection = m_connections[token];
+  if (connection->state == CONNECTING && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+    handleConnected(connection);
+  }
+  if (connection->state != CONNECTED) {
+    return;
+  }
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+    handleReadable(connection);
+  }
+  if ((events & EPOLLOUT) && connection->state == CONNECTED) {
+    if (connection->sendQueue->flush(connection->sockfd) == SendQueue::FLUSH_ERROR) {
+      handleClosed(connection, strerror(errno));
+    }
+  }
+}
+
+/*
+ * Non-blocking connect completed: find out how
+ */
+void TcpClientPool::handleConnected(connection_t * connection)
+{
+  int error = 0;
+  socklen_t errorSize = sizeof(error);
+  if (getsockopt(connection->sockfd, SOL_SOCKET, SO_ERROR, &error, &errorSize) == -1) {
+    error = errno;
+  }
+  if (error == 0) {
+    connectDone(connection, CONNECTED);
+    return;
+  }
+  connection->eventLoop->remove(connection->sockfd);
+  connectDone(connection, CLOSED, strerror(error));
+}
+
+/*
+ * Drain a connection socket until EAGAIN, as required by
+ * edge-triggered epoll, and publish what was received
+ */
+void TcpClientPool::handleReadable(connection_t * connection)
+{
+  while (true) {
+    ssize_t numOfBytesReceived = receive(connection);
+    if (numOfBytesReceived > 0) {
+      continue;
+    }
+    if (numOfBytesReceived == 0) {
+      handleClosed(connection, "server closed connection");
+      return;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      handleClosed(connection, strerror(errno));
+    }
+    return;
+  }
+}
+
+/*
+ * Receive once from a connection and publish what was received,
+ * as TcpClient::receiveFromServer() does
+ */
+ssize_t TcpClientPool::receive(connection_t * connection)
+{
+  ReceiveBuffers * receiveBuffers = connection->receiveBuffers;
+  if (receiveBuffers != nullptr) {
+    ssize_t numOfBytesReceived = receiveBuffers->receive(connection->sockfd, 0);
+    if (numOfBytesReceived > 0) {
+      publishServerBuffers(receiveBuffers->buffers(), receiveBuffers->count());
+      receiveBuffers->clear();
+      if (receiveBuffers->drained()) {
+        errno = EAGAIN;
+        return -1;
+      }
+    }
+    return numOfBytesReceived;
+  }
+
+  FrameBuffer * frameBuffer = connection->frameBuffer;
+  ssize_t numOfBytesReceived = recv(connection->sockfd, frameBuffer->writePtr(), frameBuffer->writable(), 0);
+  if (numOfBytesReceived > 0) {
+    frameBuffer->commit(numOfBytesReceived);
+    // messages of a read are published as one list
+    static thread_local std::vector<struct iovec> messages;
+    messages.clear();
+    bool valid = frameBuffer->collectFrames(m_config.framing, messages);
+    if (!messages.empty()) {
+      publishServerBuffers(messages.data(), messages.size());
+    }
+    if (!valid) {
+      errno = EPROTO;
+      return -1;
+    }
+  }
+  return numOfBytesReceived;
+}
+
+/*
+ * Take a connection out of service. Its socket stays open until
+ * finish(), as senders may still be writing to it.
+ */
+void TcpClientPool::handleClosed(connection_t * connection, const char * reason)
+{
+  int connected = CONNECTED;
+  if (!connection->state.compare_exchange_strong(connected, CLOSED)) {
+    return;
+  }
+  m_numConnected--;
+  connection->eventLoop->remove(connection->sockfd);
+  shutdown(connection->sockfd, SHUT_RDWR);
+  pipe_ret_t ret;
+  ret.success = false;
+  ret.msg = ret.reason = reason;
+  publishServerDisconnected(ret);
+}
+
+/*
+ * Connection the next message goes to, nullptr if none is connected
+ */
+TcpClientPool::connection_t * TcpClientPool::selectConnection()
+{
+  uint numConnections = (uint)m_connections.size();
+  if (numConnections == 0) {
+    return nullptr;
+  }
+  if (m_config.selection == POOL_LEAST_LOADED) {
+    // two random choices are almost as good as scanning them all
+    connection_t * first = m_connections[randomIndex(numConnections)];
+    connection_t * second = m_connections[randomIndex(numConnections)];
+    bool firstUp = first->state == CONNECTED;
+    bool secondUp = second->state == CONNECTED;
+    if (firstUp && secondUp) {
+      return second->sendQueue->queuedBytes() < first->sendQueue->queuedBytes() ? second : first;
+    }
+    if (firstUp || secondUp) {
+      return firstUp ? first : second;
+    }
+  }
+  for (uint i = 0; i < numConnections; i++) {
+    connection_t * connection = m_connections[m_nextConnection++ % numConnections];
+    if (connection->state == CONNECTED) {
+      return connection;
+    }
+  }
+  return nullptr;
+}
+
+/*
+ * Send message to server on one of the connections. With
+ * framing, the message is prefixed by its length.
+ * Never blocks, as TcpClient::sendMsg().
+ */
+pipe_ret_t TcpClientPool::sendMsg(const char * msg, size_t size)
+{
+  connection_t * connection = selectConnection();
+  if (connection == nullptr) {
+    pipe_ret_t ret;
+    ret.success = false;
+    ret.reason = "not connected";
+    return ret;
+  }
+  return send(connection, msg, size);
+}
+
+pipe_ret_t TcpClientPool::sendMsg(uint connection, const char * msg, size_t size)
+{
+  if (connection >= m_connections.size()) {
+    pipe_ret_t ret;
+    ret.success = false;
+    ret.reason = "no such connection";
+    return ret;
+  }
+  return send(m_connections[connection], msg, size);
+}
+
+pipe_ret_t TcpClientPool::send(connection_t * connection, const char * msg, size_t size)
+{
+  pipe_ret_t ret;
+  if (connection->state != CONNECTED) {
+    ret.success = false;
+    ret.reason = "not connected";
+    return ret;
+  }
+  char header[MAX_FRAME_HEADER_SIZE];
+  size_t headerSize = encodeFrameHeader(m_config.framing.mode, size, header);
+  Payload payload(header, headerSize, msg, size);
+  if (connection->sendQueue->push(payload, false, BACKPRESSURE_DROP) != SendQueue::PUSH_QUEUED) {
+    ret.success = false;
+    ret.reason = "send queue is full";
+    return ret;
+  }
+  // when the socket is full, its I/O thread writes the rest once it drains
+  if (connection->sendQueue->tryFlush(connection->sockfd) == SendQueue::FLUSH_ERROR) {
+    ret.success = false;
+    ret.code = errno;
+    ret.reason = strerror(errno);
+    return ret;
+  }
+  ret.success = true;
+  return ret;
+}
+
+void TcpClientPool::subscribe(const client_observer_t & observer)
+{
+  m_subscibers.push_back(observer);
+}
+
+void TcpClientPool::unsubscribeAll()
+{
+  m_subscibers.clear();
+}
+
+/*
+ * Publish what was received on any connection to observers: at
+ * once to those taking lists, one buffer after the other to the others
+ */
+void TcpClientPool::publishServerBuffers(const struct iovec * buffers, size_t count)
+{
+  for (uint i = 0; i < m_subscibers.size(); i++) {
+    if (m_subscibers[i].incoming_buffers_func != NULL) {
+      m_subscibers[i].incoming_buffers_func(buffers, count);
+    }
+    if (m_subscibers[i].incoming_packet_func != NULL) {
+      for (size_t j = 0; j < count; j++) {
+        m_subscibers[i].incoming_packet_func((const char *)buffers[j].iov_base, buffers[j].iov_len);
+      }
+    }
+  }
+}
+
+/*
+ * Publish the loss of one of the connections to observers
+ */
+void TcpClientPool::publishServerDisconnected(const pipe_ret_t & ret)
+{
+  for (uint i = 0; i < m_subscibers.size(); i++) {
+    if (m_subscibers[i].disconnected_func != NULL) {
+      m_subscibers[i].disconnected_func(ret);
+    }
+  }
+}
+
+/*
+ * Stop the I/O threads and close every connection.
+ * Must not be called from an observer.
+ */
+pipe_ret_t TcpClientPool::finish()
+{
+  for (uint i = 0; i < m_eventLoops.size(); i++) {
+    m_eventLoops[i]->stop();
+  }
+  for (uint i = 0; i < m_connections.size(); i++) {
+    connection_t * connection = m_connections[i];
+    if (connection->sockfd != -1) {
+      close(connection->sockfd);
+    }
+    delete connection->frameBuffer;
+    delete connection->receiveBuffers;
+    delete connection->sendQueue;
+    delete connection;
+  }
+  m_connections.clear();
+  for (uint i = 0; i < m_eventLoops.size(); i++) {
+    delete m_eventLoops[i];
+  }
+  m_eventLoops.clear();
+  m_numConnected = 0;
+  m_pendingConnects = 0;
+  pipe_ret_t ret;
+  ret.success = true;
+  return ret;
+}
@@ -1,146 +1,1507 @@
 
 #include "../include/tcp_server.h"
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 
+const uint TcpServer::DRAIN_POLL_INTERVAL_MS;
 
-void TcpServer::subscribe(const server_observer_t & observer) {
-    m_subscibers.push_back(observer);
+
+TcpServer::TcpServer() : m_sockfd(0), m_nextEventLoop(0), m_draining(false) {
+    m_clients.setReclaimHandler(std::bind(&TcpServer::closeClient, this, std::placeholders::_1));
+}
+
+TcpServer::~TcpServer() {
+    stopEventLoops();
+    for (uint i=0; i<m_retiredEventLoops.size(); i++) {
+        delete m_retiredEventLoops[i];
+    }
+    // workers hold client references, give them back before the clients table goes
+    delete m_workerPool;
+    // and so do receive threads, woken up if the server was not finished
+    m_clients.forEach([](Client & client) {
+        shutdownClient(client);
+    });
+    joinReceiveThreads();
+    for (auto it = m_receiveThreads.begin(); it != m_receiveThreads.end(); ++it) {
+        it->second.detach(); // deleting the server, it returns afterwards
+    }
+    delete m_memoryListener;
+    delete m_tlsContext;
+    delete m_compressor;
+    // the clients table, reclaiming what is left of them, goes afterwards
+    delete m_limiter;
+    m_limiter = nullptr;
+}
+
+/*
+ * Add an observer. Its wantedIp may be an address, a CIDR
+ * prefix, or empty for all clients; fails if it is neither.
+ */
+pipe_ret_t TcpServer::subscribe(const server_observer_t & observer) {
+    return m_observers.add(observer);
+}
+
+void TcpServer::unsubscribeAll() {
+    m_observers.clear();
+}
+
+void TcpServer::printClients() {
+    m_clients.forEach([](Client & client) {
+        std::string connected = client.isConnected() ? "True" : "False";
+        std::cout << "-----------------\n" <<
+                  "IP address: " << client.getIp() << std::endl <<
+                  "Connected?: " << connected << std::endl <<
+                  "Socket FD: " << client.getFileDescriptor() << std::endl <<
+                  "Message: " << client.getInfoMessage().c_str() << std::endl;
+    });
+}
+
+/*
+ * Snapshot of the server counters and histograms, plus the
+ * number of clients and the bytes queued for them right now.
+ * All zero if the server was started without collectMetrics.
+ */
+server_metrics_t TcpServer::getMetrics() {
+    server_metrics_t metrics;
+    metrics.bytesIn = m_metrics.bytesIn.value();
+    metrics.msgsIn = m_metrics.msgsIn.value();
+    metrics.bytesOut = m_metrics.bytesOut.value();
+    metrics.msgsOut = m_metrics.msgsOut.value();
+    metrics.partialWrites = m_metrics.partialWrites.value();
+    metrics.msgsDropped = m_metrics.msgsDropped.value();
+    metrics.accepted = m_metrics.accepted.value();
+    for (int i=0; i<DISCONNECT_REASONS; i++) {
+        metrics.disconnects[i] = m_metrics.disconnects[i].value();
+    }
+    metrics.handshakeFailures = m_metrics.handshakeFailures.value();
+    metrics.kernelTls = m_metrics.kernelTls.value();
+    metrics.rejected = m_metrics.rejected.value();
+    metrics.throttled = m_metrics.throttled.value();
+    metrics.clients = m_clients.size();
+    m_clients.forEach([&metrics](Client & client) {
+        if (client.m_sendQueue != nullptr) {
+            metrics.queuedBytes += client.m_sendQueue->queuedBytes();
+        }
+    });
+    m_metrics.acceptLatency.snapshot(metrics.acceptLatency);
+    m_metrics.callbackTime.snapshot(metrics.callbackTime);
+    return metrics;
+}
+
+/*
+ * Snapshot of the counters of a single client.
+ * Return false if client isn't connected.
+ */
+bool TcpServer::getClientMetrics(const Client & client, connection_metrics_t & metrics) {
+    Client * stored = m_clients.acquire(client.getId());
+    if (stored == nullptr) {
+        return false;
+    }
+    fillClientMetrics(*stored, metrics);
+    m_clients.release(stored);
+    return true;
+}
+
+/*
+ * Snapshot of the counters of every connected client
+ */
+void TcpServer::getClientsMetrics(std::vector<connection_metrics_t> & metrics) {
+    metrics.clear();
+    m_clients.forEach([&metrics](Client & client) {
+        metrics.push_back(connection_metrics_t());
+        fillClientMetrics(client, metrics.back());
+    });
+}
+
+void TcpServer::fillClientMetrics(Client & client, connection_metrics_t & metrics) {
+    metrics = connection_metrics_t();
+    metrics.clientId = client.getId();
+    if (client.m_metrics != nullptr) {
+        metrics.bytesIn = client.m_metrics->bytesIn.load(std::memory_order_relaxed);
+        metrics.msgsIn = client.m_metrics->msgsIn.load(std::memory_order_relaxed);
+        metrics.bytesOut = client.m_metrics->bytesOut.load(std::memory_order_relaxed);
+        metrics.msgsOut = client.m_metrics->msgsOut.load(std::memory_order_relaxed);
+        metrics.partialWrites = client.m_metrics->partialWrites.load(std::memory_order_relaxed);
+        metrics.msgsDropped = client.m_metrics->msgsDropped.load(std::memory_order_relaxed);
+    }
+    if (client.m_sendQueue != nullptr) {
+        metrics.queuedBytes = client.m_sendQueue->queuedBytes();
+        metrics.peakQueuedBytes = client.m_sendQueue->peakQueuedBytes();
+    }
+}
+
+/*
+ * Receive client packets, and notify user
+ */
+void TcpServer::receiveTask(client_id_t clientId) {
+
+    Client * client = m_clients.acquire(clientId);
+    if (client == nullptr) { // removed before the thread started
+        receiveTaskDone(clientId);
+        return;
+    }
+
+    while(client->isConnected()) {
+        ssize_t numOfBytesReceived = receiveFromClient(client);
+        if(numOfBytesReceived < 1) {
+            if (numOfBytesReceived == 0) { //client closed connection
+                countDisconnect(client, DISCONNECT_PEER_CLOSED);
+                client->setErrorMessage("Client closed connection");
+                //printf("client closed");
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) { // receive timeout
+                countDisconnect(client, DISCONNECT_TIMEOUT);
+                client->setErrorMessage("Read timeout");
+            } else {
+                countDisconnect(client, errno == EPROTO ? DISCONNECT_PROTOCOL_ERROR : DISCONNECT_SOCKET_ERROR);
+                client->setErrorMessage(strerror(errno));
+            }
+            client->setDisconnected();
+            notifyClientDisconnected(client);
+            m_clients.remove(clientId);
+            break;
+        }
+    }
+    m_clients.release(client);
+    receiveTaskDone(clientId);
+}
+
+/*
+ * Last thing a receive thread does: have it joined
+ */
+void TcpServer::receiveTaskDone(client_id_t clientId) {
+    std::lock_guard<std::mutex> lock(m_receiveThreadsMtx);
+    m_finishedThreads.push_back(clientId);
+}
+
+/*
+ * Spawn the receive thread of a thread per client client, after
+ * joining those which returned, so clients gone leave no thread behind
+ */
+void TcpServer::startReceiveThread(client_id_t clientId) {
+    std::lock_guard<std::mutex> lock(m_receiveThreadsMtx);
+    for (size_t i=0; i<m_finishedThreads.size(); i++) {
+        auto it = m_receiveThreads.find(m_finishedThreads[i]);
+        if (it != m_receiveThreads.end()) { // unless joined by finish() already
+            it->second.join();
+            m_receiveThreads.erase(it);
+        }
+    }
+    m_finishedThreads.clear();
+    m_receiveThreads[clientId] = std::thread(&TcpServer::receiveTask, this, clientId);
+}
+
+/*
+ * Wait for every receive thread to return, their clients must have
+ * been shut down. A receive thread finishing the server can't join
+ * itself: the destructor does, unless it runs on it as well.
+ */
+void TcpServer::joinReceiveThreads() {
+    std::unordered_map<client_id_t, std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lock(m_receiveThreadsMtx);
+        threads.swap(m_receiveThreads);
+    }
+    auto self = threads.end();
+    for (auto it = threads.begin(); it != threads.end(); ++it) {
+        if (it->second.get_id() == std::this_thread::get_id()) {
+            self = it;
+        } else {
+            it->second.join();
+        }
+    }
+    std::lock_guard<std::mutex> lock(m_receiveThreadsMtx);
+    if (self != threads.end()) {
+        m_receiveThreads[self->first] = std::move(self->second);
+    }
+}
+
+/*
+ * Dispatch epoll readiness of a client socket.
+ * Called on the I/O thread owning the client.
+ */
+void TcpServer::onEvents(uint64_t token, uint32_t events) {
+    if (isListenerToken(token)) {
+        acceptReactorClients(listenerIndex(token));
+        return;
+    }
+    Client * client = m_clients.acquire(token);
+    if (client == nullptr) { // stale event of a removed client
+        return;
+    }
+    if (client->m_handshake != nullptr) {
+        if (!continueHandshake(client)) {
+            m_clients.release(client);
+            return;
+        }
+        // read what came along with the end of the handshake, and
+        // write what observers sent once told of the client
+        events |= EPOLLIN | EPOLLOUT;
+    }
+    if ((events & EPOLLERR) && client->m_sendQueue != nullptr) { // maybe zero-copy notifications
+        client->m_sendQueue->reapZeroCopy(client->getFileDescriptor());
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        handleClientReadable(client);
+    }
+    if ((events & EPOLLOUT) && client->isConnected()) {
+        handleClientWritable(client);
+    }
+    m_clients.release(client);
+}
+
+/*
+ * Dispatch io_uring completions of SERVER_MODE_IO_URING I/O threads
+ */
+void TcpServer::onCompletion(IoUring & uring, const uring_completion_t & completion) {
+    switch (uringOp(completion.token)) {
+        case URING_ACCEPT:
+            handleUringAccept(uring, (uint)uringId(completion.token), completion);
+            break;
+        case URING_RECV:
+            handleUringReceive(uring, completion);
+            break;
+        case URING_SEND:
+            handleUringSent(completion);
+            break;
+    }
+}
+
+/*
+ * Take the TLS handshake of a client as far as its socket allows.
+ * Once done, the client is connected and observers are told.
+ * Return true if the client is connected by now.
+ */
+bool TcpServer::continueHandshake(Client * client) {
+    pipe_ret_t ret = client->m_handshake->handshake();
+    if (!ret.success) {
+        if (ret.code != EAGAIN) {
+            handleClientDisconnected(client, DISCONNECT_PROTOCOL_ERROR, ret.reason);
+        }
+        return false;
+    }
+    TlsStream * stream = client->m_handshake;
+    client->m_handshake = nullptr;
+    if (m_config.collectMetrics && (stream->kernelSend() || stream->kernelReceive())) {
+        m_metrics.kernelTls.add();
+    }
+    client->m_sendQueue->uncork();
+    client->setConnected();
+    publishClientConnected(*client);
+    return client->isConnected();
+}
+
+/*
+ * Drain a non-blocking client socket until EAGAIN, as required
+ * by edge-triggered epoll, and notify user of what was read.
+ */
+void TcpServer::handleClientReadable(Client * client) {
+    while (true) {
+        if (client->m_readLimit != nullptr) {
+            // over its rate: what is left stays in the socket meanwhile
+            uint64_t delayMs = client->m_readLimit->delay(TimerWheel::clockMs());
+            if (delayMs > 0) {
+                pauseClient(client, delayMs, true);
+                return;
+            }
+        }
+        ssize_t numOfBytesReceived = receiveFromClient(client);
+        if (numOfBytesReceived > 0) {
+            if (!client->isConnected()) { // server finished by observer
+                return;
+            }
+            if (client->m_readLimit != nullptr) {
+                client->m_readLimit->take((size_t)numOfBytesReceived);
+            }
+            continue;
+        }
+        if (numOfBytesReceived == 0) { //client closed connection
+            handleClientDisconnected(client, DISCONNECT_PEER_CLOSED, "Client closed connection");
+            return;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) { // socket drained
+            return;
+        }
+        handleClientDisconnected(client, errno == EPROTO ? DISCONNECT_PROTOCOL_ERROR : DISCONNECT_SOCKET_ERROR,
+                                 strerror(errno));
+        return;
+    }
+}
+
+/*
+ * The timer of a client expired, token is its id
+ */
+void TcpServer::onTimer(uint64_t token) {
+    Client * client = m_clients.acquire(token);
+    if (client == nullptr) { // removed meanwhile
+        return;
+    }
+    if ((client->isConnected() || client->m_handshake != nullptr) && client->m_timer != nullptr) {
+        checkClientTimeouts(client);
+    }
+    m_clients.release(client);
+}
+
+/*
+ * Disconnect a client which reached one of its timeouts, send it
+ * a heartbeat if due, resume what its rate limits paused, and have
+ * the timer expire again at the next deadline. Called on the client
+ * I/O thread.
+ */
+void TcpServer::checkClientTimeouts(Client * client) {
+    ClientTimer * timer = client->m_timer;
+    timer->timerId = 0;
+    uint64_t now = TimerWheel::clockMs();
+    if (timer->resumeAt != 0 && now >= timer->resumeAt && client->isConnected()) {
+        resumeClient(client);
+        if (!client->isConnected()) {
+            return;
+        }
+    }
+    uint64_t received = timer->lastReceived.load(std::memory_order_relaxed);
+    uint64_t sent = timer->lastSent.load(std::memory_order_relaxed);
+    uint64_t next = UINT64_MAX;
+
+    if (client->m_handshake != nullptr && m_config.tls.handshakeTimeoutMs > 0) {
+        // nothing is received before the handshake is done: since accepted
+        uint64_t deadline = received + m_config.tls.handshakeTimeoutMs;
+        if (now >= deadline) {
+            handleClientDisconnected(client, DISCONNECT_TIMEOUT, "TLS handshake timeout");
+            return;
+        }
+        next = deadline;
+    }
+    if (m_config.readTimeoutMs > 0) {
+        uint64_t deadline = received + m_config.readTimeoutMs;
+        if (now >= deadline) {
+            handleClientDisconnected(client, DISCONNECT_TIMEOUT, "Read timeout");
+            return;
+        }
+        next = std::min(next, deadline);
+    }
+    if (m_config.idleTimeoutMs > 0) {
+        uint64_t deadline = std::max(received, sent) + m_config.idleTimeoutMs;
+        if (now >= deadline) {
+            handleClientDisconnected(client, DISCONNECT_TIMEOUT, "Idle timeout");
+            return;
+        }
+        next = std::min(next, deadline);
+    }
+    if (m_config.writeTimeoutMs > 0) {
+        uint64_t written = client->m_sendQueue->writtenBytes();
+        if (written != timer->written || !client->m_sendQueue->hasPendingWrites()) {
+            timer->written = written;
+            timer->progressAt = now;
+        }
+        uint64_t deadline = timer->progressAt + m_config.writeTimeoutMs;
+        if (now >= deadline) {
+            handleClientDisconnected(client, DISCONNECT_TIMEOUT, "Write timeout");
+            return;
+        }
+        next = std::min(next, deadline);
+    }
+    if (m_config.heartbeatIntervalMs > 0 && !m_draining) { // which may have shut writing down
+        if (client->m_handshake != nullptr) {
+            // none before the TLS handshake is done, look again an interval later
+            next = std::min(next, now + m_config.heartbeatIntervalMs);
+        } else {
+            if (now >= sent + m_config.heartbeatIntervalMs) {
+                // coalescable: a client with messages queued gets them instead
+                queueToClient(client, m_heartbeat, true, true);
+                sent = now;
+            }
+            next = std::min(next, sent + m_config.heartbeatIntervalMs);
+        }
+    }
+    if (timer->resumeAt != 0) {
+        next = std::min(next, timer->resumeAt);
+    }
+    if (timer->timerId != 0) { // scheduled by a pause while resuming
+        client->m_eventLoop->cancelTimer(timer->timerId);
+        timer->timerId = 0;
+    }
+    // nothing left to time otherwise, e.g. only the TLS handshake was and it is done
+    if (next != UINT64_MAX) {
+        timer->timerId = client->m_eventLoop->addTimer(client->getId(), next - now);
+        timer->expiresAt = next;
+    }
+}
+
+/*
+ * Hold reads or writes of a client over its rate limit back for
+ * delayMs: its timer expires by then and resumes them. Called on
+ * the client I/O thread.
+ */
+void TcpServer::pauseClient(Client * client, uint64_t delayMs, bool reads) {
+    ClientTimer * timer = client->m_timer;
+    bool & paused = reads ? timer->readPaused : timer->writePaused;
+    if (!paused && m_config.collectMetrics) {
+        m_metrics.throttled.add();
+    }
+    paused = true;
+    uint64_t resumeAt = TimerWheel::clockMs() + delayMs;
+    if (timer->resumeAt != 0 && timer->resumeAt <= resumeAt) { // resumed earlier, paused again if need be
+        return;
+    }
+    timer->resumeAt = resumeAt;
+    if (timer->timerId != 0) {
+        if (timer->expiresAt <= resumeAt) {
+            return;
+        }
+        client->m_eventLoop->cancelTimer(timer->timerId);
+    }
+    timer->timerId = client->m_eventLoop->addTimer(client->getId(), delayMs);
+    timer->expiresAt = resumeAt;
+}
+
+/*
+ * Go on reading and writing what the rate limits of a client paused
+ */
+void TcpServer::resumeClient(Client * client) {
+    ClientTimer * timer = client->m_timer;
+    bool reads = timer->readPaused;
+    bool writes = timer->writePaused;
+    timer->resumeAt = 0;
+    timer->readPaused = false;
+    timer->writePaused = false;
+    if (reads) {
+        handleClientReadable(client);
+    }
+    if (writes && client->isConnected()) {
+        handleClientWritable(client);
+    }
+}
+
+/*
+ * Check the timeouts of a client just registered for the first
+ * time, on its I/O thread, which schedules its timer
+ */
+void TcpServer::startClientTimer(Client * client) {
+    client_id_t clientId = client->getId();
+    if (client->m_eventLoop->isInLoopThread()) {
+        onTimer(clientId);
+    } else {
+        client->m_eventLoop->post([this, clientId]() {
+            onTimer(clientId);
+        });
+    }
+}
+
+bool TcpServer::hasClientTimers() const {
+    return m_config.readTimeoutMs > 0 || m_config.idleTimeoutMs > 0 ||
+           m_config.writeTimeoutMs > 0 || m_config.heartbeatIntervalMs > 0 ||
+           (m_config.tls.enabled && m_config.tls.handshakeTimeoutMs > 0) ||
+           m_config.limits.readRate > 0 || m_config.limits.writeRate > 0;
+}
+
+/*
+ * Socket has room again: write out what was queued meanwhile
+ */
+void TcpServer::handleClientWritable(Client * client) {
+    client->m_flushRequest.clear();
+    if (m_config.mode == SERVER_MODE_IO_URING) {
+        submitUringSend(client);
+        return;
+    }
+    SendQueue::flush_ret_t flushRet = client->m_sendQueue->flush(client->getFileDescriptor());
+    if (flushRet == SendQueue::FLUSH_ERROR) {
+        handleClientDisconnected(client, DISCONNECT_SOCKET_ERROR, strerror(errno));
+    } else if (flushRet == SendQueue::FLUSH_THROTTLED) {
+        pauseClient(client, client->m_sendQueue->throttleDelay(), false);
+    }
+}
+
+/*
+ * Have the I/O thread of a client flush its send queue, as if the
+ * socket became writable, unless it was already asked to and has
+ * not done it yet
+ */
+void TcpServer::requestFlush(Client * client) {
+    if (client->m_flushRequest.request()) {
+        client->m_eventLoop->inject(client->getId(), EPOLLOUT);
+    }
+}
+
+/*
+ * Receive from client socket and publish what was received.
+ * Without framing the socket is drained into a batch of buffers,
+ * published as a list. With framing it is read once into the client
+ * reassembly buffer and only complete messages are published,
+ * straight from it.
+ * Return recv() result, or -1 with errno set to EPROTO if the client
+ * violated the framing, or to EAGAIN once a non-blocking socket
+ * is drained.
+ */
+ssize_t TcpServer::receiveFromClient(Client * client) {
+    // a rate limited client is read no more than its rate allows
+    size_t allowed = client->m_readLimit != nullptr ? client->m_readLimit->available() : SIZE_MAX;
+    ReceiveBuffers * receiveBuffers = client->m_receiveBuffers;
+    if (receiveBuffers != nullptr) {
+        ssize_t numOfBytesReceived = receiveBuffers->receive(client->getFileDescriptor(), 0, allowed);
+        if (numOfBytesReceived > 0) {
+            countReceived(client, numOfBytesReceived);
+            publishClientBuffers(*client, receiveBuffers->buffers(), receiveBuffers->count());
+            receiveBuffers->clear();
+            if (receiveBuffers->drained() && client->m_eventLoop != nullptr) {
+                // spare the I/O thread another read to find that out
+                errno = EAGAIN;
+                return -1;
+            }
+        }
+        return numOfBytesReceived;
+    }
+
+    FrameBuffer * frameBuffer = client->m_frameBuffer;
+
+    char * writePtr = frameBuffer->writePtr();
+    size_t writable = std::min(frameBuffer->writable(), allowed);
+    ssize_t numOfBytesReceived = client->m_stream != nullptr ?
+                                 client->m_stream->read(writePtr, writable) :
+                                 recv(client->getFileDescriptor(), writePtr, writable, 0);
+    if (numOfBytesReceived > 0) {
+        countReceived(client, numOfBytesReceived);
+        frameBuffer->commit(numOfBytesReceived);
+        if (!publishFrames(client)) {
+            errno = EPROTO;
+            return -1;
+        }
+    }
+    return numOfBytesReceived;
+}
+
+/*
+ * Publish the complete messages of the client reassembly buffer.
+ * Return false if the client violated the framing.
+ */
+bool TcpServer::publishFrames(Client * client) {
+    FrameBuffer * frameBuffer = client->m_frameBuffer;
+    Decompressor * decompressor = client->m_decompressor;
+    if (client->m_strand != nullptr) {
+        // workers get the messages where they are, along with a reference to the buffer,
+        // or inflated into the pooled buffer of the decompressor
+        bool decoded = true;
+        bool valid = frameBuffer->consumeFrames(m_config.framing, [&](const char * msg, size_t size) {
+            if (decompressor == nullptr) {
+                client->m_strand->post(frameBuffer->storage(), msg, size);
+                return;
+            }
+            const char * decodedMsg;
+            size_t decodedSize;
+            bool inflated;
+            if (decoded && !decompressor->decode(msg, size, decodedMsg, decodedSize, inflated)) {
+                decoded = false;
+            }
+            if (decoded) {
+                client->m_strand->post(inflated ? decompressor->storage() : frameBuffer->storage(),
+                                       decodedMsg, decodedSize);
+            }
+        });
+        return valid && decoded;
+    }
+    // messages of a read are published as one list
+    static thread_local std::vector<struct iovec> messages;
+    messages.clear();
+    bool valid = frameBuffer->collectFrames(m_config.framing, messages);
+    if (decompressor != nullptr && !decompressor->decode(messages.data(), messages.size())) {
+        return false;
+    }
+    if (!messages.empty()) {
+        publishClientBuffers(*client, messages.data(), messages.size());
+    }
+    return valid;
+}
+
+/*
+ * Publish data received into a buffer of our own (io_uring provided
+ * buffer): as is without framing, or through the reassembly buffer.
+ * Return false if the client violated the framing.
+ */
+bool TcpServer::handleClientData(Client * client, const char * data, size_t size) {
+    countReceived(client, size);
+    FrameBuffer * frameBuffer = client->m_frameBuffer;
+    if (frameBuffer == nullptr) {
+        publishClientMsg(*client, data, size);
+        return true;
+    }
+    while (size > 0) {
+        char * writePtr = frameBuffer->writePtr();
+        size_t chunkSize = std::min(size, frameBuffer->writable());
+        memcpy(writePtr, data, chunkSize);
+        frameBuffer->commit(chunkSize);
+        if (!publishFrames(client)) {
+            return false;
+        }
+        data += chunkSize;
+        size -= chunkSize;
+    }
+    return true;
+}
+
+/*
+ * Unregister a client from its I/O thread, notify observers
+ * and remove it from the clients table. The socket is closed
+ * once the last reference to the client is released. Observers
+ * never knew of a client still in its TLS handshake.
+ */
+void TcpServer::handleClientDisconnected(Client * client, disconnect_reason_t reason, const char * message) {
+    bool handshaking = client->m_handshake != nullptr;
+    if (handshaking && m_config.collectMetrics) {
+        m_metrics.handshakeFailures.add();
+    }
+    countDisconnect(client, reason);
+    client->setDisconnected();
+    client->setErrorMessage(message);
+    if (client->m_timer != nullptr) {
+        client->m_eventLoop->cancelTimer(client->m_timer->timerId);
+    }
+    if (m_config.mode == SERVER_MODE_IO_URING) {
+        // requests in flight hold the socket open, end them
+        shutdown(client->getFileDescriptor(), SHUT_RDWR);
+    } else {
+        client->m_eventLoop->remove(client->getFileDescriptor());
+    }
+    client->m_handshake = nullptr;
+    if (!handshaking) {
+        notifyClientDisconnected(client);
+    }
+    m_clients.remove(client->getId());
+}
+
+/*
+ * Remove client from clients table and close its connection.
+ * If client isn't in the table, return false. Return
+ * true if it is.
+ */
+bool TcpServer::deleteClient(Client & client) {
+    Client * stored = m_clients.acquire(client.getId());
+    if (stored == nullptr) {
+        return false;
+    }
+    countDisconnect(stored, DISCONNECT_BY_SERVER);
+    stored->setDisconnected();
+    // wake up a receive thread blocked on the socket
+    shutdownClient(*stored);
+    bool removed = m_clients.remove(client.getId());
+    m_clients.release(stored);
+    return removed;
+}
+
+/*
+ * Reclaim handler of the clients table: the last reference
+ * to the client is gone, so its descriptor can't be reused
+ * under anyone's feet anymore.
+ */
+void TcpServer::closeClient(Client & client) {
+    if (client.m_stream != nullptr) {
+        client.m_stream->close();
+        client.m_stream = nullptr;
+    } else {
+        close(client.getFileDescriptor());
+    }
+    delete client.m_frameBuffer;
+    client.m_frameBuffer = nullptr;
+    delete client.m_receiveBuffers;
+    client.m_receiveBuffers = nullptr;
+    delete client.m_sendQueue;
+    client.m_sendQueue = nullptr;
+    delete client.m_compressor;
+    client.m_compressor = nullptr;
+    delete client.m_decompressor;
+    client.m_decompressor = nullptr;
+    delete client.m_metrics;
+    client.m_metrics = nullptr;
+    delete client.m_strand;
+    client.m_strand = nullptr;
+    delete client.m_timer;
+    client.m_timer = nullptr;
+    delete client.m_readLimit;
+    client.m_readLimit = nullptr;
+    if (m_limiter != nullptr) { // stored clients were all admitted
+        m_limiter->release(client.getAddress());
+    }
+}
+
+/*
+ * Shut the connection of a client down, its I/O thread
+ * or receive thread notices at once
+ */
+void TcpServer::shutdownClient(Client & client) {
+    if (client.m_stream != nullptr) {
+        client.m_stream->shutdown();
+    } else {
+        shutdown(client.getFileDescriptor(), SHUT_RDWR);
+    }
+}
+
+/*
+ * Allocate per-connection state of a client just stored
+ * in the clients table
+ */
+void TcpServer::initClient(Client * client) {
+    // dispatched messages stay in the receive buffer, even without framing
+    if (m_config.framing.mode != FRAMING_NONE || m_workerPool != nullptr) {
+        client->m_frameBuffer = new FrameBuffer(m_config.framing.bufferSize);
+    } else if (m_config.mode != SERVER_MODE_IO_URING) { // which reads into its own buffers
+        client->m_receiveBuffers = new ReceiveBuffers();
+    }
+    if (m_workerPool != nullptr) {
+        client->m_strand = new ClientStrand(this, m_workerPool, client);
+    }
+    if (m_config.collectMetrics) {
+        client->m_metrics = new ConnectionMetrics();
+    }
+    if (m_compressor != nullptr) {
+        client->m_compressor = new Compressor(m_config.compression, m_config.framing.mode);
+        client->m_decompressor = new Decompressor(m_config.compression, m_config.framing.maxMessageSize);
+    }
+    // the options accepted sockets don't inherit, best effort
+    // as the listener accepted them already
+    if (m_config.transport != TRANSPORT_MEMORY) {
+        applyAcceptedSocketOptions(client->getFileDescriptor(), m_config.socketOptions);
+    }
+    if (client->m_stream != nullptr && client->m_receiveBuffers != nullptr) {
+        client->m_receiveBuffers->setStream(client->m_stream);
+    }
+    if (client->m_eventLoop != nullptr) {
+        client->m_sendQueue = new SendQueue(m_config.sendQueueLimit);
+        client->m_sendQueue->setCorkBatches(m_config.socketOptions.corkBatches);
+        client->m_sendQueue->setStream(client->m_stream);
+        if (client->m_handshake != nullptr) { // only queue until it is done
+            client->m_sendQueue->cork();
+        }
+        if (m_config.collectMetrics) {
+            client->m_sendQueue->setMetrics(&m_metrics, client->m_metrics);
+        }
+        if (hasClientTimers()) {
+            client->m_timer = new ClientTimer(TimerWheel::clockMs());
+        }
+        const limits_config_t & limits = m_config.limits;
+        if (limits.writeRate > 0) {
+            client->m_sendQueue->setRateLimit(limits.writeRate, limits.writeBurst > 0 ? limits.writeBurst : limits.writeRate);
+        }
+        if (limits.readRate > 0) {
+            client->m_readLimit = new TokenBucket(limits.readRate, limits.readBurst > 0 ? limits.readBurst : limits.readRate,
+                                                  TimerWheel::clockMs());
+        }
+    }
+    client->m_backpressurePolicy = m_config.backpressurePolicy;
+    m_observers.resolve(*client);
+}
+
+/*
+ * Count received bytes on the server and the client,
+ * and note the client is alive
+ */
+void TcpServer::countReceived(Client * client, size_t size) {
+    if (client->m_timer != nullptr) {
+        client->m_timer->lastReceived.store(TimerWheel::clockMs(), std::memory_order_relaxed);
+    }
+    if (client->m_metrics != nullptr) {
+        m_metrics.bytesIn.add(size);
+        ConnectionMetrics::add(client->m_metrics->bytesIn, size);
+    }
+}
+
+/*
+ * Count messages queued for, or sent to, a client
+ */
+void TcpServer::countSent(Client * client, size_t msgs) {
+    if (client->m_timer != nullptr) {
+        client->m_timer->lastSent.store(TimerWheel::clockMs(), std::memory_order_relaxed);
+    }
+    if (client->m_metrics != nullptr) {
+        m_metrics.msgsOut.add(msgs);
+        ConnectionMetrics::add(client->m_metrics->msgsOut, msgs);
+    }
+}
+
+/*
+ * Count an accepted connection, registered acceptedAt
+ * nanoseconds after accept() returned it
+ */
+void TcpServer::countAccepted(uint64_t acceptedAt) {
+    if (m_config.collectMetrics) {
+        m_metrics.accepted.add();
+        m_metrics.acceptLatency.record(metricsClock() - acceptedAt);
+    }
+}
+
+/*
+ * Count why a client disconnected, unless it is already known to be
+ * disconnected, e.g. when the server dropped it itself before
+ */
+void TcpServer::countDisconnect(Client * client, disconnect_reason_t reason) {
+    if (m_config.collectMetrics && client->isConnected()) {
+        m_metrics.disconnects[reason].add();
+    }
+}
+
+/*
+ * Publish incoming client message to the observers
+ * matching the client address, resolved when it connected
+ */
+void TcpServer::publishClientMsg(Client & client, const char * msg, size_t msgSize) {
+    struct iovec buffer;
+    buffer.iov_base = (void *)msg;
+    buffer.iov_len = msgSize;
+    publishClientBuffers(client, &buffer, 1);
+}
+
+/*
+ * Publish a list of buffers received from a client: at once to
+ * observers taking lists, one buffer after the other to the others
+ */
+void TcpServer::publishClientBuffers(Client & client, const struct iovec * buffers, size_t count) {
+    uint64_t start = 0;
+    if (client.m_metrics != nullptr) {
+        start = metricsClock();
+    }
+    const ObserverSet & observers = m_observers.resolve(client);
+    for (uint i=0; i<observers.incomingBuffers.size(); i++) {
+        observers.incomingBuffers[i](client, buffers, count);
+    }
+    for (uint i=0; i<observers.incoming.size(); i++) {
+        for (size_t j=0; j<count; j++) {
+            observers.incoming[i](client, (const char *)buffers[j].iov_base, buffers[j].iov_len);
+        }
+    }
+    if (client.m_metrics != nullptr) {
+        m_metrics.callbackTime.record(metricsClock() - start);
+        m_metrics.msgsIn.add(count);
+        ConnectionMetrics::add(client.m_metrics->msgsIn, count);
+    }
+}
+
+/*
+ * Publish new client connection to the observers
+ * matching the client address
+ */
+void TcpServer::publishClientConnected(Client & client) {
+    const ObserverSet & observers = m_observers.resolve(client);
+    for (uint i=0; i<observers.connected.size(); i++) {
+        observers.connected[i](client);
+    }
+}
+
+/*
+ * Publish client disconnection to the observers
+ * matching the client address
+ */
+void TcpServer::publishClientDisconnected(Client & client) {
+    const ObserverSet & observers = m_observers.resolve(client);
+    for (uint i=0; i<observers.disconnected.size(); i++) {
+        observers.disconnected[i](client);
+    }
+}
+
+/*
+ * Notify observers of a client disconnection: right away, or
+ * after its last message when dispatching to workers
+ */
+void TcpServer::notifyClientDisconnected(Client * client) {
+    if (client->m_strand != nullptr) {
+        client->m_strand->postDisconnected();
+    } else {
+        publishClientDisconnected(*client);
+    }
+}
+
+/*
+ * Worker pool side of the client strands
+ */
+void TcpServer::onStrandMessage(Client & client, const char * msg, size_t size) {
+    publishClientMsg(client, msg, size);
+}
+
+void TcpServer::onStrandDisconnected(Client & client) {
+    publishClientDisconnected(client);
+}
+
+void TcpServer::onStrandScheduled(Client & client) {
+    m_clients.retain(&client);
+}
+
+void TcpServer::onStrandIdle(Client & client) {
+    m_clients.release(&client);
+}
+
+/*
+ * Bind port and start listening. In SERVER_MODE_EPOLL the
+ * I/O threads are started as well. In SERVER_MODE_REACTOR and
+ * SERVER_MODE_IO_URING every I/O thread gets its own SO_REUSEPORT
+ * listener and accepts by itself.
+ * Return tcp_ret_t
+ */
+pipe_ret_t TcpServer::start(int port, const server_config_t & config) {
+    m_sockfd = 0;
+    m_draining = false;
+    m_config = config;
+    memset(&m_serverAddress, 0, sizeof(m_serverAddress));
+    pipe_ret_t ret;
+
+    if (m_config.transport == TRANSPORT_MEMORY &&
+        m_config.mode != SERVER_MODE_EPOLL && m_config.mode != SERVER_MODE_REACTOR) {
+        // in-memory connections are non-blocking and read by their own means
+        ret.success = false;
+        ret.msg = ret.reason = "The memory transport needs SERVER_MODE_EPOLL or SERVER_MODE_REACTOR";
+        return ret;
+    }
+
+    if (m_config.tls.enabled) {
+        if (m_config.transport == TRANSPORT_MEMORY ||
+            (m_config.mode != SERVER_MODE_EPOLL && m_config.mode != SERVER_MODE_REACTOR)) {
+            // handshakes are driven by the I/O threads, over sockets
+            ret.success = false;
+            ret.msg = ret.reason = "TLS needs SERVER_MODE_EPOLL or SERVER_MODE_REACTOR, over TCP or Unix sockets";
+            return ret;
+        }
+        delete m_tlsContext;
+        m_tlsContext = new TlsContext();
+        ret = m_tlsContext->init(m_config.tls, true);
+        if (!ret.success) {
+            return ret;
+        }
+    }
+
+    const limits_config_t & limits = m_config.limits;
+    if ((limits.readRate > 0 || limits.writeRate > 0) &&
+        m_config.mode != SERVER_MODE_EPOLL && m_config.mode != SERVER_MODE_REACTOR) {
+        // paused and resumed by the timers of the I/O threads
+        ret.success = false;
+        ret.msg = ret.reason = "Rate limits need SERVER_MODE_EPOLL or SERVER_MODE_REACTOR";
+        return ret;
+    }
+    delete m_limiter;
+    m_limiter = nullptr;
+    if (limits.maxConnections > 0 || limits.maxConnectionsPerAddress > 0) {
+        m_limiter = new ConnectionLimiter(limits.maxConnections, limits.maxConnectionsPerAddress);
+    }
+
+    delete m_compressor;
+    m_compressor = nullptr;
+    if (m_config.compression.enabled) {
+        ret = checkCompression(m_config.compression, m_config.framing.mode);
+        if (!ret.success) {
+            return ret;
+        }
+        m_compressor = new Compressor(m_config.compression, m_config.framing.mode);
+    }
+
+    if (m_config.heartbeatIntervalMs > 0) {
+        m_heartbeat = makePayload(m_config.heartbeatMessage.data(), m_config.heartbeatMessage.size());
+        if (m_heartbeat.size() == 0) {
+            ret.success = false;
+            ret.msg = ret.reason = "Heartbeat message is empty";
+            return ret;
+        }
+    }
+
+    if (m_config.dispatchToWorkers) {
+        m_workerPool = new WorkerPool();
+        ret = m_workerPool->start(m_config.workerThreads);
+        if (!ret.success) {
+            return ret;
+        }
+    }
+
+    if (m_config.mode == SERVER_MODE_REACTOR || m_config.mode == SERVER_MODE_IO_URING) {
+        ret = startEventLoops();
+        if (!ret.success) {
+            return ret;
+        }
+        // reactors read their listener concurrently, never reallocate
+        m_listenfds.reserve(m_eventLoops.size());
+        bool sharedListener = m_config.transport != TRANSPORT_TCP;
+        for (uint i=0; i<m_eventLoops.size(); i++) {
+            int listenfd;
+            if (sharedListener && i > 0) {
+                // the Unix or in-memory listener has no SO_REUSEPORT
+                // counterpart, every reactor accepts from the same one
+                listenfd = dup(m_listenfds[0]);
+                if (listenfd == -1) {
+                    ret.success = false;
+                    ret.msg = ret.reason = strerror(errno);
+                    return ret;
+                }
+            } else {
+                ret = createListener(port, true, listenfd);
+                if (!ret.success) {
+                    return ret;
+                }
+            }
+            m_listenfds.push_back(listenfd);
+            if (port == 0) { // let all reactors share the port picked by the kernel
+                port = ntohs(m_serverAddress.sin_port);
+            }
+            if (m_config.mode == SERVER_MODE_IO_URING) {
+                // requests are only queued by the loop thread
+                m_eventLoops[i]->post([this, i]() {
+                    m_eventLoops[i]->uring()->prepareAccept(m_listenfds[i], uringToken(URING_ACCEPT, i));
+                });
+            } else if (!m_eventLoops[i]->add(listenfd, EPOLLIN | EPOLLET | (sharedListener ? (uint32_t)EPOLLEXCLUSIVE : 0u),
+                                             listenerToken(i))) {
+                ret.success = false;
+                ret.msg = ret.reason = strerror(errno);
+                return ret;
+            }
+        }
+        m_sockfd = m_listenfds[0];
+        ret.success = true;
+        return ret;
+    }
+
+    ret = createListener(port, false, m_sockfd);
+    if (!ret.success) {
+        return ret;
+    }
+    m_listenfds.push_back(m_sockfd);
+    if (m_config.mode == SERVER_MODE_EPOLL) {
+        return startEventLoops();
+    }
+    ret.success = true;
+    return ret;
+}
+
+/*
+ * Create a socket listening on port. Listeners of reactor
+ * threads share the port with SO_REUSEPORT, so the kernel
+ * spreads incoming connections between them.
+ */
+pipe_ret_t TcpServer::createListener(int port, bool reusePort, int & listenfd) {
+    pipe_ret_t ret;
+    if (m_config.transport == TRANSPORT_UNIX) {
+        return createUnixListener(listenfd);
+    }
+    if (m_config.transport == TRANSPORT_MEMORY) {
+        return createMemoryListener(listenfd);
+    }
+
+    listenfd = socket(AF_INET,SOCK_STREAM,0);
+    if (listenfd == -1) { //socket failed
+        ret.success = false;
+        ret.msg = ret.reason = strerror(errno);
+        return ret;
+    }
+    // set socket for reuse (otherwise might have to wait 4 minutes every time socket is closed)
+    int option = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+    if (reusePort) {
+        if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(option)) == -1) {
+            ret.success = false;
+            ret.msg = ret.reason = strerror(errno);
+            close(listenfd);
+            return ret;
+        }
+    }
+    // accepted sockets inherit them, buffer sizes must be set before listen()
+    ret = applySocketOptions(listenfd, m_config.socketOptions);
+    if (!ret.success) {
+        close(listenfd);
+        return ret;
+    }
+    if (m_config.mode == SERVER_MODE_REACTOR) { // accepted until EAGAIN
+        int flags = fcntl(listenfd, F_GETFL, 0);
+        fcntl(listenfd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    memset(&m_serverAddress, 0, sizeof(m_serverAddress));
+    m_serverAddress.sin_family = AF_INET;
+    m_serverAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+    m_serverAddress.sin_port = htons(port);
+
+    int bindSuccess = bind(listenfd, (struct sockaddr *)&m_serverAddress, sizeof(m_serverAddress));
+    if (bindSuccess == -1) { // bind failed
+        ret.success = false;
+        ret.msg = ret.reason = strerror(errno);
+        close(listenfd);
+        return ret;
+    }
+    int listenSuccess = listen(listenfd, m_config.backlog);
+    if (listenSuccess == -1) { // listen failed
+        ret.success = false;
+        ret.msg = ret.reason = strerror(errno);
+        close(listenfd);
+        return ret;
+    }
+    socklen_t addressSize = sizeof(m_serverAddress);
+    getsockname(listenfd, (struct sockaddr *)&m_serverAddress, &addressSize);
+    ret.success = true;
+    return ret;
+}
+
+/*
+ * Create a Unix socket listening on the configured path. A socket
+ * left there by a previous run is removed, anything else is not.
+ */
+pipe_ret_t TcpServer::createUnixListener(int & listenfd) {
+    pipe_ret_t ret;
+    struct sockaddr_un address;
+    socklen_t addressSize;
+    ret = unixSocketAddress(m_config.path, address, addressSize);
+    if (!ret.success) {
+        return ret;
+    }
+    listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenfd == -1) {
+        ret.success = false;
+        ret.msg = ret.reason = strerror(errno);
+        return ret;
+    }
+    ret = applySocketOptions(listenfd, m_config.socketOptions);
+    if (!ret.success) {
+        close(listenfd);
+        return ret;
+    }
+    if (m_config.mode == SERVER_MODE_REACTOR) { // accepted until EAGAIN
+        int flags = fcntl(listenfd, F_GETFL, 0);
+        fcntl(listenfd, F_SETFL, flags | O_NONBLOCK);
+    }
+    struct stat status;
+    if (stat(m_config.path.c_str(), &status) == 0 && S_ISSOCK(status.st_mode)) {
+        unlink(m_config.path.c_str());
+    }
+    if (bind(listenfd, (struct sockaddr *)&address, addressSize) == -1 ||
+        listen(listenfd, m_config.backlog) == -1) {
+        ret.success = false;
+        ret.msg = ret.reason = strerror(errno);
+        close(listenfd);
+        return ret;
+    }
+    ret.success = true;
+    return ret;
+}
+
+/*
+ * Register the in-memory listener under the configured name.
+ * listenfd is a duplicate of its eventfd, polled like a socket.
+ */
+pipe_ret_t TcpServer::createMemoryListener(int & listenfd) {
+    pipe_ret_t ret;
+    delete m_memoryListener;
+    m_memoryListener = new MemoryListener();
+    ret = m_memoryListener->listen(m_config.path, m_config.backlog, m_config.memoryRingSize);
+    if (!ret.success) {
+        return ret;
+    }
+    listenfd = dup(m_memoryListener->fd());
+    if (listenfd == -1) {
+        ret.success = false;
+        ret.msg = ret.reason = strerror(errno);
+        m_memoryListener->close();
+        return ret;
+    }
+    ret.success = true;
+    return ret;
+}
+
+/*
+ * Port the server listens on, useful when started on port 0
+ */
+int TcpServer::getPort() const {
+    return ntohs(m_serverAddress.sin_port);
+}
+
+/*
+ * Create the epoll (or io_uring) I/O threads clients are dispatched to
+ */
+pipe_ret_t TcpServer::startEventLoops() {
+    pipe_ret_t ret;
+    uint numThreads = m_config.ioThreads;
+    uint numCores = std::max(1u, std::thread::hardware_concurrency());
+    if (numThreads == 0) {
+        numThreads = numCores;
+    }
+    for (uint i=0; i<numThreads; i++) {
+        EventLoop * eventLoop = new EventLoop();
+        m_eventLoops.push_back(eventLoop);
+        if (m_config.mode == SERVER_MODE_IO_URING) {
+            ret = eventLoop->initUring(this, m_config.uringEntries, m_config.uringBuffers, MAX_PACKET_SIZE);
+        } else {
+            ret = eventLoop->init(this);
+        }
+        if (!ret.success) {
+            return ret;
+        }
+        ret = eventLoop->start(m_config.pinThreads ? (int)(i % numCores) : -1);
+        if (!ret.success) {
+            return ret;
+        }
+    }
+    ret.success = true;
+    return ret;
+}
+
+void TcpServer::stopEventLoops() {
+    for (uint i=0; i<m_eventLoops.size(); i++) {
+        m_eventLoops[i]->stop();
+        m_retiredEventLoops.push_back(m_eventLoops[i]);
+    }
+    m_eventLoops.clear();
+}
+
+/*
+ * Accept a connection of listenfd into newClient: a socket, with
+ * accept4() flags, or the stream of the next in-memory connection.
+ * With TLS the socket gets a stream whose handshake is to be done.
+ * Return its descriptor, or -1 with errno set.
+ */
+int TcpServer::acceptConnection(int listenfd, Client & newClient, int flags) {
+    if (m_config.transport == TRANSPORT_MEMORY) {
+        MemoryStream * stream = m_memoryListener->accept();
+        if (stream == nullptr) {
+            return -1;
+        }
+        if (!admitConnection(newClient)) {
+            stream->close();
+            errno = ECONNREFUSED;
+            return -1;
+        }
+        newClient.m_stream = stream;
+        newClient.setFileDescriptor(stream->fd());
+        return stream->fd();
+    }
+    struct sockaddr_storage address;
+    socklen_t addressSize = sizeof(address);
+    int file_descriptor = accept4(listenfd, (struct sockaddr*)&address, &addressSize, flags);
+    if (file_descriptor == -1) {
+        return -1;
+    }
+    newClient.setFileDescriptor(file_descriptor);
+    newClient.setAddress((struct sockaddr*)&address);
+    if (!admitConnection(newClient)) {
+        close(file_descriptor);
+        errno = ECONNREFUSED;
+        return -1;
+    }
+    if (m_tlsContext != nullptr) {
+        TlsStream * stream;
+        if (!m_tlsContext->createStream(file_descriptor, "", stream).success) {
+            discardConnection(newClient);
+            errno = ENOMEM;
+            return -1;
+        }
+        newClient.m_stream = stream;
+        newClient.m_handshake = stream;
+    }
+    return file_descriptor;
 }
 
-void TcpServer::unsubscribeAll() {
-    m_subscibers.clear();
+/*
+ * Count a connection just accepted against the connection limits.
+ * Return false if it would exceed one, or the server is draining,
+ * it is then to be closed.
+ */
+bool TcpServer::admitConnection(const Client & newClient) {
+    if (m_draining) {
+        return false;
+    }
+    if (m_limiter == nullptr || m_limiter->admit(newClient.getAddress())) {
+        return true;
+    }
+    if (m_config.collectMetrics) {
+        m_metrics.rejected.add();
+    }
+    return false;
 }
 
-void TcpServer::printClients() {
-    for (uint i=0; i<m_clients.size(); i++) {
-        std::string connected = m_clients[i].isConnected() ? "True" : "False";
-        std::cout << "-----------------\n" <<
-                  "IP address: " << m_clients[i].getIp() << std::endl <<
-                  "Connected?: " << connected << std::endl <<
-                  "Socket FD: " << m_clients[i].getFileDescriptor() << std::endl <<
-                  "Message: " << m_clients[i].getInfoMessage().c_str() << std::endl;
+/*
+ * Close a connection accepted, and admitted, but not stored
+ */
+void TcpServer::discardConnection(const Client & newClient) {
+    if (newClient.m_stream != nullptr) {
+        newClient.m_stream->close();
+    } else {
+        close(newClient.getFileDescriptor());
+    }
+    if (m_limiter != nullptr) {
+        m_limiter->release(newClient.getAddress());
     }
 }
 
 /*
- * Receive client packets, and notify user
+ * Accept every pending connection on the listener of a reactor
+ * thread. Accepted clients stay on the reactor that accepted them.
  */
-void TcpServer::receiveTask(/*TcpServer *context*/) {
+void TcpServer::acceptReactorClients(uint reactorIndex) {
+    int listenfd = m_listenfds[reactorIndex];
 
-    Client * client = &m_clients.back();
+    while (true) {
+        Client newClient;
+        int file_descriptor = acceptConnection(listenfd, newClient, SOCK_NONBLOCK);
+        if (file_descriptor == -1) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == ECONNREFUSED) { // refused: over a limit
+                continue;
+            }
+            // EAGAIN: backlog drained. EMFILE and friends: retry on next connection
+            return;
+        }
+        uint64_t acceptedAt = metricsClock();
 
-    while(client->isConnected()) {
-        char msg[MAX_PACKET_SIZE];
-        int numOfBytesReceived = recv(client->getFileDescriptor(), msg, MAX_PACKET_SIZE, 0);
-        if(numOfBytesReceived < 1) {
-            client->setDisconnected();
-            if (numOfBytesReceived == 0) { //client closed connection
-                client->setErrorMessage("Client closed connection");
-                //printf("client closed");
-            } else {
-                client->setErrorMessage(strerror(errno));
+        // a TLS client is connected once its handshake is done
+        if (newClient.m_handshake == nullptr) {
+            newClient.setConnected();
+        }
+        Client * client = registerLoopClient(newClient, reactorIndex);
+        if (client != nullptr) {
+            countAccepted(acceptedAt);
+            if (newClient.m_handshake == nullptr) {
+                publishClientConnected(*client);
             }
-            close(client->getFileDescriptor());
-            publishClientDisconnected(*client);
-            deleteClient(*client);
-            break;
-        } else {
-            publishClientMsg(*client, msg, numOfBytesReceived);
+            m_clients.release(client);
         }
     }
 }
 
 /*
- * Erase client from clients vector.
- * If client isn't in the vector, return false. Return
- * true if it is.
+ * Completion of the multishot accept of a reactor thread
  */
-bool TcpServer::deleteClient(Client & client) {
-    int clientIndex = -1;
-    for (uint i=0; i<m_clients.size(); i++) {
-        if (m_clients[i] == client) {
-            clientIndex = i;
-            break;
+void TcpServer::handleUringAccept(IoUring & uring, uint reactorIndex, const uring_completion_t & completion) {
+    if (completion.result >= 0) {
+        uint64_t acceptedAt = metricsClock();
+        int file_descriptor = completion.result;
+        struct sockaddr_storage clientAddress;
+        socklen_t sosize = sizeof(clientAddress);
+        memset(&clientAddress, 0, sizeof(clientAddress));
+        getpeername(file_descriptor, (struct sockaddr*)&clientAddress, &sosize);
+
+        Client newClient;
+        newClient.setFileDescriptor(file_descriptor);
+        newClient.setConnected();
+        newClient.setAddress((struct sockaddr*)&clientAddress);
+        Client * client = nullptr;
+        if (admitConnection(newClient)) {
+            client = registerLoopClient(newClient, reactorIndex);
+        } else {
+            close(file_descriptor);
+        }
+        if (client != nullptr) {
+            countAccepted(acceptedAt);
+            publishClientConnected(*client);
+            m_clients.release(client);
         }
     }
-    if (clientIndex > -1) {
-        m_clients.erase(m_clients.begin() + clientIndex);
-        return true;
+    // the kernel ends multishot requests on errors (e.g. EMFILE) or overflow
+    if (!completion.more && completion.result != -EBADF && completion.result != -EINVAL) {
+        uring.prepareAccept(m_listenfds[reactorIndex], uringToken(URING_ACCEPT, reactorIndex));
     }
-    return false;
 }
 
 /*
- * Publish incoming client message to observer.
- * Observers get only messages that originated
- * from clients with IP address identical to
- * the specific observer requested IP
+ * Completion of a client multishot recv: publish what was received
+ * straight from the provided buffer, then hand the buffer back
  */
-void TcpServer::publishClientMsg(const Client & client, const char * msg, size_t msgSize) {
-    for (uint i=0; i<m_subscibers.size(); i++) {
-        if (m_subscibers[i].wantedIp == client.getIp() || m_subscibers[i].wantedIp.empty()) {
-            if (m_subscibers[i].incoming_packet_func != NULL) {
-                (*m_subscibers[i].incoming_packet_func)(client, msg, msgSize);
-            }
+void TcpServer::handleUringReceive(IoUring & uring, const uring_completion_t & completion) {
+    Client * client = m_clients.acquire(uringId(completion.token));
+    if (client == nullptr || !client->isConnected()) { // removed meanwhile
+        if (completion.bufferId >= 0) {
+            uring.recycleBuffer(completion.bufferId);
+        }
+        if (client != nullptr) {
+            m_clients.release(client);
+        }
+        return;
+    }
+
+    if (completion.result > 0) {
+        bool valid = handleClientData(client, uring.buffer(completion.bufferId), completion.result);
+        uring.recycleBuffer(completion.bufferId);
+        if (!valid) {
+            handleClientDisconnected(client, DISCONNECT_PROTOCOL_ERROR, strerror(EPROTO));
         }
+    } else if (completion.result == 0) { //client closed connection
+        handleClientDisconnected(client, DISCONNECT_PEER_CLOSED, "Client closed connection");
+    } else if (completion.result != -ENOBUFS) { // out of buffers: rearm, they were recycled meanwhile
+        handleClientDisconnected(client, DISCONNECT_SOCKET_ERROR, strerror(-completion.result));
+    }
+
+    if (!completion.more && client->isConnected() &&
+        !uring.prepareRecv(client->getFileDescriptor(), uringToken(URING_RECV, client->getId()))) {
+        handleClientDisconnected(client, DISCONNECT_SOCKET_ERROR, strerror(EBUSY));
     }
+    m_clients.release(client);
 }
 
 /*
- * Publish client disconnection to observer.
- * Observers get only notify about clients
- * with IP address identical to the specific
- * observer requested IP
+ * Hand what is queued on a client to the kernel, unless a send is
+ * already in flight. The client stays acquired until it completes.
  */
-void TcpServer::publishClientDisconnected(const Client & client) {
-    for (uint i=0; i<m_subscibers.size(); i++) {
-        if (m_subscibers[i].wantedIp == client.getIp()) {
-            if (m_subscibers[i].disconnected_func != NULL) {
-                (*m_subscibers[i].disconnected_func)(client);
-            }
-        }
+void TcpServer::submitUringSend(Client * client) {
+    if (m_clients.acquire(client->getId()) == nullptr) {
+        return;
+    }
+    const struct msghdr * msg = client->m_sendQueue->beginSend();
+    if (msg == nullptr) {
+        m_clients.release(client);
+        return;
+    }
+    if (!client->m_eventLoop->uring()->prepareSend(client->getFileDescriptor(), msg,
+                                                   uringToken(URING_SEND, client->getId()))) {
+        client->m_sendQueue->completeSend(-EBUSY);
+        handleClientDisconnected(client, DISCONNECT_SOCKET_ERROR, strerror(EBUSY));
+        m_clients.release(client);
     }
 }
 
 /*
- * Bind port and start listening
- * Return tcp_ret_t
+ * Completion of a client send: drop what was written
+ * and carry on with what got queued meanwhile
  */
-pipe_ret_t TcpServer::start(int port) {
-    m_sockfd = 0;
-    m_clients.reserve(10);
-    m_subscibers.reserve(10);
-    pipe_ret_t ret;
-
-    m_sockfd = socket(AF_INET,SOCK_STREAM,0);
-    if (m_sockfd == -1) { //socket failed
-        ret.success = false;
-        ret.msg = strerror(errno);
-        return ret;
+void TcpServer::handleUringSent(const uring_completion_t & completion) {
+    Client * client = m_clients.held(uringId(completion.token));
+    if (!client->m_sendQueue->completeSend(completion.result)) {
+        if (client->isConnected()) {
+            handleClientDisconnected(client, DISCONNECT_SOCKET_ERROR, strerror(errno));
+        }
+    } else if (client->isConnected()) {
+        submitUringSend(client);
     }
-    // set socket for reuse (otherwise might have to wait 4 minutes every time socket is closed)
-    int option = 1;
-    setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
-
-    memset(&m_serverAddress, 0, sizeof(m_serverAddress));
-    m_serverAddress.sin_family = AF_INET;
-    m_serverAddress.sin_addr.s_addr = htonl(INADDR_ANY);
-    m_serverAddress.sin_port = htons(port);
+    m_clients.release(client);
+}
 
-    int bindSuccess = bind(m_sockfd, (struct sockaddr *)&m_serverAddress, sizeof(m_serverAddress));
-    if (bindSuccess == -1) { // bind failed
-        ret.success = false;
-        ret.msg = strerror(errno);
-        return ret;
+/*
+ * Store a client socket in the clients table and hand it to an I/O
+ * thread: registered for epoll events (the socket must be non-blocking),
+ * or, with io_uring, with a multishot recv queued, in which case this
+ * must run on the I/O thread. Return the stored client, acquired
+ * for the caller, or nullptr on failure, in which case the socket
+ * is closed.
+ */
+Client * TcpServer::registerLoopClient(const Client & newClient, uint eventLoopIndex) {
+    EventLoop * eventLoop = m_eventLoops[eventLoopIndex];
+    Client * client = m_clients.insert(newClient);
+    if (client == nullptr) { // clients table is full
+        discardConnection(newClient);
+        errno = EMFILE;
+        return nullptr;
     }
-    const int clientsQueueSize = 5;
-    int listenSuccess = listen(m_sockfd, clientsQueueSize);
-    if (listenSuccess == -1) { // listen failed
-        ret.success = false;
-        ret.msg = strerror(errno);
-        return ret;
+    client->m_eventLoop = eventLoop;
+    client->m_eventLoopIndex = eventLoopIndex;
+    initClient(client);
+    // the I/O thread may drop the client as soon as it is registered
+    m_clients.acquire(client->getId());
+    bool registered;
+    if (m_config.mode == SERVER_MODE_IO_URING) {
+        registered = eventLoop->uring()->prepareRecv(client->getFileDescriptor(), uringToken(URING_RECV, client->getId()));
+        if (!registered) {
+            errno = EBUSY;
+        }
+    } else {
+        // edge-triggered EPOLLOUT only fires when a full socket drains again
+        registered = eventLoop->add(client->getFileDescriptor(), EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, client->getId());
     }
-    ret.success = true;
-    return ret;
+    if (!registered) {
+        int addErrno = errno;
+        m_clients.remove(client->getId());
+        m_clients.release(client);
+        errno = addErrno;
+        return nullptr;
+    }
+    if (client->m_timer != nullptr) {
+        startClientTimer(client);
+    }
+    return client;
 }
 
 /*
@@ -149,15 +1510,24 @@ pipe_ret_t TcpServer::start(int port) {
  * If timeout argument equal 0, this function is executed in blocking mode.
  * If timeout argument is > 0 then this function is executed in non-blocking
  * mode (async) and will quit after timeout seconds if no client tried to connect.
+ * In SERVER_MODE_EPOLL the accepted client is handed to one of the
+ * I/O threads in round robin order instead of getting its own thread.
+ * In SERVER_MODE_REACTOR and SERVER_MODE_IO_URING clients are accepted by the reactor threads,
+ * and observers are notified through connected_func instead.
+ * With TLS, observers are notified once the handshake is done, from the I/O thread.
  * Return accepted client
  */
 Client TcpServer::acceptClient(uint timeout) {
-    socklen_t sosize  = sizeof(m_clientAddress);
     Client newClient;
 
+    if (m_config.mode == SERVER_MODE_REACTOR || m_config.mode == SERVER_MODE_IO_URING) {
+        newClient.setErrorMessage("Clients are accepted by the reactor threads");
+        return newClient;
+    }
+
     if (timeout > 0) {
         struct timeval tv;
-        tv.tv_sec = 2;
+        tv.tv_sec = timeout;
         tv.tv_usec = 0;
         FD_ZERO(&m_fds);
         FD_SET(m_sockfd, &m_fds);
@@ -172,82 +1542,623 @@ Client TcpServer::acceptClient(uint timeout) {
             newClient.setErrorMessage("File descriptor is not set");
             return newClient;
         }
+    } else if (m_config.transport == TRANSPORT_MEMORY) {
+        // in-memory connections are taken without waiting, wait like accept() does
+        struct pollfd fds;
+        fds.fd = m_sockfd;
+        fds.events = POLLIN;
+        while (poll(&fds, 1, -1) == -1 && errno == EINTR) {
+        }
     }
 
-    int file_descriptor = accept(m_sockfd, (struct sockaddr*)&m_clientAddress, &sosize);
+    int file_descriptor = acceptConnection(m_sockfd, newClient, 0);
     if (file_descriptor == -1) { // accept failed
-        newClient.setErrorMessage(strerror(errno));
+        if (m_draining && (errno == ECONNREFUSED || errno == EINVAL)) { // EINVAL: listener shut down
+            newClient.setErrorMessage("Server is draining");
+        } else {
+            newClient.setErrorMessage(errno == ECONNREFUSED ? "Connection limit reached" : strerror(errno));
+        }
         return newClient;
     }
+    uint64_t acceptedAt = metricsClock();
 
-    newClient.setFileDescriptor(file_descriptor);
-    newClient.setConnected();
-    newClient.setIp(inet_ntoa(m_clientAddress.sin_addr));
-    m_clients.push_back(newClient);
-    m_clients.back().setThreadHandler(std::bind(&TcpServer::receiveTask, this));
+    // a TLS client is connected once its handshake is done
+    bool handshaking = newClient.m_handshake != nullptr;
+    if (!handshaking) {
+        newClient.setConnected();
+    }
+
+    Client * client;
+    if (m_config.mode == SERVER_MODE_EPOLL) {
+        int flags = fcntl(file_descriptor, F_GETFL, 0);
+        fcntl(file_descriptor, F_SETFL, flags | O_NONBLOCK);
+        client = registerLoopClient(newClient, m_nextEventLoop++ % m_eventLoops.size());
+        if (client == nullptr) {
+            newClient.setDisconnected();
+            newClient.setErrorMessage(strerror(errno));
+            return newClient;
+        }
+    } else {
+        client = m_clients.insert(newClient);
+        if (client == nullptr) { // clients table is full
+            discardConnection(newClient);
+            newClient.setDisconnected();
+            newClient.setErrorMessage("Too many clients");
+            return newClient;
+        }
+        initClient(client);
+        if (m_config.readTimeoutMs > 0) {
+            struct timeval receiveTimeout;
+            receiveTimeout.tv_sec = m_config.readTimeoutMs / 1000;
+            receiveTimeout.tv_usec = (m_config.readTimeoutMs % 1000) * 1000;
+            setsockopt(file_descriptor, SOL_SOCKET, SO_RCVTIMEO, &receiveTimeout, sizeof(receiveTimeout));
+        }
+        m_clients.acquire(client->getId());
+        startReceiveThread(client->getId());
+    }
+    newClient.m_id = client->getId();
+    countAccepted(acceptedAt);
+    if (handshaking) {
+        // the I/O thread tells observers once the handshake is done
+        newClient.setConnected();
+    } else {
+        publishClientConnected(*client);
+    }
+    m_clients.release(client);
 
     return newClient;
 }
 
 /*
  * Send message to all connected clients.
+ * The message is serialized once and shared by all clients,
+ * see broadcast().
+ * Thread per client servers have no send queues to broadcast with:
+ * the message is sent to one client after the other with blocking
+ * sends, so a slow client delays the ones after it, and there is no
+ * backpressure policy. Use an epoll, reactor or io_uring server to
+ * send to many clients.
  * Return true if message was sent successfully to all clients
  */
 pipe_ret_t TcpServer::sendToAllClients(const char * msg, size_t size) {
+    Payload payload = makePayload(msg, size);
+    if (!m_eventLoops.empty()) {
+        return broadcast(payload);
+    }
+
     pipe_ret_t ret;
-    for (uint i=0; i<m_clients.size(); i++) {
-        ret = sendToClient(m_clients[i], msg, size);
-        if (!ret.success) {
-            return ret;
+    ret.success = true;
+    m_clients.forEach([&](Client & client) {
+        pipe_ret_t sendRet = sendBlocking(&client, nullptr, 0, payload.data(), payload.size());
+        if (!sendRet.success) {
+            ret = sendRet;
         }
+    });
+    return ret;
+}
+
+/*
+ * Serialize a message, with its frame header if the server uses
+ * framing, into a payload which can be sent to any number of clients.
+ * With compression it is compressed once for all of them.
+ */
+Payload TcpServer::makePayload(const char * msg, size_t size) const {
+    if (m_compressor != nullptr) {
+        return m_compressor->encode(msg, size);
+    }
+    char header[MAX_FRAME_HEADER_SIZE];
+    size_t headerSize = encodeFrameHeader(m_config.framing.mode, size, header);
+    return Payload(header, headerSize, msg, size);
+}
+
+/*
+ * Send payload to all connected clients.
+ * Every client gets a reference to the payload queued, and the actual
+ * writes are done by every I/O thread for its own clients, in parallel.
+ * A slow client does not delay the others: when its send queue is full
+ * its backpressure policy decides whether the payload is dropped,
+ * coalesced or the client dropped.
+ * Thread per client servers have no send queues, and fail without
+ * sending anything, see sendToAllClients().
+ * Return true if payload was queued to all clients, otherwise
+ * the last failure, after trying all clients anyway
+ */
+pipe_ret_t TcpServer::broadcast(const Payload & payload) {
+    pipe_ret_t ret;
+
+    if (m_eventLoops.empty()) {
+        ret.success = false;
+        ret.reason = "Broadcast needs SERVER_MODE_EPOLL, SERVER_MODE_REACTOR or SERVER_MODE_IO_URING";
+        return ret;
     }
+
     ret.success = true;
+
+    m_clients.forEach([&](Client & client) {
+        if (!client.isConnected()) {
+            return;
+        }
+        pipe_ret_t queueRet = queueToClient(&client, payload, true, false);
+        if (!queueRet.success) {
+            ret = queueRet;
+            return;
+        }
+        // have the client I/O thread write it, as if the socket became writable
+        requestFlush(&client);
+    });
     return ret;
 }
 
 /*
  * Send message to specific client (determined by client IP address).
- * Return true if message was sent successfully
+ * With framing, the message is prefixed by its length.
+ * Epoll and reactor clients never block the caller: the message is
+ * queued on the client and written as soon as the socket allows it.
+ * Return true if message was sent, or queued, successfully
  */
 pipe_ret_t TcpServer::sendToClient(const Client & client, const char * msg, size_t size){
     pipe_ret_t ret;
-    int numBytesSent = send(client.getFileDescriptor(), (char *)msg, size, 0);
-    if (numBytesSent < 0) { // send failed
+    // hold the client so its descriptor stays open while sending
+    Client * stored = m_clients.acquire(client.getId());
+    if (stored == nullptr) {
+        ret.success = false;
+        ret.reason = "Client is not connected";
+        return ret;
+    }
+    if (stored->m_compressor != nullptr) {
+        // with the client's own compressor, senders to different clients don't contend
+        Payload payload = stored->m_compressor->encode(msg, size);
+        ret = stored->m_sendQueue != nullptr ? queueToClient(stored, payload, false, true) :
+              sendBlocking(stored, nullptr, 0, payload.data(), payload.size());
+    } else if (stored->m_sendQueue != nullptr) {
+        ret = queueToClient(stored, makePayload(msg, size), false, true);
+    } else {
+        char header[MAX_FRAME_HEADER_SIZE];
+        size_t headerSize = encodeFrameHeader(m_config.framing.mode, size, header);
+        ret = sendBlocking(stored, header, headerSize, msg, size);
+    }
+    m_clients.release(stored);
+    return ret;
+}
+
+/*
+ * Send length bytes of file fd, from offset, to a client with
+ * sendfile(): the data goes from the page cache to the socket without
+ * being read into memory. With framing, it is sent as one message.
+ * The file must stay open until onComplete is called.
+ * Epoll and reactor clients get the range queued, in order with the
+ * other messages, and onComplete is called from the client I/O thread
+ * once it was written, or when the client disconnected before. Thread
+ * per client clients are sent to right away and onComplete is called
+ * before returning. Not available in SERVER_MODE_IO_URING.
+ * Return true if the range was queued (or sent), onComplete is not
+ * called otherwise
+ */
+pipe_ret_t TcpServer::sendFileToClient(const Client & client, int fd, off_t offset, size_t length,
+                                       const send_complete_func_t & onComplete) {
+    SendRequest * request = new SendRequest();
+    request->kind = SendRequest::SEND_FILE;
+    request->fd = fd;
+    request->offset = offset;
+    request->size = length;
+    request->onComplete = onComplete;
+    return sendRequest(client, request);
+}
+
+/*
+ * Send msg to a client without copying it: the kernel sends straight
+ * from its pages (MSG_ZEROCOPY), so they must be left untouched until
+ * onComplete is called, which is once the kernel is done with them.
+ * Worth it for large buffers only, smaller than
+ * SendQueue::MIN_ZEROCOPY_SIZE they are copied as usual. As for
+ * sendFileToClient(), thread per client clients are sent a copy
+ * synchronously, and io_uring is not supported.
+ * Return true if msg was queued (or sent), onComplete is not
+ * called otherwise
+ */
+pipe_ret_t TcpServer::sendZeroCopyToClient(const Client & client, const char * msg, size_t size,
+                                           const send_complete_func_t & onComplete) {
+    SendRequest * request = new SendRequest();
+    request->kind = SendRequest::SEND_ZEROCOPY;
+    request->data = msg;
+    request->size = size;
+    request->onComplete = onComplete;
+    return sendRequest(client, request);
+}
+
+/*
+ * Queue a request, along with its frame header, on a non-blocking
+ * client, or send it right away to a blocking one. Takes ownership
+ * of request.
+ */
+pipe_ret_t TcpServer::sendRequest(const Client & client, SendRequest * request) {
+    pipe_ret_t ret;
+    if (m_config.mode == SERVER_MODE_IO_URING) {
+        delete request;
         ret.success = false;
-        ret.msg = strerror(errno);
+        ret.reason = "Not supported in io_uring mode";
         return ret;
     }
-    if ((uint)numBytesSent < size) { // not all bytes were sent
+    Client * stored = m_clients.acquire(client.getId());
+    if (stored == nullptr) {
+        delete request;
         ret.success = false;
-        char msg[100];
-        sprintf(msg, "Only %d bytes out of %lu was sent to client", numBytesSent, size);
-        ret.msg = msg;
+        ret.reason = "Client is not connected";
+        return ret;
+    }
+    char header[MAX_MESSAGE_HEADER_SIZE];
+    size_t headerSize = encodeMessageHeader(m_config.framing.mode, m_config.compression.enabled, request->size, header);
+
+    if (stored->m_sendQueue == nullptr) {
+        if (request->kind == SendRequest::SEND_FILE) {
+            ret = sendFileBlocking(stored, *request);
+        } else {
+            ret = sendBlocking(stored, header, headerSize, request->data, request->size);
+        }
+        m_clients.release(stored);
+        if (ret.success && request->onComplete) {
+            request->onComplete(ret);
+        }
+        delete request;
         return ret;
     }
+
+    if (request->kind == SendRequest::SEND_ZEROCOPY && request->size >= SendQueue::MIN_ZEROCOPY_SIZE) {
+        stored->m_sendQueue->enableZeroCopy(stored->getFileDescriptor());
+    }
+    Payload headerPayload;
+    if (headerSize > 0) {
+        headerPayload = Payload(header, headerSize, "", 0);
+    }
+    stored->m_sendQueue->push(headerPayload, request);
+    countSent(stored, 1);
     ret.success = true;
+    SendQueue::flush_ret_t flushRet = stored->m_sendQueue->tryFlush(stored->getFileDescriptor());
+    if (flushRet == SendQueue::FLUSH_ERROR) {
+        ret.success = false;
+        ret.reason = strerror(errno);
+    } else if (flushRet == SendQueue::FLUSH_THROTTLED) { // the I/O thread resumes it
+        requestFlush(stored);
+    }
+    m_clients.release(stored);
     return ret;
 }
 
 /*
- * Close server and clients resources.
- * Return true is success, false otherwise
+ * Write the frame header of a file range, then the range, to the
+ * blocking socket of a client
+ */
+pipe_ret_t TcpServer::sendFileBlocking(Client * client, const SendRequest & request) {
+    pipe_ret_t ret;
+    char header[MAX_MESSAGE_HEADER_SIZE];
+    size_t headerSize = encodeMessageHeader(m_config.framing.mode, m_config.compression.enabled, request.size, header);
+    if (headerSize > 0) {
+        // counts the message
+        ret = sendBlocking(client, nullptr, 0, header, headerSize);
+        if (!ret.success) {
+            return ret;
+        }
+    } else {
+        countSent(client, 1);
+    }
+    off_t offset = request.offset;
+    size_t left = request.size;
+    while (left > 0) {
+        ssize_t numBytesSent = sendfile(client->getFileDescriptor(), request.fd, &offset, left);
+        if (numBytesSent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (numBytesSent <= 0) {
+            ret.success = false;
+            ret.reason = numBytesSent == 0 ? strerror(ENODATA) : strerror(errno);
+            return ret;
+        }
+        if (client->m_metrics != nullptr) {
+            m_metrics.bytesOut.add(numBytesSent);
+            ConnectionMetrics::add(client->m_metrics->bytesOut, numBytesSent);
+        }
+        left -= (size_t)numBytesSent;
+    }
+    ret.success = true;
+    return ret;
+}
+
+/*
+ * Queue a payload on a non-blocking client. If flushNow is set, try to
+ * write it right away, unless the socket is already known to be full,
+ * in which case the client I/O thread writes it once the socket drains.
+ * With io_uring the write is always left to the I/O thread.
  */
-pipe_ret_t TcpServer::finish() {
+pipe_ret_t TcpServer::queueToClient(Client * client, const Payload & payload, bool coalescable, bool flushNow) {
     pipe_ret_t ret;
-    for (uint i=0; i<m_clients.size(); i++) {
-        m_clients[i].setDisconnected();
-        if (close(m_clients[i].getFileDescriptor()) == -1) { // close failed
+    SendQueue::push_ret_t pushRet = client->m_sendQueue->push(payload, coalescable, client->m_backpressurePolicy);
+    if (pushRet == SendQueue::PUSH_OVERFLOW) {
+        disconnectSlowClient(client);
+        ret.success = false;
+        ret.reason = "Slow client disconnected";
+        return ret;
+    }
+    if (pushRet == SendQueue::PUSH_DROPPED) {
+        ret.success = false;
+        ret.reason = "Send queue is full";
+        return ret;
+    }
+    countSent(client, 1);
+    if (flushNow && m_config.mode == SERVER_MODE_IO_URING) {
+        // batched with the other sends of the I/O thread
+        requestFlush(client);
+    } else if (flushNow) {
+        SendQueue::flush_ret_t flushRet = client->m_sendQueue->tryFlush(client->getFileDescriptor());
+        if (flushRet == SendQueue::FLUSH_ERROR) {
             ret.success = false;
-            ret.msg = strerror(errno);
+            ret.reason = strerror(errno);
             return ret;
         }
+        if (flushRet == SendQueue::FLUSH_THROTTLED) { // the I/O thread resumes it
+            requestFlush(client);
+        }
+    }
+    ret.success = true;
+    return ret;
+}
+
+/*
+ * Have the I/O thread of a client which can't keep up
+ * with what is sent to it disconnect it
+ */
+void TcpServer::disconnectSlowClient(Client * client) {
+    client_id_t clientId = client->getId();
+    client->m_eventLoop->post([this, clientId]() {
+        Client * slowClient = m_clients.acquire(clientId);
+        if (slowClient == nullptr) {
+            return;
+        }
+        if (slowClient->isConnected()) {
+            handleClientDisconnected(slowClient, DISCONNECT_SLOW_CLIENT, "Slow client");
+        }
+        m_clients.release(slowClient);
+    });
+}
+
+/*
+ * Change what happens when a client send queue is full
+ */
+bool TcpServer::setBackpressurePolicy(const Client & client, backpressure_policy_t policy) {
+    Client * stored = m_clients.acquire(client.getId());
+    if (stored == nullptr) {
+        return false;
+    }
+    stored->m_backpressurePolicy = policy;
+    m_clients.release(stored);
+    return true;
+}
+
+/*
+ * Hold the messages sent to a client, from any thread, until
+ * uncorkClient(), which sends them together: many small messages go
+ * out in a single write and full segments. Messages still corked when
+ * the client disconnects are lost. Thread per client clients are
+ * written synchronously and can't be corked.
+ * Return false if the client is not connected or can't be corked
+ */
+bool TcpServer::corkClient(const Client & client) {
+    Client * stored = m_clients.acquire(client.getId());
+    if (stored == nullptr) {
+        return false;
+    }
+    bool corked = stored->m_sendQueue != nullptr;
+    if (corked) {
+        stored->m_sendQueue->cork();
     }
-    if (close(m_sockfd) == -1) { // close failed
+    m_clients.release(stored);
+    return corked;
+}
+
+/*
+ * Send what was queued since corkClient(): right away if the socket has
+ * room, otherwise (and always with io_uring) from the client I/O thread
+ */
+pipe_ret_t TcpServer::uncorkClient(const Client & client) {
+    pipe_ret_t ret;
+    Client * stored = m_clients.acquire(client.getId());
+    if (stored == nullptr) {
         ret.success = false;
-        ret.msg = strerror(errno);
+        ret.reason = "Client is not connected";
+        return ret;
+    }
+    if (stored->m_sendQueue == nullptr) { // never corked
+        m_clients.release(stored);
+        ret.success = true;
         return ret;
     }
-    m_clients.clear();
+    stored->m_sendQueue->uncork();
+    ret.success = true;
+    SendQueue::flush_ret_t flushRet = SendQueue::FLUSH_WOULD_BLOCK;
+    if (m_config.mode != SERVER_MODE_IO_URING) {
+        flushRet = stored->m_sendQueue->tryFlush(stored->getFileDescriptor());
+    }
+    if (flushRet == SendQueue::FLUSH_ERROR) {
+        ret.success = false;
+        ret.reason = strerror(errno);
+    } else if (flushRet == SendQueue::FLUSH_WOULD_BLOCK || flushRet == SendQueue::FLUSH_THROTTLED) {
+        // the I/O thread may have skipped the socket while corked,
+        // have it flush as if the socket became writable
+        requestFlush(stored);
+    }
+    m_clients.release(stored);
+    return ret;
+}
+
+/*
+ * Write header and msg to the blocking socket of a client,
+ * resuming after partial writes until everything was sent.
+ */
+pipe_ret_t TcpServer::sendBlocking(Client * client, const char * header, size_t headerSize,
+                                   const char * msg, size_t size) {
+    pipe_ret_t ret;
+    int fd = client->getFileDescriptor();
+    struct iovec iov[2];
+    struct msghdr msgHeader;
+    memset(&msgHeader, 0, sizeof(msgHeader));
+    msgHeader.msg_iov = iov;
+    if (headerSize > 0) {
+        iov[msgHeader.msg_iovlen].iov_base = (char *)header;
+        iov[msgHeader.msg_iovlen].iov_len = headerSize;
+        msgHeader.msg_iovlen++;
+    }
+    iov[msgHeader.msg_iovlen].iov_base = (char *)msg;
+    iov[msgHeader.msg_iovlen].iov_len = size;
+    msgHeader.msg_iovlen++;
+
+    while (msgHeader.msg_iovlen > 0) {
+        ssize_t numBytesSent = sendmsg(fd, &msgHeader, MSG_NOSIGNAL);
+        if (numBytesSent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret.success = false;
+            ret.reason = strerror(errno);
+            return ret;
+        }
+        if (client->m_metrics != nullptr) {
+            m_metrics.bytesOut.add(numBytesSent);
+            ConnectionMetrics::add(client->m_metrics->bytesOut, numBytesSent);
+        }
+        // partial write: skip what was sent and send the rest
+        size_t sent = (size_t)numBytesSent;
+        while (msgHeader.msg_iovlen > 0 && sent >= msgHeader.msg_iov->iov_len) {
+            sent -= msgHeader.msg_iov->iov_len;
+            msgHeader.msg_iov++;
+            msgHeader.msg_iovlen--;
+        }
+        if (msgHeader.msg_iovlen > 0) {
+            msgHeader.msg_iov->iov_base = (char *)msgHeader.msg_iov->iov_base + sent;
+            msgHeader.msg_iov->iov_len -= sent;
+            if (client->m_metrics != nullptr) {
+                m_metrics.partialWrites.add();
+                ConnectionMetrics::add(client->m_metrics->partialWrites, 1);
+            }
+        }
+    }
+    countSent(client, 1);
+    ret.success = true;
+    return ret;
+}
+
+/*
+ * Refuse new connections: accepts end with EINVAL, or find the
+ * in-memory listener gone, and anything still accepted is closed
+ */
+void TcpServer::stopAccepting() {
+    m_draining = true;
+    for (uint i=0; i<m_listenfds.size(); i++) {
+        shutdown(m_listenfds[i], SHUT_RD);
+    }
+    if (m_memoryListener != nullptr) {
+        m_memoryListener->close();
+    }
+}
+
+/*
+ * Half-close every client once its send queue is written out: the
+ * peer reads everything queued, then end of stream, and closes in
+ * turn, which its I/O thread or receive thread notices like any other
+ * disconnection. Messages received meanwhile are still published.
+ * Return once no client is left, or after timeoutMs.
+ */
+void TcpServer::drainClients(uint timeoutMs) {
+    std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    // corked messages are in flight as well
+    m_clients.forEach([this](Client & client) {
+        if (client.m_sendQueue != nullptr && client.isConnected()) {
+            uncorkClient(client);
+        }
+    });
+    while (true) {
+        size_t connected = 0;
+        m_clients.forEach([&connected](Client & client) {
+            // not connected: leaving, or doing its TLS handshake
+            if (!client.isConnected()) {
+                return;
+            }
+            connected++;
+            if (client.m_halfClosed ||
+                (client.m_sendQueue != nullptr && client.m_sendQueue->hasPendingWrites())) {
+                return;
+            }
+            client.m_halfClosed = true;
+            if (client.m_stream != nullptr) {
+                client.m_stream->shutdownWrite();
+            } else {
+                shutdown(client.getFileDescriptor(), SHUT_WR);
+            }
+        });
+        if (connected == 0 || std::chrono::steady_clock::now() >= deadline) {
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(DRAIN_POLL_INTERVAL_MS));
+    }
+}
+
+/*
+ * The calling thread is an I/O thread or a receive thread, which
+ * can't wait for its own clients to leave
+ */
+bool TcpServer::isIoThread() {
+    for (uint i=0; i<m_eventLoops.size(); i++) {
+        if (m_eventLoops[i]->isInLoopThread()) {
+            return true;
+        }
+    }
+    std::lock_guard<std::mutex> lock(m_receiveThreadsMtx);
+    for (auto it = m_receiveThreads.begin(); it != m_receiveThreads.end(); ++it) {
+        if (it->second.get_id() == std::this_thread::get_id()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Close server and clients resources. With drainTimeoutMs, new
+ * connections are refused at once, then clients get up to that long
+ * to receive what is queued for them and close their end (see
+ * drainClients()), the rest are closed. Not drained if called on an
+ * I/O thread or a receive thread.
+ * Return true is success, false otherwise
+ */
+pipe_ret_t TcpServer::finish(uint drainTimeoutMs) {
+    pipe_ret_t ret;
     ret.success = true;
+    stopAccepting();
+    if (drainTimeoutMs > 0 && !isIoThread()) {
+        drainClients(drainTimeoutMs);
+    }
+    stopEventLoops();
+    if (m_workerPool != nullptr) { // deliver what was received
+        m_workerPool->stop();
+        // a restarted server creates its own, if it still dispatches
+        delete m_workerPool;
+        m_workerPool = nullptr;
+    }
+    // sockets are closed as soon as no thread is using them anymore
+    m_clients.forEach([this](Client & client) {
+        countDisconnect(&client, DISCONNECT_BY_SERVER);
+        client.setDisconnected();
+        shutdownClient(client);
+        m_clients.remove(client.getId());
+    });
+    joinReceiveThreads();
+    for (uint i=0; i<m_listenfds.size(); i++) {
+        if (close(m_listenfds[i]) == -1 && ret.success) { // close failed, close the others still
+            ret.success = false;
+            ret.msg = ret.reason = strerror(errno);
+        }
+    }
+    m_listenfds.clear();
+    if (m_config.transport == TRANSPORT_UNIX) {
+        unlink(m_config.path.c_str());
+    }
     return ret;
 }
@@ -0,0 +1,201 @@
+#include "../include/timer_wheel.h"
+#include <time.h>
+
+const uint32_t TimerWheel::NIL;
+
+TimerWheel::TimerWheel(uint tickMs) :
+        m_tickMs(tickMs > 0 ? tickMs : 1),
+        m_startMs(clockMs()),
+        m_lists(EXPIRED_LIST + 1, NIL) {
+}
+
+/*
+ * The coarse clock is read from the vDSO without a syscall,
+ * and its few milliseconds resolution is finer than a tick
+ */
+uint64_t TimerWheel::clockMs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+timer_id_t TimerWheel::schedule(uint64_t token, uint64_t delayMs) {
+    uint32_t index = m_freeNodes;
+    if (index != NIL) {
+        m_freeNodes = m_nodes[index].next;
+    } else {
+        index = (uint32_t)m_nodes.size();
+        node_t node;
+        node.generation = 1;
+        m_nodes.push_back(node);
+    }
+    node_t & node = m_nodes[index];
+    node.token = token;
+    // round up, a timer never expires early
+    uint64_t expiryMs = clockMs() + delayMs - m_startMs;
+    node.expiry = (expiryMs + m_tickMs - 1) / m_tickMs;
+    insert(index, m_tick + 1);
+    m_count++;
+    return ((uint64_t)node.generation << 32) | index;
+}
+
+bool TimerWheel::cancel(timer_id_t id) {
+    uint32_t index = (uint32_t)id;
+    if (id == 0 || index >= m_nodes.size()) {
+        return false;
+    }
+    node_t & node = m_nodes[index];
+    if (node.generation != (uint32_t)(id >> 32) || node.list == NIL) {
+        return false;
+    }
+    unlink(index);
+    release(index);
+    return true;
+}
+
+/*
+ * Put a node in the slot its expiry falls in, relative to the current
+ * tick: the first level within a turn of it, a higher one otherwise.
+ * Expiries beyond the last level wait in its farthest slot and come
+ * back there until they get in range. Expiries before tick first,
+ * the first tick not expired yet, are moved to it.
+ */
+void TimerWheel::insert(uint32_t index, uint64_t first) {
+    node_t & node = m_nodes[index];
+    uint64_t expiry = node.expiry > first ? node.expiry : first;
+    uint64_t delta = expiry - m_tick;
+    for (uint level=0; level<LEVELS; level++) {
+        if (delta < (1ULL << ((level + 1) * SLOT_BITS))) {
+            uint slot = (uint)(expiry >> (level * SLOT_BITS)) & (SLOTS - 1);
+            link(index, level * SLOTS + slot);
+            return;
+        }
+    }
+    uint top = LEVELS - 1;
+    uint slot = (uint)((m_tick >> (top * SLOT_BITS)) - 1) & (SLOTS - 1);
+    link(index, top * SLOTS + slot);
+}
+
+void TimerWheel::link(uint32_t index, uint32_t list) {
+    node_t & node = m_nodes[index];
+    node.list = list;
+    node.prev = NIL;
+    node.next = m_lists[list];
+    if (node.next != NIL) {
+        m_nodes[node.next].prev = index;
+    }
+    m_lists[list] = index;
+}
+
+void TimerWheel::unlink(uint32_t index) {
+    node_t & node = m_nodes[index];
+    if (node.prev != NIL) {
+        m_nodes[node.prev].next = node.next;
+    } else {
+        m_lists[node.list] = node.next;
+    }
+    if (node.next != NIL) {
+        m_nodes[node.next].prev = node.prev;
+    }
+    node.list = NIL;
+}
+
+/*
+ * Back to the free list, with a new generation
+ * so the id handed out for it is stale
+ */
+void TimerWheel::release(uint32_t index) {
+    node_t & node = m_nodes[index];
+    node.generation++;
+    if (node.generation == 0) {
+        node.generation = 1;
+    }
+    node.next = m_freeNodes;
+    m_freeNodes = index;
+    m_count--;
+}
+
+bool TimerWheel::nextExpired(uint64_t nowMs, uint64_t & token) {
+    if (m_lists[EXPIRED_LIST] == NIL) {
+        uint64_t now = nowMs > m_startMs ? (nowMs - m_startMs) / m_tickMs : 0;
+        if (m_count == 0 && now > m_tick) { // nothing to expire on the way
+            m_tick = now;
+        }
+        while (m_lists[EXPIRED_LIST] == NIL && m_tick < now) {
+            advance();
+        }
+        if (m_lists[EXPIRED_LIST] == NIL) {
+            return false;
+        }
+    }
+    uint32_t index = m_lists[EXPIRED_LIST];
+    token = m_nodes[index].token;
+    unlink(index);
+    release(index);
+    return true;
+}
+
+/*
+ * Move to the next tick: bring down the timers of the higher levels
+ * whose turn starts, highest level first, then expire the slot of the
+ * first level.
+ */
+void TimerWheel::advance() {
+    m_tick++;
+    uint levels = 0;
+    while (levels + 1 < LEVELS && (m_tick & ((1ULL << ((levels + 1) * SLOT_BITS)) - 1)) == 0) {
+        levels++;
+    }
+    for (uint level=levels; level>0; level--) {
+        cascade(level);
+    }
+    uint32_t list = (uint32_t)(m_tick & (SLOTS - 1));
+    while (m_lists[list] != NIL) {
+        uint32_t index = m_lists[list];
+        unlink(index);
+        link(index, EXPIRED_LIST);
+    }
+}
+
+/*
+ * Reinsert the timers of the current slot of level, now
+ * that they are within a turn of the level below
+ */
+void TimerWheel::cascade(uint level) {
+    uint slot = (uint)(m_tick >> (level * SLOT_BITS)) & (SLOTS - 1);
+    uint32_t list = level * SLOTS + slot;
+    uint32_t index = m_lists[list];
+    m_lists[list] = NIL;
+    while (index != NIL) {
+        uint32_t next = m_nodes[index].next;
+        // the slot of the current tick is expired right after
+        insert(index, m_tick);
+        index = next;
+    }
+}
+
+/*
+ * Time to the next non empty slot of the first level, or to the
+ * end of its turn, when higher levels may have timers to bring down
+ */
+int TimerWheel::timeout(uint64_t nowMs) const {
+    if (m_count == 0) {
+        return -1;
+    }
+    if (m_lists[EXPIRED_LIST] != NIL) {
+        return 0;
+    }
+    uint64_t tick = m_tick + 1;
+    while (true) {
+        if (m_lists[tick & (SLOTS - 1)] != NIL || (tick & (SLOTS - 1)) == 0) {
+            break;
+        }
+        tick++;
+    }
+    uint64_t atMs = m_startMs + tick * m_tickMs;
+    if (atMs <= nowMs) {
+        return 0;
+    }
+    uint64_t timeoutMs = atMs - nowMs;
+    return timeoutMs > (uint64_t)INT32_MAX ? INT32_MAX : (int)timeoutMs;
+}
@@ -0,0 +1,425 @@
+
+
+#include "../include/tls.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+const size_t TlsStream::MAX_RECORD_SIZE;
+
+#ifdef INTERCOM_HAVE_TLS
+
+#include <arpa/inet.h>
+#include <sys/sendfile.h>
+#include <algorithm>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+
+/*
+ * Reason of the last OpenSSL error of the thread, a static string
+ */
+static const char * lastError(const char * fallback) {
+    unsigned long error = ERR_peek_last_error();
+    const char * reason = error != 0 ? ERR_reason_error_string(error) : nullptr;
+    return reason != nullptr ? reason : fallback;
+}
+
+TlsContext::~TlsContext() {
+    SSL_CTX_free(m_ctx);
+}
+
+pipe_ret_t TlsContext::init(const tls_config_t & config, bool server) {
+    pipe_ret_t ret;
+    ret.success = false;
+    if (server && (config.certificateFile.empty() || config.privateKeyFile.empty())) {
+        ret.msg = ret.reason = "A TLS server needs a certificate and a private key";
+        return ret;
+    }
+    SSL_CTX_free(m_ctx);
+    ERR_clear_error();
+    m_ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+    if (m_ctx == nullptr) {
+        ret.msg = ret.reason = lastError("Failed to create the TLS context");
+        return ret;
+    }
+    m_server = server;
+    m_verifyPeer = config.verifyPeer;
+
+    SSL_CTX_set_min_proto_version(m_ctx, TLS1_2_VERSION);
+    // a peer closing without close_notify reads as end of stream, as on a plain socket
+    uint64_t options = SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF;
+#ifdef SSL_OP_ENABLE_KTLS
+    if (config.kernelOffload) {
+        options |= SSL_OP_ENABLE_KTLS;
+    }
+#endif
+    SSL_CTX_set_options(m_ctx, options);
+    // idle connections hold no record buffers
+    SSL_CTX_set_mode(m_ctx, SSL_MODE_RELEASE_BUFFERS);
+    if (server) {
+        // no session tickets: they are records a client whose kernel
+        // took over receiving couldn't read after the handshake
+        SSL_CTX_set_num_tickets(m_ctx, 0);
+    }
+
+    if (!config.certificateFile.empty()) {
+        const std::string & keyFile = config.privateKeyFile.empty() ? config.certificateFile : config.privateKeyFile;
+        if (SSL_CTX_use_certificate_chain_file(m_ctx, config.certificateFile.c_str()) != 1 ||
+            SSL_CTX_use_PrivateKey_file(m_ctx, keyFile.c_str(), SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(m_ctx) != 1) {
+            ret.msg = ret.reason = lastError("Failed to load the certificate");
+            return ret;
+        }
+    }
+    if (config.verifyPeer) {
+        int loaded = config.caFile.empty() ? SSL_CTX_set_default_verify_paths(m_ctx) :
+                     SSL_CTX_load_verify_locations(m_ctx, config.caFile.c_str(), nullptr);
+        if (loaded != 1) {
+            ret.msg = ret.reason = lastError("Failed to load the CA certificates");
+            return ret;
+        }
+        SSL_CTX_set_verify(m_ctx, server ? SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT : SSL_VERIFY_PEER, nullptr);
+    }
+    ret.success = true;
+    return ret;
+}
+
+pipe_ret_t TlsContext::createStream(int fd, const std::string & serverName, TlsStream *& stream) {
+    pipe_ret_t ret;
+    ERR_clear_error();
+    SSL * ssl = SSL_new(m_ctx);
+    if (ssl == nullptr || SSL_set_fd(ssl, fd) != 1) {
+        SSL_free(ssl);
+        ret.success = false;
+        ret.msg = ret.reason = lastError("Failed to create the TLS connection");
+        return ret;
+    }
+    if (m_server) {
+        SSL_set_accept_state(ssl);
+    } else {
+        SSL_set_connect_state(ssl);
+        if (!serverName.empty()) {
+            struct in6_addr address;
+            bool literal = inet_pton(AF_INET, serverName.c_str(), &address) == 1 ||
+                           inet_pton(AF_INET6, serverName.c_str(), &address) == 1;
+            if (!literal) { // SNI only carries host names
+                SSL_set_tlsext_host_name(ssl, serverName.c_str());
+            }
+            if (m_verifyPeer) {
+                SSL_set1_host(ssl, serverName.c_str());
+            }
+        }
+    }
+    stream = new TlsStream(ssl, fd);
+    ret.success = true;
+    return ret;
+}
+
+
+TlsStream::~TlsStream() {
+    SSL_free(m_ssl);
+    delete[] m_record;
+}
+
+/*
+ * Take the handshake as far as the socket allows. Once done, see
+ * which directions OpenSSL handed over to the kernel.
+ */
+pipe_ret_t TlsStream::handshake() {
+    pipe_ret_t ret;
+    std::lock_guard<std::mutex> lock(m_mtx);
+    ERR_clear_error();
+    int result = SSL_do_handshake(m_ssl);
+    int handshakeErrno = errno;
+    if (result == 1) {
+#ifndef OPENSSL_NO_KTLS
+        m_kernelSend = BIO_get_ktls_send(SSL_get_wbio(m_ssl));
+        m_kernelReceive = BIO_get_ktls_recv(SSL_get_rbio(m_ssl));
+#endif
+        ret.success = true;
+        return ret;
+    }
+    ret.success = false;
+    int error = SSL_get_error(m_ssl, result);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        m_wantsWrite = error == SSL_ERROR_WANT_WRITE;
+        ret.code = EAGAIN;
+        ret.msg = ret.reason = strerror(EAGAIN);
+        return ret;
+    }
+    ret.code = EPROTO;
+    long verifyResult = SSL_get_verify_result(m_ssl);
+    if (verifyResult != X509_V_OK) {
+        ret.msg = ret.reason = X509_verify_cert_error_string(verifyResult);
+    } else if (error == SSL_ERROR_SYSCALL && handshakeErrno != 0) {
+        ret.msg = ret.reason = strerror(handshakeErrno);
+    } else {
+        ret.msg = ret.reason = lastError("Connection closed during the TLS handshake");
+    }
+    return ret;
+}
+
+/*
+ * Map a failed SSL call to what the socket call would have
+ * returned: 0 at end of stream, otherwise -1 with errno set
+ */
+int TlsStream::fail(int result) {
+    int callErrno = errno;
+    switch (SSL_get_error(m_ssl, result)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            errno = callErrno != 0 ? callErrno : EPROTO;
+            return -1;
+        default:
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+/*
+ * Read records until iov is full or the socket is drained. What
+ * stopped the read is met again by the next one, if some was read.
+ */
+ssize_t TlsStream::readv(const struct iovec * iov, int iovcnt) {
+    if (m_kernelReceive) {
+        ssize_t numRead = ::readv(m_fd, iov, iovcnt);
+        if (numRead == -1 && errno == EIO) {
+            // a record other than data, the peer's close_notify alert
+            return 0;
+        }
+        return numRead;
+    }
+    std::lock_guard<std::mutex> lock(m_mtx);
+    size_t received = 0;
+    for (int i=0; i<iovcnt; i++) {
+        size_t filled = 0;
+        while (filled < iov[i].iov_len) {
+            size_t numRead;
+            ERR_clear_error();
+            int result = SSL_read_ex(m_ssl, (char *)iov[i].iov_base + filled, iov[i].iov_len - filled, &numRead);
+            if (result != 1) {
+                return received > 0 ? (ssize_t)received : fail(result);
+            }
+            filled += numRead;
+            received += numRead;
+        }
+    }
+    return (ssize_t)received;
+}
+
+/*
+ * Gather iov into records of up to MAX_RECORD_SIZE, one SSL_write()
+ * each, until everything is written or a record is left pending
+ */
+ssize_t TlsStream::writev(const struct iovec * iov, int iovcnt) {
+    if (m_kernelSend) {
+        struct msghdr msgHeader;
+        memset(&msgHeader, 0, sizeof(msgHeader));
+        msgHeader.msg_iov = (struct iovec *)iov;
+        msgHeader.msg_iovlen = iovcnt;
+        return sendmsg(m_fd, &msgHeader, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (m_pendingSize > 0 && flushPendingLocked() == -1) {
+        return -1;
+    }
+    if (m_record == nullptr) {
+        m_record = new char[MAX_RECORD_SIZE];
+    }
+    size_t written = 0;
+    int i = 0;
+    size_t offset = 0;
+    while (i < iovcnt && m_pendingSize == 0) {
+        size_t size = 0;
+        while (i < iovcnt && size < MAX_RECORD_SIZE) {
+            size_t chunk = std::min(iov[i].iov_len - offset, MAX_RECORD_SIZE - size);
+            memcpy(m_record + size, (const char *)iov[i].iov_base + offset, chunk);
+            size += chunk;
+            offset += chunk;
+            if (offset == iov[i].iov_len) {
+                i++;
+                offset = 0;
+            }
+        }
+        if (size == 0) {
+            break;
+        }
+        if (writeRecordLocked(size) == -1) {
+            return written > 0 ? (ssize_t)written : -1;
+        }
+        written += size;
+    }
+    return (ssize_t)written;
+}
+
+/*
+ * Write the size bytes of m_record as a record. If the socket is
+ * full OpenSSL keeps the encrypted record, to be written by calling
+ * it again with the same buffer: the bytes count as written.
+ */
+ssize_t TlsStream::writeRecordLocked(size_t size) {
+    size_t numWritten;
+    ERR_clear_error();
+    int result = SSL_write_ex(m_ssl, m_record, size, &numWritten);
+    if (result == 1) {
+        return (ssize_t)size;
+    }
+    int error = SSL_get_error(m_ssl, result);
+    if (error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ) {
+        m_pendingSize = size;
+        return (ssize_t)size;
+    }
+    if (fail(result) == 0) {
+        errno = EPIPE;
+    }
+    return -1;
+}
+
+int TlsStream::flushPendingLocked() {
+    size_t numWritten;
+    ERR_clear_error();
+    int result = SSL_write_ex(m_ssl, m_record, m_pendingSize, &numWritten);
+    if (result == 1) {
+        m_pendingSize = 0;
+        return 0;
+    }
+    if (fail(result) == 0) {
+        errno = EPIPE;
+    }
+    return -1;
+}
+
+bool TlsStream::writePending() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_pendingSize > 0;
+}
+
+int TlsStream::flushPending() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_pendingSize > 0 ? flushPendingLocked() : 0;
+}
+
+/*
+ * Through a buffer, encrypted like any data, unless the kernel
+ * encrypts: then the range goes from the page cache to the socket
+ */
+ssize_t TlsStream::sendFile(int fd, off_t * offset, size_t count) {
+    if (m_kernelSend) {
+        return sendfile(m_fd, fd, offset, count);
+    }
+    static thread_local char buffer[MAX_RECORD_SIZE];
+    ssize_t numRead = pread(fd, buffer, std::min(count, sizeof(buffer)), *offset);
+    if (numRead <= 0) {
+        return numRead;
+    }
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = (size_t)numRead;
+    ssize_t written = writev(&iov, 1);
+    if (written > 0) {
+        *offset += written;
+    }
+    return written;
+}
+
+/*
+ * Send close_notify, so the peer tells the end of the stream from a
+ * truncation, then the FIN. The socket is full if it can't be sent:
+ * the FIN is the end of the stream anyway.
+ */
+void TlsStream::shutdownWrite() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    ERR_clear_error();
+    SSL_shutdown(m_ssl);
+    ::shutdown(m_fd, SHUT_WR);
+}
+
+#else // !INTERCOM_HAVE_TLS
+
+TlsContext::~TlsContext() {
+}
+
+pipe_ret_t TlsContext::init(const tls_config_t & config, bool server) {
+    (void)config;
+    (void)server;
+    pipe_ret_t ret;
+    ret.success = false;
+    ret.msg = ret.reason = "TLS support was not built in";
+    return ret;
+}
+
+pipe_ret_t TlsContext::createStream(int fd, const std::string & serverName, TlsStream *& stream) {
+    (void)fd;
+    (void)serverName;
+    stream = nullptr;
+    pipe_ret_t ret;
+    ret.success = false;
+    ret.msg = ret.reason = "TLS support was not built in";
+    return ret;
+}
+
+// streams are only created by a context, never without TLS support
+
+TlsStream::~TlsStream() {
+}
+
+pipe_ret_t TlsStream::handshake() {
+    pipe_ret_t ret;
+    ret.success = false;
+    ret.code = EPROTO;
+    ret.msg = ret.reason = "TLS support was not built in";
+    return ret;
+}
+
+ssize_t TlsStream::readv(const struct iovec * iov, int iovcnt) {
+    (void)iov;
+    (void)iovcnt;
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t TlsStream::writev(const struct iovec * iov, int iovcnt) {
+    (void)iov;
+    (void)iovcnt;
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t TlsStream::sendFile(int fd, off_t * offset, size_t count) {
+    (void)fd;
+    (void)offset;
+    (void)count;
+    errno = ENOTSUP;
+    return -1;
+}
+
+bool TlsStream::writePending() {
+    return false;
+}
+
+int TlsStream::flushPending() {
+    return 0;
+}
+
+void TlsStream::shutdownWrite() {
+    ::shutdown(m_fd, SHUT_WR);
+}
+
+#endif // INTERCOM_HAVE_TLS
+
+void TlsStream::shutdown() {
+    ::shutdown(m_fd, SHUT_RDWR);
+}
+
+void TlsStream::close() {
+    ::close(m_fd);
+    delete this;
+}
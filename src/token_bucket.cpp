@@ -0,0 +1,20 @@
+
+
+#include "../include/token_bucket.h"
+#include <algorithm>
+
+
+TokenBucket::TokenBucket(uint64_t rate, uint64_t burst, uint64_t nowMs) :
+    m_rate(rate), m_burst((int64_t)burst * 1000), m_tokens(m_burst), m_refilledMs(nowMs) {}
+
+uint64_t TokenBucket::delay(uint64_t nowMs) {
+    if (nowMs > m_refilledMs) {
+        m_tokens = std::min(m_burst, m_tokens + (int64_t)(m_rate * (nowMs - m_refilledMs)));
+        m_refilledMs = nowMs;
+    }
+    if (m_tokens >= 1000) {
+        return 0;
+    }
+    // until a whole byte is available
+    return ((uint64_t)(1000 - m_tokens) + m_rate - 1) / m_rate;
+}
@@ -0,0 +1,21 @@
+
+
+#include "../include/transport.h"
+#include <string.h>
+#include <stddef.h>
+
+
+pipe_ret_t unixSocketAddress(const std::string & path, struct sockaddr_un & address, socklen_t & addressSize) {
+    pipe_ret_t ret;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+        ret.success = false;
+        ret.msg = ret.reason = path.empty() ? "Unix socket path is empty" : "Unix socket path is too long";
+        return ret;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size());
+    addressSize = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path.size() + 1);
+    ret.success = true;
+    return ret;
+}
@@ -0,0 +1,355 @@
+
+
+#include "../include/uring.h"
+#include <string.h>
+#include <errno.h>
+
+#ifdef INTERCOM_HAVE_IO_URING
+
+#include <unistd.h>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+
+static int uringSetup(unsigned entries, struct io_uring_params * params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int ringfd, unsigned toSubmit, unsigned minComplete, unsigned flags,
+                      struct io_uring_getevents_arg * arg = NULL) {
+    return (int)syscall(__NR_io_uring_enter, ringfd, toSubmit, minComplete, flags,
+                        arg, arg != NULL ? sizeof(*arg) : 0);
+}
+
+static int uringRegister(int ringfd, unsigned opcode, void * arg, unsigned numArgs) {
+    return (int)syscall(__NR_io_uring_register, ringfd, opcode, arg, numArgs);
+}
+
+IoUring::~IoUring() {
+    if (m_bufferRing != nullptr) {
+        munmap(m_bufferRing, m_bufferRingSize);
+    }
+    if (m_buffers != nullptr) {
+        munmap(m_buffers, m_buffersSize);
+    }
+    if (m_sqes != nullptr) {
+        munmap(m_sqes, m_sqesSize);
+    }
+    if (m_cqRing != nullptr && m_cqRing != m_sqRing) {
+        munmap(m_cqRing, m_cqRingSize);
+    }
+    if (m_sqRing != nullptr) {
+        munmap(m_sqRing, m_sqRingSize);
+    }
+    if (m_ringfd != -1) {
+        // cancels whatever is still in flight
+        close(m_ringfd);
+    }
+}
+
+/*
+ * Create the ring with room for entries submissions, and a completion
+ * queue four times as large since multishot requests complete many times
+ */
+pipe_ret_t IoUring::init(unsigned entries) {
+    pipe_ret_t ret;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = entries * 4;
+    m_ringfd = uringSetup(entries, &params);
+    if (m_ringfd == -1 && errno == EINVAL) { // kernel older than 5.19
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        m_ringfd = uringSetup(entries, &params);
+    }
+    if (m_ringfd == -1) {
+        ret.success = false;
+        ret.msg = ret.reason = strerror(errno);
+        return ret;
+    }
+
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMmap) {
+        m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+    }
+    m_sqRing = mmap(NULL, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    m_ringfd, IORING_OFF_SQ_RING);
+    if (m_sqRing == MAP_FAILED) {
+        m_sqRing = nullptr;
+        ret.success = false;
+        ret.msg = ret.reason = strerror(errno);
+        return ret;
+    }
+    m_cqRing = m_sqRing;
+    if (!singleMmap) {
+        m_cqRing = mmap(NULL, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        m_ringfd, IORING_OFF_CQ_RING);
+        if (m_cqRing == MAP_FAILED) {
+            m_cqRing = nullptr;
+            ret.success = false;
+            ret.msg = ret.reason = strerror(errno);
+            return ret;
+        }
+    }
+    m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void * sqes = mmap(NULL, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       m_ringfd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        ret.success = false;
+        ret.msg = ret.reason = strerror(errno);
+        return ret;
+    }
+    m_sqes = (struct io_uring_sqe *)sqes;
+
+    char * sq = (char *)m_sqRing;
+    m_sqHead = reinterpret_cast<std::atomic<unsigned> *>(sq + params.sq_off.head);
+    m_sqTail = reinterpret_cast<std::atomic<unsigned> *>(sq + params.sq_off.tail);
+    m_sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    m_sqEntries = params.sq_entries;
+    m_sqLocalTail = m_sqSubmitted = m_sqTail->load(std::memory_order_relaxed);
+    // submission queue entries are used in order, map them one to one
+    unsigned * sqArray = (unsigned *)(sq + params.sq_off.array);
+    for (unsigned i=0; i<m_sqEntries; i++) {
+        sqArray[i] = i;
+    }
+
+    char * cq = (char *)m_cqRing;
+    m_cqHead = reinterpret_cast<std::atomic<unsigned> *>(cq + params.cq_off.head);
+    m_cqTail = reinterpret_cast<std::atomic<unsigned> *>(cq + params.cq_off.tail);
+    m_cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    m_cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    ret.success = true;
+    return ret;
+}
+
+/*
+ * Register count buffers of bufferSize bytes each as provided
+ * buffer group BUFFER_GROUP. count must be a power of 2.
+ */
+pipe_ret_t IoUring::initBuffers(unsigned count, size_t bufferSize) {
+    pipe_ret_t ret;
+    if (count == 0 || (count & (count - 1)) != 0 || count > 32768) {
+        ret.success = false;
+        ret.msg = ret.reason = "buffer count must be a power of 2 up to 32768";
+        return ret;
+    }
+    m_bufferRingSize = count * sizeof(struct io_uring_buf);
+    void * bufferRing = mmap(NULL, m_bufferRingSize, PROT_READ | PROT_WRITE,
+                             MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (bufferRing == MAP_FAILED) {
+        ret.success = false;
+        ret.msg = ret.reason = strerror(errno);
+        return ret;
+    }
+    m_bufferRing = (struct io_uring_buf_ring *)bufferRing;
+    m_buffersSize = count * bufferSize;
+    void * buffers = mmap(NULL, m_buffersSize, PROT_READ | PROT_WRITE,
+                          MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (buffers == MAP_FAILED) {
+        ret.success = false;
+        ret.msg = ret.reason = strerror(errno);
+        return ret;
+    }
+    m_buffers = (char *)buffers;
+    m_bufferSize = bufferSize;
+    m_bufferCount = count;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)m_bufferRing;
+    reg.ring_entries = count;
+    reg.bgid = BUFFER_GROUP;
+    if (uringRegister(m_ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        ret.success = false;
+        ret.msg = ret.reason = strerror(errno);
+        return ret;
+    }
+    for (unsigned i=0; i<count; i++) {
+        recycleBuffer((int)i);
+    }
+    ret.success = true;
+    return ret;
+}
+
+/*
+ * Hand a buffer back to the kernel for upcoming receives
+ */
+void IoUring::recycleBuffer(int bufferId) {
+    // the ring is an array of io_uring_buf, indexed by hand: compiled as C++
+    // the kernel header's flexible array member is not at offset 0
+    struct io_uring_buf * bufs = reinterpret_cast<struct io_uring_buf *>(m_bufferRing);
+    struct io_uring_buf * buf = &bufs[m_bufferTail & (m_bufferCount - 1)];
+    buf->addr = (uint64_t)(uintptr_t)buffer(bufferId);
+    buf->len = (uint32_t)m_bufferSize;
+    buf->bid = (uint16_t)bufferId;
+    m_bufferTail++;
+    reinterpret_cast<std::atomic<uint16_t> *>(&m_bufferRing->tail)->store(m_bufferTail, std::memory_order_release);
+}
+
+/*
+ * Next free submission queue entry, zeroed. When the queue is
+ * full, what was prepared so far is submitted to make room.
+ */
+struct io_uring_sqe * IoUring::getSqe() {
+    if (m_sqLocalTail - m_sqHead->load(std::memory_order_acquire) >= m_sqEntries) {
+        submit(0);
+        if (m_sqLocalTail - m_sqHead->load(std::memory_order_acquire) >= m_sqEntries) {
+            return nullptr;
+        }
+    }
+    struct io_uring_sqe * sqe = &m_sqes[m_sqLocalTail & m_sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sqLocalTail++;
+    return sqe;
+}
+
+/*
+ * Multishot accept: one completion per accepted connection,
+ * whose result is a non-blocking socket
+ */
+bool IoUring::prepareAccept(int listenfd, uint64_t token) {
+    struct io_uring_sqe * sqe = getSqe();
+    if (sqe == nullptr) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = token;
+    return true;
+}
+
+/*
+ * Multishot recv: one completion per chunk received,
+ * in a buffer picked from the provided buffer ring
+ */
+bool IoUring::prepareRecv(int fd, uint64_t token) {
+    struct io_uring_sqe * sqe = getSqe();
+    if (sqe == nullptr) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = token;
+    return true;
+}
+
+/*
+ * sendmsg(); msg and the data it points to must stay
+ * valid until the request completes
+ */
+bool IoUring::prepareSend(int fd, const struct msghdr * msg, uint64_t token) {
+    struct io_uring_sqe * sqe = getSqe();
+    if (sqe == nullptr) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = token;
+    return true;
+}
+
+bool IoUring::prepareRead(int fd, void * buffer, size_t size, uint64_t token) {
+    struct io_uring_sqe * sqe = getSqe();
+    if (sqe == nullptr) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = (uint32_t)size;
+    sqe->off = (uint64_t)-1; // current position, for non seekable files
+    sqe->user_data = token;
+    return true;
+}
+
+/*
+ * Submit all prepared requests in a single syscall and wait until
+ * at least waitFor requests completed, or timeoutMs elapsed.
+ * Return 0 or -errno, -ETIME on timeout.
+ */
+int IoUring::submit(unsigned waitFor, int timeoutMs) {
+    unsigned toSubmit = m_sqLocalTail - m_sqSubmitted;
+    if (toSubmit == 0 && waitFor == 0) {
+        return 0;
+    }
+    m_sqTail->store(m_sqLocalTail, std::memory_order_release);
+    unsigned flags = waitFor > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int submitted;
+    if (waitFor > 0 && timeoutMs >= 0) {
+        // the timeout is passed along, without a timeout request (5.11+)
+        struct __kernel_timespec timeout;
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&timeout;
+        submitted = uringEnter(m_ringfd, toSubmit, waitFor, flags | IORING_ENTER_EXT_ARG, &arg);
+    } else {
+        submitted = uringEnter(m_ringfd, toSubmit, waitFor, flags);
+    }
+    if (submitted < 0) {
+        return -errno;
+    }
+    m_sqSubmitted += submitted;
+    return 0;
+}
+
+/*
+ * Pop the next completion, return false if there is none
+ */
+bool IoUring::nextCompletion(uring_completion_t & completion) {
+    unsigned head = m_cqHead->load(std::memory_order_relaxed);
+    if (head == m_cqTail->load(std::memory_order_acquire)) {
+        return false;
+    }
+    const struct io_uring_cqe & cqe = m_cqes[head & m_cqMask];
+    completion.token = cqe.user_data;
+    completion.result = cqe.res;
+    completion.more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+    completion.bufferId = (cqe.flags & IORING_CQE_F_BUFFER) ? (int)(cqe.flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    m_cqHead->store(head + 1, std::memory_order_release);
+    return true;
+}
+
+#else // !INTERCOM_HAVE_IO_URING
+
+IoUring::~IoUring() {
+}
+
+pipe_ret_t IoUring::init(unsigned entries) {
+    (void)entries;
+    pipe_ret_t ret;
+    ret.success = false;
+    ret.msg = ret.reason = "io_uring support was not built in";
+    return ret;
+}
+
+pipe_ret_t IoUring::initBuffers(unsigned, size_t) {
+    return init(0);
+}
+
+bool IoUring::prepareAccept(int, uint64_t) { return false; }
+bool IoUring::prepareRecv(int, uint64_t) { return false; }
+bool IoUring::prepareSend(int, const struct msghdr *, uint64_t) { return false; }
+bool IoUring::prepareRead(int, void *, size_t, uint64_t) { return false; }
+int IoUring::submit(unsigned, int) { return -ENOSYS; }
+bool IoUring::nextCompletion(uring_completion_t &) { return false; }
+void IoUring::recycleBuffer(int) {}
+
+#endif // INTERCOM_HAVE_IO_URING
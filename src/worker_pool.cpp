@@ -0,0 +1,234 @@
+#include "../include/worker_pool.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+#include <system_error>
+
+
+namespace {
+    // pool and queue of the worker running on this thread, if any
+    thread_local WorkerPool * currentPool = nullptr;
+    thread_local uint currentWorker = 0;
+
+    // rounds of looking for work before a worker goes to sleep
+    const int IDLE_SPINS = 64;
+}
+
+WorkerPool::TaskQueue::TaskQueue() : m_enqueuePos(0), m_dequeuePos(0) {
+    for (size_t i=0; i<QUEUE_SIZE; i++) {
+        m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        m_cells[i].task = nullptr;
+    }
+}
+
+/*
+ * Return false if the queue is full
+ */
+bool WorkerPool::TaskQueue::push(WorkerTask * task) {
+    size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+    while (true) {
+        cell_t & cell = m_cells[pos & (QUEUE_SIZE - 1)];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                cell.task = task;
+                cell.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) { // cell still holds the task of the previous lap
+            return false;
+        } else {
+            pos = m_enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * Return nullptr if the queue is empty
+ */
+WorkerTask * WorkerPool::TaskQueue::pop() {
+    size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+    while (true) {
+        cell_t & cell = m_cells[pos & (QUEUE_SIZE - 1)];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                WorkerTask * task = cell.task;
+                cell.sequence.store(pos + QUEUE_SIZE, std::memory_order_release);
+                return task;
+            }
+        } else if (diff < 0) { // not filled yet
+            return nullptr;
+        } else {
+            pos = m_dequeuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void * WorkerPool::worker_t::operator new(size_t size) {
+    void * ptr;
+    if (posix_memalign(&ptr, alignof(worker_t), size) != 0) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void WorkerPool::worker_t::operator delete(void * ptr) {
+    free(ptr);
+}
+
+WorkerPool::WorkerPool() : m_nextWorker(0), m_running(false), m_overflowSize(0), m_sleepers(0) {
+}
+
+WorkerPool::~WorkerPool() {
+    stop();
+    for (uint i=0; i<m_workers.size(); i++) {
+        if (m_workers[i]->thread.joinable()) { // destroyed by one of its own tasks
+            m_workers[i]->thread.detach();
+        }
+        delete m_workers[i];
+    }
+}
+
+/*
+ * Start numThreads workers, one per core if 0
+ */
+pipe_ret_t WorkerPool::start(uint numThreads) {
+    pipe_ret_t ret;
+    if (numThreads == 0) {
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    m_running = true;
+    // all queues exist before any worker starts stealing from them
+    for (uint i=0; i<numThreads; i++) {
+        m_workers.push_back(new worker_t());
+    }
+    for (uint i=0; i<numThreads; i++) {
+        try {
+            m_workers[i]->thread = std::thread(&WorkerPool::workerLoop, this, i);
+        } catch (const std::system_error & error) {
+            stop();
+            ret.success = false;
+            ret.msg = ret.reason = strerror(error.code().value());
+            return ret;
+        }
+    }
+    ret.success = true;
+    return ret;
+}
+
+/*
+ * Let the workers run what is queued and join them. A worker
+ * calling stop() can't join itself, it leaves once its task returns.
+ */
+void WorkerPool::stop() {
+    m_running = false;
+    {
+        std::lock_guard<std::mutex> lock(m_idleMtx);
+        m_idleCondition.notify_all();
+    }
+    for (uint i=0; i<m_workers.size(); i++) {
+        std::thread & thread = m_workers[i]->thread;
+        if (thread.joinable() && thread.get_id() != std::this_thread::get_id()) {
+            thread.join();
+        }
+    }
+}
+
+/*
+ * Queue a task to be run by one of the workers
+ */
+void WorkerPool::submit(WorkerTask * task) {
+    if (!m_running && currentPool != this) { // stopped: workers may be gone already
+        task->run();
+        return;
+    }
+    uint numWorkers = (uint)m_workers.size();
+    uint first = (currentPool == this) ? currentWorker :
+                 m_nextWorker.fetch_add(1, std::memory_order_relaxed) % numWorkers;
+    bool queued = false;
+    for (uint i=0; i<numWorkers && !queued; i++) {
+        queued = m_workers[(first + i) % numWorkers]->queue.push(task);
+    }
+    if (!queued) {
+        std::lock_guard<std::mutex> lock(m_overflowMtx);
+        m_overflow.push_back(task);
+        m_overflowSize.fetch_add(1, std::memory_order_relaxed);
+    }
+    wakeWorker();
+}
+
+/*
+ * Wake up a sleeping worker, if any. Pairs with the sleeper count
+ * increment in workerLoop(): either the worker going to sleep sees
+ * the new task, or the submitter sees the sleeper.
+ */
+void WorkerPool::wakeWorker() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_sleepers.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lock(m_idleMtx);
+        m_idleCondition.notify_one();
+    }
+}
+
+/*
+ * Next task for worker index: from its own queue first,
+ * then stolen from the other workers, then from the overflow
+ */
+WorkerTask * WorkerPool::findTask(uint index) {
+    uint numWorkers = (uint)m_workers.size();
+    for (uint i=0; i<numWorkers; i++) {
+        WorkerTask * task = m_workers[(index + i) % numWorkers]->queue.pop();
+        if (task != nullptr) {
+            return task;
+        }
+    }
+    if (m_overflowSize.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lock(m_overflowMtx);
+        if (!m_overflow.empty()) {
+            WorkerTask * task = m_overflow.front();
+            m_overflow.pop_front();
+            m_overflowSize.fetch_sub(1, std::memory_order_relaxed);
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+void WorkerPool::workerLoop(uint index) {
+    currentPool = this;
+    currentWorker = index;
+    int idleRounds = 0;
+    while (true) {
+        WorkerTask * task = findTask(index);
+        if (task != nullptr) {
+            idleRounds = 0;
+            task->run();
+            continue;
+        }
+        if (!m_running) { // nothing left to run
+            break;
+        }
+        if (++idleRounds < IDLE_SPINS) {
+            std::this_thread::yield();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_idleMtx);
+        m_sleepers.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        task = findTask(index);
+        if (task == nullptr && m_running) {
+            m_idleCondition.wait(lock);
+        }
+        m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+        lock.unlock();
+        if (task != nullptr) {
+            idleRounds = 0;
+            task->run();
+        }
+    }
+}
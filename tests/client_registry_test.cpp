@@ -0,0 +1,153 @@
+
+
+#include "test.h"
+#include "../include/client_registry.h"
+#include <set>
+#include <thread>
+#include <vector>
+
+static uint32_t slotOf(client_id_t id) { return (uint32_t)id; }
+static uint32_t generationOf(client_id_t id) { return (uint32_t)(id >> 32); }
+
+static Client makeClient(int fd) {
+    Client client;
+    client.setFileDescriptor(fd);
+    return client;
+}
+
+static void insertAndAcquire() {
+    ClientRegistry registry;
+    Client * first = registry.insert(makeClient(10));
+    Client * second = registry.insert(makeClient(11));
+    CHECK(first != nullptr && second != nullptr);
+    CHECK(first->getId() != 0 && second->getId() != 0);
+    CHECK(first->getId() != second->getId());
+    CHECK(registry.size() == 2);
+
+    Client * acquired = registry.acquire(second->getId());
+    CHECK(acquired == second);
+    CHECK(acquired->getFileDescriptor() == 11);
+    registry.release(acquired);
+    CHECK(registry.acquire(0) == nullptr);
+}
+
+static void removedSlotIsReusedUnderNextGeneration() {
+    ClientRegistry registry;
+    client_id_t oldId = registry.insert(makeClient(10))->getId();
+    CHECK(registry.remove(oldId));
+    CHECK(!registry.remove(oldId));
+    CHECK(registry.acquire(oldId) == nullptr);
+    CHECK(registry.size() == 0);
+
+    client_id_t newId = registry.insert(makeClient(11))->getId();
+    CHECK(slotOf(newId) == slotOf(oldId));
+    CHECK(generationOf(newId) == generationOf(oldId) + 1);
+    // the stale id must not reach the client now in its slot
+    CHECK(registry.acquire(oldId) == nullptr);
+    CHECK(!registry.remove(oldId));
+    Client * acquired = registry.acquire(newId);
+    CHECK(acquired != nullptr && acquired->getFileDescriptor() == 11);
+    registry.release(acquired);
+}
+
+static void removedClientIsReclaimedAfterLastRelease() {
+    ClientRegistry registry;
+    std::vector<int> reclaimed;
+    registry.setReclaimHandler([&reclaimed](Client & client) { reclaimed.push_back(client.getFileDescriptor()); });
+
+    client_id_t id = registry.insert(makeClient(10))->getId();
+    Client * held = registry.acquire(id);
+    CHECK(registry.remove(id));
+    CHECK(reclaimed.empty());
+    // still usable through the reference, but no longer acquirable
+    CHECK(registry.held(id) == held);
+    CHECK(held->getFileDescriptor() == 10);
+    CHECK(registry.acquire(id) == nullptr);
+    registry.release(held);
+    CHECK(reclaimed.size() == 1 && reclaimed[0] == 10);
+
+    // a slot is only reused once reclaimed
+    Client * reused = registry.insert(makeClient(11));
+    CHECK(slotOf(reused->getId()) == slotOf(id));
+}
+
+static void forEachVisitsLiveClients() {
+    ClientRegistry registry;
+    std::vector<client_id_t> ids;
+    for (int i=0; i<10; i++) {
+        ids.push_back(registry.insert(makeClient(i))->getId());
+    }
+    for (int i=0; i<10; i+=2) {
+        registry.remove(ids[i]);
+    }
+    std::set<int> visited;
+    registry.forEach([&visited](Client & client) { visited.insert(client.getFileDescriptor()); });
+    CHECK(visited == std::set<int>({1, 3, 5, 7, 9}));
+}
+
+static void slotsSpanChunks() {
+    ClientRegistry registry;
+    std::vector<client_id_t> ids;
+    for (uint32_t i=0; i<ClientRegistry::CHUNK_SIZE + 10; i++) {
+        ids.push_back(registry.insert(makeClient((int)i))->getId());
+    }
+    CHECK(registry.size() == ClientRegistry::CHUNK_SIZE + 10);
+    Client * last = registry.acquire(ids.back());
+    CHECK(last != nullptr && last->getFileDescriptor() == (int)ClientRegistry::CHUNK_SIZE + 9);
+    registry.release(last);
+    for (client_id_t id : ids) {
+        registry.remove(id);
+    }
+    CHECK(registry.size() == 0);
+}
+
+static void concurrentInsertAndRemove() {
+    ClientRegistry registry;
+    const int THREADS = 4;
+    const int ROUNDS = 20000;
+    std::vector<std::thread> threads;
+    std::vector<int> failures(THREADS, 0);
+    for (int t=0; t<THREADS; t++) {
+        threads.emplace_back([&registry, &failures, t, ROUNDS]() {
+            std::vector<client_id_t> mine;
+            for (int i=0; i<ROUNDS; i++) {
+                Client * client = registry.insert(makeClient(t));
+                mine.push_back(client->getId());
+                if (mine.size() > 8) {
+                    client_id_t id = mine.front();
+                    mine.erase(mine.begin());
+                    Client * acquired = registry.acquire(id);
+                    if (acquired == nullptr || acquired->getFileDescriptor() != t) {
+                        failures[t]++;
+                    }
+                    if (acquired != nullptr) {
+                        registry.release(acquired);
+                    }
+                    if (!registry.remove(id) || registry.acquire(id) != nullptr) {
+                        failures[t]++;
+                    }
+                }
+            }
+            for (client_id_t id : mine) {
+                registry.remove(id);
+            }
+        });
+    }
+    for (std::thread & thread : threads) {
+        thread.join();
+    }
+    for (int t=0; t<THREADS; t++) {
+        CHECK(failures[t] == 0);
+    }
+    CHECK(registry.size() == 0);
+}
+
+int main() {
+    RUN_TEST(insertAndAcquire);
+    RUN_TEST(removedSlotIsReusedUnderNextGeneration);
+    RUN_TEST(removedClientIsReclaimedAfterLastRelease);
+    RUN_TEST(forEachVisitsLiveClients);
+    RUN_TEST(slotsSpanChunks);
+    RUN_TEST(concurrentInsertAndRemove);
+    return TEST_RESULT();
+}
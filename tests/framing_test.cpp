@@ -0,0 +1,155 @@
+
+
+#include "test.h"
+#include "../include/framing.h"
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+static std::string message(size_t i) {
+    std::string msg((i * 7919) % 5000, 0);
+    for (size_t k=0; k<msg.size(); k++) {
+        msg[k] = (char)('a' + (i + k) % 26);
+    }
+    return msg;
+}
+
+static std::string frame(framing_mode_t mode, const std::string & msg) {
+    char header[MAX_FRAME_HEADER_SIZE];
+    size_t headerSize = encodeFrameHeader(mode, msg.size(), header);
+    return std::string(header, headerSize) + msg;
+}
+
+/*
+ * Write stream into buffer in reads of the given sizes, as recv()
+ * would, collecting the messages handed out after every read
+ */
+static bool feed(FrameBuffer & buffer, const framing_config_t & config, const std::string & stream,
+                 const std::vector<size_t> & readSizes, std::vector<std::string> & received) {
+    size_t offset = 0;
+    size_t read = 0;
+    while (offset < stream.size()) {
+        char * writePtr = buffer.writePtr();
+        size_t size = std::min(std::min(readSizes[read++ % readSizes.size()], buffer.writable()),
+                               stream.size() - offset);
+        memcpy(writePtr, stream.data() + offset, size);
+        buffer.commit(size);
+        offset += size;
+        bool valid = buffer.consumeFrames(config, [&received](const char * msg, size_t msgSize) {
+            received.push_back(std::string(msg, msgSize));
+        });
+        if (!valid) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void headersRoundTrip() {
+    for (framing_mode_t mode : {FRAMING_FIXED32, FRAMING_VARINT}) {
+        for (size_t size : {(size_t)0, (size_t)1, (size_t)127, (size_t)128, (size_t)300, (size_t)70000, (size_t)0xFFFFFFFF}) {
+            char header[MAX_FRAME_HEADER_SIZE];
+            size_t headerSize = encodeFrameHeader(mode, size, header);
+            size_t msgSize, parsedSize;
+            CHECK(decodeFrameHeader(mode, header, headerSize, msgSize, parsedSize) == 1);
+            CHECK(msgSize == size && parsedSize == headerSize);
+            // any prefix of the header asks for more
+            for (size_t available=0; available<headerSize; available++) {
+                CHECK(decodeFrameHeader(mode, header, available, msgSize, parsedSize) == 0);
+            }
+        }
+    }
+    char overlong[11];
+    memset(overlong, 0x80, sizeof(overlong));
+    size_t msgSize, headerSize;
+    CHECK(decodeFrameHeader(FRAMING_VARINT, overlong, sizeof(overlong), msgSize, headerSize) == -1);
+}
+
+static void reassemblesAcrossPartialReads() {
+    for (framing_mode_t mode : {FRAMING_FIXED32, FRAMING_VARINT}) {
+        framing_config_t config;
+        config.mode = mode;
+        config.bufferSize = 1024;
+        std::string stream;
+        std::vector<std::string> sent;
+        for (size_t i=0; i<300; i++) {
+            sent.push_back(message(i));
+            stream += frame(mode, sent.back());
+        }
+        // one byte at a time, splitting every header, odd sizes, and large reads
+        std::vector<std::vector<size_t> > patterns = {{1}, {3, 7, 1, 13}, {1000, 1}, {65536}};
+        for (const std::vector<size_t> & readSizes : patterns) {
+            FrameBuffer buffer(config.bufferSize);
+            std::vector<std::string> received;
+            CHECK(feed(buffer, config, stream, readSizes, received));
+            CHECK(received == sent);
+        }
+    }
+}
+
+static void growsForLargeMessages() {
+    framing_config_t config;
+    config.mode = FRAMING_FIXED32;
+    FrameBuffer buffer(256);
+    std::string large(200000, 'x');
+    large[0] = 'a';
+    large[large.size() - 1] = 'z';
+    std::vector<std::string> received;
+    CHECK(feed(buffer, config, frame(config.mode, large) + frame(config.mode, "next"), {4096}, received));
+    CHECK(received.size() == 2 && received[0] == large && received[1] == "next");
+}
+
+static void rejectsOversizedAndMalformedFrames() {
+    framing_config_t config;
+    config.mode = FRAMING_FIXED32;
+    config.maxMessageSize = 100;
+    FrameBuffer buffer(1024);
+    std::vector<std::string> received;
+    CHECK(!feed(buffer, config, frame(config.mode, std::string(101, 'x')), {1024}, received));
+
+    config.mode = FRAMING_VARINT;
+    FrameBuffer varintBuffer(1024);
+    CHECK(!feed(varintBuffer, config, std::string(11, '\x80'), {1024}, received));
+    CHECK(received.empty());
+}
+
+static void heldMessagesSurviveFurtherReads() {
+    framing_config_t config;
+    config.mode = FRAMING_VARINT;
+    FrameBuffer buffer(1024);
+    // messages handed out with a reference to the storage, as to workers
+    std::vector<Payload> references;
+    std::vector<std::pair<const char *, size_t> > held;
+    std::string stream;
+    std::vector<std::string> sent;
+    for (size_t i=0; i<200; i++) {
+        sent.push_back(message(i));
+        stream += frame(config.mode, sent.back());
+    }
+    size_t offset = 0;
+    while (offset < stream.size()) {
+        char * writePtr = buffer.writePtr();
+        size_t size = std::min(std::min((size_t)700, buffer.writable()), stream.size() - offset);
+        memcpy(writePtr, stream.data() + offset, size);
+        buffer.commit(size);
+        offset += size;
+        CHECK(buffer.consumeFrames(config, [&](const char * msg, size_t msgSize) {
+            references.push_back(buffer.storage());
+            held.push_back(std::make_pair(msg, msgSize));
+        }));
+    }
+    CHECK(held.size() == sent.size());
+    for (size_t i=0; i<held.size() && i<sent.size(); i++) {
+        CHECK(std::string(held[i].first, held[i].second) == sent[i]);
+    }
+}
+
+int main() {
+    RUN_TEST(headersRoundTrip);
+    RUN_TEST(reassemblesAcrossPartialReads);
+    RUN_TEST(growsForLargeMessages);
+    RUN_TEST(rejectsOversizedAndMalformedFrames);
+    RUN_TEST(heldMessagesSurviveFurtherReads);
+    return TEST_RESULT();
+}
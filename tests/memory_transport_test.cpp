@@ -0,0 +1,268 @@
+
+
+#include "test.h"
+#include "../include/memory_transport.h"
+#include "../include/tcp_server.h"
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+
+static struct iovec iovecOf(const void * data, size_t size) {
+    struct iovec iov;
+    iov.iov_base = (void *)data;
+    iov.iov_len = size;
+    return iov;
+}
+
+static char patternAt(size_t position) {
+    return (char)(position * 31 + position / 251);
+}
+
+static void ringWrapsAround() {
+    SpscRing ring(64);
+    char buffer[64];
+    struct iovec iov = iovecOf(buffer, sizeof(buffer));
+    CHECK(ring.read(&iov, 1) == 0);
+
+    size_t written = 0;
+    size_t read = 0;
+    for (size_t round=0; round<2000; round++) {
+        char chunk[50];
+        size_t size = 1 + round % 50;
+        for (size_t i=0; i<size; i++) {
+            chunk[i] = patternAt(written + i);
+        }
+        // split over two iovecs, as queued messages are
+        struct iovec parts[2] = {iovecOf(chunk, size / 2), iovecOf(chunk + size / 2, size - size / 2)};
+        written += ring.write(parts, 2);
+
+        iov = iovecOf(buffer, 1 + round % 37);
+        size_t got = ring.read(&iov, 1);
+        for (size_t i=0; i<got; i++) {
+            if (buffer[i] != patternAt(read + i)) {
+                CHECK(buffer[i] == patternAt(read + i));
+                return;
+            }
+        }
+        read += got;
+        CHECK(written - read <= 64);
+    }
+    CHECK(read > 0 && written > 64 * 100);
+}
+
+static void fullRingTakesWhatFits() {
+    SpscRing ring(64);
+    char data[100];
+    memset(data, 'x', sizeof(data));
+    struct iovec iov = iovecOf(data, sizeof(data));
+    CHECK(ring.write(&iov, 1) == 64);
+    CHECK(ring.write(&iov, 1) == 0);
+    char buffer[10];
+    iov = iovecOf(buffer, sizeof(buffer));
+    CHECK(ring.read(&iov, 1) == 10);
+    iov = iovecOf(data, sizeof(data));
+    CHECK(ring.write(&iov, 1) == 10);
+}
+
+static void ringAcrossThreads() {
+    SpscRing ring(4096);
+    const size_t TOTAL = 8 * 1024 * 1024;
+    std::thread producer([&ring, TOTAL]() {
+        char chunk[1500];
+        size_t written = 0;
+        while (written < TOTAL) {
+            size_t size = std::min((size_t)(1 + written % 1500), TOTAL - written);
+            for (size_t i=0; i<size; i++) {
+                chunk[i] = patternAt(written + i);
+            }
+            size_t offset = 0;
+            while (offset < size) {
+                struct iovec iov = iovecOf(chunk + offset, size - offset);
+                size_t taken = ring.write(&iov, 1);
+                if (taken == 0) {
+                    std::this_thread::yield();
+                }
+                offset += taken;
+            }
+            written += size;
+        }
+    });
+    char buffer[3000];
+    size_t read = 0;
+    bool intact = true;
+    while (read < TOTAL) {
+        struct iovec iov = iovecOf(buffer, 1 + read % sizeof(buffer));
+        size_t got = ring.read(&iov, 1);
+        if (got == 0) {
+            std::this_thread::yield();
+        }
+        for (size_t i=0; i<got && intact; i++) {
+            intact = buffer[i] == patternAt(read + i);
+        }
+        read += got;
+    }
+    producer.join();
+    CHECK(intact);
+    CHECK(read == TOTAL);
+}
+
+static std::string readFor(MemoryStream * stream, size_t size) {
+    std::string received;
+    char buffer[4096];
+    for (int polls=0; received.size() < size && polls < 500; polls++) {
+        ssize_t n = stream->read(buffer, sizeof(buffer));
+        if (n > 0) {
+            received.append(buffer, n);
+        } else if (n == 0 || errno != EAGAIN) {
+            break;
+        } else {
+            struct pollfd pfd;
+            pfd.fd = stream->fd();
+            pfd.events = POLLIN;
+            poll(&pfd, 1, 10);
+        }
+    }
+    return received;
+}
+
+static void streamsCarryBothDirections() {
+    MemoryListener listener;
+    CHECK(listener.listen("memory_transport_test.streams", 4, 1024).success);
+    MemoryStream * client = nullptr;
+    CHECK(MemoryListener::connect("memory_transport_test.streams", client).success);
+    MemoryStream * server = listener.accept();
+    CHECK(client != nullptr && server != nullptr);
+    if (client == nullptr || server == nullptr) {
+        return;
+    }
+    CHECK(listener.accept() == nullptr && errno == EAGAIN);
+
+    char buffer[16];
+    CHECK(server->read(buffer, sizeof(buffer)) == -1 && errno == EAGAIN);
+    struct iovec iov = iovecOf("ping", 4);
+    CHECK(client->writev(&iov, 1) == 4);
+    CHECK(readFor(server, 4) == "ping");
+    iov = iovecOf("pong", 4);
+    CHECK(server->writev(&iov, 1) == 4);
+    CHECK(readFor(client, 4) == "pong");
+
+    // a ring of 1024 bytes: the writer is told to wait, nothing is lost
+    std::string large(5000, 'L');
+    size_t written = 0;
+    std::string received;
+    while (written < large.size()) {
+        iov = iovecOf(large.data() + written, large.size() - written);
+        ssize_t n = client->writev(&iov, 1);
+        if (n > 0) {
+            written += n;
+        } else {
+            CHECK(errno == EAGAIN);
+            received += readFor(server, 1);
+        }
+    }
+    received += readFor(server, large.size() - received.size());
+    CHECK(received == large);
+
+    // end of stream after what was written, the writer fails from then on
+    iov = iovecOf("last", 4);
+    client->writev(&iov, 1);
+    client->shutdownWrite();
+    CHECK(readFor(server, 5) == "last");
+    CHECK(server->read(buffer, sizeof(buffer)) == 0);
+    CHECK(client->writev(&iov, 1) == -1 && errno == EPIPE);
+    client->close();
+    server->close();
+}
+
+static void listenerRefusesBeyondBacklog() {
+    MemoryStream * stream = nullptr;
+    CHECK(!MemoryListener::connect("memory_transport_test.nobody", stream).success);
+
+    MemoryListener listener;
+    CHECK(listener.listen("memory_transport_test.backlog", 2).success);
+    MemoryListener other;
+    CHECK(!other.listen("memory_transport_test.backlog", 2).success);
+    MemoryStream * first = nullptr;
+    MemoryStream * second = nullptr;
+    MemoryStream * third = nullptr;
+    CHECK(MemoryListener::connect("memory_transport_test.backlog", first).success);
+    CHECK(MemoryListener::connect("memory_transport_test.backlog", second).success);
+    CHECK(!MemoryListener::connect("memory_transport_test.backlog", third).success);
+    struct pollfd pfd;
+    pfd.fd = listener.fd();
+    pfd.events = POLLIN;
+    CHECK(poll(&pfd, 1, 0) == 1);
+    MemoryStream * accepted = listener.accept();
+    CHECK(accepted != nullptr);
+    CHECK(MemoryListener::connect("memory_transport_test.backlog", third).success);
+    accepted->close();
+    // connections still pending are shut down along with the listener
+    listener.close();
+    char buffer[4];
+    CHECK(readFor(second, 1).empty());
+    CHECK(second->read(buffer, sizeof(buffer)) == 0);
+    for (MemoryStream * stream : {first, second, third}) {
+        stream->close();
+    }
+}
+
+static void serverEchoesOverMemory() {
+    TcpServer server;
+    server_config_t config;
+    config.mode = SERVER_MODE_REACTOR;
+    config.ioThreads = 2;
+    config.transport = TRANSPORT_MEMORY;
+    config.path = "memory_transport_test.server";
+    config.framing.mode = FRAMING_FIXED32;
+    server_observer_t observer;
+    observer.incoming_packet_func = [&server](const Client & client, const char * msg, size_t size) {
+        server.sendToClient(client, msg, size);
+    };
+    server.subscribe(observer);
+    pipe_ret_t ret = server.start(0, config);
+    CHECK(ret.success);
+    if (!ret.success) {
+        return;
+    }
+
+    MemoryStream * stream = nullptr;
+    CHECK(MemoryListener::connect(config.path, stream).success);
+    if (stream == nullptr) {
+        return;
+    }
+    std::string sent;
+    for (size_t i=0; i<100; i++) {
+        std::string msg(1 + i * 37, (char)('a' + i % 26));
+        char header[MAX_FRAME_HEADER_SIZE];
+        size_t headerSize = encodeFrameHeader(config.framing.mode, msg.size(), header);
+        sent += std::string(header, headerSize) + msg;
+    }
+    size_t written = 0;
+    std::string received;
+    while (written < sent.size()) {
+        struct iovec iov = iovecOf(sent.data() + written, sent.size() - written);
+        ssize_t n = stream->writev(&iov, 1);
+        if (n > 0) {
+            written += n;
+        } else {
+            received += readFor(stream, 1);
+        }
+    }
+    received += readFor(stream, sent.size() - received.size());
+    CHECK(received == sent);
+    stream->close();
+    server.finish();
+}
+
+int main() {
+    RUN_TEST(ringWrapsAround);
+    RUN_TEST(fullRingTakesWhatFits);
+    RUN_TEST(ringAcrossThreads);
+    RUN_TEST(streamsCarryBothDirections);
+    RUN_TEST(listenerRefusesBeyondBacklog);
+    RUN_TEST(serverEchoesOverMemory);
+    return TEST_RESULT();
+}
@@ -0,0 +1,166 @@
+
+
+#include "test.h"
+#include "../include/connection_limiter.h"
+#include "../include/token_bucket.h"
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+static ip_address_t addressOf(const std::string & text) {
+    ip_address_t address;
+    ip_address_t::parse(text.c_str(), address);
+    return address;
+}
+
+static std::vector<ip_address_t> manyAddresses(size_t count) {
+    std::vector<ip_address_t> addresses;
+    for (size_t i=0; i<count; i++) {
+        std::string text = i % 2 == 0 ?
+            "10." + std::to_string(i / 65536 % 256) + "." + std::to_string(i / 256 % 256) + "." + std::to_string(i % 256) :
+            "2001:db8::" + std::to_string(i % 10000);
+        addresses.push_back(addressOf(text));
+    }
+    return addresses;
+}
+
+static void totalLimit() {
+    ConnectionLimiter limiter(3, 0);
+    ip_address_t address = addressOf("192.0.2.1");
+    CHECK(limiter.admit(address));
+    CHECK(limiter.admit(address));
+    CHECK(limiter.admit(ip_address_t()));
+    CHECK(!limiter.admit(addressOf("192.0.2.2")));
+    CHECK(limiter.connections() == 3);
+    limiter.release(address);
+    CHECK(limiter.admit(addressOf("192.0.2.2")));
+}
+
+static void perAddressLimit() {
+    ConnectionLimiter limiter(0, 2);
+    ip_address_t first = addressOf("192.0.2.1");
+    ip_address_t second = addressOf("2001:db8::1");
+    CHECK(limiter.admit(first));
+    CHECK(limiter.admit(first));
+    CHECK(!limiter.admit(first));
+    CHECK(limiter.admit(second));
+    CHECK(limiter.admit(second));
+    CHECK(!limiter.admit(second));
+    // Unix socket and in-memory peers have no address to limit
+    for (int i=0; i<10; i++) {
+        CHECK(limiter.admit(ip_address_t()));
+    }
+    limiter.release(first);
+    CHECK(limiter.admit(first));
+    CHECK(!limiter.admit(first));
+    CHECK(limiter.connections() == 14);
+}
+
+/*
+ * With one connection allowed per address, an address is refused
+ * exactly when the table still finds its entry
+ */
+static bool tracked(ConnectionLimiter & limiter, const ip_address_t & address) {
+    if (limiter.admit(address)) {
+        limiter.release(address);
+        return false;
+    }
+    return true;
+}
+
+static void releaseCompactsTheTable() {
+    ConnectionLimiter limiter(0, 1);
+    // enough to grow the table several times over
+    std::vector<ip_address_t> addresses = manyAddresses(2000);
+    for (const ip_address_t & address : addresses) {
+        CHECK(limiter.admit(address));
+    }
+    CHECK(limiter.connections() == addresses.size());
+    std::vector<size_t> order(addresses.size());
+    for (size_t i=0; i<order.size(); i++) {
+        order[i] = i;
+    }
+    std::mt19937 random(42);
+    std::shuffle(order.begin(), order.end(), random);
+    std::vector<bool> live(addresses.size(), true);
+    for (size_t n=0; n<order.size(); n++) {
+        limiter.release(addresses[order[n]]);
+        live[order[n]] = false;
+        // after every removal, check a sample of addresses is still found,
+        // released ones included, across the entries moved back
+        for (size_t i=n % 7; i<addresses.size(); i+=97) {
+            if (tracked(limiter, addresses[i]) != live[i]) {
+                CHECK(tracked(limiter, addresses[i]) == live[i]);
+                return;
+            }
+        }
+    }
+    CHECK(limiter.connections() == 0);
+    // reusing the table once emptied
+    for (const ip_address_t & address : addresses) {
+        CHECK(limiter.admit(address));
+    }
+}
+
+static void bucketStartsFull() {
+    TokenBucket bucket(1000, 500, 0);
+    CHECK(bucket.delay(0) == 0);
+    CHECK(bucket.available() == 500);
+    bucket.take(500);
+    CHECK(bucket.available() == 0);
+    // one byte every millisecond at 1000 bytes per second
+    CHECK(bucket.delay(0) == 1);
+}
+
+static void bucketRefillsAtItsRate() {
+    TokenBucket bucket(1000, 500, 0);
+    bucket.take(500);
+    CHECK(bucket.delay(100) == 0);
+    CHECK(bucket.available() == 100);
+    bucket.take(100);
+    CHECK(bucket.delay(350) == 0);
+    CHECK(bucket.available() == 250);
+    // no more than the burst, however long it was idle
+    CHECK(bucket.delay(100000) == 0);
+    CHECK(bucket.available() == 500);
+    // a time going backwards refills nothing
+    bucket.take(500);
+    CHECK(bucket.delay(50000) == 1);
+    CHECK(bucket.available() == 0);
+}
+
+static void bucketOwesOverdraft() {
+    TokenBucket bucket(100, 100, 0);
+    // a transfer may take more than was available, e.g. a whole TLS record
+    bucket.take(300);
+    CHECK(bucket.delay(0) == 2010);
+    CHECK(bucket.delay(1000) == 1010);
+    CHECK(bucket.delay(2010) == 0);
+    CHECK(bucket.available() == 1);
+}
+
+static void slowBucketKeepsFractions() {
+    TokenBucket bucket(3, 3, 0);
+    bucket.take(3);
+    // a byte per 333.3 milliseconds: fractions carry over, nothing is lost
+    size_t moved = 0;
+    for (uint64_t now=1; now<=10000; now++) {
+        if (bucket.delay(now) == 0) {
+            moved += bucket.available();
+            bucket.take(bucket.available());
+        }
+    }
+    CHECK(moved == 30);
+}
+
+int main() {
+    RUN_TEST(totalLimit);
+    RUN_TEST(perAddressLimit);
+    RUN_TEST(releaseCompactsTheTable);
+    RUN_TEST(bucketStartsFull);
+    RUN_TEST(bucketRefillsAtItsRate);
+    RUN_TEST(bucketOwesOverdraft);
+    RUN_TEST(slowBucketKeepsFractions);
+    return TEST_RESULT();
+}
@@ -0,0 +1,75 @@
+
+
+#ifndef INTERCOM_SELF_SIGNED_H
+#define INTERCOM_SELF_SIGNED_H
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string>
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+/*
+ * Self-signed certificate for "localhost" and its key, generated when
+ * the test runs and written as PEM files, removed on destruction
+ */
+class SelfSigned {
+
+public:
+    std::string certificateFile;
+    std::string privateKeyFile;
+
+    explicit SelfSigned(const std::string & name) {
+        certificateFile = "/tmp/intercom_" + name + "_" + std::to_string(getpid()) + ".pem";
+        privateKeyFile = "/tmp/intercom_" + name + "_" + std::to_string(getpid()) + ".key";
+
+        EVP_PKEY * key = nullptr;
+        EVP_PKEY_CTX * keyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+        EVP_PKEY_keygen_init(keyContext);
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keyContext, NID_X9_62_prime256v1);
+        EVP_PKEY_keygen(keyContext, &key);
+        EVP_PKEY_CTX_free(keyContext);
+
+        X509 * certificate = X509_new();
+        X509_set_version(certificate, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+        X509_gmtime_adj(X509_get_notBefore(certificate), -60);
+        X509_gmtime_adj(X509_get_notAfter(certificate), 24 * 3600);
+        X509_set_pubkey(certificate, key);
+        X509_NAME * subject = X509_get_subject_name(certificate);
+        X509_NAME_add_entry_by_txt(subject, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+        X509_set_issuer_name(certificate, subject);
+        addExtension(certificate, NID_subject_alt_name, "DNS:localhost,IP:127.0.0.1");
+        addExtension(certificate, NID_basic_constraints, "critical,CA:TRUE");
+        X509_sign(certificate, key, EVP_sha256());
+
+        FILE * file = fopen(certificateFile.c_str(), "w");
+        PEM_write_X509(file, certificate);
+        fclose(file);
+        file = fopen(privateKeyFile.c_str(), "w");
+        PEM_write_PrivateKey(file, key, nullptr, nullptr, 0, nullptr, nullptr);
+        fclose(file);
+        X509_free(certificate);
+        EVP_PKEY_free(key);
+    }
+
+    ~SelfSigned() {
+        unlink(certificateFile.c_str());
+        unlink(privateKeyFile.c_str());
+    }
+
+private:
+    static void addExtension(X509 * certificate, int nid, const char * value) {
+        X509V3_CTX context;
+        X509V3_set_ctx(&context, certificate, certificate, nullptr, nullptr, 0);
+        X509_EXTENSION * extension = X509V3_EXT_conf_nid(nullptr, &context, nid, (char *)value);
+        X509_add_ext(certificate, extension, -1);
+        X509_EXTENSION_free(extension);
+    }
+};
+
+
+#endif //INTERCOM_SELF_SIGNED_H
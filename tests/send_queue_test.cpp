@@ -0,0 +1,184 @@
+
+
+#include "test.h"
+#include "../include/send_queue.h"
+#include "../include/stream.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/*
+ * Stream taking at most budget bytes per writev(), and nothing once
+ * it took callsUntilFull writes, like a socket filling up
+ */
+class ScriptedStream : public Stream {
+
+public:
+    std::string written;
+    std::vector<int> iovcnts;
+    size_t budget = SIZE_MAX;
+    int callsUntilFull = INT32_MAX;
+
+    int fd() const { return -1; }
+    ssize_t readv(const struct iovec *, int) { errno = EAGAIN; return -1; }
+    ssize_t writev(const struct iovec * iov, int iovcnt) {
+        if (callsUntilFull == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        callsUntilFull--;
+        iovcnts.push_back(iovcnt);
+        size_t taken = 0;
+        for (int i=0; i<iovcnt && taken < budget; i++) {
+            size_t size = std::min(iov[i].iov_len, budget - taken);
+            written.append((const char *)iov[i].iov_base, size);
+            taken += size;
+        }
+        return (ssize_t)taken;
+    }
+    ssize_t sendFile(int, off_t *, size_t) { errno = EINVAL; return -1; }
+    void shutdown() {}
+    void shutdownWrite() {}
+    void close() {}
+};
+
+static std::string message(size_t i) {
+    return std::string(1 + (i * 131) % 900, (char)('a' + i % 26));
+}
+
+static Payload payloadOf(const std::string & msg) {
+    return Payload(nullptr, 0, msg.data(), msg.size());
+}
+
+static void partialWritesResumeWhereTheyStopped() {
+    SendQueue queue(1024 * 1024);
+    ScriptedStream stream;
+    queue.setStream(&stream);
+    std::string expected;
+    for (size_t i=0; i<200; i++) {
+        expected += message(i);
+        CHECK(queue.push(payloadOf(message(i)), false, BACKPRESSURE_DROP) == SendQueue::PUSH_QUEUED);
+    }
+    // a few odd sized writes per flush, then the socket is full
+    stream.budget = 37;
+    int flushes = 0;
+    SendQueue::flush_ret_t ret;
+    do {
+        stream.callsUntilFull = 3;
+        ret = queue.flush(-1);
+        flushes++;
+    } while (ret == SendQueue::FLUSH_WOULD_BLOCK && flushes < 100000);
+    CHECK(ret == SendQueue::FLUSH_COMPLETE);
+    CHECK(stream.written == expected);
+    CHECK(queue.empty() && queue.queuedBytes() == 0);
+    CHECK(queue.writtenBytes() == expected.size());
+}
+
+static void messagesAreBatchedIntoFewWrites() {
+    SendQueue queue(1024 * 1024);
+    ScriptedStream stream;
+    queue.setStream(&stream);
+    std::string expected;
+    for (size_t i=0; i<SendQueue::MAX_IOVECS + 10; i++) {
+        expected += message(i);
+        queue.push(payloadOf(message(i)), false, BACKPRESSURE_DROP);
+    }
+    CHECK(queue.flush(-1) == SendQueue::FLUSH_COMPLETE);
+    CHECK(stream.written == expected);
+    CHECK(stream.iovcnts.size() == 2);
+    CHECK(!stream.iovcnts.empty() && stream.iovcnts[0] == SendQueue::MAX_IOVECS);
+}
+
+static void corkedMessagesGoOutTogether() {
+    SendQueue queue(1024 * 1024);
+    ScriptedStream stream;
+    queue.setStream(&stream);
+    queue.cork();
+    for (size_t i=0; i<5; i++) {
+        queue.push(payloadOf(message(i)), false, BACKPRESSURE_DROP);
+    }
+    CHECK(queue.flush(-1) == SendQueue::FLUSH_WOULD_BLOCK);
+    CHECK(stream.written.empty());
+    CHECK(!queue.hasPendingWrites());
+    queue.uncork();
+    CHECK(queue.flush(-1) == SendQueue::FLUSH_COMPLETE);
+    CHECK(stream.iovcnts.size() == 1 && stream.iovcnts[0] == 5);
+}
+
+static void fullQueueFollowsItsPolicy() {
+    std::string msg(100, 'x');
+    SendQueue queue(250);
+    CHECK(queue.push(payloadOf(msg), true, BACKPRESSURE_DROP) == SendQueue::PUSH_QUEUED);
+    CHECK(queue.push(payloadOf(msg), true, BACKPRESSURE_DROP) == SendQueue::PUSH_QUEUED);
+    CHECK(queue.push(payloadOf(msg), true, BACKPRESSURE_DROP) == SendQueue::PUSH_DROPPED);
+    CHECK(queue.push(payloadOf(msg), true, BACKPRESSURE_DISCONNECT) == SendQueue::PUSH_OVERFLOW);
+    CHECK(queue.queuedBytes() == 200);
+}
+
+static void coalescingKeepsPartiallyWrittenHead() {
+    SendQueue queue(250);
+    ScriptedStream stream;
+    queue.setStream(&stream);
+    std::string first(100, '1'), second(100, '2'), latest(100, '3');
+    std::string ordered(20, 'o');
+    queue.push(payloadOf(first), true, BACKPRESSURE_COALESCE);
+    queue.push(payloadOf(ordered), false, BACKPRESSURE_COALESCE);
+    queue.push(payloadOf(second), true, BACKPRESSURE_COALESCE);
+    // the head is started: it must go out whole
+    stream.budget = 10;
+    stream.callsUntilFull = 1;
+    CHECK(queue.flush(-1) == SendQueue::FLUSH_WOULD_BLOCK);
+    CHECK(queue.push(payloadOf(latest), true, BACKPRESSURE_COALESCE) == SendQueue::PUSH_QUEUED);
+    stream.budget = SIZE_MAX;
+    stream.callsUntilFull = INT32_MAX;
+    CHECK(queue.flush(-1) == SendQueue::FLUSH_COMPLETE);
+    // the not yet started broadcast was dropped, the others kept their order
+    CHECK(stream.written == first + ordered + latest);
+}
+
+static void socketPartialWrites() {
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    int size = 4096;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    SendQueue queue(16 * 1024 * 1024);
+    std::string expected;
+    for (size_t i=0; i<2000; i++) {
+        expected += message(i);
+        queue.push(payloadOf(message(i)), false, BACKPRESSURE_DROP);
+    }
+    std::string received;
+    char buffer[3000];
+    SendQueue::flush_ret_t ret;
+    int rounds = 0;
+    while ((ret = queue.flush(fds[0])) == SendQueue::FLUSH_WOULD_BLOCK && rounds++ < 100000) {
+        ssize_t n = read(fds[1], buffer, sizeof(buffer));
+        if (n > 0) {
+            received.append(buffer, n);
+        }
+    }
+    CHECK(ret == SendQueue::FLUSH_COMPLETE);
+    CHECK(rounds > 0);
+    ::close(fds[0]);
+    ssize_t n;
+    while ((n = read(fds[1], buffer, sizeof(buffer))) > 0) {
+        received.append(buffer, n);
+    }
+    ::close(fds[1]);
+    CHECK(received == expected);
+}
+
+int main() {
+    RUN_TEST(partialWritesResumeWhereTheyStopped);
+    RUN_TEST(messagesAreBatchedIntoFewWrites);
+    RUN_TEST(corkedMessagesGoOutTogether);
+    RUN_TEST(fullQueueFollowsItsPolicy);
+    RUN_TEST(coalescingKeepsPartiallyWrittenHead);
+    RUN_TEST(socketPartialWrites);
+    return TEST_RESULT();
+}
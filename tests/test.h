@@ -0,0 +1,29 @@
+
+
+#ifndef INTERCOM_TEST_H
+#define INTERCOM_TEST_H
+
+#include <stdio.h>
+
+/*
+ * Minimal checks for the test executables, which ctest runs: a failed
+ * CHECK prints where it failed and the test goes on, its main then
+ * returns TEST_RESULT(), a failure if any check failed.
+ */
+static int testFailures = 0;
+
+#define CHECK(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            testFailures++; \
+        } \
+    } while (0)
+
+#define RUN_TEST(test) do { \
+        fprintf(stderr, "%s\n", #test); \
+        test(); \
+    } while (0)
+
+#define TEST_RESULT() (testFailures == 0 ? 0 : 1)
+
+#endif //INTERCOM_TEST_H
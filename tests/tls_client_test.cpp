@@ -0,0 +1,155 @@
+
+
+#include "test.h"
+#include "self_signed.h"
+#include "../include/tcp_client.h"
+#include <arpa/inet.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <openssl/ssl.h>
+
+static SelfSigned * certificate;
+
+/*
+ * TLS echo server made of plain OpenSSL calls, serving one connection
+ * at a time, and counting the handshakes it completed
+ */
+class RawTlsServer {
+
+public:
+    int port = 0;
+    std::atomic<int> handshakes;
+
+    RawTlsServer() : handshakes(0) {
+        m_context = SSL_CTX_new(TLS_server_method());
+        SSL_CTX_use_certificate_file(m_context, certificate->certificateFile.c_str(), SSL_FILETYPE_PEM);
+        SSL_CTX_use_PrivateKey_file(m_context, certificate->privateKeyFile.c_str(), SSL_FILETYPE_PEM);
+        m_listenfd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+        bind(m_listenfd, (struct sockaddr *)&address, sizeof(address));
+        listen(m_listenfd, 8);
+        socklen_t size = sizeof(address);
+        getsockname(m_listenfd, (struct sockaddr *)&address, &size);
+        port = ntohs(address.sin_port);
+        m_thread = std::thread(&RawTlsServer::serve, this);
+    }
+
+    ~RawTlsServer() {
+        shutdown(m_listenfd, SHUT_RDWR);
+        m_thread.join();
+        close(m_listenfd);
+        SSL_CTX_free(m_context);
+    }
+
+private:
+    SSL_CTX * m_context;
+    int m_listenfd;
+    std::thread m_thread;
+
+    void serve() {
+        int fd;
+        while ((fd = accept(m_listenfd, nullptr, nullptr)) != -1) {
+            SSL * ssl = SSL_new(m_context);
+            SSL_set_fd(ssl, fd);
+            if (SSL_accept(ssl) == 1) {
+                handshakes++;
+                char buffer[16384];
+                int n;
+                while ((n = SSL_read(ssl, buffer, sizeof(buffer))) > 0) {
+                    SSL_write(ssl, buffer, n);
+                }
+                SSL_shutdown(ssl);
+            }
+            SSL_free(ssl);
+            close(fd);
+        }
+    }
+};
+
+static tls_config_t verifyingConfig() {
+    tls_config_t tls;
+    tls.enabled = true;
+    tls.verifyPeer = true;
+    tls.caFile = certificate->certificateFile;
+    tls.serverName = "localhost";
+    return tls;
+}
+
+static void handshakeAndEcho() {
+    RawTlsServer server;
+    TcpClient client;
+    framing_config_t framing;
+    framing.mode = FRAMING_VARINT;
+    client.setFraming(framing);
+    client.setTls(verifyingConfig());
+    std::mutex mtx;
+    std::string received;
+    std::atomic<int> messages(0);
+    client_observer_t observer;
+    observer.incoming_packet_func = [&](const char * msg, size_t size) {
+        std::lock_guard<std::mutex> lock(mtx);
+        received.append(msg, size);
+        messages++;
+    };
+    client.subscribe(observer);
+
+    pipe_ret_t ret = client.connectTo("127.0.0.1", server.port);
+    CHECK(ret.success);
+    if (!ret.success) {
+        fprintf(stderr, "connectTo: %s\n", ret.reason);
+        return;
+    }
+    CHECK(server.handshakes == 1);
+    std::string sent;
+    for (size_t i=0; i<20; i++) {
+        std::string msg(1 + i * 1499, (char)('a' + i));
+        sent += msg;
+        CHECK(client.sendMsg(msg.data(), msg.size()).success);
+    }
+    for (int i=0; i<500 && messages < 20; i++) {
+        usleep(10000);
+    }
+    CHECK(messages == 20);
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        CHECK(received == sent);
+    }
+    client.finish();
+}
+
+static void wrongServerNameIsRejected() {
+    RawTlsServer server;
+    TcpClient client;
+    tls_config_t tls = verifyingConfig();
+    tls.serverName = "intercom.example";
+    client.setTls(tls);
+    CHECK(!client.connectTo("127.0.0.1", server.port).success);
+    client.finish();
+}
+
+static void untrustedCertificateIsRejected() {
+    RawTlsServer server;
+    TcpClient client;
+    tls_config_t tls = verifyingConfig();
+    // verified against the system CAs, which did not sign it
+    tls.caFile = "";
+    client.setTls(tls);
+    CHECK(!client.connectTo("127.0.0.1", server.port).success);
+    client.finish();
+}
+
+int main() {
+    SelfSigned selfSigned("tls_client_test");
+    certificate = &selfSigned;
+    RUN_TEST(handshakeAndEcho);
+    RUN_TEST(wrongServerNameIsRejected);
+    RUN_TEST(untrustedCertificateIsRejected);
+    return TEST_RESULT();
+}